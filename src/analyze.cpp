@@ -0,0 +1,161 @@
+/**
+ * analyze.cpp
+ *
+ * cec-analyze: rebuilds bus, opcode and key statistics from daemon logs and
+ * event traces, and prints them as JSON
+ */
+#include "tracestats.h"
+
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using std::cerr;
+using std::endl;
+using std::string;
+
+// Files smaller than this are not worth splitting between threads
+static const size_t MIN_CHUNK = 4 * 1024 * 1024;
+
+static void usage(const char *name) {
+	cerr << "Usage: " << name << " [options] <log or trace file>..." << endl
+	     << "  -j <n>     scan with n threads (default one per CPU)" << endl
+	     << "  -o <path>  write the JSON here instead of stdout" << endl
+	     << "  -h         show this help" << endl;
+}
+
+/**
+ * Scans a whole file, split into chunks on line boundaries scanned in parallel
+ */
+static void analyze(const string & path, unsigned jobs, TraceStats & stats, uint64_t & bytes) {
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		throw std::runtime_error("Failed to open " + path + ": " + strerror(errno));
+
+	struct stat st;
+	if (fstat(fd, &st) < 0) {
+		close(fd);
+		throw std::runtime_error("Failed to stat " + path + ": " + strerror(errno));
+	}
+
+	size_t size = st.st_size;
+	if (size == 0) {
+		close(fd);
+		return;
+	}
+
+	void *map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		throw std::runtime_error("Failed to map " + path + ": " + strerror(errno));
+
+	madvise(map, size, MADV_SEQUENTIAL);
+
+	const char *begin = (const char *) map;
+	const char *end   = begin + size;
+
+	size_t chunks = size / MIN_CHUNK;
+	if (chunks > jobs)
+		chunks = jobs;
+	if (chunks < 1)
+		chunks = 1;
+
+	// Each chunk ends just after a newline, so no line is split
+	std::vector<const char *> bounds(1, begin);
+	for (size_t i = 1; i < chunks; i++) {
+		const char *p = begin + size / chunks * i;
+		if (p < bounds.back())
+			p = bounds.back();
+		const char *nl = (const char *) memchr(p, '\n', end - p);
+		bounds.push_back(nl ? nl + 1 : end);
+	}
+	bounds.push_back(end);
+
+	std::vector<TraceStats> results(chunks);
+	std::vector<std::thread> threads;
+	for (size_t i = 1; i < chunks; i++)
+		threads.push_back(std::thread(&TraceStats::scan, &results[i], bounds[i], bounds[i + 1]));
+	results[0].scan(bounds[0], bounds[1]);
+
+	for (size_t i = 0; i < threads.size(); i++)
+		threads[i].join();
+
+	for (size_t i = 0; i < chunks; i++)
+		stats.merge(results[i]);
+
+	munmap(map, size);
+	bytes += size;
+}
+
+int main(int argc, char *argv[]) {
+	unsigned jobs = std::thread::hardware_concurrency();
+	const char *output = NULL;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "j:o:h")) != -1) {
+		switch (opt) {
+			case 'j':
+				jobs = strtoul(optarg, NULL, 10);
+				break;
+			case 'o':
+				output = optarg;
+				break;
+			case 'h':
+				usage(argv[0]);
+				return 0;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if (optind >= argc) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (jobs < 1)
+		jobs = 1;
+
+	FILE *out = stdout;
+	if (output && !(out = fopen(output, "w"))) {
+		cerr << "Failed to create " << output << ": " << strerror(errno) << endl;
+		return 1;
+	}
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	TraceStats stats;
+	uint64_t bytes = 0;
+
+	try {
+		for (int i = optind; i < argc; i++)
+			analyze(argv[i], jobs, stats, bytes);
+	} catch (std::exception & e) {
+		cerr << e.what() << endl;
+		return 1;
+	}
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	fprintf(out, "{\"bytes\":%llu,\"seconds\":%.3f,\"stats\":", (unsigned long long) bytes, seconds);
+	stats.write(out);
+	fputs("}\n", out);
+
+	if (fclose(out) != 0) {
+		cerr << "Failed to write the results: " << strerror(errno) << endl;
+		return 1;
+	}
+	return 0;
+}
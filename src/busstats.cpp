@@ -0,0 +1,286 @@
+/**
+ * busstats.cpp
+ *
+ * Live bus occupancy, frame rates and reliability from libcec's traffic
+ */
+#include "busstats.h"
+#include "events.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+using namespace CEC;
+
+using std::string;
+
+// libcec reporting the last frame sent was not acked
+static const char NOT_ACKED[]  = "not acked";
+static const char FAILED_ACK[] = "FAILED_ACK";
+
+// How quickly the bus time of each opcode is forgotten
+static const double DECAY_SECONDS = 60.0;
+
+// The shorter window in snapshots, besides the whole WINDOW
+static const size_t SHORT_WINDOW = 10;
+
+static int hexDigit(char c) {
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+static double rate(uint64_t count, uint64_t total) {
+	return total ? (double) count / total : 0.0;
+}
+
+void BusStats::Counts::clear() {
+	memset(this, 0, sizeof(*this));
+}
+
+void BusStats::Counts::add(const Counts & other) {
+	frames      += other.frames;
+	tx          += other.tx;
+	polls       += other.polls;
+	nacked      += other.nacked;
+	retransmits += other.retransmits;
+	unacked     += other.unacked;
+	noEom       += other.noEom;
+	busy        += other.busy;
+	for (size_t i = 0; i < 16; i++)
+		initiators[i] += other.initiators[i];
+}
+
+BusStats::BusStats() : started(Event::now()), haveLastTx(false) {
+	lastSecond = started / 1000000;
+
+	for (size_t i = 0; i < WINDOW; i++) {
+		buckets[i].second = -1;
+		buckets[i].counts.clear();
+	}
+	total.clear();
+
+	memset(opcodeFrames, 0, sizeof(opcodeFrames));
+	for (size_t i = 0; i < 256; i++)
+		opcodeLoad[i] = 0.0;
+	memset(last, 0, sizeof(last));
+}
+
+/**
+ * The bucket for now, starting a new one (and decaying the opcode loads)
+ * when a second has passed. sync must be held.
+ */
+BusStats::Bucket & BusStats::bucket(uint64_t now) {
+	int64_t second = now / 1000000;
+
+	if (second > lastSecond) {
+		int64_t elapsed = second - lastSecond;
+		double factor = elapsed > 10 * DECAY_SECONDS ? 0.0 : exp(-elapsed / DECAY_SECONDS);
+		for (size_t i = 0; i < 256; i++)
+			opcodeLoad[i] *= factor;
+		lastSecond = second;
+	}
+
+	Bucket & b = buckets[second % WINDOW];
+	if (b.second < second) {
+		b.second = second;
+		b.counts.clear();
+	}
+	return b;
+}
+
+void BusStats::message(const cec_log_message & message, uint64_t now) {
+	const char *text = message.message;
+
+	if (message.level != CEC_LOG_TRAFFIC) {
+		if (strstr(text, NOT_ACKED) || strstr(text, FAILED_ACK))
+			nack(now);
+		return;
+	}
+
+	// ">> 10:8f" for a frame received, "<< 10:8f" for one sent
+	if (!((text[0] == '>' && text[1] == '>') || (text[0] == '<' && text[1] == '<')) || text[2] != ' ')
+		return;
+
+	uint8_t data[MAX_FRAME];
+	size_t len = 0;
+	const char *p = text + 3;
+	while (len < MAX_FRAME) {
+		int hi = hexDigit(p[0]);
+		int lo = hi < 0 ? -1 : hexDigit(p[1]);
+		if (lo < 0)
+			break;
+		data[len++] = hi << 4 | lo;
+		if (p[2] != ':')
+			break;
+		p += 3;
+	}
+
+	if (len)
+		frame(data, len, text[0] == '<', now);
+}
+
+void BusStats::frame(const uint8_t *data, size_t len, bool sent, uint64_t now) {
+	int initiator = data[0] >> 4;
+	uint64_t duration = START_BIT_US + BYTE_US * len;
+
+	// Frames sent are logged before they go out, and received ones once they are in
+	uint64_t start = sent ? now : now - std::min(now, duration);
+
+	std::lock_guard<std::mutex> lock(sync);
+	Counts & counts = bucket(now).counts;
+
+	LastFrame & previous = last[initiator];
+	bool retransmit = previous.len == len && start <= previous.end + RETRANSMIT_GAP_US
+		&& memcmp(previous.data, data, len) == 0;
+
+	previous.len = len;
+	previous.end = start + duration;
+	memcpy(previous.data, data, len);
+
+	uint64_t busy = frameTime(len);
+	Counts * both[] = { &counts, &total };
+	for (size_t i = 0; i < 2; i++) {
+		Counts & c = *both[i];
+		c.frames++;
+		c.busy += busy;
+		c.initiators[initiator]++;
+		if (sent)
+			c.tx++;
+		if (len == 1)
+			c.polls++;
+		if (retransmit)
+			c.retransmits++;
+	}
+
+	if (sent)
+		haveLastTx = true;
+
+	if (len > 1) {
+		opcodeFrames[data[1]]++;
+		opcodeLoad[data[1]] += busy;
+	}
+}
+
+void BusStats::nack(uint64_t now) {
+	std::lock_guard<std::mutex> lock(sync);
+
+	// Only the first report counts, libcec may log the failure more than once
+	if (!haveLastTx)
+		return;
+	haveLastTx = false;
+
+	bucket(now).counts.nacked++;
+	total.nacked++;
+}
+
+void BusStats::command(const cec_command & command, uint64_t now) {
+	if (command.ack && command.eom)
+		return;
+
+	std::lock_guard<std::mutex> lock(sync);
+	Counts & counts = bucket(now).counts;
+
+	if (!command.ack) {
+		counts.unacked++;
+		total.unacked++;
+	}
+	if (!command.eom) {
+		counts.noEom++;
+		total.noEom++;
+	}
+}
+
+/**
+ * Sums the buckets of the last seconds up to now, setting covered to how
+ * many seconds of that the daemon has been running for. sync must be held.
+ */
+BusStats::Counts BusStats::window(size_t seconds, uint64_t now, double & covered) {
+	int64_t second = bucket(now).second;
+
+	Counts sum;
+	sum.clear();
+	for (size_t i = 0; i < seconds && i < WINDOW; i++) {
+		const Bucket & b = buckets[(second - i) % WINDOW];
+		if (b.second == second - (int64_t) i)
+			sum.add(b.counts);
+	}
+
+	covered = std::min((double) seconds, std::max(1.0, (now - started) / 1e6));
+	return sum;
+}
+
+int BusStats::format(char *out, size_t len, const Counts & c) {
+	return snprintf(out, len, "\"frames\":%llu,\"rx\":%llu,\"tx\":%llu,\"polls\":%llu,\"nacked\":%llu,\"nack_rate\":%.4f,"
+		"\"retransmits\":%llu,\"unacked\":%llu,\"no_eom\":%llu,\"busy_us\":%llu",
+		(unsigned long long) c.frames, (unsigned long long) (c.frames - c.tx), (unsigned long long) c.tx,
+		(unsigned long long) c.polls, (unsigned long long) c.nacked, rate(c.nacked, c.tx),
+		(unsigned long long) c.retransmits, (unsigned long long) c.unacked, (unsigned long long) c.noEom,
+		(unsigned long long) c.busy);
+}
+
+string BusStats::snapshot(uint64_t now) {
+	char out[4096];
+	size_t len = sizeof(out);
+	int n;
+
+	std::lock_guard<std::mutex> lock(sync);
+
+	n = snprintf(out, len, "{\"type\":\"stats\",\"time\":%llu,\"uptime\":%llu,\"total\":{",
+		(unsigned long long) now, (unsigned long long) (now - std::min(now, started)) / 1000000);
+	n += format(out + n, len - n, total);
+
+	const size_t windows[] = { SHORT_WINDOW, WINDOW };
+	n += snprintf(out + n, len - n, "},\"windows\":[");
+	for (size_t w = 0; w < 2; w++) {
+		double covered;
+		Counts c = window(windows[w], now, covered);
+
+		n += snprintf(out + n, len - n, "%s{\"seconds\":%zu,", w ? "," : "", windows[w]);
+		n += format(out + n, len - n, c);
+		n += snprintf(out + n, len - n, ",\"fps\":%.2f,\"occupancy\":%.4f,\"initiators\":[",
+			c.frames / covered, std::min(1.0, c.busy / (covered * 1e6)));
+
+		bool first = true;
+		for (size_t i = 0; i < 16; i++) {
+			if (!c.initiators[i])
+				continue;
+			n += snprintf(out + n, len - n, "%s{\"address\":%zu,\"fps\":%.2f}",
+				first ? "" : ",", i, c.initiators[i] / covered);
+			first = false;
+		}
+		n += snprintf(out + n, len - n, "]}");
+	}
+
+	// The heaviest opcodes by recent bus time, kept in order by insertion
+	size_t top[TOP_OPCODES];
+	size_t count = 0;
+	double load = 0.0;
+	for (size_t i = 0; i < 256; i++) {
+		load += opcodeLoad[i];
+		if (opcodeLoad[i] < 1.0)
+			continue;
+
+		size_t j = count < TOP_OPCODES ? count++ : TOP_OPCODES;
+		for (; j > 0 && opcodeLoad[top[j - 1]] < opcodeLoad[i]; j--) {
+			if (j < TOP_OPCODES)
+				top[j] = top[j - 1];
+		}
+		if (j < TOP_OPCODES)
+			top[j] = i;
+	}
+
+	n += snprintf(out + n, len - n, "],\"opcodes\":[");
+	for (size_t i = 0; i < count; i++) {
+		n += snprintf(out + n, len - n, "%s{\"opcode\":%zu,\"frames\":%llu,\"load\":%.4f}",
+			i ? "," : "", top[i], (unsigned long long) opcodeFrames[top[i]], opcodeLoad[top[i]] / load);
+	}
+	n += snprintf(out + n, len - n, "]}");
+
+	return string(out, std::min((size_t) n, len - 1));
+}
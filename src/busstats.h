@@ -0,0 +1,117 @@
+#ifndef LIBCEC_DAEMON_BUSSTATS_H
+#define LIBCEC_DAEMON_BUSSTATS_H
+
+#include <libcec/cectypes.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+/**
+ * Live CEC bus statistics, kept from the TRAFFIC log messages and commands
+ * libcec (or the kernel backend) already reports.
+ *
+ * Counts go into one bucket per second, kept for the last WINDOW seconds, so
+ * rates over recent windows come from summing buckets. Bus time per opcode
+ * decays exponentially, so the heaviest opcodes are those of the last minute
+ * or so rather than since startup. Memory use is fixed, nothing touches the
+ * heap until a snapshot is taken, and each frame costs a short parse and a
+ * few increments under an uncontended lock.
+ *
+ * Bus occupancy is estimated from the nominal CEC timing: a 4.5ms start bit,
+ * 24ms for each byte, and the 5 bit periods (12ms) of signal free time the
+ * next initiator waits for. A frame sent again by the same initiator within
+ * RETRANSMIT_GAP of its end counts as a retransmission.
+ */
+class BusStats {
+public:
+	static const size_t WINDOW      = 60;  // seconds kept
+	static const size_t TOP_OPCODES = 8;   // in snapshots
+
+	// The libcec log levels that need to be produced to keep the statistics
+	static const int LOG_MASK = CEC::CEC_LOG_TRAFFIC | CEC::CEC_LOG_DEBUG;
+
+	static const uint64_t START_BIT_US      = 4500;
+	static const uint64_t BYTE_US           = 24000;
+	static const uint64_t SIGNAL_FREE_US    = 12000;
+	static const uint64_t RETRANSMIT_GAP_US = 50000;
+	static const size_t MAX_FRAME           = 16;  // bytes, header included
+
+	BusStats();
+
+	/**
+	 * Accounts for a libcec log message logged at now (CLOCK_MONOTONIC in
+	 * microseconds): frames such as ">> 10:8f", and reports of the last frame
+	 * sent not being acked. Anything else is ignored. Safe to call from any
+	 * thread.
+	 */
+	void message(const CEC::cec_log_message & message, uint64_t now);
+
+	/**
+	 * Accounts for the ack and eom flags of a received command. Safe to call
+	 * from any thread.
+	 */
+	void command(const CEC::cec_command & command, uint64_t now);
+
+	/**
+	 * The statistics as a single line of JSON
+	 */
+	std::string snapshot(uint64_t now);
+
+	/**
+	 * How long a frame of len bytes keeps the bus busy, in microseconds
+	 */
+	static uint64_t frameTime(size_t len) { return START_BIT_US + BYTE_US * len + SIGNAL_FREE_US; }
+
+private:
+	struct Counts {
+		uint64_t frames;
+		uint64_t tx;          // sent by us
+		uint64_t polls;       // header only frames
+		uint64_t nacked;      // sent by us and not acked
+		uint64_t retransmits;
+		uint64_t unacked;     // received commands without ack
+		uint64_t noEom;       // received commands without eom
+		uint64_t busy;        // estimated bus time in microseconds
+		uint64_t initiators[16];
+
+		void clear();
+		void add(const Counts & other);
+	};
+
+	struct Bucket {
+		int64_t second;
+		Counts counts;
+	};
+
+	// The last frame from each initiator, to spot retransmissions
+	struct LastFrame {
+		uint8_t len;
+		uint8_t data[MAX_FRAME];
+		uint64_t end;
+	};
+
+	std::mutex sync;
+	uint64_t started;
+	int64_t lastSecond;
+	Bucket buckets[WINDOW];
+	Counts total;
+
+	uint64_t opcodeFrames[256];
+	double opcodeLoad[256];       // decayed bus time
+	LastFrame last[16];
+	bool haveLastTx;              // a frame we sent not reported as not acked yet
+
+	Bucket & bucket(uint64_t now);
+	void frame(const uint8_t *data, size_t len, bool sent, uint64_t now);
+	void nack(uint64_t now);
+	Counts window(size_t seconds, uint64_t now, double & covered);
+	static int format(char *out, size_t len, const Counts & counts);
+
+	// Not implemented
+	BusStats(BusStats const&);
+	void operator=(BusStats const&);
+};
+
+#endif
@@ -0,0 +1,166 @@
+/**
+ * callstats.cpp
+ *
+ * Latency histograms and slow call warnings for calls into libcec
+ */
+#include "callstats.h"
+#include "log.h"
+
+#include <cstdio>
+
+using namespace log4cplus;
+
+using std::string;
+
+static Logger logger = Logger::getInstance("libcec");
+
+static const struct {
+	const char *name;
+	unsigned slowMs;   // default slow threshold
+} calls[CallStats::CALL_MAX] = {
+	{ "LibCecInitialise",         2000 },
+	{ "FindAdapters",             2000 },
+	{ "Open",                     5000 },
+	{ "Close",                    2000 },
+	{ "SetActiveSource",          1000 },
+	{ "SetInactiveView",          1000 },
+	{ "PingAdapter",               500 },
+	{ "GetActiveDevices",         1000 },
+	{ "GetDevicePhysicalAddress", 1000 },
+	{ "GetDeviceOSDName",         1000 },
+	{ "GetDeviceVendorId",        1000 },
+};
+
+CallStats::CallStats() : running(NULL) {
+	for (size_t i = 0; i < CALL_MAX; i++) {
+		apis[i] = Api();
+		apis[i].threshold = std::chrono::milliseconds(calls[i].slowMs);
+	}
+}
+
+CallStats::Timer::Timer(CallStats & stats, Call call)
+	: stats(stats), call(call), start(Clock::now()), finished(false), timedOut(false), prev(NULL) {
+	std::lock_guard<std::mutex> lock(stats.sync);
+	next = stats.running;
+	if (next)
+		next->prev = this;
+	stats.running = this;
+}
+
+/**
+ * Takes the timer out of the calls running, stats.sync must be held
+ */
+void CallStats::Timer::unlink() {
+	if (prev)
+		prev->next = next;
+	else
+		stats.running = next;
+	if (next)
+		next->prev = prev;
+}
+
+void CallStats::Timer::finish(bool ok) {
+	finished = true;
+	Clock::time_point end = Clock::now();
+	{
+		std::lock_guard<std::mutex> lock(stats.sync);
+		unlink();
+	}
+	stats.record(call, end - start, ok);
+	if (Trace::enabled())
+		Trace::record(name(call), Trace::micros(start), Trace::micros(end));
+}
+
+const char *CallStats::name(Call call) {
+	return call >= 0 && call < CALL_MAX ? calls[call].name : "unknown";
+}
+
+void CallStats::setSlowThreshold(std::chrono::milliseconds threshold) {
+	std::lock_guard<std::mutex> lock(sync);
+	for (size_t i = 0; i < CALL_MAX; i++)
+		apis[i].threshold = threshold;
+}
+
+void CallStats::record(Call call, Clock::duration took, bool ok) {
+	uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(took).count();
+	size_t bucket = us < 2 ? 0 : 63 - __builtin_clzll(us);
+	bool slow;
+
+	{
+		std::lock_guard<std::mutex> lock(sync);
+		Api & api = apis[call];
+
+		slow = api.threshold.count() > 0 && us >= (uint64_t) api.threshold.count();
+
+		api.count++;
+		api.total += us;
+		if (us > api.max)
+			api.max = us;
+		api.counts[bucket < BUCKETS ? bucket : BUCKETS - 1]++;
+		if (!ok)
+			api.failed++;
+		if (slow)
+			api.slow++;
+	}
+
+	if (slow)
+		LOG4CPLUS_WARN(logger, name(call) << " took " << us / 1000 << "ms" << (ok ? "" : " and failed"));
+}
+
+void CallStats::timeout() {
+	std::lock_guard<std::mutex> lock(sync);
+	for (Timer *t = running; t; t = t->next) {
+		if (t->timedOut)
+			continue;
+		t->timedOut = true;
+		apis[t->call].timeouts++;
+	}
+}
+
+/**
+ * The upper bound of the bucket holding the p-th percentile call, in microseconds
+ */
+uint64_t CallStats::percentile(const Api & api, unsigned p) {
+	uint64_t rank = (api.count * p + 99) / 100;
+	uint64_t seen = 0;
+	for (size_t i = 0; i < BUCKETS; i++) {
+		seen += api.counts[i];
+		if (seen >= rank)
+			return 2ULL << i;
+	}
+	return api.max;
+}
+
+string CallStats::snapshot() const {
+	string out = "{";
+	char buf[256];
+
+	std::lock_guard<std::mutex> lock(sync);
+
+	for (size_t i = 0; i < CALL_MAX; i++) {
+		const Api & api = apis[i];
+		if (!api.count)
+			continue;
+
+		snprintf(buf, sizeof(buf), "%s\"%s\":{\"count\":%llu,\"failed\":%llu,\"slow\":%llu,\"timeouts\":%llu,"
+			"\"avg_us\":%llu,\"max_us\":%llu,\"p50_us\":%llu,\"p99_us\":%llu,\"latency\":[",
+			out.size() > 1 ? "," : "", calls[i].name,
+			(unsigned long long) api.count, (unsigned long long) api.failed, (unsigned long long) api.slow,
+			(unsigned long long) api.timeouts, (unsigned long long) (api.total / api.count),
+			(unsigned long long) api.max, (unsigned long long) percentile(api, 50),
+			(unsigned long long) percentile(api, 99));
+		out += buf;
+
+		size_t used = BUCKETS;
+		while (used > 0 && api.counts[used - 1] == 0)
+			used--;
+		for (size_t b = 0; b < used; b++) {
+			snprintf(buf, sizeof(buf), b ? ",%llu" : "%llu", (unsigned long long) api.counts[b]);
+			out += buf;
+		}
+		out += "]}";
+	}
+
+	out += "}";
+	return out;
+}
@@ -0,0 +1,126 @@
+#ifndef LIBCEC_DAEMON_CALLSTATS_H
+#define LIBCEC_DAEMON_CALLSTATS_H
+
+#include "trace.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+/**
+ * Latency of the blocking calls Cec makes into libcec, kept per API so slow
+ * calls can be told apart from slowness in the daemon itself.
+ *
+ * Each API has a log2 histogram of call times, plus counts of calls that
+ * failed, that were slow, and of timeouts: calls the daemon gave up waiting
+ * for (see timeout()), which are still recorded as usual if they return.
+ * Slow calls are logged as warnings, and every call is a span while tracing.
+ * Memory use is fixed.
+ */
+class CallStats {
+public:
+	enum Call {
+		CALL_INITIALISE,
+		CALL_FIND_ADAPTERS,
+		CALL_OPEN,
+		CALL_CLOSE,
+		CALL_SET_ACTIVE_SOURCE,
+		CALL_SET_INACTIVE_VIEW,
+		CALL_PING_ADAPTER,
+		CALL_GET_ACTIVE_DEVICES,
+		CALL_GET_DEVICE_PHYSICAL_ADDRESS,
+		CALL_GET_DEVICE_OSD_NAME,
+		CALL_GET_DEVICE_VENDOR_ID,
+
+		CALL_MAX
+	};
+
+	/**
+	 * Bucket 0 holds calls under 2us, and bucket i after that calls taking
+	 * from 2^i up to 2^(i+1)us
+	 */
+	static const size_t BUCKETS = 32;
+
+	typedef std::chrono::steady_clock Clock;
+
+	/**
+	 * Times one call, from construction until finish(), or until it goes
+	 * out of scope, which counts as a failure
+	 */
+	class Timer {
+	private:
+		CallStats & stats;
+		Call call;
+		Clock::time_point start;
+		bool finished;
+
+		// In stats' list of calls running, guarded by its sync
+		bool timedOut;
+		Timer *prev;
+		Timer *next;
+
+		void unlink();
+
+		// Not implemented
+		Timer(Timer const&);
+		void operator=(Timer const&);
+
+	public:
+		Timer(CallStats & stats, Call call);
+		~Timer() { if (!finished) finish(false); }
+
+		void finish(bool ok);
+
+		friend class CallStats;
+	};
+
+	CallStats();
+
+	/**
+	 * Calls taking at least this long are slow, none with 0. Each API has a
+	 * default of its own, as opening an adapter normally takes far longer
+	 * than a ping.
+	 */
+	void setSlowThreshold(std::chrono::milliseconds threshold);
+
+	void record(Call call, Clock::duration took, bool ok);
+
+	/**
+	 * Counts the calls running now as timeouts, for when whoever made them
+	 * gave up waiting. A call still running the next time counts only once.
+	 */
+	void timeout();
+
+	/**
+	 * The calls made so far, as a JSON object keyed by libcec API name
+	 */
+	std::string snapshot() const;
+
+	static const char *name(Call call);
+
+private:
+	struct Api {
+		uint64_t count;
+		uint64_t failed;
+		uint64_t slow;
+		uint64_t timeouts;
+		uint64_t total;    // microseconds
+		uint64_t max;
+		uint64_t counts[BUCKETS];
+		std::chrono::microseconds threshold;
+	};
+
+	mutable std::mutex sync;
+	Api apis[CALL_MAX];
+	Timer *running;    // calls in progress, guarded by sync
+
+	static uint64_t percentile(const Api & api, unsigned p);
+
+	// Not implemented
+	CallStats(CallStats const&);
+	void operator=(CallStats const&);
+};
+
+#endif
@@ -0,0 +1,303 @@
+/**
+ * cecdaemon.cpp
+ *
+ * The C API of libcecdaemon, running Main inside another program
+ */
+#include "cecdaemon.h"
+#include "eventring.h"
+#include "main.h"
+#include "log.h"
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+using namespace CEC;
+using namespace log4cplus;
+
+using std::string;
+
+static Logger logger = Logger::getInstance("cecd");
+
+static constexpr bool same(int a, int b) { return a == b; }
+
+static_assert(same(CECD_EVENT_KEY, EVENT_KEY) && same(CECD_EVENT_COMMAND, EVENT_COMMAND) &&
+	same(CECD_EVENT_POWER, EVENT_POWER) && same(CECD_EVENT_SOURCE, EVENT_SOURCE) &&
+	same(CECD_EVENT_ALERT, EVENT_ALERT) && same(CECD_EVENT_RESTART, EVENT_RESTART) &&
+	same(CECD_EVENT_RESUME, EVENT_RESUME) && same(CECD_EVENT_READY, EVENT_READY),
+	"C API event types must match EventType");
+static_assert(same(CECD_POWER_INACTIVE, EVENT_POWER_INACTIVE) && same(CECD_POWER_ACTIVE, EVENT_POWER_ACTIVE) &&
+	same(CECD_POWER_STANDBY, EVENT_POWER_STANDBY), "C API power states must match the events");
+static_assert(CECD_MAX_PARAMETERS == Event::MAX_PARAMETERS, "C API events must hold every parameter");
+
+// How often cecd_close() asks again, in case Main was between restarts and missed it
+static const std::chrono::milliseconds STOP_RETRY(100);
+
+struct cecd {
+	cecd_callback callback;
+	void *data;
+	int fd;             // eventfd, readable while events are queued
+	std::thread thread; // running Main::loop()
+
+	std::mutex sync;
+	std::condition_variable cond;
+	RingBuffer<Event, 256> queue; // guarded by sync
+	bool ready;                   // guarded by sync
+	bool finished;                // Main::loop() returned, guarded by sync
+
+	cecd(cecd_callback callback, void *data) : callback(callback), data(data), fd(-1), ready(false), finished(false) {}
+
+	void publish(const Event & event);
+	void signal();
+};
+
+// Main is a singleton, so there can only be one handle at a time
+static std::atomic<bool> opened(false);
+
+// The handle cecd_open() returned, until it is closed
+static std::atomic<cecd *> current(nullptr);
+
+static void convert(const Event & in, cecd_event & out) {
+	out.time        = in.time;
+	out.type        = in.type;
+	out.code        = in.code;
+	out.value       = in.value;
+	out.initiator   = in.initiator;
+	out.destination = in.destination;
+	out.ack         = in.ack;
+	out.eom         = in.eom;
+	out.size        = in.size;
+	memcpy(out.parameters, in.parameters, sizeof(out.parameters));
+}
+
+/**
+ * Makes the fd readable. sync must be held.
+ */
+void cecd::signal() {
+	uint64_t one = 1;
+	if (write(fd, &one, sizeof(one)) < 0) {
+		// Already readable
+	}
+}
+
+void cecd::publish(const Event & event) {
+	if (event.type == EVENT_READY) {
+		std::lock_guard<std::mutex> lock(sync);
+		ready = true;
+		cond.notify_all();
+	}
+
+	if (callback) {
+		cecd_event out;
+		convert(event, out);
+		callback(&out, data);
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(sync);
+	if (queue.empty())
+		signal();
+	if (!queue.push(event))
+		LOG4CPLUS_DEBUG(logger, "Event queue full, dropping " << Event::typeName(event.type) << " event");
+}
+
+extern "C" cecd *cecd_open(const char *device, unsigned flags, cecd_callback callback, void *data) {
+	if (opened.exchange(true)) {
+		errno = EBUSY;
+		return NULL;
+	}
+
+	cecd *handle = new (std::nothrow) cecd(callback, data);
+	if (!handle) {
+		opened = false;
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	handle->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (handle->fd < 0) {
+		int error = errno;
+		delete handle;
+		opened = false;
+		errno = error;
+		return NULL;
+	}
+
+	try {
+		Main & main = Main::instance();
+		main.setEmbedded(true);
+		main.setBackend(flags & CECD_KERNEL ? "kernel" : "libcec");
+		main.setMakeActive(!(flags & CECD_NO_ACTIVATE));
+		main.setOutputs(flags & CECD_UINPUT ? "uinput" : "none");
+		main.setEventListener([handle] (const Event & event) { handle->publish(event); });
+
+		string path = device ? device : "";
+		handle->thread = std::thread([handle, path] {
+			try {
+				Main::instance().loop(path);
+			} catch (std::exception & e) {
+				LOG4CPLUS_ERROR(logger, "Stopped: " << e.what());
+			}
+
+			std::lock_guard<std::mutex> lock(handle->sync);
+			handle->finished = true;
+			handle->signal();
+			handle->cond.notify_all();
+		});
+	} catch (std::exception & e) {
+		LOG4CPLUS_ERROR(logger, "Failed to start: " << e.what());
+		Main::instance().setEventListener(nullptr);
+		close(handle->fd);
+		delete handle;
+		opened = false;
+		errno = EIO;
+		return NULL;
+	}
+
+	std::unique_lock<std::mutex> lock(handle->sync);
+	handle->cond.wait(lock, [handle] { return handle->ready || handle->finished; });
+	bool failed = !handle->ready;
+	lock.unlock();
+
+	if (failed) {
+		cecd_close(handle);
+		errno = EIO;
+		return NULL;
+	}
+
+	current = handle;
+	return handle;
+}
+
+extern "C" int cecd_fd(const cecd *handle) {
+	return handle->fd;
+}
+
+extern "C" int cecd_read(cecd *handle, cecd_event *events, int max) {
+	std::lock_guard<std::mutex> lock(handle->sync);
+
+	int n = 0;
+	while (n < max && !handle->queue.empty()) {
+		convert(handle->queue.front(), events[n++]);
+		handle->queue.pop();
+	}
+
+	if (handle->queue.empty()) {
+		if (n == 0 && handle->finished) {
+			errno = ENODEV;
+			return -1;
+		}
+
+		uint64_t count;
+		if (read(handle->fd, &count, sizeof(count)) < 0) {
+			// Wasn't readable
+		}
+	}
+
+	return n;
+}
+
+extern "C" int cecd_send(cecd *handle, int command, int arg) {
+	// Main would act on any pointer, so refuse one that isn't the open handle
+	if (!handle || handle != current) {
+		errno = EBADF;
+		return -1;
+	}
+
+	Main & main = Main::instance();
+
+	switch (command) {
+		case CECD_SET_ACTIVE_SOURCE:
+			main.setActiveSource();
+			return 0;
+		case CECD_PRESS_KEY:
+			if (arg < 0 || arg > CEC_USER_CONTROL_CODE_MAX)
+				break;
+			main.pressKey((cec_user_control_code) arg);
+			return 0;
+		case CECD_RESTART:
+			main.restart();
+			return 0;
+	}
+
+	errno = EINVAL;
+	return -1;
+}
+
+extern "C" void cecd_close(cecd *handle) {
+	if (!handle)
+		return;
+
+	current = nullptr;
+
+	// Main publishes some events with its own locks held, so never ask it to stop with sync held
+	std::unique_lock<std::mutex> lock(handle->sync);
+	while (!handle->finished) {
+		lock.unlock();
+		Main::instance().stop();
+		lock.lock();
+		handle->cond.wait_for(lock, STOP_RETRY, [handle] { return handle->finished; });
+	}
+	lock.unlock();
+
+	handle->thread.join();
+	Main::instance().setEventListener(nullptr);
+
+	close(handle->fd);
+	delete handle;
+	opened = false;
+}
+
+struct cecd_ring {
+	EventRing::Reader reader;
+
+	explicit cecd_ring(int fd) : reader(fd) {}
+};
+
+extern "C" cecd_ring *cecd_ring_open(const char *path) {
+	int fd = EventRing::receive(path);
+	if (fd < 0)
+		return NULL;
+
+	try {
+		return new cecd_ring(fd);
+	} catch (std::bad_alloc &) {
+		close(fd);
+		errno = ENOMEM;
+	} catch (std::exception & e) {
+		// The reader has closed fd
+		LOG4CPLUS_ERROR(logger, e.what());
+		errno = EPROTO;
+	}
+	return NULL;
+}
+
+extern "C" int cecd_ring_read(cecd_ring *ring, cecd_event *events, int max) {
+	Event event(EVENT_KEY);
+
+	int n = 0;
+	while (n < max && ring->reader.read(event))
+		convert(event, events[n++]);
+	return n;
+}
+
+extern "C" int cecd_ring_wait(cecd_ring *ring, int timeout_ms) {
+	return ring->reader.wait(timeout_ms) ? 1 : 0;
+}
+
+extern "C" uint64_t cecd_ring_lost(const cecd_ring *ring) {
+	return ring->reader.lost();
+}
+
+extern "C" void cecd_ring_close(cecd_ring *ring) {
+	delete ring;
+}
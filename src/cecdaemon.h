@@ -0,0 +1,150 @@
+#ifndef LIBCEC_DAEMON_CECDAEMON_H
+#define LIBCEC_DAEMON_CECDAEMON_H
+
+/**
+ * libcecdaemon, the daemon's handling of the CEC bus as a library, for
+ * programs that want remote control keys and bus events in process, without
+ * running the daemon and reading them back from uinput.
+ *
+ * A program opens the adapter with cecd_open(), which runs the same keymap,
+ * command handling and adapter lifecycle (restarts, resume after suspend,
+ * key release timeouts) as the daemon, on threads of its own. Events arrive
+ * either through a callback, or in a queue read with cecd_read() whenever the
+ * descriptor from cecd_fd() polls readable.
+ *
+ * Only one handle can be open in a process at a time. Logging goes through
+ * log4cplus, which the program configures as it likes.
+ *
+ * Programs can also follow a running daemon's events through its event ring,
+ * with the cecd_ring_* functions, which leave the adapter to the daemon.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct cecd cecd;
+
+/* Event types, as on the daemon's event socket */
+enum {
+	CECD_EVENT_KEY,      /* code: cec_user_control_code, value: duration in ms */
+	CECD_EVENT_COMMAND,  /* code: cec_opcode, plus initiator, destination, ack, eom and parameters */
+	CECD_EVENT_POWER,    /* code: CECD_POWER_* */
+	CECD_EVENT_SOURCE,   /* code: logical address, value: 1 if activated, 0 if deactivated */
+	CECD_EVENT_ALERT,    /* code: libcec_alert */
+	CECD_EVENT_RESTART,  /* the adapter connection is being restarted */
+	CECD_EVENT_RESUME,   /* code: how the adapter was recovered, value: time spent suspended in ms */
+	CECD_EVENT_READY     /* the adapter is open and the bus is being handled */
+};
+
+enum {
+	CECD_POWER_INACTIVE,
+	CECD_POWER_ACTIVE,
+	CECD_POWER_STANDBY
+};
+
+#define CECD_MAX_PARAMETERS 14
+
+typedef struct cecd_event {
+	uint64_t time;       /* CLOCK_MONOTONIC in microseconds */
+	int type;            /* CECD_EVENT_* */
+	int code;
+	int value;
+	int initiator;       /* -1 unless a command */
+	int destination;
+	int ack;
+	int eom;
+	int size;            /* number of parameters */
+	uint8_t parameters[CECD_MAX_PARAMETERS];
+} cecd_event;
+
+/* Flags for cecd_open() */
+#define CECD_NO_ACTIVATE  0x1  /* don't become the active source when opened */
+#define CECD_KERNEL       0x2  /* use the kernel CEC framework (/dev/cecN) rather than libcec */
+#define CECD_UINPUT       0x4  /* send keys to a uinput device as well, as the daemon does */
+
+/* Commands for cecd_send() */
+enum {
+	CECD_SET_ACTIVE_SOURCE, /* make this device the active source */
+	CECD_PRESS_KEY,         /* press and release arg, a cec_user_control_code */
+	CECD_RESTART            /* reopen the adapter */
+};
+
+/**
+ * Called with each event, on one of the library's threads. It must return
+ * quickly, and must not call back into the library.
+ */
+typedef void (*cecd_callback)(const cecd_event *event, void *data);
+
+/**
+ * Opens the adapter (a USB path, /dev/cecN with CECD_KERNEL, or NULL for the
+ * first one found) and waits until it is ready. With a callback, every event
+ * is passed to it, otherwise they are queued for cecd_read(). Returns NULL
+ * with errno set on failure: EBUSY if a handle is already open, EIO if the
+ * adapter could not be opened.
+ */
+cecd *cecd_open(const char *device, unsigned flags, cecd_callback callback, void *data);
+
+/**
+ * A descriptor that polls readable while events are queued
+ */
+int cecd_fd(const cecd *handle);
+
+/**
+ * Takes up to max queued events, without blocking. Returns how many, which
+ * may be 0, or -1 with errno set to ENODEV once the library has stopped
+ * handling the adapter and every event has been read. Events that arrive
+ * while the queue is full are dropped.
+ */
+int cecd_read(cecd *handle, cecd_event *events, int max);
+
+/**
+ * Queues a CECD_* command. Returns 0, or -1 with errno set to EINVAL for an
+ * unknown command or argument, or to EBADF if handle is NULL or is not the
+ * one cecd_open() returned and cecd_close() has not yet closed.
+ */
+int cecd_send(cecd *handle, int command, int arg);
+
+/**
+ * Closes the adapter, stops the library's threads and frees the handle
+ */
+void cecd_close(cecd *handle);
+
+typedef struct cecd_ring cecd_ring;
+
+/**
+ * Attaches to the event ring of the daemon listening on the event socket at
+ * path (its --socket), to read events from shared memory as they are
+ * published, starting with the next one. Returns NULL with errno set on
+ * failure: ENOTSUP if the daemon has no ring, EPROTO if it is not one this
+ * library can read.
+ */
+cecd_ring *cecd_ring_open(const char *path);
+
+/**
+ * Takes up to max events, without blocking. Returns how many, which may be 0.
+ */
+int cecd_ring_read(cecd_ring *ring, cecd_event *events, int max);
+
+/**
+ * Sleeps until there may be events to read, for up to timeout_ms (forever if
+ * negative). Returns 1, or 0 if it timed out.
+ */
+int cecd_ring_wait(cecd_ring *ring, int timeout_ms);
+
+/**
+ * How many events were overwritten before they could be read, as the daemon
+ * never waits for a reader that falls a whole ring behind
+ */
+uint64_t cecd_ring_lost(const cecd_ring *ring);
+
+void cecd_ring_close(cecd_ring *ring);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef LIBCEC_DAEMON_CECDEVICE_H
+#define LIBCEC_DAEMON_CECDEVICE_H
+
+#include <libcec/cec.h>
+
+#include <ostream>
+#include <string>
+
+class CallStats;
+
+namespace HDMI {
+	class address;
+}
+
+class CecCallback {
+	public:
+		virtual ~CecCallback() {}
+
+		// Virtual methods to handle callbacks
+		virtual int onCecLogMessage(const CEC::cec_log_message & message) = 0;
+		virtual int onCecKeyPress  (const CEC::cec_keypress & key) = 0;
+		virtual int onCecCommand   (const CEC::cec_command & command) = 0;
+		virtual int onCecConfigurationChanged(const CEC::libcec_configuration & configuration) = 0;
+		virtual int onCecAlert(const CEC::libcec_alert alert, const CEC::libcec_parameter & param) = 0;
+		virtual int onCecMenuStateChanged(const CEC::cec_menu_state & menu_state) = 0;
+		virtual void onCecSourceActivated(const CEC::cec_logical_address & address, bool bActivated) = 0;
+};
+
+/**
+ * A CEC adapter, as driven by one of the backends: libcec (Cec), or the
+ * kernel CEC framework (KernelCec). Whichever it is, everything that
+ * happens on the bus is reported through the same CecCallback, using
+ * libcec's types.
+ */
+class CecDevice {
+	public:
+		virtual ~CecDevice() {}
+
+		/**
+		 * List all found adapters and prints them out
+		 */
+		virtual std::ostream & listDevices(std::ostream & out) = 0;
+
+		/**
+		 * Loads and initialises the backend, does nothing if already done
+		 */
+		virtual void init() = 0;
+
+		/**
+		 * Searches for the named adapter (or the first one found when
+		 * no name is given), and returns its comm port
+		 */
+		virtual std::string findAdapter(const std::string &adapter = "") = 0;
+
+		/**
+		 * Opens the adapter on the given comm port
+		 */
+		virtual void openAdapter(const std::string &comm) = 0;
+
+		/**
+		 * Closes the open adapter
+		 */
+		virtual void close(bool makeInactive = true) = 0;
+
+		/**
+		 * Only pass on log messages whose cec_log_level is in mask
+		 */
+		virtual void setLogMask(int mask) = 0;
+
+		virtual void makeActive() = 0;
+		virtual void setTargetAddress(const HDMI::address & address) = 0;
+
+		/**
+		 * Goes back to autodetecting the address. The adapter must be closed.
+		 */
+		virtual void clearTargetAddress() = 0;
+		virtual bool ping() = 0;
+
+		/**
+		 * How long calls into the backend have taken, or NULL if it doesn't
+		 * keep track
+		 */
+		virtual CallStats * callStats() { return NULL; }
+};
+
+#endif
@@ -0,0 +1,200 @@
+/**
+ * ceclog.cpp
+ *
+ * Asynchronous, rate limited logging of libcec's messages
+ */
+#include "ceclog.h"
+#include "log.h"
+
+#include <chrono>
+#include <cstring>
+
+using namespace CEC;
+using namespace log4cplus;
+
+static Logger logger = Logger::getInstance("libcec");
+
+// How often dropped message counts are logged
+static const std::chrono::seconds REPORT_INTERVAL(10);
+
+static const char *levelName[] = {"ERROR", "WARNING", "NOTICE", "TRAFFIC", "DEBUG"};
+
+// The daemon log level each libcec log level is logged at
+static const LogLevel levelMap[] = {
+	ERROR_LOG_LEVEL,
+	WARN_LOG_LEVEL,
+	DEBUG_LOG_LEVEL,
+	TRACE_LOG_LEVEL,
+	DEBUG_LOG_LEVEL,
+};
+
+CecLog::CecLog() : head(0), tail(0), rateLimit(0), sleeping(false), stopping(false) {
+	for (size_t i = 0; i < CAPACITY; i++)
+		cells[i].sequence.store(i, std::memory_order_relaxed);
+
+	for (int i = 0; i < LEVELS; i++) {
+		levels[i].window  = 0;
+		levels[i].count   = 0;
+		levels[i].limited = 0;
+		levels[i].full    = 0;
+	}
+}
+
+CecLog::~CecLog() {
+	stop();
+}
+
+int CecLog::levelIndex(int level) {
+	switch (level) {
+		case CEC_LOG_ERROR:   return 0;
+		case CEC_LOG_WARNING: return 1;
+		case CEC_LOG_NOTICE:  return 2;
+		case CEC_LOG_TRAFFIC: return 3;
+		default:              return 4;
+	}
+}
+
+int CecLog::levelMask() const {
+	int mask = 0;
+	for (int i = 0; i < LEVELS; i++) {
+		if (logger.isEnabledFor(levelMap[i]))
+			mask |= 1 << i;
+	}
+	return mask;
+}
+
+void CecLog::start() {
+	if (thread.joinable())
+		return;
+
+	stopping = false;
+	thread = std::thread(&CecLog::run, this);
+}
+
+void CecLog::stop() {
+	if (!thread.joinable())
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(sync);
+		stopping = true;
+	}
+	cond.notify_one();
+	thread.join();
+}
+
+bool CecLog::push(const cec_log_message & message) {
+	Level & level = levels[levelIndex(message.level)];
+
+	unsigned limit = rateLimit.load(std::memory_order_relaxed);
+	if (limit) {
+		int64_t second = std::chrono::duration_cast<std::chrono::seconds>(
+			std::chrono::steady_clock::now().time_since_epoch()).count();
+
+		int64_t window = level.window.load(std::memory_order_relaxed);
+		if (window != second && level.window.compare_exchange_strong(window, second))
+			level.count.store(0, std::memory_order_relaxed);
+
+		if (level.count.fetch_add(1, std::memory_order_relaxed) >= limit) {
+			level.limited.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+	}
+
+	// Claim a cell, as in Dmitry Vyukov's bounded MPMC queue
+	Cell *cell;
+	size_t pos = head.load(std::memory_order_relaxed);
+	while (true) {
+		cell = &cells[pos & (CAPACITY - 1)];
+		size_t sequence = cell->sequence.load(std::memory_order_acquire);
+		intptr_t diff = (intptr_t) sequence - (intptr_t) pos;
+
+		if (diff == 0) {
+			if (head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			level.full.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		} else {
+			pos = head.load(std::memory_order_relaxed);
+		}
+	}
+
+	cell->entry.time  = message.time;
+	cell->entry.level = message.level;
+	strncpy(cell->entry.message, message.message, MESSAGE_SIZE - 1);
+	cell->entry.message[MESSAGE_SIZE - 1] = '\0';
+	cell->sequence.store(pos + 1, std::memory_order_release);
+
+	// Only pay for a wakeup when the logger thread is idle
+	if (sleeping.load())
+		cond.notify_one();
+
+	return true;
+}
+
+bool CecLog::pop(Entry & entry) {
+	size_t pos = tail.load(std::memory_order_relaxed);
+	Cell & cell = cells[pos & (CAPACITY - 1)];
+
+	if (cell.sequence.load(std::memory_order_acquire) != pos + 1)
+		return false;
+
+	entry = cell.entry;
+	cell.sequence.store(pos + CAPACITY, std::memory_order_release);
+	tail.store(pos + 1, std::memory_order_relaxed);
+	return true;
+}
+
+void CecLog::write(const Entry & entry) const {
+	switch (levelIndex(entry.level)) {
+		case 0:  LOG4CPLUS_ERROR(logger, entry.time << " " << entry.message); break;
+		case 1:  LOG4CPLUS_WARN (logger, entry.time << " " << entry.message); break;
+		case 3:  LOG4CPLUS_TRACE(logger, entry.time << " " << entry.message); break;
+		default: LOG4CPLUS_DEBUG(logger, entry.time << " " << entry.message); break;
+	}
+}
+
+void CecLog::reportDrops() {
+	for (int i = 0; i < LEVELS; i++) {
+		unsigned limited = levels[i].limited.exchange(0, std::memory_order_relaxed);
+		unsigned full    = levels[i].full.exchange(0, std::memory_order_relaxed);
+
+		if (limited || full) {
+			LOG4CPLUS_WARN(logger, "Dropped " << (limited + full) << " libcec " << levelName[i] << " messages ("
+				<< limited << " over the rate limit, " << full << " with the queue full)");
+		}
+	}
+}
+
+void CecLog::run() {
+	std::chrono::steady_clock::time_point nextReport = std::chrono::steady_clock::now() + REPORT_INTERVAL;
+	Entry entry;
+
+	while (true) {
+		while (pop(entry))
+			write(entry);
+
+		if (std::chrono::steady_clock::now() >= nextReport) {
+			reportDrops();
+			nextReport = std::chrono::steady_clock::now() + REPORT_INTERVAL;
+		}
+
+		std::unique_lock<std::mutex> lock(sync);
+		if (stopping)
+			break;
+
+		sleeping = true;
+		size_t pos = tail.load(std::memory_order_relaxed);
+		if (cells[pos & (CAPACITY - 1)].sequence.load(std::memory_order_acquire) != pos + 1) {
+			// A wakeup can be missed, as push() never takes the lock, so never sleep for long
+			cond.wait_for(lock, std::chrono::milliseconds(100));
+		}
+		sleeping = false;
+	}
+
+	// Drain whatever is left
+	while (pop(entry))
+		write(entry);
+	reportDrops();
+}
@@ -0,0 +1,97 @@
+#ifndef LIBCEC_DAEMON_CECLOG_H
+#define LIBCEC_DAEMON_CECLOG_H
+
+#include <libcec/cectypes.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+/**
+ * Logs libcec's messages from a thread of its own.
+ *
+ * libcec calls back with log messages on the same threads that handle the
+ * bus, so rather than formatting and writing them there, push() only copies
+ * each message into a bounded lock-free queue, and never blocks. Each libcec
+ * log level is rate limited separately, and messages over the limit, or that
+ * find the queue full, are dropped and counted. The counts are logged from
+ * time to time, so a log storm costs the bus threads almost nothing.
+ */
+class CecLog {
+public:
+	static const size_t CAPACITY     = 256; // must be a power of 2
+	static const size_t MESSAGE_SIZE = 256; // longer messages are truncated
+
+	CecLog();
+	~CecLog();
+
+	/**
+	 * Messages allowed per second for each libcec log level, 0 for no limit
+	 */
+	void setRateLimit(unsigned perSecond) { rateLimit = perSecond; }
+
+	/**
+	 * The libcec log levels (as a mask of cec_log_level) that would be logged
+	 * at the current log level. Others need not be produced at all.
+	 */
+	int levelMask() const;
+
+	void start();
+	void stop();
+
+	/**
+	 * Queues a message, returns false if it was dropped. Safe to call from
+	 * any thread.
+	 */
+	bool push(const CEC::cec_log_message & message);
+
+private:
+	static const int LEVELS = 5;
+
+	struct Entry {
+		int64_t time;
+		int level;
+		char message[MESSAGE_SIZE];
+	};
+
+	struct Cell {
+		std::atomic<size_t> sequence;
+		Entry entry;
+	};
+
+	struct Level {
+		std::atomic<int64_t> window;      // the second the count is for
+		std::atomic<unsigned> count;
+		std::atomic<unsigned> limited;    // dropped by the rate limit
+		std::atomic<unsigned> full;       // dropped with the queue full
+	};
+
+	Cell cells[CAPACITY];
+	std::atomic<size_t> head;   // next cell to write
+	std::atomic<size_t> tail;   // next cell to read, only touched by the logger thread
+
+	Level levels[LEVELS];
+	std::atomic<unsigned> rateLimit;
+
+	std::mutex sync;
+	std::condition_variable cond;
+	std::atomic<bool> sleeping;
+	bool stopping;
+	std::thread thread;
+
+	static int levelIndex(int level);
+
+	bool pop(Entry & entry);
+	void write(const Entry & entry) const;
+	void reportDrops();
+	void run();
+
+	// Not implemented
+	CecLog(CecLog const&);
+	void operator=(CecLog const&);
+};
+
+#endif
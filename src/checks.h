@@ -0,0 +1,42 @@
+#ifndef LIBCEC_DAEMON_CHECKS_H
+#define LIBCEC_DAEMON_CHECKS_H
+
+#include <iostream>
+#include <string>
+
+/**
+ * Pass or fail checks made by the test programs (cec-sinkbench and
+ * cec-fakekernel), each reported on a line of its own as it is made
+ */
+class Checks {
+private:
+	unsigned failures;
+
+public:
+	Checks() : failures(0) {}
+
+	void check(const char *name, bool ok) {
+		std::cerr << (ok ? "ok      " : "FAILED  ") << name << std::endl;
+		if (!ok)
+			failures++;
+	}
+
+	/**
+	 * Counts something that kept the checks from being made as a failure
+	 */
+	void fail(const std::string & why) {
+		std::cerr << why << std::endl;
+		failures++;
+	}
+
+	/**
+	 * Reports how many checks failed, and returns the program's exit status
+	 */
+	int finish() const {
+		if (failures)
+			std::cerr << failures << " checks failed" << std::endl;
+		return failures ? 1 : 0;
+	}
+};
+
+#endif
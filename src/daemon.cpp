@@ -0,0 +1,306 @@
+/**
+ * daemon.cpp
+ *
+ * The libcec-daemon command line: parses the options, sets up logging and
+ * runs Main until it exits
+ */
+#include "main.h"
+#include "config.h"
+#include "hdmi.h"
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+
+#if defined(MINIMAL_BUILD)
+#include "options.h"
+#else
+#include <boost/program_options.hpp>
+#include "accumulator.hpp"
+#endif
+
+#include "log.h"
+
+using namespace log4cplus;
+
+using std::cout;
+using std::cerr;
+using std::endl;
+using std::min;
+using std::string;
+
+#if defined(MINIMAL_BUILD)
+
+/*
+** minimal builds use the built-in option parser
+*/
+
+namespace po = miniopts;
+
+using miniopts::value;
+using miniopts::accumulator;
+
+#elif defined(HAVE_BOOST_PO_TYPED_VALUE_NAME)
+
+/*
+** boost versions 1.50 and newer support value_name() program option value
+*/
+
+namespace po = boost::program_options;
+
+using boost::program_options::value;
+
+#else
+
+/*
+** provide a value_name() replacement for older versions
+*/
+
+namespace po = boost::program_options;
+
+template<class T> class typed_value_name : public boost::program_options::typed_value<T>
+{
+    public:
+        typed_value_name(T *my_value = new T()) : boost::program_options::typed_value<T>(my_value), val_name("arg") {};
+        boost::program_options::typed_value<T> *value_name(const char *name) { val_name = name;; return this; };
+        std::string name() const { return std::string(val_name); };
+
+    protected:
+        const char *val_name;
+};
+
+template<class T> typed_value_name<T> *value(T *my_value = new T()) { return new typed_value_name<T>(my_value); };
+
+#endif
+
+int main (int argc, char *argv[]) {
+
+    BasicConfigurator config;
+    config.configure();
+
+    int loglevel = 0;
+
+	po::options_description desc("Allowed options");
+	desc.add_options()
+	    ("help,h",    "show help message")
+	    ("version,V", "show version (and exit)")
+	    ("daemon,d",  "daemon mode, run in background")
+	    ("list,l",    "list available CEC adapters and devices")
+	    ("verbose,v", accumulator<int>(&loglevel)->implicit_value(1), "verbose output (use -vv for more)")
+	    ("quiet,q",   "quiet output (print almost nothing)")
+	    ("donotactivate,a", "do not activate device on startup")
+
+	    ("onstandby", value<string>()->value_name("<path>"),  "command to run on standby")
+	    ("onactivate", value<string>()->value_name("<path>"),  "command to run on activation")
+	    ("ondeactivate", value<string>()->value_name("<path>"),  "command to run on deactivation")
+	    ("debounce", value<int>()->value_name("<ms>"),  "wait for activation changes to settle for this long before acting on them (default 250)")
+	    ("resume-check", value<int>()->value_name("<ms>"),  "look this often for the host resuming from suspend, to check the adapter straight away, 0 to disable (default 1000)")
+	    ("resume-activate", "become the active source again after a resume, if it was before")
+	    ("no-bus-stats", "do not keep bus statistics, so libcec need not report every frame (see Bus statistics below)")
+	    ("open-timeout", value<int>()->value_name("<ms>"),  "give up on loading libcec, finding or opening the adapter after this long, 0 to wait for ever (default 30000)")
+	    ("adapter-timeout", value<int>()->value_name("<ms>"),  "give up on any other call into the adapter, such as closing it or a ping, after this long, 0 to wait for ever (default 5000)")
+	    ("slow-call", value<int>()->value_name("<ms>"),  "warn about libcec calls taking this long, 0 to never warn (default depends on the call, from 500 for a ping to 5000 to open the adapter)")
+	    ("log-rate", value<unsigned>()->value_name("<n>"),  "log at most this many libcec messages per second for each libcec log level, 0 for no limit (default 50)")
+	    ("key-timeout", value<int>()->value_name("<ms>"),  "release a held key if the TV stops repeating it for this long, 0 to disable (default 550)")
+	    ("macros", value<string>()->value_name("<path>"),  "play the key macros in this file, see Macros below")
+	    ("state-file", value<string>()->value_name("<path>"),  "remember the bus configuration here, to skip detecting it on the next start")
+	    ("output", value<string>()->value_name("<list>"),  "where to send keys, a comma separated list of uinput, none, unix:<path>, file:<path> or fd:<n> (default uinput)")
+	    ("socket", value<string>()->value_name("<path>"),  "stream events to clients connecting to this unix socket")
+	    ("event-ring", value<unsigned>()->value_name("<n>"),  "share the last n events with --socket clients through shared memory, 0 to disable (default 1024)")
+	    ("trace", "trace spans from startup, see Tracing below")
+	    ("trace-file", value<string>()->value_name("<path>"),  "where traces are saved (default /tmp/libcec-daemon-trace.json)")
+	    ("realtime", "lock memory and run the input path with real-time priority")
+	    ("rt-priority", value<int>()->value_name("<n>"),  "real-time priority for --realtime (default 50)")
+	    ("rt-policy", value<string>()->value_name("<fifo|rr>"),  "real-time scheduling policy for --realtime (default fifo)")
+	    ("rt-cec-cpus", value<string>()->value_name("<list>"),  "CPUs to pin libcec threads to, such as 0 or 2-3")
+	    ("rt-delivery-cpus", value<string>()->value_name("<list>"),  "CPUs to pin the delivery thread to, such as 1")
+	    ("port,p", value<HDMI::address>()->value_name("[a[.b.c.d]>"),  "HDMI port A or address A.B.C.D (overrides autodetected value)")
+	    ("backend", value<string>()->value_name("<libcec|kernel>"),  "drive the adapter through libcec, or the kernel CEC framework (/dev/cecN) (default libcec)")
+	    ("usb", value<string>()->value_name("<path>"), "USB adapter path, or /dev/cecN with --backend kernel (as shown by --list)")
+	;
+
+	po::positional_options_description p;
+	p.add("usb", 1);
+
+    po::variables_map vm;
+    try
+    {
+        po::store(po::command_line_parser(argc, argv).options(desc).positional(p).run(), vm);
+    }
+    catch( po::error &e )
+    {
+        cerr << argv[0] << ": " << e.what() << endl;
+        cerr << "Type \"" << argv[0] << " --help\" for more information." << endl;
+        return 1;
+    }
+    po::notify(vm);
+
+	if (vm.count("help")) {
+		cout << "Usage: " << argv[0] << " [options] [usb]" << endl << endl;
+	    cout << desc << endl;
+	    return 0;
+	}
+
+	if (vm.count("version")) {
+		cout << PACKAGE_STRING << endl;
+		return 0;
+	}
+
+	if(vm.count("quiet")) {
+		loglevel = -1;
+	} else {
+		loglevel = min(loglevel, 2);
+	}
+
+	Logger root = Logger::getRoot();
+	switch (loglevel) {
+		case 2:  root.setLogLevel(TRACE_LOG_LEVEL); break;
+		case 1:  root.setLogLevel(DEBUG_LOG_LEVEL); break;
+		default: root.setLogLevel(INFO_LOG_LEVEL); break;
+		case -1: root.setLogLevel(FATAL_LOG_LEVEL); break;
+	}
+
+	try {
+		// Create the main
+		Main & main = Main::instance();
+		main.setArguments(argc, argv);
+
+		int handoff = Handoff::inherited();
+		if (handoff >= 0) {
+			main.setHandoff(handoff);
+		}
+        string device = "";
+
+		if (vm.count("backend")) {
+			main.setBackend(vm["backend"].as< string >());
+		}
+
+		if (vm.count("list")) {
+			main.listDevices();
+			return 0;
+		}
+
+		if (vm.count("donotactivate")) {
+			main.setMakeActive(false);
+		}
+
+		if (vm.count("usb")) {
+			device = vm["usb"].as< string >();
+		}
+
+		if (vm.count("onstandby")) {
+			main.setOnStandbyCommand(vm["onstandby"].as< string >());
+		}
+
+		if (vm.count("onactivate")) {
+			main.setOnActivateCommand(vm["onactivate"].as< string >());
+		}
+
+		if (vm.count("ondeactivate")) {
+			main.setOnDeactivateCommand(vm["ondeactivate"].as< string >());
+		}
+
+		if (vm.count("no-bus-stats")) {
+			main.setBusStats(false);
+		}
+
+		if (vm.count("open-timeout")) {
+			main.setOpenTimeout(vm["open-timeout"].as< int >());
+		}
+
+		if (vm.count("adapter-timeout")) {
+			main.setAdapterTimeout(vm["adapter-timeout"].as< int >());
+		}
+
+		if (vm.count("slow-call")) {
+			main.setSlowCall(vm["slow-call"].as< int >());
+		}
+
+		if (vm.count("log-rate")) {
+			main.setLogRateLimit(vm["log-rate"].as< unsigned >());
+		}
+
+		if (vm.count("key-timeout")) {
+			main.setKeyTimeout(vm["key-timeout"].as< int >());
+		}
+
+		if (vm.count("macros")) {
+			main.loadMacros(vm["macros"].as< string >());
+		}
+
+		if (vm.count("state-file")) {
+			main.setStateFile(vm["state-file"].as< string >());
+		}
+
+		if (vm.count("output")) {
+			main.setOutputs(vm["output"].as< string >());
+		}
+
+		if (vm.count("socket")) {
+			main.setEventSocket(vm["socket"].as< string >());
+		}
+
+		if (vm.count("event-ring")) {
+			main.setEventRing(vm["event-ring"].as< unsigned >());
+		}
+
+		if (vm.count("trace-file")) {
+			main.setTraceFile(vm["trace-file"].as< string >());
+		}
+
+		if (vm.count("trace")) {
+			main.trace(true);
+		}
+
+		if (vm.count("realtime")) {
+			main.getRealtime().setEnabled(true);
+		}
+
+		if (vm.count("rt-priority")) {
+			main.getRealtime().setPriority(vm["rt-priority"].as< int >());
+		}
+
+		if (vm.count("rt-policy")) {
+			main.getRealtime().setPolicy(vm["rt-policy"].as< string >());
+		}
+
+		if (vm.count("rt-cec-cpus")) {
+			main.getRealtime().setCecCpus(vm["rt-cec-cpus"].as< string >());
+		}
+
+		if (vm.count("rt-delivery-cpus")) {
+			main.getRealtime().setDeliveryCpus(vm["rt-delivery-cpus"].as< string >());
+		}
+
+		if (vm.count("debounce")) {
+			main.setPowerDebounce(vm["debounce"].as< int >());
+		}
+
+		if (vm.count("resume-check")) {
+			main.setResumeCheck(vm["resume-check"].as< int >());
+		}
+
+		if (vm.count("resume-activate")) {
+			main.setResumeActivate(true);
+		}
+
+		if (vm.count("port")) {
+            main.setTargetAddress(vm["port"].as< HDMI::address >());
+        }
+
+        if (vm.count("daemon")) {
+            if( daemon(0, 0) )
+                return -1;
+        }
+
+		main.loop(device);
+
+	} catch (std::exception & e) {
+		cerr << e.what() << endl;
+		return -1;
+	}
+
+	return 0;
+}
+
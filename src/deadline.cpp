@@ -0,0 +1,183 @@
+/**
+ * deadline.cpp
+ *
+ * Calls into the adapter with an upper bound on how long they are waited for
+ */
+#include "deadline.h"
+#include "realtime.h"
+#include "log.h"
+
+#include <exception>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+using namespace log4cplus;
+
+static Logger logger = Logger::getInstance("deadline");
+
+typedef std::chrono::steady_clock Clock;
+
+struct DeadlineRunner::Pending {
+	Call call;
+	bool done;                 // guarded by Shared::sync, as is all of it
+	bool abandoned;
+	std::exception_ptr error;
+
+	explicit Pending(const Call & call) : call(call), done(false), abandoned(false) {}
+};
+
+DeadlineRunner::DeadlineRunner() : shared(std::make_shared<Shared>()) {}
+
+DeadlineRunner::~DeadlineRunner() {
+	retire(shared);
+}
+
+/**
+ * Lets the worker go once it has finished with any call it is running
+ */
+void DeadlineRunner::retire(const std::shared_ptr<Shared> & shared) {
+	std::lock_guard<std::mutex> lock(shared->sync);
+	shared->retired = true;
+	shared->work.notify_one();
+}
+
+/**
+ * The worker, which runs the calls one at a time for as long as the runner
+ * wants it
+ */
+void DeadlineRunner::work(std::shared_ptr<Shared> shared) {
+	/* it may have been started from a real-time thread, but adapter calls can take their time */
+	Realtime::enterNormal("adapter");
+
+	std::unique_lock<std::mutex> lock(shared->sync);
+	for (;;) {
+		shared->work.wait(lock, [&] { return shared->next || shared->retired; });
+		if (!shared->next)
+			return;
+
+		std::shared_ptr<Pending> pending = shared->next;
+		shared->next.reset();
+		lock.unlock();
+
+		std::exception_ptr error;
+		try {
+			pending->call();
+		} catch (...) {
+			error = std::current_exception();
+		}
+
+		lock.lock();
+		pending->done = true;
+		pending->error = error;
+		if (pending->abandoned)
+			shared->outstanding--;
+		shared->busy = false;
+		shared->cond.notify_all();
+	}
+}
+
+static std::runtime_error gaveUp(const char *what, std::chrono::milliseconds timeout, bool cancelled, const char *why = "") {
+	std::ostringstream message;
+	message << "Gave up " << what;
+	if (cancelled)
+		message << ", as the daemon is stopping";
+	else
+		message << " after " << timeout.count() << "ms" << why;
+	return std::runtime_error(message.str());
+}
+
+void DeadlineRunner::run(const char *what, const Call & call, std::chrono::milliseconds timeout) {
+	LOG4CPLUS_TRACE(logger, "DeadlineRunner::run(" << what << ")");
+
+	std::shared_ptr<Shared> shared = this->shared;
+	Clock::time_point deadline = Clock::now() + timeout;
+	std::unique_lock<std::mutex> lock(shared->sync);
+	unsigned cancels = shared->cancels;
+
+	if (shared->cancelled)
+		throw gaveUp(what, timeout, true);
+
+	/* waits until done, the deadline, or cancel(), and says whether it was done */
+	auto wait = [&] (std::function<bool()> done) {
+		auto woken = [&] { return done() || shared->cancels != cancels; };
+		if (timeout.count())
+			shared->cond.wait_until(lock, deadline, woken);
+		else
+			shared->cond.wait(lock, woken);
+		return done();
+	};
+
+	/* one call at a time, and the adapter is in no state to take another until one given up on returns */
+	if (!wait([&] { return !shared->busy; }))
+		throw gaveUp(what, timeout, shared->cancels != cancels,
+			shared->outstanding ? ", as the adapter is still busy with a call given up on" : ", as the adapter is busy with another call");
+
+	if (!shared->started) {
+		std::thread(&DeadlineRunner::work, shared).detach();
+		shared->started = true;
+	}
+
+	std::shared_ptr<Pending> pending = std::make_shared<Pending>(call);
+	shared->next = pending;
+	shared->busy = true;
+	shared->work.notify_one();
+
+	if (wait([&] { return pending->done; })) {
+		std::exception_ptr error = pending->error;
+		lock.unlock();
+		if (error)
+			std::rethrow_exception(error);
+		return;
+	}
+
+	/* the worker never got to it, so it never runs */
+	if (shared->next == pending) {
+		shared->next.reset();
+		shared->busy = false;
+		shared->cond.notify_all();
+		throw gaveUp(what, timeout, shared->cancels != cancels);
+	}
+
+	pending->abandoned = true;
+	shared->outstanding++;
+	bool cancelled = shared->cancels != cancels;
+	lock.unlock();
+
+	LOG4CPLUS_DEBUG(logger, "Still " << what << " in the background");
+	if (giveUpHook)
+		giveUpHook();
+	throw gaveUp(what, timeout, cancelled);
+}
+
+void DeadlineRunner::cancel() {
+	/* under the lock, so a caller can't miss the wakeup just as it goes to sleep */
+	std::lock_guard<std::mutex> lock(shared->sync);
+	shared->cancelled = true;
+	shared->cancels++;
+	shared->cond.notify_all();
+}
+
+void DeadlineRunner::reset() {
+	std::lock_guard<std::mutex> lock(shared->sync);
+	shared->cancelled = false;
+}
+
+bool DeadlineRunner::wedged() {
+	std::lock_guard<std::mutex> lock(shared->sync);
+	return shared->outstanding > 0;
+}
+
+void DeadlineRunner::abandon() {
+	std::shared_ptr<Shared> fresh = std::make_shared<Shared>();
+	{
+		std::lock_guard<std::mutex> lock(shared->sync);
+		if (!shared->outstanding)
+			return;
+		fresh->cancelled = shared->cancelled;
+	}
+
+	LOG4CPLUS_DEBUG(logger, "Leaving the calls given up on to their worker, and starting another");
+	retire(shared);
+	shared = fresh;
+}
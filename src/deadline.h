@@ -0,0 +1,104 @@
+#ifndef LIBCEC_DAEMON_DEADLINE_H
+#define LIBCEC_DAEMON_DEADLINE_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+/**
+ * Runs calls into the adapter that may never come back, such as libcec's
+ * Open() or Close() on a wedged adapter, so the caller waits for them no
+ * longer than a deadline, and can be told to stop waiting altogether.
+ *
+ * The calls run one at a time on a worker thread, under normal scheduling
+ * whatever thread started it, so a wedged adapter never ties up a real-time
+ * priority or CPU. A call given up on is left to finish (or not) by itself,
+ * and as it is still using the adapter, later calls first wait for it to
+ * return, within their own deadline. While one is outstanding the adapter
+ * counts as wedged, and must not be destroyed.
+ *
+ * Calls must only capture what outlives them, by value: after they are
+ * given up on, whatever they captured by reference may be gone.
+ */
+class DeadlineRunner {
+public:
+	typedef std::function<void()> Call;
+
+	DeadlineRunner();
+	~DeadlineRunner();
+
+	/**
+	 * Runs call, waiting for it for at most timeout, or for ever if timeout
+	 * is 0. Rethrows whatever call throws, and throws if it was given up on.
+	 * what describes the call for errors, as in "opening the adapter".
+	 */
+	void run(const char *what, const Call & call, std::chrono::milliseconds timeout);
+
+	/**
+	 * Like run(), returning what function returned
+	 */
+	template<typename T> T call(const char *what, const std::function<T()> & function, std::chrono::milliseconds timeout) {
+		std::shared_ptr<T> result = std::make_shared<T>();
+		run(what, [result, function] { *result = function(); }, timeout);
+		return *result;
+	}
+
+	/**
+	 * Gives up on the calls in progress, and refuses any more until reset().
+	 * Takes a lock, so must not be called from a signal handler.
+	 */
+	void cancel();
+	void reset();
+
+	/**
+	 * Calls hook on the caller's thread whenever a call already running is
+	 * given up on, while it is still running. Set before any calls are made.
+	 */
+	void setGiveUpHook(const std::function<void()> & hook) { giveUpHook = hook; }
+
+	/**
+	 * Whether a call given up on has yet to return
+	 */
+	bool wedged();
+
+	/**
+	 * Leaves the calls given up on to the worker still running them, and
+	 * runs later calls on a fresh worker, once whatever those calls were
+	 * using has been replaced, so later calls need not wait for them
+	 */
+	void abandon();
+
+private:
+	struct Pending;
+
+	// Shared with the worker, which may outlive the runner
+	struct Shared {
+		std::mutex sync;
+		std::condition_variable cond;   // for the callers
+		std::condition_variable work;   // for the worker
+		bool cancelled;                 // all of these guarded by sync
+		unsigned cancels;               // bumped by each cancel()
+		size_t outstanding;             // calls given up on, still running
+		bool started;                   // the worker has been started
+		bool retired;                   // the worker is to return once idle
+		bool busy;                      // the worker has a call, taken or not
+		std::shared_ptr<Pending> next;  // the call it has yet to take
+
+		Shared() : cancelled(false), cancels(0), outstanding(0), started(false), retired(false), busy(false) {}
+	};
+
+	std::shared_ptr<Shared> shared;
+	std::function<void()> giveUpHook;
+
+	static void work(std::shared_ptr<Shared> shared);
+	static void retire(const std::shared_ptr<Shared> & shared);
+
+	// Not implemented
+	DeadlineRunner(DeadlineRunner const&);
+	void operator=(DeadlineRunner const&);
+};
+
+#endif
@@ -0,0 +1,302 @@
+/**
+ * eventring.cpp
+ *
+ * A shared memory ring of events, for local processes to follow
+ */
+#include "eventring.h"
+#include "log.h"
+
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace log4cplus;
+
+using std::string;
+
+static Logger logger = Logger::getInstance("events");
+
+// The request for the ring on the event socket, after asking for no other events
+static const char RING_REQUEST[] = "types\nring\n";
+static const char RING_REPLY[] = "{\"type\":\"ring\"";
+
+// How long receive() waits for the daemon to answer
+static const int RECEIVE_TIMEOUT_S = 5;
+
+static long futex(const std::atomic<uint32_t> *word, int op, uint32_t value, const struct timespec *timeout) {
+	// Not FUTEX_PRIVATE_FLAG, the waiters are in other processes
+	return syscall(SYS_futex, reinterpret_cast<const uint32_t *>(word), op, value, timeout, NULL, 0);
+}
+
+static size_t ringLength(uint64_t slots) {
+	return sizeof(EventRing::Header) + slots * sizeof(EventRing::Slot);
+}
+
+EventRing::EventRing() : fd(-1), readFd(-1), length(0), header(NULL), slots(NULL), mask(0), head(0) {}
+
+EventRing::~EventRing() {
+	close();
+}
+
+void EventRing::open(size_t count) {
+	LOG4CPLUS_TRACE_STR(logger, "EventRing::open()");
+
+	size_t n = 1;
+	while (n < count)
+		n <<= 1;
+
+	int memfd = memfd_create("cec-events", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (memfd < 0) {
+		throw std::runtime_error(string("Failed to create event ring: ") + strerror(errno));
+	}
+
+	// Sealed so that no reader can shrink it out from under the daemon
+	size_t len = ringLength(n);
+	if (ftruncate(memfd, len) < 0 || fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW) < 0) {
+		::close(memfd);
+		throw std::runtime_error(string("Failed to size event ring: ") + strerror(errno));
+	}
+
+	void *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	if (map == MAP_FAILED) {
+		::close(memfd);
+		throw std::runtime_error(string("Failed to map event ring: ") + strerror(errno));
+	}
+
+	/*
+	** Readers get a descriptor opened read-only, and once the daemon has its
+	** own mapping, nobody can map the ring writable any more, where the
+	** kernel can seal it so (Linux 5.1 and later)
+	*/
+	int seals = F_SEAL_SEAL;
+#ifdef F_SEAL_FUTURE_WRITE
+	seals |= F_SEAL_FUTURE_WRITE;
+#endif
+	if (fcntl(memfd, F_ADD_SEALS, seals) < 0 && (seals == F_SEAL_SEAL || fcntl(memfd, F_ADD_SEALS, F_SEAL_SEAL) < 0)) {
+		munmap(map, len);
+		::close(memfd);
+		throw std::runtime_error(string("Failed to seal event ring: ") + strerror(errno));
+	}
+
+	char path[32];
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", memfd);
+	int rofd = ::open(path, O_RDONLY | O_CLOEXEC);
+	if (rofd < 0) {
+		munmap(map, len);
+		::close(memfd);
+		throw std::runtime_error(string("Failed to open event ring read-only: ") + strerror(errno));
+	}
+
+	// A new memfd is zeroed, which is a valid empty ring once the header is filled in
+	Header *h = static_cast<Header *>(map);
+	h->magic = MAGIC;
+	h->version = VERSION;
+	h->slots = n;
+	h->slotSize = sizeof(Slot);
+
+	std::lock_guard<std::mutex> lock(sync);
+	fd = memfd;
+	readFd = rofd;
+	length = len;
+	header = h;
+	slots = reinterpret_cast<Slot *>(static_cast<char *>(map) + sizeof(Header));
+	mask = n - 1;
+	head = 0;
+
+	LOG4CPLUS_DEBUG(logger, "Event ring of " << n << " events, " << len << " bytes");
+}
+
+void EventRing::close() {
+	std::lock_guard<std::mutex> lock(sync);
+	if (fd < 0)
+		return;
+
+	// Readers keep their own mappings, so they can finish reading what is there
+	munmap(header, length);
+	::close(fd);
+	::close(readFd);
+
+	fd = -1;
+	readFd = -1;
+	header = NULL;
+	slots = NULL;
+}
+
+void EventRing::publish(const Event & event) {
+	std::lock_guard<std::mutex> lock(sync);
+	if (!header)
+		return;
+
+	Slot & slot = slots[head & mask];
+	slot.sequence.store(0, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	slot.event = event;
+	slot.sequence.store(head + 1, std::memory_order_release);
+
+	head++;
+	header->head.store(head);
+	header->futex.fetch_add(1);
+
+	/*
+	** Always, as readers can't write to the ring to say they are waiting.
+	** Events are few, and a wake with nobody waiting costs little.
+	*/
+	futex(&header->futex, FUTEX_WAKE, INT_MAX, NULL);
+}
+
+int EventRing::receive(const string & path) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+
+	if (path.size() >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+	int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (sock < 0)
+		return -1;
+
+	struct timeval timeout = { RECEIVE_TIMEOUT_S, 0 };
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	if (connect(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0
+			|| send(sock, RING_REQUEST, sizeof(RING_REQUEST) - 1, MSG_NOSIGNAL) < 0) {
+		int error = errno;
+		::close(sock);
+		errno = error;
+		return -1;
+	}
+
+	// Events sent before the daemon read the request may come first, so skip whole lines until the reply
+	int ring = -1;
+	string line;
+	bool replied = false;
+	while (!replied) {
+		char buf[512];
+		char control[CMSG_SPACE(sizeof(int))];
+		struct iovec iov = { buf, sizeof(buf) };
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		ssize_t ret = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+		if (ret <= 0) {
+			int error = ret < 0 ? errno : ECONNRESET;
+			if (ring >= 0)
+				::close(ring);
+			::close(sock);
+			errno = error;
+			return -1;
+		}
+
+		for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+			if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS && ring < 0)
+				memcpy(&ring, CMSG_DATA(c), sizeof(int));
+		}
+
+		for (ssize_t i = 0; i < ret && !replied; i++) {
+			if (buf[i] != '\n') {
+				line += buf[i];
+				continue;
+			}
+			replied = line.compare(0, sizeof(RING_REPLY) - 1, RING_REPLY) == 0;
+			line.clear();
+		}
+	}
+
+	::close(sock);
+	if (ring < 0)
+		errno = ENOTSUP;
+	return ring;
+}
+
+EventRing::Reader::Reader(int fd) : fd(fd), size(0), header(NULL), slots(NULL), mask(0), cursor(0), missed(0) {
+	struct stat st;
+	if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(Header)) {
+		::close(fd);
+		throw std::runtime_error("Not an event ring");
+	}
+
+	size = st.st_size;
+	void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		::close(fd);
+		throw std::runtime_error(string("Failed to map event ring: ") + strerror(errno));
+	}
+
+	header = static_cast<const Header *>(map);
+	uint32_t n = header->slots;
+	if (header->magic != MAGIC || header->version != VERSION || header->slotSize != sizeof(Slot)
+			|| n == 0 || (n & (n - 1)) || ringLength(n) > size) {
+		munmap(map, size);
+		::close(fd);
+		throw std::runtime_error("Unsupported event ring");
+	}
+
+	slots = reinterpret_cast<const Slot *>(static_cast<const char *>(map) + sizeof(Header));
+	mask = n - 1;
+	cursor = header->head.load(std::memory_order_acquire);
+}
+
+EventRing::Reader::~Reader() {
+	munmap(const_cast<Header *>(header), size);
+	::close(fd);
+}
+
+bool EventRing::Reader::read(Event & event) {
+	while (true) {
+		uint64_t head = header->head.load(std::memory_order_acquire);
+		if (cursor == head)
+			return false;
+
+		if (head - cursor > mask + 1) {
+			missed += head - cursor - (mask + 1);
+			cursor = head - (mask + 1);
+		}
+
+		const Slot & slot = slots[cursor & mask];
+		uint64_t before = slot.sequence.load(std::memory_order_acquire);
+		memcpy(static_cast<void *>(&event), &slot.event, sizeof(Event));
+		std::atomic_thread_fence(std::memory_order_acquire);
+		uint64_t after = slot.sequence.load(std::memory_order_relaxed);
+
+		cursor++;
+		if (before == cursor && after == before)
+			return true;
+
+		// Being overwritten by an event a ring later, so this one is gone
+		missed++;
+	}
+}
+
+bool EventRing::Reader::wait(int timeoutMs) {
+	// The futex is bumped after head, so if head is still the same, the next event changes it
+	uint32_t seen = header->futex.load();
+	bool ready = header->head.load() != cursor;
+
+	long ret = 0;
+	if (!ready) {
+		struct timespec timeout = { timeoutMs / 1000, (timeoutMs % 1000) * 1000000L };
+		ret = futex(&header->futex, FUTEX_WAIT, seen, timeoutMs < 0 ? NULL : &timeout);
+	}
+
+	return ready || ret == 0 || errno != ETIMEDOUT;
+}
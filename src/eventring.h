@@ -0,0 +1,140 @@
+#ifndef LIBCEC_DAEMON_EVENTRING_H
+#define LIBCEC_DAEMON_EVENTRING_H
+
+#include "events.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+/**
+ * Events in shared memory, for any number of local processes to follow
+ * without a socket copy and a wakeup of their own each: a sealed memfd
+ * holding a ring of the latest events, written by the daemon alone.
+ *
+ * Every reader keeps its own cursor, so publishing costs the same however
+ * many are attached, and nobody waits for a slow reader. A reader that falls
+ * more than a ring behind skips ahead, and counts the events it lost.
+ *
+ * Slots are seqlocks: the daemon zeroes a slot's sequence, writes the event,
+ * then sets the sequence to the event's number plus one, and a reader only
+ * keeps an event whose sequence was the same before and after copying it.
+ * Readers sleep on a futex in the header, which the daemon wakes after every
+ * event. Readers only get a read-only descriptor, and map it read-only, so
+ * none of them can corrupt the ring for the others or the daemon.
+ */
+class EventRing {
+public:
+	static const uint32_t MAGIC = 0x52434543; // "CECR"
+	static const uint32_t VERSION = 2;
+
+	static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+		"atomics in shared memory must be lock free");
+
+	struct alignas(64) Slot {
+		std::atomic<uint64_t> sequence; // 0 while being written, else the event's number + 1
+		Event event;
+	};
+
+	struct Header {
+		uint32_t magic;
+		uint32_t version;
+		uint32_t slots;                 // a power of two
+		uint32_t slotSize;              // sizeof(Slot)
+
+		// Written by the daemon for every event, so kept off the line above
+		alignas(64) std::atomic<uint64_t> head; // number of the next event
+		std::atomic<uint32_t> futex;    // bumped after every event
+	};
+
+	/**
+	 * A process following the ring. Not thread safe, each thread following
+	 * it should have a Reader of its own.
+	 */
+	class Reader {
+	private:
+		int fd;
+		size_t size;
+		const Header *header;
+		const Slot *slots;
+		uint64_t mask;
+		uint64_t cursor;     // number of the next event to read
+		uint64_t missed;
+
+		// Not implemented
+		Reader(Reader const&);
+		void operator=(Reader const&);
+
+	public:
+		/**
+		 * Maps the ring in fd, which it then owns, starting from the next
+		 * event published
+		 */
+		explicit Reader(int fd);
+		~Reader();
+
+		/**
+		 * Takes the next event, or returns false if there is none yet
+		 */
+		bool read(Event & event);
+
+		/**
+		 * Sleeps until there may be events to read, for up to timeoutMs
+		 * (forever if negative). Returns false if it timed out.
+		 */
+		bool wait(int timeoutMs);
+
+		/**
+		 * Events overwritten before they could be read
+		 */
+		uint64_t lost() const { return missed; }
+	};
+
+	EventRing();
+	~EventRing();
+
+	/**
+	 * Creates a ring of slots events, rounded up to a power of two
+	 */
+	void open(size_t slots);
+	void close();
+
+	bool isOpen() const { return fd >= 0; }
+
+	/**
+	 * A read-only descriptor for the ring, to hand to readers
+	 */
+	int descriptor() const { return readFd; }
+	uint32_t size() const { return (uint32_t) (mask + 1); }
+
+	/**
+	 * Writes the event into the next slot, waking any readers asleep. Safe to
+	 * call from any thread.
+	 */
+	void publish(const Event & event);
+
+	/**
+	 * Asks the daemon listening on the event socket at path for its ring.
+	 * Returns the ring's fd, or -1 with errno set: ENOTSUP if the daemon
+	 * has no ring.
+	 */
+	static int receive(const std::string & path);
+
+private:
+	int fd;
+	int readFd;
+	size_t length;
+	Header *header;
+	Slot *slots;
+	uint64_t mask;
+	uint64_t head;   // guarded by sync
+	std::mutex sync;
+
+	// Not implemented
+	EventRing(EventRing const&);
+	void operator=(EventRing const&);
+};
+
+#endif
@@ -0,0 +1,516 @@
+/**
+ * events.cpp
+ *
+ * Streams daemon events to local clients over a unix socket
+ */
+#include "events.h"
+#include "eventring.h"
+#include "libcec.h"
+#include "realtime.h"
+#include "log.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <sstream>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace log4cplus;
+
+using std::string;
+
+static Logger logger = Logger::getInstance("events");
+
+// Events kept in the shared memory ring unless told otherwise, 64 bytes each
+static const size_t RING_SLOTS = 1024;
+
+static const char *eventTypeName[EVENT_TYPE_MAX] = {
+	"key",
+	"command",
+	"power",
+	"source",
+	"alert",
+	"restart",
+	"resume",
+	"ready",
+};
+
+static const char *powerName[] = {
+	"inactive",
+	"active",
+	"standby",
+};
+
+static const char *recoveryName[] = {
+	"alive",
+	"reopened",
+	"restart",
+};
+
+Event::Event(EventType type, int32_t code, int32_t value)
+	: time(now()), type(type), code(code), value(value),
+	  initiator(-1), destination(-1), ack(0), eom(0), size(0)
+{
+	memset(parameters, 0, sizeof(parameters));
+}
+
+uint64_t Event::now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+const char *Event::typeName(uint32_t type) {
+	return type < EVENT_TYPE_MAX ? eventTypeName[type] : "unknown";
+}
+
+EventServer::Client::Client(int fd) : fd(fd), dead(false), types(~0u), passFd(-1), passAt(0) {
+	opcodes.set();
+	out.reserve(CLIENT_BUFFER);
+}
+
+EventServer::Client::~Client() {
+	::close(fd);
+}
+
+bool EventServer::Client::wants(const Event & event) const {
+	if (dead || !(types & (1u << event.type)))
+		return false;
+	if (event.type == EVENT_COMMAND && !opcodes[event.code & 0xFF])
+		return false;
+	return true;
+}
+
+/**
+ * Handles a request line from the client
+ */
+EventServer::Request EventServer::Client::request(const string & line) {
+	std::istringstream ss(line);
+	string what, item;
+
+	ss >> what;
+	if (what == "types") {
+		types = 0;
+		while (std::getline(ss >> std::ws, item, ',')) {
+			for (uint32_t t = 0; t < EVENT_TYPE_MAX; t++) {
+				if (item == eventTypeName[t])
+					types |= 1u << t;
+			}
+		}
+	} else if (what == "opcodes") {
+		opcodes.reset();
+		while (std::getline(ss >> std::ws, item, ',')) {
+			opcodes.set(strtoul(item.c_str(), NULL, 0) & 0xFF);
+		}
+	} else if (what == "stats") {
+		return REQUEST_STATS;
+	} else if (what == "ring") {
+		return REQUEST_RING;
+	} else if (what == "trace") {
+		ss >> item;
+		if (item == "on")
+			return REQUEST_TRACE_ON;
+		if (item == "off")
+			return REQUEST_TRACE_OFF;
+		LOG4CPLUS_DEBUG(logger, "Ignoring unknown request \"" << line << "\"");
+	} else if (!what.empty()) {
+		LOG4CPLUS_DEBUG(logger, "Ignoring unknown request \"" << line << "\"");
+	}
+	return REQUEST_NONE;
+}
+
+EventServer::EventServer() : boundDev(0), boundIno(0), listenFd(-1), wakeFd(-1), stopping(false), clientCount(0), sequence(0), ringSlots(RING_SLOTS) {}
+
+EventServer::~EventServer() {
+	close();
+}
+
+void EventServer::open(const string & path) {
+	LOG4CPLUS_TRACE_STR(logger, "EventServer::open()");
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+
+	if (path.size() >= sizeof(addr.sun_path)) {
+		throw std::runtime_error("Event socket path is too long");
+	}
+	strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+	listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listenFd < 0) {
+		throw std::runtime_error("Failed to create event socket");
+	}
+
+	// Remove any stale socket left behind by a previous run, but nothing else a mistyped path names
+	struct stat stale;
+	if (lstat(path.c_str(), &stale) == 0 && S_ISSOCK(stale.st_mode))
+		unlink(path.c_str());
+
+	if (bind(listenFd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(listenFd, MAX_CLIENTS) < 0) {
+		LOG4CPLUS_ERROR(logger, "Failed to listen on " << path << ": " << strerror(errno));
+		::close(listenFd);
+		listenFd = -1;
+		throw std::runtime_error("Failed to open event socket");
+	}
+
+	struct stat bound;
+	if (lstat(path.c_str(), &bound) == 0) {
+		boundDev = bound.st_dev;
+		boundIno = bound.st_ino;
+	}
+
+	wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wakeFd < 0) {
+		::close(listenFd);
+		listenFd = -1;
+		throw std::runtime_error("Failed to create eventfd");
+	}
+
+	if (ringSlots) {
+		// Clients can still follow the socket without it
+		try {
+			ring.reset(new EventRing());
+			ring->open(ringSlots);
+		} catch (std::exception & e) {
+			LOG4CPLUS_WARN(logger, e.what());
+			ring.reset();
+		}
+	}
+
+	this->path = path;
+	stopping = false;
+	thread = std::thread(&EventServer::run, this);
+
+	LOG4CPLUS_INFO(logger, "Listening for event subscribers on " << path);
+}
+
+void EventServer::close() {
+	if (listenFd < 0)
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(sync);
+		stopping = true;
+	}
+	wake();
+	thread.join();
+
+	clients.clear();
+	clientCount = 0;
+	ring.reset();
+
+	::close(wakeFd);
+	::close(listenFd);
+
+	/* after an upgrade, the socket at path is the new daemon's */
+	struct stat current;
+	if (lstat(path.c_str(), &current) == 0 && current.st_dev == boundDev && current.st_ino == boundIno)
+		unlink(path.c_str());
+
+	wakeFd = listenFd = -1;
+}
+
+void EventServer::wake() {
+	uint64_t one = 1;
+	if (write(wakeFd, &one, sizeof(one)) < 0) {
+		// Already pending, so the server thread will wake anyway
+	}
+}
+
+size_t EventServer::format(const Event & event, char *line, size_t len) const {
+	int n = snprintf(line, len, "{\"seq\":%llu,\"time\":%llu,\"type\":\"%s\"",
+		(unsigned long long) sequence, (unsigned long long) event.time, Event::typeName(event.type));
+
+	switch (event.type) {
+		case EVENT_KEY: {
+			const char *name = Cec::cecUserControlCodeName[event.code & 0xFF];
+			n += snprintf(line + n, len - n, ",\"code\":%d,\"name\":\"%s\",\"duration\":%d",
+				event.code, name ? name : "UNKNOWN", event.value);
+			break;
+		}
+		case EVENT_COMMAND:
+			n += snprintf(line + n, len - n, ",\"opcode\":%d,\"initiator\":%d,\"destination\":%d,\"ack\":%s,\"eom\":%s,\"parameters\":\"",
+				event.code, event.initiator, event.destination, event.ack ? "true" : "false", event.eom ? "true" : "false");
+			for (uint8_t i = 0; i < event.size && i < Event::MAX_PARAMETERS; i++)
+				n += snprintf(line + n, len - n, "%02x", event.parameters[i]);
+			n += snprintf(line + n, len - n, "\"");
+			break;
+		case EVENT_POWER:
+			n += snprintf(line + n, len - n, ",\"state\":\"%s\"",
+				event.code >= EVENT_POWER_INACTIVE && event.code <= EVENT_POWER_STANDBY ? powerName[event.code] : "unknown");
+			break;
+		case EVENT_SOURCE:
+			n += snprintf(line + n, len - n, ",\"address\":%d,\"activated\":%s", event.code, event.value ? "true" : "false");
+			break;
+		case EVENT_ALERT:
+			n += snprintf(line + n, len - n, ",\"alert\":%d", event.code);
+			break;
+		case EVENT_RESUME:
+			n += snprintf(line + n, len - n, ",\"recovery\":\"%s\",\"slept\":%d",
+				event.code >= EVENT_RESUME_ALIVE && event.code <= EVENT_RESUME_RESTART ? recoveryName[event.code] : "unknown", event.value);
+			break;
+		default:
+			break;
+	}
+
+	n += snprintf(line + n, len - n, "}\n");
+	return (size_t) n < len ? n : len - 1;
+}
+
+void EventServer::publish(const Event & event) {
+	if (listener)
+		listener(event);
+
+	if (ring)
+		ring->publish(event);
+
+	if (clientCount.load(std::memory_order_relaxed) == 0)
+		return;
+
+	char line[512];
+	bool needWake = false;
+
+	std::lock_guard<std::mutex> lock(sync);
+
+	// Sequence numbers are assigned under the lock, so every client sees them in order
+	sequence++;
+	size_t len = format(event, line, sizeof(line));
+
+	for (std::vector< std::unique_ptr<Client> >::iterator i = clients.begin(); i != clients.end(); ++i) {
+		Client & client = **i;
+		if (!client.wants(event))
+			continue;
+
+		size_t sent = 0;
+		if (client.out.empty()) {
+			// Nothing queued, so try to deliver straight away
+			ssize_t ret = send(client.fd, line, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+			if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+				client.dead = true;
+				needWake = true;
+				continue;
+			}
+			sent = ret < 0 ? 0 : ret;
+		}
+
+		if (sent < len) {
+			if (client.out.size() + (len - sent) > client.out.capacity()) {
+				LOG4CPLUS_WARN(logger, "Dropping slow event subscriber " << client.fd);
+				client.dead = true;
+			} else {
+				client.out.insert(client.out.end(), line + sent, line + len);
+			}
+			needWake = true;
+		}
+	}
+
+	if (needWake)
+		wake();
+}
+
+void EventServer::accept() {
+	int fd = accept4(listenFd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	if (clients.size() >= MAX_CLIENTS) {
+		LOG4CPLUS_WARN(logger, "Too many event subscribers, refusing another");
+		::close(fd);
+		return;
+	}
+
+	LOG4CPLUS_DEBUG(logger, "New event subscriber " << fd);
+	clients.push_back(std::unique_ptr<Client>(new Client(fd)));
+	clientCount = clients.size();
+}
+
+void EventServer::flush(Client & client) {
+	while (!client.out.empty()) {
+		struct iovec iov = { client.out.data(), client.out.size() };
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+
+		// A passed fd arrives with the first byte of the message it was sent with
+		char control[CMSG_SPACE(sizeof(int))];
+		if (client.passFd >= 0 && client.passAt == 0) {
+			memset(control, 0, sizeof(control));
+			msg.msg_control = control;
+			msg.msg_controllen = sizeof(control);
+			struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+			c->cmsg_level = SOL_SOCKET;
+			c->cmsg_type = SCM_RIGHTS;
+			c->cmsg_len = CMSG_LEN(sizeof(int));
+			memcpy(CMSG_DATA(c), &client.passFd, sizeof(int));
+		} else if (client.passFd >= 0) {
+			iov.iov_len = client.passAt;
+		}
+
+		ssize_t ret = sendmsg(client.fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				client.dead = true;
+			return;
+		}
+		client.out.erase(client.out.begin(), client.out.begin() + ret);
+
+		if (client.passFd >= 0) {
+			if (client.passAt == 0)
+				client.passFd = -1;
+			else
+				client.passAt -= ret;
+		}
+	}
+}
+
+/**
+ * Reads the client's requests and answers them. lock holds sync, and is let
+ * go while a request is handed to code outside the server.
+ */
+void EventServer::receive(Client & client, std::unique_lock<std::mutex> & lock) {
+	char buf[256];
+
+	ssize_t ret = recv(client.fd, buf, sizeof(buf), MSG_DONTWAIT);
+	if (ret == 0 || (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+		client.dead = true;
+		return;
+	}
+
+	for (ssize_t i = 0; i < ret; i++) {
+		if (buf[i] == '\n') {
+			Request request = client.request(client.in);
+			switch (request) {
+				case REQUEST_STATS:
+					if (stats) {
+						/* gathering stats takes other locks, and publish() must not wait for them */
+						lock.unlock();
+						string line = stats() + "\n";
+						lock.lock();
+						reply(client, line);
+					}
+					break;
+				case REQUEST_RING: {
+					char line[128];
+					snprintf(line, sizeof(line), "{\"type\":\"ring\",\"version\":%u,\"slots\":%u,\"slot_size\":%zu}\n",
+						EventRing::VERSION, ring ? ring->size() : 0, sizeof(EventRing::Slot));
+					reply(client, line, ring ? ring->descriptor() : -1);
+					break;
+				}
+				case REQUEST_TRACE_ON:
+				case REQUEST_TRACE_OFF:
+					if (trace) {
+						/* stopping a trace waits for spans in progress, which publish() may be in */
+						lock.unlock();
+						string line = trace(request == REQUEST_TRACE_ON) + "\n";
+						lock.lock();
+						reply(client, line);
+					}
+					break;
+				default:
+					break;
+			}
+			client.in.clear();
+		} else if (client.in.size() < sizeof(buf)) {
+			client.in += buf[i];
+		}
+	}
+}
+
+/**
+ * Queues a line for the client alone, behind any events already queued,
+ * passing fd along with it if there is one
+ */
+void EventServer::reply(Client & client, const string & line, int fd) {
+	if (client.out.size() + line.size() > client.out.capacity()) {
+		LOG4CPLUS_WARN(logger, "Dropping slow event subscriber " << client.fd);
+		client.dead = true;
+		return;
+	}
+	// Only one can be on its way, and asking twice only needs it once
+	if (fd >= 0 && client.passFd < 0) {
+		client.passFd = fd;
+		client.passAt = client.out.size();
+	}
+	client.out.insert(client.out.end(), line.begin(), line.end());
+	flush(client);
+}
+
+void EventServer::reap() {
+	for (std::vector< std::unique_ptr<Client> >::iterator i = clients.begin(); i != clients.end(); ) {
+		if ((*i)->dead) {
+			LOG4CPLUS_DEBUG(logger, "Event subscriber " << (*i)->fd << " gone");
+			i = clients.erase(i);
+		} else {
+			++i;
+		}
+	}
+	clientCount = clients.size();
+}
+
+void EventServer::run() {
+	LOG4CPLUS_TRACE_STR(logger, "EventServer::run()");
+
+	/* subscribers are served from their own buffers, off the input path */
+	Realtime::enterNormal("events");
+
+	std::vector<struct pollfd> fds;
+
+	while (true) {
+		{
+			std::lock_guard<std::mutex> lock(sync);
+			if (stopping)
+				break;
+
+			reap();
+
+			fds.clear();
+			fds.push_back({ wakeFd, POLLIN, 0 });
+			fds.push_back({ listenFd, POLLIN, 0 });
+			for (std::vector< std::unique_ptr<Client> >::const_iterator i = clients.begin(); i != clients.end(); ++i) {
+				fds.push_back({ (*i)->fd, (short) (POLLIN | ((*i)->out.empty() ? 0 : POLLOUT)), 0 });
+			}
+		}
+
+		if (poll(fds.data(), fds.size(), -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			LOG4CPLUS_ERROR(logger, "poll failed: " << strerror(errno));
+			break;
+		}
+
+		std::unique_lock<std::mutex> lock(sync);
+
+		if (fds[0].revents & POLLIN) {
+			uint64_t count;
+			if (read(wakeFd, &count, sizeof(count)) < 0) {
+				// Spurious wakeup
+			}
+		}
+
+		if (fds[1].revents & POLLIN)
+			accept();
+
+		// Clients can only have been added since, so the first ones still line up
+		for (size_t i = 2; i < fds.size(); i++) {
+			Client & client = *clients[i - 2];
+			if (fds[i].revents & POLLIN)
+				receive(client, lock);
+			if (fds[i].revents & POLLOUT)
+				flush(client);
+			if (fds[i].revents & (POLLERR | POLLHUP))
+				client.dead = true;
+		}
+	}
+}
@@ -0,0 +1,187 @@
+#ifndef LIBCEC_DAEMON_EVENTS_H
+#define LIBCEC_DAEMON_EVENTS_H
+
+#include <atomic>
+#include <bitset>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/types.h>
+
+enum EventType {
+	EVENT_KEY,      // code: cec_user_control_code, value: duration in ms
+	EVENT_COMMAND,  // code: cec_opcode, plus initiator, destination, ack, eom and parameters
+	EVENT_POWER,    // code: EVENT_POWER_*
+	EVENT_SOURCE,   // code: logical address, value: 1 if activated, 0 if deactivated
+	EVENT_ALERT,    // code: libcec_alert
+	EVENT_RESTART,  // the adapter connection is being restarted
+	EVENT_RESUME,   // code: EVENT_RESUME_*, value: time spent suspended in ms
+	EVENT_READY,    // the adapter is open and the daemon is handling the bus
+
+	EVENT_TYPE_MAX
+};
+
+enum {
+	EVENT_POWER_INACTIVE,
+	EVENT_POWER_ACTIVE,
+	EVENT_POWER_STANDBY,
+};
+
+// How the adapter was recovered after the host resumed from suspend
+enum {
+	EVENT_RESUME_ALIVE,    // it still answered
+	EVENT_RESUME_REOPENED, // it was reopened
+	EVENT_RESUME_RESTART,  // the connection had to be restarted
+};
+
+/**
+ * A structured daemon event. This is plain data, so it can be copied around
+ * (and between processes) freely.
+ */
+struct Event {
+	static const size_t MAX_PARAMETERS = 14;
+
+	uint64_t time;        // CLOCK_MONOTONIC in microseconds
+	uint32_t type;        // EventType
+	int32_t  code;
+	int32_t  value;
+	int8_t   initiator;
+	int8_t   destination;
+	uint8_t  ack;
+	uint8_t  eom;
+	uint8_t  size;        // number of parameters
+	uint8_t  parameters[MAX_PARAMETERS];
+
+	Event(EventType type, int32_t code = 0, int32_t value = 0);
+
+	static uint64_t now();
+	static const char *typeName(uint32_t type);
+};
+
+class EventRing;
+
+/**
+ * Unix socket server streaming events to local clients, one JSON object per line.
+ *
+ * Clients can narrow what they receive by sending lines of their own:
+ *   types key,command,power       only these event types (default all)
+ *   opcodes 0x36,0x44             only command events with these opcodes (default all)
+ *   stats                         reply with one line of bus statistics, see BusStats
+ *   ring                          reply with the event ring's size, passing its fd, see EventRing
+ *   trace on|off                  start span tracing, or stop and save it, see Trace
+ *
+ * Each client has a bounded output buffer. A client that falls so far behind
+ * that its buffer fills is disconnected, rather than slowing everyone down.
+ */
+class EventServer {
+private:
+	enum Request {
+		REQUEST_NONE,
+		REQUEST_STATS,
+		REQUEST_RING,
+		REQUEST_TRACE_ON,
+		REQUEST_TRACE_OFF,
+	};
+
+	struct Client {
+		int fd;
+		bool dead;
+		uint32_t types;                // bitmask of EventType
+		std::bitset<256> opcodes;
+		std::vector<char> out;         // pending output, never grows past its reserved capacity
+		std::string in;                // partial request line
+		int passFd;                    // fd to send along with out[passAt], or -1
+		size_t passAt;
+
+		explicit Client(int fd);
+		~Client();
+
+		bool wants(const Event & event) const;
+		Request request(const std::string & line);
+	};
+
+	static const size_t MAX_CLIENTS = 16;
+	static const size_t CLIENT_BUFFER = 64 * 1024;
+
+	std::string path;
+	dev_t boundDev; // the socket bound at path, so close() only removes that one
+	ino_t boundIno;
+	int listenFd;
+	int wakeFd;
+	bool stopping;
+
+	std::mutex sync;
+	std::atomic<size_t> clientCount;
+	std::vector< std::unique_ptr<Client> > clients;
+	uint64_t sequence;
+	std::function<std::string()> stats;
+	std::function<std::string(bool)> trace;
+	std::function<void(const Event &)> listener;
+	size_t ringSlots;
+	std::unique_ptr<EventRing> ring;
+
+	std::thread thread;
+
+	void run();
+	void wake();
+	void accept();
+	void flush(Client & client);
+	void receive(Client & client, std::unique_lock<std::mutex> & lock);
+	void reply(Client & client, const std::string & line, int fd = -1);
+	void reap();
+
+	size_t format(const Event & event, char *line, size_t len) const;
+
+	// Not implemented
+	EventServer(EventServer const&);
+	void operator=(EventServer const&);
+
+public:
+	EventServer();
+	virtual ~EventServer();
+
+	/**
+	 * Starts listening on the unix socket at path
+	 */
+	void open(const std::string & path);
+	void close();
+
+	/**
+	 * Answers stats requests with the line source returns, which is called
+	 * on the server thread without its lock held. Set before open().
+	 */
+	void setStats(std::function<std::string()> source) { stats = source; }
+
+	/**
+	 * Answers trace requests with the line control returns, after it has
+	 * turned tracing on or off. Called on the server thread, without its lock
+	 * held, so it may wait for publish(). Set before open().
+	 */
+	void setTrace(std::function<std::string(bool)> control) { trace = control; }
+
+	/**
+	 * Also writes events into a shared memory ring of this many, 0 for none,
+	 * which clients can ask for. Set before open().
+	 */
+	void setRingSlots(size_t slots) { ringSlots = slots; }
+
+	/**
+	 * Also hands every event to listener, on the thread publishing it, for
+	 * consumers in the same process. Set while nothing is being published.
+	 */
+	void setListener(std::function<void(const Event &)> listener) { this->listener = listener; }
+
+	/**
+	 * Sends the event to all interested clients. Safe to call from any thread,
+	 * and cheap when nobody is listening.
+	 */
+	void publish(const Event & event);
+};
+
+#endif
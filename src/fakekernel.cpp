@@ -0,0 +1,380 @@
+/**
+ * fakekernel.cpp
+ *
+ * cec-fakekernel: drives KernelCec against a fake /dev/cecN, feeding it
+ * received messages and events as the kernel would, and checks that they come
+ * out as the callbacks libcec would make, with the answers libcec would send
+ */
+#include "kernelcec.h"
+#include "checks.h"
+#include "log.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <getopt.h>
+#include <linux/cec.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace CEC;
+using namespace log4cplus;
+
+using std::cerr;
+using std::endl;
+using std::string;
+
+typedef std::chrono::steady_clock Clock;
+
+static const uint16_t PHYSICAL_ADDRESS = 0x1000;
+static const uint16_t MOVED_ADDRESS    = 0x2000;
+
+// What the fake kernel hands out when a recording device claims an address
+static const cec_logical_address LOGICAL_ADDRESS = CECDEVICE_RECORDINGDEVICE1;
+
+// Longer than anything takes to come through, unless it never will
+static const std::chrono::seconds WAIT(2);
+
+/**
+ * Stands in for the kernel. The device is one end of a unix socket pair:
+ * each message queued for CEC_RECEIVE puts a byte on the other end, which
+ * makes it readable just as a message does, and each event for CEC_DQEVENT
+ * an out of band byte, which raises POLLPRI just as an event does.
+ */
+class FakeKernelCec : public KernelCec {
+	private:
+		std::mutex sync;
+		int peer;
+		std::deque<struct cec_msg> received;
+		std::deque<struct cec_event> events;
+		std::vector<struct cec_msg> transmitted;
+		uint16_t physical;
+		uint16_t logicalMask;
+
+	protected:
+		int openDevice(const string & path) {
+			int fds[2];
+			if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0)
+				return -1;
+
+			std::lock_guard<std::mutex> lock(sync);
+			peer = fds[1];
+			return fds[0];
+		}
+
+		int control(int fd, unsigned long request, void *arg) {
+			std::lock_guard<std::mutex> lock(sync);
+			char byte;
+
+			switch (request) {
+				case CEC_ADAP_G_CAPS: {
+					struct cec_caps *caps = (struct cec_caps *) arg;
+					strncpy(caps->driver, "fakekernel", sizeof(caps->driver) - 1);
+					strncpy(caps->name, "fake", sizeof(caps->name) - 1);
+					caps->capabilities = CEC_CAP_LOG_ADDRS | CEC_CAP_TRANSMIT;
+					return 0;
+				}
+				case CEC_S_MODE:
+					return 0;
+				case CEC_ADAP_S_LOG_ADDRS: {
+					struct cec_log_addrs *addrs = (struct cec_log_addrs *) arg;
+					logicalMask = addrs->num_log_addrs ? 1 << LOGICAL_ADDRESS : 0;
+					if (addrs->num_log_addrs) {
+						addrs->log_addr[0] = LOGICAL_ADDRESS;
+						addrs->log_addr_mask = logicalMask;
+					}
+					return 0;
+				}
+				case CEC_ADAP_G_PHYS_ADDR:
+					*(uint16_t *) arg = physical;
+					return 0;
+				case CEC_ADAP_G_LOG_ADDRS: {
+					struct cec_log_addrs *addrs = (struct cec_log_addrs *) arg;
+					addrs->num_log_addrs = logicalMask ? 1 : 0;
+					addrs->log_addr[0] = LOGICAL_ADDRESS;
+					addrs->log_addr_mask = logicalMask;
+					return 0;
+				}
+				case CEC_TRANSMIT: {
+					struct cec_msg *msg = (struct cec_msg *) arg;
+					msg->tx_status = CEC_TX_STATUS_OK;
+					transmitted.push_back(*msg);
+					return 0;
+				}
+				case CEC_RECEIVE: {
+					ssize_t n = recv(fd, &byte, 1, MSG_DONTWAIT);
+					if (n == 0 || received.empty()) {
+						errno = n == 0 ? ENODEV : EAGAIN;
+						return -1;
+					}
+					*(struct cec_msg *) arg = received.front();
+					received.pop_front();
+					return 0;
+				}
+				case CEC_DQEVENT: {
+					if (recv(fd, &byte, 1, MSG_OOB | MSG_DONTWAIT) < 0 || events.empty()) {
+						errno = EAGAIN;
+						return -1;
+					}
+					struct cec_event event = events.front();
+					events.pop_front();
+					if (event.event == CEC_EVENT_STATE_CHANGE)
+						physical = event.state_change.phys_addr;
+					*(struct cec_event *) arg = event;
+					return 0;
+				}
+				default:
+					errno = ENOTTY;
+					return -1;
+			}
+		}
+
+	public:
+		FakeKernelCec(CecCallback *callback) : KernelCec("fake", callback), peer(-1),
+			physical(PHYSICAL_ADDRESS), logicalMask(0) {}
+
+		/**
+		 * Queues a message from the bus for CEC_RECEIVE
+		 */
+		void receive(std::initializer_list<uint8_t> bytes) {
+			struct cec_msg msg;
+			memset(&msg, 0, sizeof(msg));
+			std::copy(bytes.begin(), bytes.end(), msg.msg);
+			msg.len = bytes.size();
+
+			std::lock_guard<std::mutex> lock(sync);
+			received.push_back(msg);
+			if (send(peer, "m", 1, MSG_NOSIGNAL) != 1)
+				throw std::runtime_error(string("Failed to signal a message: ") + strerror(errno));
+		}
+
+		/**
+		 * Queues an event for CEC_DQEVENT
+		 */
+		void event(const struct cec_event & event) {
+			std::lock_guard<std::mutex> lock(sync);
+			events.push_back(event);
+			if (send(peer, "e", 1, MSG_OOB | MSG_NOSIGNAL) != 1)
+				throw std::runtime_error(string("Failed to signal an event (no MSG_OOB on unix sockets?): ") + strerror(errno));
+		}
+
+		/**
+		 * The adapter going away, as when it is unplugged
+		 */
+		void hangUp() {
+			std::lock_guard<std::mutex> lock(sync);
+			::close(peer);
+			peer = -1;
+		}
+
+		std::vector<struct cec_msg> sent() {
+			std::lock_guard<std::mutex> lock(sync);
+			return transmitted;
+		}
+};
+
+/**
+ * Records the callbacks KernelCec makes
+ */
+class Recorder : public CecCallback {
+	private:
+		std::mutex sync;
+		std::condition_variable cond;
+
+	public:
+		std::vector<cec_keypress> keys;
+		std::vector<cec_command> commands;
+		std::vector<libcec_configuration> configurations;
+		std::vector<libcec_alert> alerts;
+		std::vector<std::pair<cec_logical_address, bool> > activations;
+		std::vector<string> messages;
+
+		int onCecLogMessage(const cec_log_message & message) {
+			std::lock_guard<std::mutex> lock(sync);
+			messages.push_back(message.message);
+			cond.notify_all();
+			return 1;
+		}
+
+		int onCecKeyPress(const cec_keypress & key) {
+			std::lock_guard<std::mutex> lock(sync);
+			keys.push_back(key);
+			cond.notify_all();
+			return 1;
+		}
+
+		int onCecCommand(const cec_command & command) {
+			std::lock_guard<std::mutex> lock(sync);
+			commands.push_back(command);
+			cond.notify_all();
+			return 1;
+		}
+
+		int onCecConfigurationChanged(const libcec_configuration & configuration) {
+			std::lock_guard<std::mutex> lock(sync);
+			configurations.push_back(configuration);
+			cond.notify_all();
+			return 1;
+		}
+
+		int onCecAlert(const libcec_alert alert, const libcec_parameter & param) {
+			std::lock_guard<std::mutex> lock(sync);
+			alerts.push_back(alert);
+			cond.notify_all();
+			return 1;
+		}
+
+		int onCecMenuStateChanged(const cec_menu_state & menu_state) {
+			return 1;
+		}
+
+		void onCecSourceActivated(const cec_logical_address & address, bool activated) {
+			std::lock_guard<std::mutex> lock(sync);
+			activations.push_back(std::make_pair(address, activated));
+			cond.notify_all();
+		}
+
+		/**
+		 * Waits for done to hold of what has been recorded
+		 */
+		bool waitFor(std::function<bool()> done) {
+			std::unique_lock<std::mutex> lock(sync);
+			return cond.wait_until(lock, Clock::now() + WAIT, done);
+		}
+};
+
+static Checks checks;
+
+/**
+ * Whether a message with this opcode was sent to destination
+ */
+static bool wasSent(FakeKernelCec & cec, cec_logical_address destination, cec_opcode opcode) {
+	std::vector<struct cec_msg> sent = cec.sent();
+	for (std::vector<struct cec_msg>::const_iterator m = sent.begin(); m != sent.end(); ++m) {
+		if (m->len >= 2 && cec_msg_destination(&*m) == destination && m->msg[1] == opcode)
+			return true;
+	}
+	return false;
+}
+
+static void usage(const char *name) {
+	cerr << "Usage: " << name << " [options]" << endl << endl
+	     << "  -v  log KernelCec's messages (-vv for debug)" << endl
+	     << "  -h  show this help" << endl;
+}
+
+int main(int argc, char *argv[]) {
+	int verbose = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "vh")) != -1) {
+		switch (opt) {
+			case 'v': verbose++; break;
+			case 'h': usage(argv[0]); return 0;
+			default:  usage(argv[0]); return 1;
+		}
+	}
+
+	BasicConfigurator config;
+	config.configure();
+	Logger::getRoot().setLogLevel(verbose > 1 ? DEBUG_LOG_LEVEL : verbose ? INFO_LOG_LEVEL : WARN_LOG_LEVEL);
+
+	Recorder recorder;
+	FakeKernelCec cec(&recorder);
+	const uint8_t us = LOGICAL_ADDRESS;
+
+	try {
+		cec.openAdapter("/dev/cecfake");
+	} catch (std::exception & e) {
+		cerr << "Failed to open the fake adapter: " << e.what() << endl;
+		return 1;
+	}
+
+	checks.check("opening reports the configuration", recorder.waitFor([&] {
+		return !recorder.configurations.empty()
+			&& recorder.configurations.back().iPhysicalAddress == PHYSICAL_ADDRESS
+			&& recorder.configurations.back().logicalAddresses.primary == LOGICAL_ADDRESS;
+	}));
+
+	try {
+		struct cec_event moved;
+		memset(&moved, 0, sizeof(moved));
+		moved.event = CEC_EVENT_STATE_CHANGE;
+		moved.state_change.phys_addr = MOVED_ADDRESS;
+		moved.state_change.log_addr_mask = 1 << LOGICAL_ADDRESS;
+		cec.event(moved);
+		checks.check("a state change event reports the new configuration", recorder.waitFor([&] {
+			return recorder.configurations.size() == 2 && recorder.configurations.back().iPhysicalAddress == MOVED_ADDRESS;
+		}));
+
+		struct cec_event lost;
+		memset(&lost, 0, sizeof(lost));
+		lost.event = CEC_EVENT_LOST_MSGS;
+		lost.lost_msgs.lost_msgs = 3;
+		cec.event(lost);
+		checks.check("a lost messages event is logged", recorder.waitFor([&] {
+			return std::find(recorder.messages.begin(), recorder.messages.end(), "lost 3 messages") != recorder.messages.end();
+		}));
+
+		cec.receive({ (uint8_t) (CECDEVICE_TV << 4 | us), CEC_OPCODE_USER_CONTROL_PRESSED, CEC_USER_CONTROL_CODE_SELECT });
+		checks.check("a key press is passed on", recorder.waitFor([&] {
+			return recorder.keys.size() == 1 && recorder.keys[0].keycode == CEC_USER_CONTROL_CODE_SELECT && recorder.keys[0].duration == 0;
+		}));
+		checks.check("and as a command", recorder.waitFor([&] {
+			return !recorder.commands.empty() && recorder.commands.back().opcode == CEC_OPCODE_USER_CONTROL_PRESSED
+				&& recorder.commands.back().initiator == CECDEVICE_TV;
+		}));
+
+		cec.receive({ (uint8_t) (CECDEVICE_TV << 4 | us), CEC_OPCODE_USER_CONTROL_RELEASE });
+		checks.check("its release is passed on with how long it was held", recorder.waitFor([&] {
+			return recorder.keys.size() == 2 && recorder.keys[1].keycode == CEC_USER_CONTROL_CODE_SELECT && recorder.keys[1].duration > 0;
+		}));
+
+		cec.receive({ (uint8_t) (CECDEVICE_TV << 4 | us), CEC_OPCODE_USER_CONTROL_PRESSED, CEC_USER_CONTROL_CODE_UP });
+		cec.receive({ (uint8_t) (CECDEVICE_TV << 4 | us), CEC_OPCODE_USER_CONTROL_PRESSED, CEC_USER_CONTROL_CODE_DOWN });
+		checks.check("a different key releases the one held", recorder.waitFor([&] {
+			return recorder.keys.size() == 5 && recorder.keys[3].keycode == CEC_USER_CONTROL_CODE_UP && recorder.keys[3].duration > 0
+				&& recorder.keys[4].keycode == CEC_USER_CONTROL_CODE_DOWN && recorder.keys[4].duration == 0;
+		}));
+
+		cec.receive({ (uint8_t) (CECDEVICE_TV << 4 | us), CEC_OPCODE_GIVE_OSD_NAME });
+		checks.check("the OSD name is given when asked", recorder.waitFor([&] {
+			return wasSent(cec, CECDEVICE_TV, CEC_OPCODE_SET_OSD_NAME);
+		}));
+
+		cec.receive({ (uint8_t) (CECDEVICE_TV << 4 | CECDEVICE_BROADCAST), CEC_OPCODE_SET_STREAM_PATH,
+			(uint8_t) (MOVED_ADDRESS >> 8), (uint8_t) MOVED_ADDRESS });
+		checks.check("a stream path to us makes us the active source", recorder.waitFor([&] {
+			return !recorder.activations.empty() && recorder.activations.back().second
+				&& wasSent(cec, CECDEVICE_BROADCAST, CEC_OPCODE_ACTIVE_SOURCE);
+		}));
+
+		cec.receive({ (uint8_t) (CECDEVICE_PLAYBACKDEVICE1 << 4 | CECDEVICE_BROADCAST), CEC_OPCODE_ACTIVE_SOURCE, 0x30, 0x00 });
+		checks.check("another active source deactivates us", recorder.waitFor([&] {
+			return recorder.activations.size() == 2 && !recorder.activations.back().second;
+		}));
+
+		cec.hangUp();
+		checks.check("losing the device raises a connection lost alert", recorder.waitFor([&] {
+			return !recorder.alerts.empty() && recorder.alerts.back() == CEC_ALERT_CONNECTION_LOST;
+		}));
+	} catch (std::exception & e) {
+		checks.fail(e.what());
+	}
+
+	cec.close(false);
+
+	return checks.finish();
+}
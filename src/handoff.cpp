@@ -0,0 +1,195 @@
+/**
+ * handoff.cpp
+ *
+ * Passes state from a running daemon to the binary replacing it
+ */
+#include "handoff.h"
+#include "log.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace log4cplus;
+
+using std::string;
+
+extern char **environ;
+
+static Logger logger = Logger::getInstance("handoff");
+
+// Messages are short, a little state and a few keys
+static const size_t MAX_MESSAGE = 4096;
+
+const char *Handoff::ENVIRONMENT = "LIBCEC_DAEMON_HANDOFF_FD";
+
+Handoff::~Handoff() {
+	close();
+}
+
+int Handoff::inherited() {
+	const char *env = getenv(ENVIRONMENT);
+	if (!env)
+		return -1;
+
+	int fd = atoi(env);
+	unsetenv(ENVIRONMENT);
+
+	// Don't pass it on to hooks, or to a later upgrade
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	return fd;
+}
+
+void Handoff::close() {
+	if (fd >= 0)
+		::close(fd);
+	fd = -1;
+}
+
+pid_t Handoff::spawn(const string & path, const std::vector<string> & args, bool watchdog) {
+	LOG4CPLUS_TRACE_STR(logger, "Handoff::spawn()");
+
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0) {
+		throw std::runtime_error("Failed to create handoff socket");
+	}
+
+	// Everything the child needs is prepared before forking, as this process has threads
+	string env = string(ENVIRONMENT) + "=" + std::to_string(fds[1]);
+	std::vector<char *> argv;
+	for (std::vector<string>::const_iterator a = args.begin(); a != args.end(); ++a)
+		argv.push_back(const_cast<char *>(a->c_str()));
+	argv.push_back(NULL);
+
+	// The watchdog is the child's once it takes over, so WATCHDOG_PID must name it
+	static const char WATCHDOG_PID[] = "WATCHDOG_PID=";
+	char watchdogPid[sizeof(WATCHDOG_PID) + 16];
+	memcpy(watchdogPid, WATCHDOG_PID, sizeof(WATCHDOG_PID));
+
+	std::vector<char *> envp;
+	for (char **e = environ; *e; ++e) {
+		if (!watchdog || strncmp(*e, WATCHDOG_PID, sizeof(WATCHDOG_PID) - 1) != 0)
+			envp.push_back(*e);
+	}
+	envp.push_back(const_cast<char *>(env.c_str()));
+	if (watchdog)
+		envp.push_back(watchdogPid);
+	envp.push_back(NULL);
+
+	pid_t pid = fork();
+	if (pid < 0) {
+		::close(fds[0]);
+		::close(fds[1]);
+		throw std::runtime_error("Failed to fork");
+	}
+
+	if (pid == 0) {
+		// Only the child's end of the channel survives the exec
+		fcntl(fds[1], F_SETFD, 0);
+
+		// Only async-signal-safe calls here, so no snprintf()
+		char digits[16];
+		size_t n = 0;
+		for (pid_t p = getpid(); p; p /= 10)
+			digits[n++] = '0' + p % 10;
+		char *end = watchdogPid + sizeof(WATCHDOG_PID) - 1;
+		while (n)
+			*end++ = digits[--n];
+		*end = '\0';
+
+		execve(path.c_str(), argv.data(), envp.data());
+		_exit(127);
+	}
+
+	::close(fds[1]);
+	close();
+	fd = fds[0];
+
+	LOG4CPLUS_INFO(logger, "Started " << path << " as process " << pid);
+	return pid;
+}
+
+void Handoff::send(const string & message, int passFd) {
+	struct iovec iov;
+	iov.iov_base = const_cast<char *>(message.data());
+	iov.iov_len  = message.size();
+
+	char control[CMSG_SPACE(sizeof(int))];
+	memset(control, 0, sizeof(control));
+
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov    = &iov;
+	msg.msg_iovlen = 1;
+
+	if (passFd >= 0) {
+		msg.msg_control    = control;
+		msg.msg_controllen = sizeof(control);
+
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type  = SCM_RIGHTS;
+		cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cmsg), &passFd, sizeof(int));
+	}
+
+	if (sendmsg(fd, &msg, MSG_NOSIGNAL) != (ssize_t) message.size()) {
+		LOG4CPLUS_ERROR(logger, "Failed to send handoff message: " << strerror(errno));
+		throw std::runtime_error("Failed to send handoff message");
+	}
+}
+
+bool Handoff::receive(string & message, int timeoutMs, int *passFd) {
+	if (passFd)
+		*passFd = -1;
+
+	struct pollfd pfd = { fd, POLLIN, 0 };
+	int ret;
+	do {
+		ret = poll(&pfd, 1, timeoutMs);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret <= 0) {
+		LOG4CPLUS_WARN(logger, "Timed out waiting for handoff message");
+		return false;
+	}
+
+	char buf[MAX_MESSAGE];
+	struct iovec iov;
+	iov.iov_base = buf;
+	iov.iov_len  = sizeof(buf);
+
+	char control[CMSG_SPACE(sizeof(int))];
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov        = &iov;
+	msg.msg_iovlen     = 1;
+	msg.msg_control    = control;
+	msg.msg_controllen = sizeof(control);
+
+	ssize_t len = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+	if (len <= 0) {
+		LOG4CPLUS_WARN(logger, "Handoff channel closed");
+		return false;
+	}
+
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			int received;
+			memcpy(&received, CMSG_DATA(cmsg), sizeof(int));
+			if (passFd)
+				*passFd = received;
+			else
+				::close(received);
+		}
+	}
+
+	message.assign(buf, len);
+	return true;
+}
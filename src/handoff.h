@@ -0,0 +1,64 @@
+#ifndef LIBCEC_DAEMON_HANDOFF_H
+#define LIBCEC_DAEMON_HANDOFF_H
+
+#include <sys/types.h>
+
+#include <string>
+#include <vector>
+
+/**
+ * Channel between a running daemon and the new binary taking over from it
+ * during an upgrade (SIGUSR2).
+ *
+ * The old daemon spawn()s the new one, which finds the channel through the
+ * LIBCEC_DAEMON_HANDOFF_FD environment variable. Both then exchange short
+ * text messages, which can carry a file descriptor (such as the uinput
+ * device), so the new daemon can carry on where the old one left off.
+ */
+class Handoff {
+private:
+	int fd;
+
+	// Not implemented
+	Handoff(Handoff const&);
+	void operator=(Handoff const&);
+
+public:
+	static const char *ENVIRONMENT;
+
+	/**
+	 * Wraps an existing channel, or none when fd is -1
+	 */
+	explicit Handoff(int fd = -1) : fd(fd) {}
+	~Handoff();
+
+	/**
+	 * The channel passed down by the old daemon, or -1 if this is a normal start
+	 */
+	static int inherited();
+
+	bool isOpen() const { return fd >= 0; }
+	void attach(int fd) { close(); this->fd = fd; }
+	void close();
+
+	/**
+	 * Runs path with the given arguments, connected to this channel.
+	 * With watchdog, the service manager's watchdog passes to the new
+	 * process along with everything else. Returns the new process id.
+	 */
+	pid_t spawn(const std::string & path, const std::vector<std::string> & args, bool watchdog = false);
+
+	/**
+	 * Sends a message, and optionally passes the file descriptor passFd along
+	 */
+	void send(const std::string & message, int passFd = -1);
+
+	/**
+	 * Waits up to timeoutMs for a message. Returns false if none came, or the
+	 * other side went away. Any file descriptor passed along is stored in
+	 * passFd (or -1 if none), which must then be closed by the caller.
+	 */
+	bool receive(std::string & message, int timeoutMs, int *passFd = NULL);
+};
+
+#endif
@@ -1,3 +1,6 @@
+#ifndef LIBCEC_DAEMON_HDMI_H
+#define LIBCEC_DAEMON_HDMI_H
+
 #include <cstdint>
 #include <iostream>
 #include <libcec/cectypes.h>
@@ -43,4 +46,4 @@ namespace HDMI
     std::istream& operator>>(std::istream &in, HDMI::address & address);
 };
 
-
+#endif
@@ -0,0 +1,646 @@
+/**
+ * kernelcec.cpp
+ *
+ * Drives an adapter through the Linux kernel CEC framework (/dev/cecN)
+ */
+#include "kernelcec.h"
+#include "hdmi.h"
+#include "log.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+#include <fcntl.h>
+#include <glob.h>
+#include <linux/cec.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+using namespace CEC;
+using namespace log4cplus;
+
+using std::endl;
+using std::string;
+
+static Logger logger = Logger::getInstance("kernelcec");
+
+static const char DEVICE_PATTERN[] = "/dev/cec[0-9]*";
+
+/**
+ * All the CEC devices, in order
+ */
+static std::vector<string> findDevices() {
+	std::vector<string> devices;
+	glob_t found;
+
+	if (glob(DEVICE_PATTERN, 0, NULL, &found) == 0) {
+		devices.assign(found.gl_pathv, found.gl_pathv + found.gl_pathc);
+	}
+	globfree(&found);
+
+	std::sort(devices.begin(), devices.end());
+	return devices;
+}
+
+/**
+ * The port our physical address hangs off, the last part of it that is set
+ */
+static uint8_t portOf(uint16_t physical) {
+	for (int shift = 0; shift < 16; shift += 4) {
+		if ((physical >> shift) & 0xF)
+			return (physical >> shift) & 0xF;
+	}
+	return 0;
+}
+
+KernelCec::KernelCec(const char *name, CecCallback *callback)
+	: name(name), callback(callback), fd(-1), wakeFd(-1), connected(false), logMask(CEC_LOG_ALL),
+	  targetPhysicalAddress(CEC_PHYS_ADDR_INVALID),
+	  physicalAddress(CEC_PHYS_ADDR_INVALID), logicalAddress(CECDEVICE_UNKNOWN), active(false),
+	  menuState(CEC_MENU_STATE_ACTIVATED),
+	  keyHeld(false), heldKey(CEC_USER_CONTROL_CODE_UNKNOWN)
+{}
+
+KernelCec::~KernelCec() {
+	close(false);
+}
+
+int KernelCec::openDevice(const string & path) {
+	return ::open(path.c_str(), O_RDWR | O_CLOEXEC);
+}
+
+int KernelCec::control(int fd, unsigned long request, void *arg) {
+	int ret;
+	do {
+		ret = ioctl(fd, request, arg);
+	} while (ret < 0 && errno == EINTR);
+	return ret;
+}
+
+void KernelCec::init() {
+	// Nothing to load, the kernel does all libcec would
+}
+
+string KernelCec::findAdapter(const string & adapter) {
+	LOG4CPLUS_TRACE_STR(logger, "KernelCec::findAdapter()");
+
+	std::vector<string> devices = findDevices();
+	if (devices.empty()) {
+		throw std::runtime_error("No adapters found");
+	}
+
+	if (adapter.empty()) {
+		LOG4CPLUS_INFO(logger, "Found " << devices[0]);
+		return devices[0];
+	}
+
+	LOG4CPLUS_INFO(logger, "Looking for " << adapter);
+	for (std::vector<string>::const_iterator i = devices.begin(); i != devices.end(); ++i) {
+		if (*i == adapter || *i == "/dev/" + adapter) {
+			LOG4CPLUS_INFO(logger, "Found " << *i);
+			return *i;
+		}
+	}
+	throw std::runtime_error("adapter not found");
+}
+
+void KernelCec::openAdapter(const string & comm) {
+	LOG4CPLUS_TRACE_STR(logger, "KernelCec::openAdapter()");
+	LOG4CPLUS_INFO(logger, "Opening " << comm);
+
+	int dev = openDevice(comm);
+	if (dev < 0) {
+		throw std::runtime_error("Failed to open adapter " + comm + ": " + strerror(errno));
+	}
+
+	struct cec_caps caps;
+	memset(&caps, 0, sizeof(caps));
+	if (control(dev, CEC_ADAP_G_CAPS, &caps) < 0) {
+		::close(dev);
+		throw std::runtime_error(comm + " is not a CEC adapter");
+	}
+	LOG4CPLUS_INFO(logger, "Adapter " << caps.name << " (" << caps.driver << ")");
+
+	// Everything addressed to us comes here, the kernel still answers the core messages itself
+	uint32_t mode = CEC_MODE_INITIATOR | CEC_MODE_EXCL_FOLLOWER;
+	if (control(dev, CEC_S_MODE, &mode) < 0) {
+		int error = errno;
+		::close(dev);
+		if (error == EBUSY)
+			throw std::runtime_error("Adapter " + comm + " is in use by another program");
+		throw std::runtime_error("Failed to take over " + comm + ": " + strerror(error));
+	}
+
+	if (caps.capabilities & CEC_CAP_PHYS_ADDR) {
+		// The driver can't read the EDID, so the physical address has to come from us
+		if (targetPhysicalAddress != CEC_PHYS_ADDR_INVALID) {
+			uint16_t physical = targetPhysicalAddress;
+			if (control(dev, CEC_ADAP_S_PHYS_ADDR, &physical) < 0) {
+				LOG4CPLUS_WARN(logger, "Failed to set the physical address: " << strerror(errno));
+			}
+		} else {
+			LOG4CPLUS_WARN(logger, comm << " can't detect its physical address, give it with --port");
+		}
+	}
+
+	if (caps.capabilities & CEC_CAP_LOG_ADDRS) {
+		struct cec_log_addrs addrs;
+
+		// Anything claimed before has to be given up first
+		memset(&addrs, 0, sizeof(addrs));
+		control(dev, CEC_ADAP_S_LOG_ADDRS, &addrs);
+
+		addrs.cec_version          = CEC_OP_CEC_VERSION_1_4;
+		addrs.vendor_id            = CEC_VENDOR_ID_NONE;
+		addrs.num_log_addrs        = 1;
+		addrs.flags                = CEC_LOG_ADDRS_FL_ALLOW_UNREG_FALLBACK;
+		addrs.log_addr_type[0]     = CEC_LOG_ADDR_TYPE_RECORD;
+		addrs.primary_device_type[0] = CEC_OP_PRIM_DEVTYPE_RECORD;
+		addrs.all_device_types[0]  = CEC_OP_ALL_DEVTYPE_RECORD;
+		strncpy(addrs.osd_name, name.c_str(), sizeof(addrs.osd_name) - 1);
+
+		// Blocks until the address is claimed, unless there is no physical address yet
+		if (control(dev, CEC_ADAP_S_LOG_ADDRS, &addrs) < 0) {
+			int error = errno;
+			::close(dev);
+			throw std::runtime_error(string("Failed to claim a logical address: ") + strerror(error));
+		}
+	}
+
+	wakeFd = eventfd(0, EFD_CLOEXEC);
+	if (wakeFd < 0) {
+		::close(dev);
+		throw std::runtime_error("Failed to create eventfd");
+	}
+
+	fd        = dev;
+	opened    = std::chrono::steady_clock::now();
+	keyHeld   = false;
+	connected = true;
+
+	// libcec reports the configuration while opening, so do the same
+	uint16_t physical = CEC_PHYS_ADDR_INVALID;
+	struct cec_log_addrs addrs;
+	memset(&addrs, 0, sizeof(addrs));
+	control(fd, CEC_ADAP_G_PHYS_ADDR, &physical);
+	control(fd, CEC_ADAP_G_LOG_ADDRS, &addrs);
+	stateChanged(physical, addrs.log_addr_mask);
+
+	thread = std::thread(&KernelCec::run, this);
+
+	LOG4CPLUS_INFO(logger, "Opened " << comm);
+}
+
+void KernelCec::close(bool makeInactive) {
+	if (fd < 0)
+		return;
+
+	LOG4CPLUS_TRACE_STR(logger, "KernelCec::close()");
+
+	if (makeInactive) {
+		uint16_t physical;
+		bool wasActive;
+		{
+			std::lock_guard<std::mutex> lock(sync);
+			physical  = physicalAddress;
+			wasActive = active;
+		}
+		if (wasActive) {
+			uint8_t address[2] = { (uint8_t) (physical >> 8), (uint8_t) physical };
+			transmit(CECDEVICE_TV, CEC_OPCODE_INACTIVE_SOURCE, address, sizeof(address));
+		}
+	}
+
+	uint64_t one = 1;
+	if (write(wakeFd, &one, sizeof(one)) < 0) {
+		// Can't happen, the counter is nowhere near full
+	}
+	thread.join();
+
+	// Logical addresses stay claimed, so reopening (or a new daemon) is quick
+	::close(fd);
+	::close(wakeFd);
+	fd = wakeFd = -1;
+	connected = false;
+
+	std::lock_guard<std::mutex> lock(sync);
+	logicalAddress = CECDEVICE_UNKNOWN;
+	active = false;
+}
+
+void KernelCec::setLogMask(int mask) {
+	logMask = mask;
+}
+
+void KernelCec::makeActive() {
+	LOG4CPLUS_TRACE_STR(logger, "KernelCec::makeActive()");
+
+	uint16_t physical;
+	{
+		std::lock_guard<std::mutex> lock(sync);
+		physical = physicalAddress;
+	}
+
+	// Just as libcec does, wake the TV up, then tell everyone to switch to us
+	uint8_t address[2] = { (uint8_t) (physical >> 8), (uint8_t) physical };
+	transmit(CECDEVICE_TV, CEC_OPCODE_IMAGE_VIEW_ON);
+	if (!transmit(CECDEVICE_BROADCAST, CEC_OPCODE_ACTIVE_SOURCE, address, sizeof(address))) {
+		throw std::runtime_error("Failed to become active");
+	}
+	activated(true);
+}
+
+void KernelCec::setTargetAddress(const HDMI::address & address) {
+	LOG4CPLUS_INFO(logger, "Physical Address is set to " << address.physical);
+	targetPhysicalAddress = address.physical;
+}
+
+void KernelCec::clearTargetAddress() {
+	LOG4CPLUS_INFO(logger, "Autodetecting the physical address");
+	targetPhysicalAddress = CEC_PHYS_ADDR_INVALID;
+}
+
+bool KernelCec::ping() {
+	if (fd < 0 || !connected)
+		return false;
+
+	uint16_t physical;
+	return control(fd, CEC_ADAP_G_PHYS_ADDR, &physical) == 0;
+}
+
+/**
+ * Waits for messages and events from the adapter, until closed
+ */
+void KernelCec::run() {
+	LOG4CPLUS_TRACE_STR(logger, "KernelCec::run()");
+
+	struct pollfd fds[2] = {
+		{ fd,     POLLIN | POLLPRI, 0 },
+		{ wakeFd, POLLIN,           0 },
+	};
+
+	while (connected) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			LOG4CPLUS_ERROR(logger, "poll failed: " << strerror(errno));
+			break;
+		}
+
+		if (fds[1].revents & POLLIN)
+			return;
+
+		// The fd is blocking, so only take one of each per wakeup
+		if (fds[0].revents & POLLPRI)
+			dequeueEvent();
+		if (fds[0].revents & POLLIN)
+			receive();
+		if (fds[0].revents & (POLLERR | POLLHUP | POLLNVAL))
+			connected = false;
+	}
+
+	message(CEC_LOG_ERROR, "connection lost");
+
+	libcec_parameter param;
+	memset(&param, 0, sizeof(param));
+	callback->onCecAlert(CEC_ALERT_CONNECTION_LOST, param);
+}
+
+void KernelCec::receive() {
+	struct cec_msg msg;
+	memset(&msg, 0, sizeof(msg));
+
+	if (control(fd, CEC_RECEIVE, &msg) < 0) {
+		if (errno == ENODEV)
+			connected = false;
+		return;
+	}
+
+	handle(msg);
+}
+
+void KernelCec::dequeueEvent() {
+	struct cec_event event;
+	memset(&event, 0, sizeof(event));
+
+	if (control(fd, CEC_DQEVENT, &event) < 0) {
+		if (errno == ENODEV)
+			connected = false;
+		return;
+	}
+
+	switch (event.event) {
+		case CEC_EVENT_STATE_CHANGE:
+			stateChanged(event.state_change.phys_addr, event.state_change.log_addr_mask);
+			break;
+		case CEC_EVENT_LOST_MSGS: {
+			char text[64];
+			snprintf(text, sizeof(text), "lost %u messages", event.lost_msgs.lost_msgs);
+			message(CEC_LOG_WARNING, text);
+			break;
+		}
+		default:
+			break;
+	}
+}
+
+void KernelCec::stateChanged(uint16_t physical, uint16_t logicalMask) {
+	cec_logical_address logical = CECDEVICE_UNKNOWN;
+	for (int i = CECDEVICE_TV; i < CECDEVICE_BROADCAST; i++) {
+		if (logicalMask & (1 << i)) {
+			logical = (cec_logical_address) i;
+			break;
+		}
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(sync);
+		if (physical == physicalAddress && logical == logicalAddress)
+			return;
+		physicalAddress = physical;
+		logicalAddress  = logical;
+	}
+
+	LOG4CPLUS_INFO(logger, "Physical address " << HDMI::physical_address(physical) << ", logical address " << (int) logical);
+
+	libcec_configuration configuration;
+	configuration.Clear();
+	configuration.iPhysicalAddress = physical;
+	configuration.baseDevice       = CECDEVICE_TV;
+	configuration.iHDMIPort        = portOf(physical);
+	configuration.logicalAddresses.Clear();
+	if (logical != CECDEVICE_UNKNOWN)
+		configuration.logicalAddresses.Set(logical);
+	configuration.logicalAddresses.primary = logical;
+
+	callback->onCecConfigurationChanged(configuration);
+}
+
+/**
+ * How long the held key has been held, in ms. A duration of 0 means pressed,
+ * so this is at least 1.
+ */
+unsigned KernelCec::heldFor() const {
+	unsigned duration = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - keyPressed).count();
+	return std::max(duration, 1u);
+}
+
+void KernelCec::activated(bool now) {
+	cec_logical_address logical;
+	{
+		std::lock_guard<std::mutex> lock(sync);
+		if (active == now)
+			return;
+		active  = now;
+		logical = logicalAddress;
+	}
+	callback->onCecSourceActivated(logical, now);
+}
+
+/**
+ * Turns what arrives into the callbacks libcec would make, and answers what
+ * libcec would answer
+ */
+void KernelCec::handle(const struct cec_msg & msg) {
+	traffic(msg, false);
+
+	if (msg.len < 2)
+		return;
+
+	cec_command command;
+	command.Clear();
+	command.initiator   = (cec_logical_address) cec_msg_initiator(&msg);
+	command.destination = (cec_logical_address) cec_msg_destination(&msg);
+	command.ack         = 1;
+	command.eom         = 1;
+	command.opcode      = (cec_opcode) msg.msg[1];
+	command.opcode_set  = 1;
+	for (uint32_t i = 2; i < msg.len; i++)
+		command.parameters.PushBack(msg.msg[i]);
+
+	callback->onCecCommand(command);
+
+	uint16_t physical;
+	bool isActive;
+	bool forUs;
+	{
+		std::lock_guard<std::mutex> lock(sync);
+		physical = physicalAddress;
+		isActive = active;
+		forUs    = command.destination == logicalAddress;
+	}
+	uint16_t address = msg.len >= 4 ? msg.msg[2] << 8 | msg.msg[3] : CEC_PHYS_ADDR_INVALID;
+	uint8_t ourAddress[2] = { (uint8_t) (physical >> 8), (uint8_t) physical };
+
+	switch (command.opcode) {
+		case CEC_OPCODE_USER_CONTROL_PRESSED: {
+			if (msg.len < 3)
+				break;
+			cec_user_control_code code = (cec_user_control_code) msg.msg[2];
+
+			// A different key without a release in between, so release the old one first
+			if (keyHeld && code != heldKey) {
+				cec_keypress release = { heldKey, heldFor() };
+				callback->onCecKeyPress(release);
+				keyHeld = false;
+			}
+			// Repeats of a held key are passed on as presses, as libcec does
+			if (!keyHeld) {
+				keyHeld    = true;
+				heldKey    = code;
+				keyPressed = std::chrono::steady_clock::now();
+			}
+			cec_keypress press = { code, 0 };
+			callback->onCecKeyPress(press);
+			break;
+		}
+		case CEC_OPCODE_USER_CONTROL_RELEASE: {
+			if (!keyHeld)
+				break;
+			keyHeld = false;
+
+			cec_keypress release = { heldKey, heldFor() };
+			callback->onCecKeyPress(release);
+			break;
+		}
+		case CEC_OPCODE_GIVE_DEVICE_POWER_STATUS: {
+			if (!forUs)
+				break;
+			uint8_t status = CEC_POWER_STATUS_ON;
+			transmit(command.initiator, CEC_OPCODE_REPORT_POWER_STATUS, &status, 1);
+			break;
+		}
+		case CEC_OPCODE_GIVE_OSD_NAME:
+			if (forUs)
+				transmit(command.initiator, CEC_OPCODE_SET_OSD_NAME, (const uint8_t *) name.data(), std::min(name.size(), (size_t) 14));
+			break;
+		case CEC_OPCODE_MENU_REQUEST: {
+			if (!forUs || msg.len < 3)
+				break;
+			uint8_t request = msg.msg[2];
+
+			// 0 activates, 1 deactivates, 2 only asks
+			if (request == CEC_MENU_STATE_ACTIVATED || request == CEC_MENU_STATE_DEACTIVATED) {
+				{
+					std::lock_guard<std::mutex> lock(sync);
+					menuState = (cec_menu_state) request;
+				}
+				callback->onCecMenuStateChanged((cec_menu_state) request);
+			}
+
+			uint8_t state;
+			{
+				std::lock_guard<std::mutex> lock(sync);
+				state = menuState;
+			}
+			transmit(command.initiator, CEC_OPCODE_MENU_STATUS, &state, 1);
+			break;
+		}
+		case CEC_OPCODE_SET_STREAM_PATH:
+			if (address == physical) {
+				transmit(CECDEVICE_BROADCAST, CEC_OPCODE_ACTIVE_SOURCE, ourAddress, sizeof(ourAddress));
+				activated(true);
+			}
+			break;
+		case CEC_OPCODE_ROUTING_CHANGE:
+			if (msg.len >= 6) {
+				uint16_t to = msg.msg[4] << 8 | msg.msg[5];
+				if (to == physical) {
+					transmit(CECDEVICE_BROADCAST, CEC_OPCODE_ACTIVE_SOURCE, ourAddress, sizeof(ourAddress));
+					activated(true);
+				} else {
+					activated(false);
+				}
+			}
+			break;
+		case CEC_OPCODE_ACTIVE_SOURCE:
+			if (address != physical)
+				activated(false);
+			break;
+		case CEC_OPCODE_REQUEST_ACTIVE_SOURCE:
+			if (isActive)
+				transmit(CECDEVICE_BROADCAST, CEC_OPCODE_ACTIVE_SOURCE, ourAddress, sizeof(ourAddress));
+			break;
+		default:
+			break;
+	}
+}
+
+/**
+ * Sends a message and waits for it to be acked. Returns false if it was not.
+ */
+bool KernelCec::transmit(cec_logical_address destination, cec_opcode opcode, const uint8_t *parameters, size_t size) {
+	cec_logical_address initiator;
+	{
+		std::lock_guard<std::mutex> lock(sync);
+		initiator = logicalAddress;
+	}
+	if (fd < 0 || !connected || initiator == CECDEVICE_UNKNOWN)
+		return false;
+
+	struct cec_msg msg;
+	memset(&msg, 0, sizeof(msg));
+	size = std::min(size, (size_t) CEC_MAX_MSG_SIZE - 2);
+
+	msg.msg[0] = initiator << 4 | (destination & 0xF);
+	msg.msg[1] = opcode;
+	if (size)
+		memcpy(msg.msg + 2, parameters, size);
+	msg.len = 2 + size;
+
+	if (control(fd, CEC_TRANSMIT, &msg) < 0) {
+		if (errno == ENODEV)
+			connected = false;
+		LOG4CPLUS_WARN(logger, "Failed to transmit: " << strerror(errno));
+		return false;
+	}
+
+	traffic(msg, true);
+
+	if (msg.tx_status & CEC_TX_STATUS_OK)
+		return true;
+
+	// Worded like libcec, so logs read the same whichever backend wrote them
+	char text[64];
+	if (msg.tx_status & CEC_TX_STATUS_NACK) {
+		snprintf(text, sizeof(text), "command 0x%02x was not acked", opcode);
+	} else {
+		snprintf(text, sizeof(text), "command 0x%02x failed, status 0x%02x", opcode, msg.tx_status);
+	}
+	message(CEC_LOG_DEBUG, text);
+	return false;
+}
+
+/**
+ * Logs a frame like libcec does, such as ">> 01:90:00"
+ */
+void KernelCec::traffic(const struct cec_msg & msg, bool sent) {
+	if (!(logMask & CEC_LOG_TRAFFIC))
+		return;
+
+	char text[3 + CEC_MAX_MSG_SIZE * 3 + 1];
+	int n = snprintf(text, sizeof(text), sent ? "<< " : ">> ");
+	for (uint32_t i = 0; i < msg.len && i < CEC_MAX_MSG_SIZE; i++)
+		n += snprintf(text + n, sizeof(text) - n, i ? ":%02x" : "%02x", msg.msg[i]);
+
+	message(CEC_LOG_TRAFFIC, text);
+}
+
+/**
+ * Passes a message on as a libcec log message
+ */
+void KernelCec::message(cec_log_level level, const char *text) {
+	if (!(level & logMask))
+		return;
+
+	cec_log_message message;
+	memset(&message, 0, sizeof(message));
+	strncpy(message.message, text, sizeof(message.message) - 1);
+	message.level = level;
+	message.time  = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - opened).count();
+
+	callback->onCecLogMessage(message);
+}
+
+/**
+ * Prints the CEC devices, with what the kernel knows about each of them
+ */
+std::ostream & KernelCec::listDevices(std::ostream & out) {
+	std::vector<string> devices = findDevices();
+	if (devices.empty()) {
+		LOG4CPLUS_ERROR(logger, "No adapters found");
+	}
+
+	for (size_t i = 0; i < devices.size(); i++) {
+		int dev = openDevice(devices[i]);
+		if (dev < 0) {
+			out << "[" << i << "] port:" << devices[i] << endl << "\tFailed to open" << endl;
+			continue;
+		}
+
+		struct cec_caps caps;
+		struct cec_log_addrs addrs;
+		uint16_t physical = CEC_PHYS_ADDR_INVALID;
+
+		memset(&caps, 0, sizeof(caps));
+		memset(&addrs, 0, sizeof(addrs));
+		control(dev, CEC_ADAP_G_CAPS, &caps);
+		control(dev, CEC_ADAP_G_PHYS_ADDR, &physical);
+		control(dev, CEC_ADAP_G_LOG_ADDRS, &addrs);
+		::close(dev);
+
+		out << "[" << i << "] port:" << devices[i] << " path:" << caps.driver << " " << caps.name << endl;
+		out << "\t" << "physical address " << HDMI::physical_address(physical) << ", logical addresses";
+		for (unsigned j = 0; j < addrs.num_log_addrs; j++)
+			out << " " << (int) addrs.log_addr[j];
+		out << endl;
+	}
+
+	return out;
+}
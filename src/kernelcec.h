@@ -0,0 +1,101 @@
+#ifndef LIBCEC_DAEMON_KERNELCEC_H
+#define LIBCEC_DAEMON_KERNELCEC_H
+
+#include "cecdevice.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+
+struct cec_msg;
+struct cec_event;
+
+/**
+ * Drives an adapter through the Linux kernel CEC framework (/dev/cecN),
+ * as found on the Raspberry Pi 4, Amlogic and many other SoCs, instead of
+ * through libcec.
+ *
+ * The kernel already handles the low level protocol, so all this needs is one
+ * thread polling the device, which turns what arrives into the same callbacks
+ * libcec makes: key presses and releases, commands, menu and active source
+ * changes, and address changes. Bus traffic is reported as libcec TRAFFIC log
+ * messages, so -vv logs look the same with either backend.
+ *
+ * All access to the device goes through openDevice() and control(), so
+ * cec-fakekernel (src/fakekernel.cpp) can stand in for the kernel. The vivid
+ * driver also provides software CEC adapters connected to each other, with no
+ * hardware needed.
+ */
+class KernelCec : public CecDevice {
+	private:
+		std::string name;    // OSD name
+		CecCallback *callback;
+
+		int fd;
+		int wakeFd;
+		std::thread thread;
+		std::atomic<bool> connected;
+		std::atomic<int> logMask;
+		std::chrono::steady_clock::time_point opened;
+
+		uint16_t targetPhysicalAddress; // from --port, or 0xFFFF to use the driver's
+
+		// Current bus state, guarded by sync
+		std::mutex sync;
+		uint16_t physicalAddress;
+		CEC::cec_logical_address logicalAddress;
+		bool active;
+		CEC::cec_menu_state menuState;
+
+		// Key being held, only touched by the polling thread
+		bool keyHeld;
+		CEC::cec_user_control_code heldKey;
+		std::chrono::steady_clock::time_point keyPressed;
+
+		void run();
+		void receive();
+		void dequeueEvent();
+		void handle(const struct cec_msg & msg);
+		void stateChanged(uint16_t physical, uint16_t logicalMask);
+		void activated(bool active);
+		unsigned heldFor() const;
+
+		bool transmit(CEC::cec_logical_address destination, CEC::cec_opcode opcode, const uint8_t *parameters = NULL, size_t size = 0);
+		void traffic(const struct cec_msg & msg, bool sent);
+		void message(CEC::cec_log_level level, const char *text);
+
+		// Not implemented
+		KernelCec(KernelCec const&);
+		void operator=(KernelCec const&);
+
+	protected:
+		/**
+		 * Opens the device node, returning the fd or -1 with errno set
+		 */
+		virtual int openDevice(const std::string & path);
+
+		/**
+		 * ioctl() on the open device
+		 */
+		virtual int control(int fd, unsigned long request, void *arg);
+
+	public:
+		KernelCec(const char *name, CecCallback *callback);
+		virtual ~KernelCec();
+
+		virtual std::ostream & listDevices(std::ostream & out);
+		virtual void init();
+		virtual std::string findAdapter(const std::string &adapter = "");
+		virtual void openAdapter(const std::string &comm);
+		virtual void close(bool makeInactive = true);
+		virtual void setLogMask(int mask);
+		virtual void makeActive();
+		virtual void setTargetAddress(const HDMI::address & address);
+		virtual void clearTargetAddress();
+		virtual bool ping();
+};
+
+#endif
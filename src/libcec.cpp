@@ -16,22 +16,22 @@
  */
 #include "libcec.h"
 #include "hdmi.h"
+#include "trace.h"
 
+#include <atomic>
 #include <cstdio>
 #include <iostream>
 #include <ostream>
 #include <stdexcept>
 #include <cassert>
-#include <map>
+#include <cstring>
 
-#include <log4cplus/logger.h>
-#include <log4cplus/loggingmacros.h>
+#include "log.h"
 
 using namespace CEC;
 using namespace log4cplus;
 
 using std::endl;
-using std::map;
 using std::ostream;
 using std::string;
 using std::hex;
@@ -46,12 +46,20 @@ static Logger logger = Logger::getInstance("libcec");
 #define MAX_CEC_PORTS (CEC_MAX_HDMI_PORTNUMBER-CEC_MIN_HDMI_PORTNUMBER)
 
 // Map of control codes to Strings
-const map<enum cec_user_control_code, const char *> Cec::cecUserControlCodeName = Cec::setupUserControlCodeName();
+const Cec::UserControlCodeNames Cec::cecUserControlCodeName = Cec::setupUserControlCodeName();
 
 // We store a global handle, so we can use g_cec->ToString(..) in certain cases. This is a bit of a HACK :(
 static ICECAdapter * g_cec = NULL;
 
+// Log levels passed on to the callback, see Cec::setLogMask()
+static std::atomic<int> g_logMask(CEC_LOG_ALL);
+
 int cecLogMessage(void *cbParam, const cec_log_message message) {
+	if (!(message.level & g_logMask.load(std::memory_order_relaxed)))
+		return 1;
+
+	Trace::Span span("cecLogMessage");
+
 	try {
 		return ((CecCallback*) cbParam)->onCecLogMessage(message);
 	} catch (...) {}
@@ -59,6 +67,8 @@ int cecLogMessage(void *cbParam, const cec_log_message message) {
 }
 
 int cecKeyPress(void *cbParam, const cec_keypress key) {
+	Trace::Span span("cecKeyPress");
+
 	try {
 		return ((CecCallback*) cbParam)->onCecKeyPress(key);
 	} catch (...) {}
@@ -66,6 +76,8 @@ int cecKeyPress(void *cbParam, const cec_keypress key) {
 }
 
 int cecCommand(void *cbParam, const cec_command command) {
+	Trace::Span span("cecCommand");
+
 	try {
 		return ((CecCallback*) cbParam)->onCecCommand(command);
 	} catch (...) {}
@@ -73,6 +85,8 @@ int cecCommand(void *cbParam, const cec_command command) {
 }
 
 int cecAlert(void *cbParam, const libcec_alert alert, const libcec_parameter param) {
+	Trace::Span span("cecAlert");
+
 	try {
 		return ((CecCallback*) cbParam)->onCecAlert(alert, param);
 	} catch (...) {}
@@ -80,6 +94,8 @@ int cecAlert(void *cbParam, const libcec_alert alert, const libcec_parameter par
 }
 
 int cecConfigurationChanged(void *cbParam, const libcec_configuration configuration) {
+	Trace::Span span("cecConfigurationChanged");
+
 	try {
 		return ((CecCallback*) cbParam)->onCecConfigurationChanged(configuration);
 	} catch (...) {}
@@ -87,6 +103,8 @@ int cecConfigurationChanged(void *cbParam, const libcec_configuration configurat
 }
 
 int cecMenuStateChanged(void *cbParam, const cec_menu_state menu_state) {
+	Trace::Span span("cecMenuStateChanged");
+
 	try {
 		return ((CecCallback*) cbParam)->onCecMenuStateChanged(menu_state);
 	} catch (...) {}
@@ -94,6 +112,8 @@ int cecMenuStateChanged(void *cbParam, const cec_menu_state menu_state) {
 }
 
 void cecSourceActivated(void *cbParam, const cec_logical_address address, const uint8_t val) {
+	Trace::Span span("cecSourceActivated");
+
 	try {
 		return ((CecCallback*) cbParam)->onCecSourceActivated(address, val);
 	} catch (...) {}
@@ -162,7 +182,9 @@ void Cec::init()
     {
         // LibCecInitialise is noisy, so we redirect cout to nowhere
         RedirectStreamBuffer redirect(cout, 0);
+        CallStats::Timer timer(calls, CallStats::CALL_INITIALISE);
         g_cec = LibCecInitialise(&config);
+        timer.finish(g_cec != NULL);
         if (! g_cec) {
             throw std::runtime_error("Failed to initialise libCEC");
         }
@@ -171,16 +193,18 @@ void Cec::init()
     }
 }
 
-void Cec::open(const std::string &name) {
-	LOG4CPLUS_TRACE_STR(logger, "Cec::open()");
+string Cec::findAdapter(const std::string &name) {
+	LOG4CPLUS_TRACE_STR(logger, "Cec::findAdapter()");
 	int id = 0;
 
-	init();
+	assert(cec);
 
 	// Search for adapters
 	cec_adapter devices[MAX_CEC_PORTS];
 
-	uint8_t ret = cec->FindAdapters(devices, MAX_CEC_PORTS, NULL);
+	CallStats::Timer timer(calls, CallStats::CALL_FIND_ADAPTERS);
+	int8_t ret = cec->FindAdapters(devices, MAX_CEC_PORTS, NULL);
+	timer.finish(ret >= 0);
 	if (ret < 0) {
 		throw std::runtime_error("Error occurred searching for adapters");
 	}
@@ -206,21 +230,46 @@ void Cec::open(const std::string &name) {
 	}
 
 	// Just use the first found
-	LOG4CPLUS_INFO(logger, "Opening " << devices[id].path);
+	LOG4CPLUS_INFO(logger, "Found " << devices[id].path);
+
+	return devices[id].comm;
+}
+
+void Cec::openAdapter(const std::string &comm) {
+	LOG4CPLUS_TRACE_STR(logger, "Cec::openAdapter()");
+
+	assert(cec);
+
+	LOG4CPLUS_INFO(logger, "Opening " << comm);
 
-	if (!cec->Open(devices[id].comm)) {
+	CallStats::Timer timer(calls, CallStats::CALL_OPEN);
+	bool opened = cec->Open(comm.c_str());
+	timer.finish(opened);
+	if (!opened) {
 		throw std::runtime_error("Failed to open adapter");
 	}
 
-	LOG4CPLUS_INFO(logger, "Opened " << devices[id].path);
+	LOG4CPLUS_INFO(logger, "Opened " << comm);
+}
+
+void Cec::open(const std::string &name) {
+	LOG4CPLUS_TRACE_STR(logger, "Cec::open()");
+
+	init();
+	openAdapter(findAdapter(name));
 }
 
 void Cec::close(bool makeInactive) {
 	assert(cec);
 
-    if (makeInactive)
-        cec->SetInactiveView();
-    cec->Close();
+	if (makeInactive) {
+		CallStats::Timer timer(calls, CallStats::CALL_SET_INACTIVE_VIEW);
+		timer.finish(cec->SetInactiveView());
+	}
+
+	CallStats::Timer timer(calls, CallStats::CALL_CLOSE);
+	cec->Close();
+	timer.finish(true);
 }
 
 void Cec::setTargetAddress(const HDMI::address & address) {
@@ -232,11 +281,32 @@ void Cec::setTargetAddress(const HDMI::address & address) {
 	config.iHDMIPort = address.port;
 }
 
+void Cec::clearTargetAddress() {
+	LOG4CPLUS_INFO(logger, "Autodetecting the physical address");
+
+	libcec_configuration defaults;
+	defaults.Clear();
+
+	config.iPhysicalAddress = defaults.iPhysicalAddress;
+	config.baseDevice       = defaults.baseDevice;
+	config.iHDMIPort        = defaults.iHDMIPort;
+
+	cec.reset();
+}
+
+void Cec::setLogMask(int mask) {
+	g_logMask = mask;
+	callbacks.CBCecLogMessage = mask ? &::cecLogMessage : NULL;
+}
+
 void Cec::makeActive() {
 	assert(cec);
 
 	// and made active
-	if (!cec->SetActiveSource(config.deviceTypes[0])) {
+	CallStats::Timer timer(calls, CallStats::CALL_SET_ACTIVE_SOURCE);
+	bool active = cec->SetActiveSource(config.deviceTypes[0]);
+	timer.finish(active);
+	if (!active) {
 		throw std::runtime_error("Failed to become active");
 	}
 }
@@ -244,7 +314,10 @@ void Cec::makeActive() {
 bool Cec::ping() {
 	assert(cec);
 
-    return cec->PingAdapter();
+	CallStats::Timer timer(calls, CallStats::CALL_PING_ADAPTER);
+	bool alive = cec->PingAdapter();
+	timer.finish(alive);
+	return alive;
 }
 
 
@@ -257,7 +330,9 @@ ostream & Cec::listDevices(ostream & out) {
 
     init();
 
+	CallStats::Timer timer(calls, CallStats::CALL_FIND_ADAPTERS);
 	int8_t ret = cec->FindAdapters(devices, MAX_CEC_PORTS, NULL);
+	timer.finish(ret >= 0);
 	if (ret < 0) {
 		LOG4CPLUS_ERROR(logger, "Error occurred searching for adapters");
 		return out;
@@ -270,18 +345,32 @@ ostream & Cec::listDevices(ostream & out) {
 	for (int8_t i = 0; i < ret; i++) {
 		out << "[" << (int) i << "] port:" << devices[i].comm << " path:" << devices[i].path << endl;
 
-		if (!cec->Open(devices[i].comm)) {
+		CallStats::Timer openTimer(calls, CallStats::CALL_OPEN);
+		bool opened = cec->Open(devices[i].comm);
+		openTimer.finish(opened);
+		if (!opened) {
 			out << "\tFailed to open" << endl;
 		}
 
+		CallStats::Timer activeTimer(calls, CallStats::CALL_GET_ACTIVE_DEVICES);
 		cec_logical_addresses devices = cec->GetActiveDevices();
+		activeTimer.finish(true);
 		for (int j = 0; j < 16; j++) {
 			if (devices[j]) {
 				cec_logical_address logical_addres = (cec_logical_address) j;
 
-                HDMI::physical_address physical_address(cec->GetDevicePhysicalAddress(logical_addres));
+				CallStats::Timer addressTimer(calls, CallStats::CALL_GET_DEVICE_PHYSICAL_ADDRESS);
+				uint16_t address = cec->GetDevicePhysicalAddress(logical_addres);
+				addressTimer.finish(address != CEC_INVALID_PHYSICAL_ADDRESS);
+				HDMI::physical_address physical_address(address);
+
+				CallStats::Timer nameTimer(calls, CallStats::CALL_GET_DEVICE_OSD_NAME);
 				cec_osd_name name = cec->GetDeviceOSDName(logical_addres);
+				nameTimer.finish(true);
+
+				CallStats::Timer vendorTimer(calls, CallStats::CALL_GET_DEVICE_VENDOR_ID);
 				cec_vendor_id vendor = (cec_vendor_id) cec->GetDeviceVendorId(logical_addres);
+				vendorTimer.finish(vendor != CEC_VENDOR_UNKNOWN);
 
 				out << "\t"  << cec->ToString(logical_addres)
 				    << " @ 0x" << hex << physical_address
@@ -293,10 +382,12 @@ ostream & Cec::listDevices(ostream & out) {
 	return out;
 }
 
-map<cec_user_control_code, const char *> & Cec::setupUserControlCodeName() {
-	static map<cec_user_control_code, const char *> cecUserControlCodeName;
+const Cec::UserControlCodeNames & Cec::setupUserControlCodeName() {
+	static UserControlCodeNames cecUserControlCodeName;
+
+	if (cecUserControlCodeName[CEC_USER_CONTROL_CODE_UNKNOWN] == NULL) {
+		cecUserControlCodeName.fill(NULL);
 
-	if (cecUserControlCodeName.empty()) {
 		cecUserControlCodeName[CEC_USER_CONTROL_CODE_SELECT]="SELECT";
 		cecUserControlCodeName[CEC_USER_CONTROL_CODE_UP]="UP";
 		cecUserControlCodeName[CEC_USER_CONTROL_CODE_DOWN]="DOWN";
@@ -384,15 +475,13 @@ map<cec_user_control_code, const char *> & Cec::setupUserControlCodeName() {
 }
 
 std::ostream& operator<<(std::ostream &out, const cec_user_control_code code) {
-	map<cec_user_control_code, const char *>::const_iterator it;
-
-	it = Cec::cecUserControlCodeName.find(code);
-	if (it == Cec::cecUserControlCodeName.end()) {
-		it = Cec::cecUserControlCodeName.find(CEC_USER_CONTROL_CODE_UNKNOWN);
-		assert(it != Cec::cecUserControlCodeName.end());
+	const char *name = Cec::cecUserControlCodeName[(uint8_t) code];
+	if (name == NULL) {
+		name = Cec::cecUserControlCodeName[CEC_USER_CONTROL_CODE_UNKNOWN];
+		assert(name != NULL);
 	}
 
-	return out << it->second;
+	return out << name;
 }
 
 std::ostream& operator<<(std::ostream &out, const cec_log_level & log) {
@@ -427,13 +516,14 @@ std::ostream& operator<<(std::ostream &out, const cec_command & cmd) {
 std::ostream& operator<<(std::ostream &out, const cec_opcode & opcode) {
 	if (g_cec)
 		return out << g_cec->ToString(opcode);
-	return out << "UNKNOWN";
+	// libcec is not loaded when using the kernel backend
+	return out << "0x" << hex << (int) opcode << std::dec;
 }
 
 std::ostream& operator<<(std::ostream &out, const cec_logical_address & address) {
 	if (g_cec)
 		return out << g_cec->ToString(address);
-	return out << "UNKNOWN";
+	return out << (int) address;
 }
 
 std::ostream& operator<<(std::ostream &out, const libcec_configuration & configuration) {
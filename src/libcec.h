@@ -1,37 +1,26 @@
+#ifndef LIBCEC_DAEMON_LIBCEC_H
+#define LIBCEC_DAEMON_LIBCEC_H
+
+#include "cecdevice.h"
+#include "callstats.h"
+
 #include <cstddef>
 #include <libcec/cec.h>
 
+#include <array>
 #include <memory>
-#include <map>
 #include <string>
 
-namespace HDMI {
-	class physical_address;
-	class address;
-}
-
-class CecCallback {
-	public:
-		virtual ~CecCallback() {}
-
-		// Virtual methods to handle callbacks
-		virtual int onCecLogMessage(const CEC::cec_log_message & message) = 0;
-		virtual int onCecKeyPress  (const CEC::cec_keypress & key) = 0;
-		virtual int onCecCommand   (const CEC::cec_command & command) = 0;
-		virtual int onCecConfigurationChanged(const CEC::libcec_configuration & configuration) = 0;
-		virtual int onCecAlert(const CEC::libcec_alert alert, const CEC::libcec_parameter & param) = 0;
-		virtual int onCecMenuStateChanged(const CEC::cec_menu_state & menu_state) = 0;
-		virtual void onCecSourceActivated(const CEC::cec_logical_address & address, bool bActivated) = 0;
-};
-
 /**
  * Simple wrapper class around libcec
  */
-class Cec {
+class Cec : public CecDevice {
 
 	private:
 
-		static std::map<CEC::cec_user_control_code, const char *> & setupUserControlCodeName();
+		typedef std::array<const char *, 256> UserControlCodeNames;
+
+		static const UserControlCodeNames & setupUserControlCodeName();
 
 		// Members for the libcec interface
 		CEC::ICECCallbacks callbacks;
@@ -39,12 +28,12 @@ class Cec {
 
 		std::unique_ptr<CEC::ICECAdapter> cec;
 
-		// Inits the CECAdapter 
-		void init();
+		CallStats calls;
 
 	public:
 
-		const static std::map<CEC::cec_user_control_code, const char *> cecUserControlCodeName;
+		// Indexed by cec_user_control_code, NULL for codes without a name
+		const static UserControlCodeNames cecUserControlCodeName;
 
 		Cec(const char *name, CecCallback *callback);
 		virtual ~Cec();
@@ -52,7 +41,23 @@ class Cec {
 		/**
 		 * List all found adapters and prints them out
 		 */
-		std::ostream & listDevices(std::ostream & out);
+		virtual std::ostream & listDevices(std::ostream & out);
+
+		/**
+		 * Loads and initialises libcec, does nothing if already done
+		 */
+		virtual void init();
+
+		/**
+		 * Searches for the named adapter (or the first one found when
+		 * no name is given), and returns its comm port
+		 */
+		virtual std::string findAdapter(const std::string &adapter = "");
+
+		/**
+		 * Opens the adapter on the given comm port
+		 */
+		virtual void openAdapter(const std::string &comm);
 
 		/**
 		 * Opens the first adapter it finds
@@ -62,11 +67,25 @@ class Cec {
 		/**
 		 * Closes the open adapter
 		 */
-		void close(bool makeInactive = true);
+		virtual void close(bool makeInactive = true);
 
-		void makeActive();
-		void setTargetAddress(const HDMI::address & address);
-		bool ping();
+		/**
+		 * Only pass on log messages whose cec_log_level is in mask. With an
+		 * empty mask, no log callback is registered at all, which only takes
+		 * effect if set before init().
+		 */
+		virtual void setLogMask(int mask);
+
+		virtual void makeActive();
+		virtual void setTargetAddress(const HDMI::address & address);
+
+		/**
+		 * Goes back to autodetecting the address. This unloads libcec, as
+		 * the address only takes effect on init(), so the adapter must be closed.
+		 */
+		virtual void clearTargetAddress();
+		virtual bool ping();
+		virtual CallStats * callStats() { return &calls; }
 
 	// These are just wrapper functions, to map C callbacks to C++
 	friend int cecLogMessage (void *cbParam, const CEC::cec_log_message &message);
@@ -84,3 +103,5 @@ std::ostream& operator<<(std::ostream &out, const CEC::cec_log_message & message
 std::ostream& operator<<(std::ostream &out, const CEC::cec_keypress & key);
 std::ostream& operator<<(std::ostream &out, const CEC::cec_command & command);
 std::ostream& operator<<(std::ostream &out, const CEC::libcec_configuration & configuration);
+
+#endif
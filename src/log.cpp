@@ -0,0 +1,48 @@
+/**
+ * log.cpp
+ *
+ * Built-in logger used by minimal builds, see log.h
+ */
+#include "log.h"
+
+#ifdef MINIMAL_BUILD
+
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+
+namespace minilog {
+
+static const char *levelName(LogLevel ll) {
+	if (ll >= FATAL_LOG_LEVEL) return "FATAL";
+	if (ll >= ERROR_LOG_LEVEL) return "ERROR";
+	if (ll >= WARN_LOG_LEVEL)  return "WARN";
+	if (ll >= INFO_LOG_LEVEL)  return "INFO";
+	if (ll >= DEBUG_LOG_LEVEL) return "DEBUG";
+	return "TRACE";
+}
+
+LogLevel & Logger::level() {
+	static LogLevel root = DEBUG_LOG_LEVEL;
+	return root;
+}
+
+void Logger::log(LogLevel ll, const LogStream & message) const {
+	char line[sizeof(message) + 64];
+
+	int len = snprintf(line, sizeof(line), "%-5s %s - %.*s\n",
+		levelName(ll), name, (int) message.size(), message.c_str());
+	if (len < 0)
+		return;
+	if ((size_t) len >= sizeof(line))
+		len = sizeof(line) - 1;
+
+	// A single write keeps lines from different threads whole
+	if (write(STDERR_FILENO, line, len) < 0) {
+		// Nowhere left to report this
+	}
+}
+
+}
+
+#endif // MINIMAL_BUILD
@@ -0,0 +1,114 @@
+/**
+ * log.h
+ *
+ * Selects the logging backend. Normal builds use log4cplus, while minimal
+ * builds (--enable-minimal) use the small built-in logger below, which
+ * provides the subset of the log4cplus API used by the daemon and formats
+ * each message into a fixed stack buffer, so logging never touches the heap.
+ */
+#ifndef LIBCEC_DAEMON_LOG_H
+#define LIBCEC_DAEMON_LOG_H
+
+#include "config.h"
+
+#ifndef MINIMAL_BUILD
+
+#include <log4cplus/logger.h>
+#include <log4cplus/loggingmacros.h>
+#include <log4cplus/configurator.h>
+
+#else
+
+#include <cstddef>
+#include <ostream>
+#include <streambuf>
+
+namespace minilog {
+
+	typedef int LogLevel;
+
+	const LogLevel OFF_LOG_LEVEL   = 60000;
+	const LogLevel FATAL_LOG_LEVEL = 50000;
+	const LogLevel ERROR_LOG_LEVEL = 40000;
+	const LogLevel WARN_LOG_LEVEL  = 30000;
+	const LogLevel INFO_LOG_LEVEL  = 20000;
+	const LogLevel DEBUG_LOG_LEVEL = 10000;
+	const LogLevel TRACE_LOG_LEVEL = 0;
+
+	/**
+	 * Stream writing into a fixed size buffer, silently truncating long messages
+	 */
+	class LogStream : public std::ostream {
+	private:
+		class Buffer : public std::streambuf {
+		public:
+			Buffer(char *begin, size_t len) { setp(begin, begin + len); }
+			size_t size() const { return pptr() - pbase(); }
+		};
+
+		char data[512];
+		Buffer buffer;
+
+	public:
+		LogStream() : std::ostream(0), buffer(data, sizeof(data)) { rdbuf(&buffer); }
+
+		const char *c_str() const { return data; }
+		size_t size() const { return buffer.size(); }
+	};
+
+	/**
+	 * All loggers share the root log level, which is all the daemon needs
+	 */
+	class Logger {
+	private:
+		const char *name;
+
+		explicit Logger(const char *name) : name(name) {}
+
+		static LogLevel & level();
+
+	public:
+		static Logger getInstance(const char *name) { return Logger(name); }
+		static Logger getRoot() { return Logger("root"); }
+
+		void setLogLevel(LogLevel ll) { level() = ll; }
+		LogLevel getLogLevel() const { return level(); }
+		bool isEnabledFor(LogLevel ll) const { return ll >= level(); }
+
+		void log(LogLevel ll, const LogStream & message) const;
+	};
+
+	class BasicConfigurator {
+	public:
+		void configure() {}
+	};
+}
+
+namespace log4cplus = minilog;
+
+#define MINILOG_LOG(logger, ll, event) \
+	do { \
+		if ((logger).isEnabledFor(minilog::ll)) { \
+			minilog::LogStream _minilog_stream; \
+			_minilog_stream << event; \
+			(logger).log(minilog::ll, _minilog_stream); \
+		} \
+	} while (0)
+
+#define LOG4CPLUS_TRACE(logger, event) MINILOG_LOG(logger, TRACE_LOG_LEVEL, event)
+#define LOG4CPLUS_DEBUG(logger, event) MINILOG_LOG(logger, DEBUG_LOG_LEVEL, event)
+#define LOG4CPLUS_INFO(logger, event)  MINILOG_LOG(logger, INFO_LOG_LEVEL,  event)
+#define LOG4CPLUS_WARN(logger, event)  MINILOG_LOG(logger, WARN_LOG_LEVEL,  event)
+#define LOG4CPLUS_ERROR(logger, event) MINILOG_LOG(logger, ERROR_LOG_LEVEL, event)
+#define LOG4CPLUS_FATAL(logger, event) MINILOG_LOG(logger, FATAL_LOG_LEVEL, event)
+
+#define LOG4CPLUS_TRACE_STR(logger, str) LOG4CPLUS_TRACE(logger, str)
+#define LOG4CPLUS_DEBUG_STR(logger, str) LOG4CPLUS_DEBUG(logger, str)
+#define LOG4CPLUS_INFO_STR(logger, str)  LOG4CPLUS_INFO(logger, str)
+#define LOG4CPLUS_WARN_STR(logger, str)  LOG4CPLUS_WARN(logger, str)
+#define LOG4CPLUS_ERROR_STR(logger, str) LOG4CPLUS_ERROR(logger, str)
+#define LOG4CPLUS_FATAL_STR(logger, str) LOG4CPLUS_FATAL(logger, str)
+
+#endif // MINIMAL_BUILD
+
+#endif // LIBCEC_DAEMON_LOG_H
@@ -0,0 +1,512 @@
+/**
+ * macro.cpp
+ *
+ * Compiles key macros and plays them back on deadlines
+ */
+#include "macro.h"
+#include "log.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+using namespace log4cplus;
+
+using std::string;
+
+static Logger logger = Logger::getInstance("macro");
+
+struct KeyName {
+	const char *name;
+	__u16 code;
+};
+
+static const KeyName keyNames[] = {
+	{"esc", KEY_ESC}, {"escape", KEY_ESC},
+	{"1", KEY_1}, {"2", KEY_2}, {"3", KEY_3}, {"4", KEY_4}, {"5", KEY_5},
+	{"6", KEY_6}, {"7", KEY_7}, {"8", KEY_8}, {"9", KEY_9}, {"0", KEY_0},
+	{"minus", KEY_MINUS}, {"equal", KEY_EQUAL}, {"backspace", KEY_BACKSPACE}, {"tab", KEY_TAB},
+	{"q", KEY_Q}, {"w", KEY_W}, {"e", KEY_E}, {"r", KEY_R}, {"t", KEY_T},
+	{"y", KEY_Y}, {"u", KEY_U}, {"i", KEY_I}, {"o", KEY_O}, {"p", KEY_P},
+	{"leftbrace", KEY_LEFTBRACE}, {"rightbrace", KEY_RIGHTBRACE}, {"enter", KEY_ENTER}, {"return", KEY_ENTER},
+	{"a", KEY_A}, {"s", KEY_S}, {"d", KEY_D}, {"f", KEY_F}, {"g", KEY_G},
+	{"h", KEY_H}, {"j", KEY_J}, {"k", KEY_K}, {"l", KEY_L},
+	{"semicolon", KEY_SEMICOLON}, {"apostrophe", KEY_APOSTROPHE}, {"grave", KEY_GRAVE}, {"backslash", KEY_BACKSLASH},
+	{"z", KEY_Z}, {"x", KEY_X}, {"c", KEY_C}, {"v", KEY_V}, {"b", KEY_B},
+	{"n", KEY_N}, {"m", KEY_M}, {"comma", KEY_COMMA}, {"dot", KEY_DOT}, {"slash", KEY_SLASH},
+	{"space", KEY_SPACE}, {"capslock", KEY_CAPSLOCK},
+	{"leftctrl", KEY_LEFTCTRL}, {"rightctrl", KEY_RIGHTCTRL}, {"ctrl", KEY_LEFTCTRL},
+	{"leftshift", KEY_LEFTSHIFT}, {"rightshift", KEY_RIGHTSHIFT}, {"shift", KEY_LEFTSHIFT},
+	{"leftalt", KEY_LEFTALT}, {"rightalt", KEY_RIGHTALT}, {"alt", KEY_LEFTALT}, {"altgr", KEY_RIGHTALT},
+	{"leftmeta", KEY_LEFTMETA}, {"rightmeta", KEY_RIGHTMETA}, {"meta", KEY_LEFTMETA}, {"super", KEY_LEFTMETA},
+	{"f1", KEY_F1}, {"f2", KEY_F2}, {"f3", KEY_F3}, {"f4", KEY_F4}, {"f5", KEY_F5}, {"f6", KEY_F6},
+	{"f7", KEY_F7}, {"f8", KEY_F8}, {"f9", KEY_F9}, {"f10", KEY_F10}, {"f11", KEY_F11}, {"f12", KEY_F12},
+	{"up", KEY_UP}, {"down", KEY_DOWN}, {"left", KEY_LEFT}, {"right", KEY_RIGHT},
+	{"home", KEY_HOME}, {"end", KEY_END}, {"pageup", KEY_PAGEUP}, {"pagedown", KEY_PAGEDOWN},
+	{"insert", KEY_INSERT}, {"delete", KEY_DELETE}, {"compose", KEY_COMPOSE}, {"sysrq", KEY_SYSRQ},
+	{"mute", KEY_MUTE}, {"volumedown", KEY_VOLUMEDOWN}, {"volumeup", KEY_VOLUMEUP},
+	{"power", KEY_POWER}, {"sleep", KEY_SLEEP}, {"wakeup", KEY_WAKEUP},
+	{"playpause", KEY_PLAYPAUSE}, {"play", KEY_PLAY}, {"pause", KEY_PAUSE}, {"stop", KEY_STOP},
+	{"stopcd", KEY_STOPCD}, {"record", KEY_RECORD}, {"rewind", KEY_REWIND}, {"fastforward", KEY_FASTFORWARD},
+	{"nextsong", KEY_NEXTSONG}, {"previoussong", KEY_PREVIOUSSONG}, {"next", KEY_NEXT}, {"previous", KEY_PREVIOUS},
+	{"ok", KEY_OK}, {"select", KEY_SELECT}, {"menu", KEY_MENU}, {"back", KEY_BACK}, {"forward", KEY_FORWARD},
+	{"exit", KEY_EXIT}, {"info", KEY_INFO}, {"epg", KEY_EPG}, {"setup", KEY_SETUP}, {"homepage", KEY_HOMEPAGE},
+	{"channelup", KEY_CHANNELUP}, {"channeldown", KEY_CHANNELDOWN}, {"search", KEY_SEARCH},
+	{"red", KEY_RED}, {"green", KEY_GREEN}, {"yellow", KEY_YELLOW}, {"blue", KEY_BLUE},
+	{"subtitle", KEY_SUBTITLE}, {"audio", KEY_AUDIO}, {"zoom", KEY_ZOOM},
+};
+
+// Characters that need shift, and the key they are on (US layout)
+static const char shifted[]   = "~!@#$%^&*()_+{}|:\"<>?";
+static const char unshifted[] = "`1234567890-=[]\\;',./";
+
+__u16 Macro::keyCode(const string & name) {
+	string lower;
+	for (size_t i = 0; i < name.size(); i++)
+		lower += tolower((unsigned char) name[i]);
+
+	for (size_t i = 0; i < sizeof(keyNames) / sizeof(keyNames[0]); i++)
+		if (lower == keyNames[i].name)
+			return keyNames[i].code;
+
+	// Any other key by number, such as 0x1d0
+	char *end;
+	unsigned long code = strtoul(lower.c_str(), &end, 0);
+	if (!lower.empty() && *end == '\0' && code > KEY_RESERVED && code < KEY_CNT)
+		return code;
+
+	return KEY_RESERVED;
+}
+
+/**
+ * The key typing c, and whether it needs shift, returns KEY_RESERVED if it can't be typed
+ */
+static __u16 charKey(char c, bool & shift) {
+	shift = false;
+
+	if (isupper((unsigned char) c)) {
+		shift = true;
+		c = tolower((unsigned char) c);
+	}
+
+	const char *s = strchr(shifted, c);
+	if (c != '\0' && s) {
+		shift = true;
+		c = unshifted[s - shifted];
+	}
+
+	switch (c) {
+		case ' ':  return KEY_SPACE;
+		case '\n': return KEY_ENTER;
+		case '\t': return KEY_TAB;
+		case '`':  return KEY_GRAVE;
+		case '-':  return KEY_MINUS;
+		case '=':  return KEY_EQUAL;
+		case '[':  return KEY_LEFTBRACE;
+		case ']':  return KEY_RIGHTBRACE;
+		case '\\': return KEY_BACKSLASH;
+		case ';':  return KEY_SEMICOLON;
+		case '\'': return KEY_APOSTROPHE;
+		case ',':  return KEY_COMMA;
+		case '.':  return KEY_DOT;
+		case '/':  return KEY_SLASH;
+	}
+
+	if (isalnum((unsigned char) c))
+		return Macro::keyCode(string(1, c));
+
+	return KEY_RESERVED;
+}
+
+/**
+ * Splits text into steps, keeping quoted text (with \" \\ \n and \t escapes) together
+ */
+static std::vector<string> tokenize(const string & text) {
+	std::vector<string> tokens;
+	size_t i = 0;
+
+	while (i < text.size()) {
+		if (isspace((unsigned char) text[i])) {
+			i++;
+			continue;
+		}
+
+		string token;
+		if (text[i] == '"') {
+			token += text[i++];
+			while (i < text.size() && text[i] != '"') {
+				char c = text[i++];
+				if (c == '\\' && i < text.size()) {
+					c = text[i++];
+					if (c == 'n')
+						c = '\n';
+					else if (c == 't')
+						c = '\t';
+				}
+				token += c;
+			}
+			if (i == text.size())
+				throw std::runtime_error("unterminated text");
+			token += text[i++];
+		} else {
+			while (i < text.size() && !isspace((unsigned char) text[i]))
+				token += text[i++];
+		}
+		tokens.push_back(token);
+	}
+
+	return tokens;
+}
+
+void Macro::add(Op op, uint16_t arg) {
+	Step step = { (uint8_t) op, arg };
+	steps.push_back(step);
+}
+
+/**
+ * Adds a key event to the current frame, ending the frame first if the key
+ * already changed in it, as a key must change at most once per frame
+ */
+void Macro::event(Op op, __u16 key, std::bitset<KEY_CNT> & frame) {
+	if (frame[key])
+		endFrame(frame);
+	frame.set(key);
+	add(op, key);
+}
+
+void Macro::endFrame(std::bitset<KEY_CNT> & frame) {
+	if (frame.none())
+		return;
+	add(OP_SYNC);
+	frame.reset();
+}
+
+Macro Macro::compile(const string & text) {
+	Macro macro;
+	std::vector<string> tokens = tokenize(text);
+
+	std::bitset<KEY_CNT> down;
+	std::vector<__u16> downOrder;
+	std::bitset<KEY_CNT> frame; // keys with an event since the last sync
+
+	for (size_t t = 0; t < tokens.size(); t++) {
+		const string & token = tokens[t];
+
+		if (token == "...") {
+			macro.endFrame(frame);
+			macro.add(OP_HOLD);
+		}
+		else if (token[0] == '"') {
+			for (size_t i = 1; i + 1 < token.size(); i++) {
+				bool shift;
+				__u16 key = charKey(token[i], shift);
+				if (key == KEY_RESERVED)
+					throw std::runtime_error("can't type '" + string(1, token[i]) + "'");
+				if (down[key] || (shift && down[KEY_LEFTSHIFT]))
+					throw std::runtime_error("text types a key already pressed");
+
+				if (shift)
+					macro.event(OP_PRESS, KEY_LEFTSHIFT, frame);
+				macro.event(OP_PRESS, key, frame);
+				macro.endFrame(frame);
+				macro.event(OP_RELEASE, key, frame);
+				if (shift)
+					macro.event(OP_RELEASE, KEY_LEFTSHIFT, frame);
+				macro.endFrame(frame);
+			}
+		}
+		else if (token.size() > 2 && token.compare(token.size() - 2, 2, "ms") == 0 && isdigit((unsigned char) token[0])) {
+			char *end;
+			unsigned long ms = strtoul(token.c_str(), &end, 10);
+			if (end != token.c_str() + token.size() - 2)
+				throw std::runtime_error("bad delay " + token);
+
+			macro.endFrame(frame);
+			for (; ms > 0xFFFF; ms -= 0xFFFF)
+				macro.add(OP_DELAY, 0xFFFF);
+			if (ms)
+				macro.add(OP_DELAY, ms);
+		}
+		else if ((token[0] == '+' || token[0] == '-') && token.size() > 1) {
+			__u16 key = keyCode(token.substr(1));
+			if (key == KEY_RESERVED)
+				throw std::runtime_error("unknown key " + token.substr(1));
+
+			if (token[0] == '+') {
+				if (down[key])
+					throw std::runtime_error(token.substr(1) + " is already pressed");
+				down.set(key);
+				downOrder.push_back(key);
+				macro.event(OP_PRESS, key, frame);
+			} else {
+				if (!down[key])
+					throw std::runtime_error(token.substr(1) + " is not pressed");
+				down.reset(key);
+				downOrder.erase(std::find(downOrder.begin(), downOrder.end(), key));
+				macro.event(OP_RELEASE, key, frame);
+			}
+		}
+		else {
+			// A chord, such as ctrl+shift+m
+			std::vector<__u16> chord;
+			size_t start = 0;
+			while (start <= token.size()) {
+				size_t plus = token.find('+', start);
+				if (plus == string::npos)
+					plus = token.size();
+
+				string name = token.substr(start, plus - start);
+				__u16 key = keyCode(name);
+				if (key == KEY_RESERVED)
+					throw std::runtime_error("unknown key " + (name.empty() ? token : name));
+				if (down[key])
+					throw std::runtime_error(name + " is already pressed");
+				if (std::find(chord.begin(), chord.end(), key) != chord.end())
+					throw std::runtime_error(name + " is in " + token + " twice");
+				chord.push_back(key);
+				start = plus + 1;
+			}
+
+			for (size_t i = 0; i < chord.size(); i++)
+				macro.event(OP_PRESS, chord[i], frame);
+			macro.endFrame(frame);
+
+			// Held for as long as the CEC key is
+			if (t + 1 < tokens.size() && tokens[t + 1] == "...") {
+				macro.add(OP_HOLD);
+				t++;
+			}
+
+			for (size_t i = chord.size(); i-- > 0; )
+				macro.event(OP_RELEASE, chord[i], frame);
+			macro.endFrame(frame);
+		}
+	}
+
+	// Never leave anything pressed
+	for (size_t i = downOrder.size(); i-- > 0; )
+		macro.event(OP_RELEASE, downOrder[i], frame);
+	macro.endFrame(frame);
+
+	if (macro.empty())
+		throw std::runtime_error("empty macro");
+
+	return macro;
+}
+
+Macro Macro::chord(const KeyList & keys) {
+	Macro macro;
+	if (keys.empty())
+		return macro;
+
+	for (KeyList::const_iterator k = keys.begin(); k != keys.end(); ++k)
+		macro.add(OP_PRESS, *k);
+	macro.add(OP_SYNC);
+	macro.add(OP_HOLD);
+	for (KeyList::const_iterator k = keys.end(); k-- != keys.begin(); )
+		macro.add(OP_RELEASE, *k);
+	macro.add(OP_SYNC);
+
+	return macro;
+}
+
+void Macro::addKeys(std::vector<KeyList> & keys) const {
+	KeyList list;
+	for (size_t i = 0; i < steps.size(); i++) {
+		if (steps[i].op != OP_PRESS)
+			continue;
+		if (list.size() == KeyList::MAX_KEYS) {
+			keys.push_back(list);
+			list.clear();
+		}
+		list.push_back(steps[i].arg);
+	}
+	if (!list.empty())
+		keys.push_back(list);
+}
+
+MacroRunner::MacroRunner() : count(0), dropped(0) {
+	memset(refs, 0, sizeof(refs));
+}
+
+/**
+ * Runs steps until the macro has to wait, or ends
+ */
+void MacroRunner::advance(Instance & instance, InputSink & output, Clock::time_point now) {
+	const Macro & macro = *instance.macro;
+
+	while (instance.pc < macro.size()) {
+		const Macro::Step & step = macro[instance.pc];
+
+		switch (step.op) {
+			case Macro::OP_PRESS:
+				if (!instance.pressed[step.arg]) {
+					instance.pressed.set(step.arg);
+					if (refs[step.arg]++ == 0)
+						output.send_event(EV_KEY, step.arg, EV_KEY_PRESSED);
+				}
+				break;
+			case Macro::OP_RELEASE:
+				if (instance.pressed[step.arg]) {
+					instance.pressed.reset(step.arg);
+					if (--refs[step.arg] == 0)
+						output.send_event(EV_KEY, step.arg, EV_KEY_RELEASED);
+				}
+				break;
+			case Macro::OP_SYNC:
+				output.sync();
+				break;
+			case Macro::OP_DELAY:
+				instance.pc++;
+				instance.wake = now + std::chrono::milliseconds(step.arg);
+				return;
+			case Macro::OP_HOLD:
+				if (instance.held)
+					return;
+				break;
+		}
+		instance.pc++;
+	}
+}
+
+/**
+ * Releases whatever the macro still has pressed, carrying on if sending fails
+ */
+void MacroRunner::releaseKeys(Instance & instance, InputSink & output) {
+	if (instance.pressed.none())
+		return;
+
+	for (size_t key = 0; key < KEY_CNT; key++) {
+		if (!instance.pressed[key])
+			continue;
+		instance.pressed.reset(key);
+		if (--refs[key] == 0) {
+			try {
+				output.send_event(EV_KEY, key, EV_KEY_RELEASED);
+			} catch (std::exception & e) {
+				LOG4CPLUS_ERROR(logger, "Failed to release key " << key << ": " << e.what());
+			}
+		}
+	}
+
+	try {
+		output.sync();
+	} catch (std::exception & e) {
+		LOG4CPLUS_ERROR(logger, "Failed to sync output: " << e.what());
+	}
+}
+
+/**
+ * Forgets macros that have ended and whose CEC key is no longer held
+ */
+void MacroRunner::prune(InputSink & output) {
+	size_t kept = 0;
+
+	for (size_t i = 0; i < count; i++) {
+		Instance & instance = running[i];
+		if (instance.pc == instance.macro->size() && !instance.held) {
+			releaseKeys(instance, output);
+			continue;
+		}
+		if (kept != i)
+			running[kept] = instance;
+		kept++;
+	}
+
+	count = kept;
+}
+
+bool MacroRunner::start(const Macro & macro, int key, Clock::time_point releaseBy, InputSink & output, Clock::time_point now) {
+	// Anything already due goes first, so macros keep their order
+	run(output, now);
+
+	if (count == MAX_RUNNING) {
+		dropped++;
+		return false;
+	}
+
+	Instance & instance = running[count++];
+	instance.macro = &macro;
+	instance.pc = 0;
+	instance.key = key;
+	instance.held = now < releaseBy;
+	instance.wake = Clock::time_point::min();
+	instance.releaseBy = releaseBy;
+	instance.pressed.reset();
+
+	advance(instance, output, now);
+	prune(output);
+	return true;
+}
+
+bool MacroRunner::repeat(int key, Clock::time_point releaseBy) {
+	bool found = false;
+
+	for (size_t i = 0; i < count; i++) {
+		if (running[i].held && running[i].key == key) {
+			running[i].releaseBy = releaseBy;
+			found = true;
+		}
+	}
+
+	return found;
+}
+
+bool MacroRunner::release(int key, InputSink & output, Clock::time_point now) {
+	bool found = false;
+
+	for (size_t i = 0; i < count; i++) {
+		Instance & instance = running[i];
+		if (!instance.held || (key != ANY_KEY && instance.key != key))
+			continue;
+
+		instance.held = false;
+		found = true;
+
+		// Carry on straight away if it was waiting for this, rather than in a delay
+		if (instance.wake == Clock::time_point::min())
+			advance(instance, output, now);
+	}
+
+	prune(output);
+	return found;
+}
+
+void MacroRunner::run(InputSink & output, Clock::time_point now) {
+	for (size_t i = 0; i < count; i++) {
+		Instance & instance = running[i];
+
+		if (instance.held && now >= instance.releaseBy)
+			instance.held = false;
+
+		if (instance.wake <= now) {
+			instance.wake = Clock::time_point::min();
+			advance(instance, output, now);
+		}
+	}
+
+	prune(output);
+}
+
+MacroRunner::Clock::time_point MacroRunner::deadline() const {
+	Clock::time_point next = Clock::time_point::max();
+
+	for (size_t i = 0; i < count; i++) {
+		const Instance & instance = running[i];
+
+		if (instance.wake != Clock::time_point::min() && instance.wake < next)
+			next = instance.wake;
+		if (instance.held && instance.releaseBy < next)
+			next = instance.releaseBy;
+	}
+
+	return next;
+}
+
+void MacroRunner::abort(InputSink & output) {
+	for (size_t i = 0; i < count; i++)
+		releaseKeys(running[i], output);
+	count = 0;
+}
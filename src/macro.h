@@ -0,0 +1,169 @@
+#ifndef LIBCEC_DAEMON_MACRO_H
+#define LIBCEC_DAEMON_MACRO_H
+
+#include "uinput.h"
+
+#include <bitset>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * A sequence of uinput key events played for one CEC key (--macros).
+ *
+ * Macros are written as space separated steps:
+ *   ctrl+shift+m     press the keys in order, then release them in reverse
+ *   ctrl+shift+m ... the same, but hold the keys down for as long as the
+ *                    CEC key is held
+ *   +ctrl -ctrl      press or release a single key
+ *   30ms             wait
+ *   ...              wait for the CEC key to be released
+ *   "some text"      type the text, using shift where needed (US layout)
+ *
+ * and compiled into compact steps, so nothing needs to be parsed or allocated
+ * while one is playing. Key names are the kernel's KEY_ names without the
+ * prefix, in lower case (a, f1, leftctrl, volumeup), a few aliases such as
+ * ctrl, shift, alt and meta, or key codes as numbers. Every key still pressed
+ * at the end is released.
+ */
+class Macro {
+public:
+	enum Op {
+		OP_PRESS,   // arg is the key
+		OP_RELEASE, // arg is the key
+		OP_SYNC,    // end of a frame
+		OP_DELAY,   // arg is milliseconds
+		OP_HOLD     // wait until the CEC key is released
+	};
+
+	struct Step {
+		uint8_t op;
+		uint16_t arg;
+	};
+
+private:
+	std::vector<Step> steps;
+
+	void add(Op op, uint16_t arg = 0);
+	void event(Op op, __u16 key, std::bitset<KEY_CNT> & frame);
+	void endFrame(std::bitset<KEY_CNT> & frame);
+
+public:
+	/**
+	 * Throws std::runtime_error describing the first mistake in text
+	 */
+	static Macro compile(const std::string & text);
+
+	/**
+	 * Presses keys until the CEC key is released, as a plain mapped key would
+	 */
+	static Macro chord(const KeyList & keys);
+
+	bool empty() const { return steps.empty(); }
+	size_t size() const { return steps.size(); }
+	const Step & operator[](size_t i) const { return steps[i]; }
+
+	/**
+	 * Appends every key the macro presses, so the output can be set up for them
+	 */
+	void addKeys(std::vector<KeyList> & keys) const;
+
+	/**
+	 * Looks up a key name, returns KEY_RESERVED if unknown
+	 */
+	static __u16 keyCode(const std::string & name);
+};
+
+/**
+ * Plays macros without ever sleeping. Each step that can run now is run
+ * straight away, and the owner calls run() again once deadline() has passed.
+ *
+ * Macros play in the order they were started: one runs until its next delay
+ * or hold before the next gets a turn, so frames from different macros never
+ * mix. A key pressed by several macros at once is only released once the
+ * last of them lets go of it.
+ *
+ * The CEC key that started a macro counts as held until release() or, if the
+ * TV's repeats stop coming, its release deadline. Repeats of a held key don't
+ * start the macro again.
+ *
+ * Not thread safe, and nothing here touches the heap.
+ */
+class MacroRunner {
+public:
+	typedef std::chrono::steady_clock Clock;
+
+	static const size_t MAX_RUNNING = 8;
+	static const int ANY_KEY = -1;
+
+private:
+	struct Instance {
+		const Macro *macro;
+		size_t pc;                  // next step
+		int key;                    // CEC key that started it
+		bool held;                  // the CEC key is still down
+		Clock::time_point wake;     // end of the current delay
+		Clock::time_point releaseBy;
+		std::bitset<KEY_CNT> pressed;
+	};
+
+	Instance running[MAX_RUNNING];
+	size_t count;
+	uint8_t refs[KEY_CNT];         // how many macros have each key pressed
+	uint64_t dropped;
+
+	void advance(Instance & instance, InputSink & output, Clock::time_point now);
+	void releaseKeys(Instance & instance, InputSink & output);
+	void prune(InputSink & output);
+
+	// Not implemented
+	MacroRunner(MacroRunner const&);
+	void operator=(MacroRunner const&);
+
+public:
+	MacroRunner();
+
+	/**
+	 * Starts macro for the CEC key, held until releaseBy at the latest. False
+	 * if too many macros are already playing.
+	 */
+	bool start(const Macro & macro, int key, Clock::time_point releaseBy, InputSink & output, Clock::time_point now);
+
+	/**
+	 * Pushes back the release deadline of a held key. False if no macro is
+	 * playing for it, so this is a new press.
+	 */
+	bool repeat(int key, Clock::time_point releaseBy);
+
+	/**
+	 * Releases the CEC key (or all of them, for ANY_KEY), so macros waiting
+	 * for that carry on. False if it wasn't held.
+	 */
+	bool release(int key, InputSink & output, Clock::time_point now);
+
+	/**
+	 * Runs every step that is due
+	 */
+	void run(InputSink & output, Clock::time_point now);
+
+	/**
+	 * When run() next needs calling, or Clock::time_point::max()
+	 */
+	Clock::time_point deadline() const;
+
+	/**
+	 * Stops every macro, releasing the keys they hold
+	 */
+	void abort(InputSink & output);
+
+	bool busy() const { return count > 0; }
+
+	/**
+	 * Macros not started because too many were playing
+	 */
+	uint64_t droppedCount() const { return dropped; }
+};
+
+#endif
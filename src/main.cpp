@@ -9,78 +9,1256 @@
 #include "main.h"
 #include "config.h"
 #include "hdmi.h"
+#include "startup.h"
+#include "callstats.h"
+#include "trace.h"
+
+#ifdef HAVE_LINUX_CEC_H
+#include "kernelcec.h"
+#endif
 
 #define CEC_NAME    "linux PC"
 #define UINPUT_NAME "libcec-daemon"
 
 #include <algorithm>
+#include <cassert>
+#include <cerrno>
 #include <cstdio>
 #include <iostream>
 #include <cstdint>
 #include <cstddef>
 #include <csignal>
 #include <cstdlib>
-#include <vector>
+#include <cstring>
+#include <ctime>
+#include <chrono>
+#include <condition_variable>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <strings.h>
+#include <fcntl.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
-#include <boost/program_options.hpp>
-#include <boost/thread/mutex.hpp>
-#include <boost/thread/condition_variable.hpp>
-#include <boost/thread/thread.hpp>
-#include "accumulator.hpp"
+#include "log.h"
+
+using namespace CEC;
+using namespace log4cplus;
+
+using std::cout;
+using std::cerr;
+using std::endl;
+using std::min;
+using std::string;
+
+typedef std::chrono::steady_clock Clock;
+
+static Logger logger = Logger::getInstance("main");
+static std::mutex libcec_sync;
+static std::condition_variable libcec_cond;
+static std::condition_variable lifecycle_cond;
+
+// Set by SIGUSR1, asking the loop to log the command lane statistics, guarded by libcec_sync
+static bool laneStatsRequested = false;
+
+// signalHandler() writes the signals it gets here, for signalLoop() to act on
+static int signalPipe[2] = { -1, -1 };
+static std::mutex keys_sync;
+static std::mutex state_sync;
+static std::mutex output_sync;
+
+const Main::UInputKeyMap Main::uinputCecMap = Main::setupUinputMap();
+
+enum
+{
+	COMMAND_NONE = -1,
+	COMMAND_STANDBY,
+	COMMAND_ACTIVE,
+	COMMAND_INACTIVE,
+	COMMAND_RESTART,
+	COMMAND_KEYPRESS,
+	COMMAND_KEYRELEASE,
+	COMMAND_EXIT,
+	COMMAND_UPGRADE,
+	COMMAND_SET_ACTIVE_SOURCE,
+};
+
+enum
+{
+	HANDOFF_DONE,    // the new daemon took over
+	HANDOFF_FAILED,  // nothing was given up, carry on
+	HANDOFF_ABORTED, // the adapter was given up, but the new daemon failed
+};
+
+// How long either side waits for the other during a handoff
+static const int HANDOFF_TIMEOUT_MS = 30000;
+
+// How long keys pressed by the daemon itself (such as POWER on standby) are held
+static const std::chrono::milliseconds SIMULATED_PRESS(100);
+
+// Time unaccounted for by CLOCK_MONOTONIC past which the host counts as having been suspended
+static const int64_t RESUME_THRESHOLD_US = 250000;
+
+/**
+ * How long the host has spent suspended since boot, in microseconds. Only
+ * CLOCK_BOOTTIME keeps counting while suspended, so this jumps on resume.
+ */
+static int64_t suspendedMicros() {
+	struct timespec boot, mono;
+	if (clock_gettime(CLOCK_BOOTTIME, &boot) < 0 || clock_gettime(CLOCK_MONOTONIC, &mono) < 0)
+		return 0;
+	return (int64_t) (boot.tv_sec - mono.tv_sec) * 1000000 + (boot.tv_nsec - mono.tv_nsec) / 1000;
+}
+
+Main & Main::instance() {
+	// Singleton pattern so we can use main from a sighandle
+	static Main main;
+	return main;
+}
+
+Main::Main() : busStatsEnabled(true), logMask(0), cec(new Cec(getCecName(), this)),
+	makeActive(true), running(false),
+	keyTimeout(550),
+	pendingPowerCommand(COMMAND_NONE), appliedPowerCommand(COMMAND_NONE), powerDebounce(250),
+	traceFile("/tmp/libcec-daemon-trace.json"), outputs("uinput"), logicalAddress(CECDEVICE_UNKNOWN),
+	explicitAddress(false), usingSavedState(false), savedStateStale(false),
+	adapterReady(false), serviceReady(false),
+	resumeCheck(1000), resumeActivate(false), embedded(false),
+	openTimeout(30000), adapterTimeout(5000), stopping(false)
+{
+	LOG4CPLUS_TRACE_STR(logger, "Main::Main()");
+
+	updateLogMask();
+	cecLog.setRateLimit(50);
+
+	for (size_t i = 0; i < uinputCecMap.size(); i++)
+		tapMacros[i] = Macro::chord(uinputCecMap[i]);
+
+	/* whatever libcec calls the adapter call given up on was making have timed out */
+	adapterCalls.setGiveUpHook([this] {
+		CallStats *calls = cec ? cec->callStats() : NULL;
+		if (calls)
+			calls->timeout();
+	});
+}
+
+Main::~Main() {
+	LOG4CPLUS_TRACE_STR(logger, "Main::~Main()");
+	stop();
+
+	/* loop() threw while signals were being watched */
+	if (signalThread.joinable())
+		unwatchSignals();
+
+	releaseHeldKeys("shutdown");
+	releaseWedgedDevice();
+}
+
+void Main::loop(const string & device) {
+	LOG4CPLUS_TRACE_STR(logger, "Main::loop()");
+
+	bool restart = false;
+
+	{
+		std::lock_guard<std::mutex> lock(libcec_sync);
+		stopping = false;
+	}
+	adapterCalls.reset();
+
+	cecLog.start();
+	realtime.start();
+	realtime.enterDelivery();
+
+	if (!eventSocket.empty()) {
+		events.setStats([this] { return stats(); });
+		events.setTrace([this] (bool on) { return trace(on); });
+		events.open(eventSocket);
+	}
+
+	bool takingOver = handoff.isOpen();
+	if (takingOver) {
+		receiveHandoff();
+	} else if (!stateFile.empty()) {
+		loadState(device);
+	}
+
+	do
+	{
+		/*
+		** output creation (normally uinput) and libcec loading are independent, so run them
+		** concurrently, and only the adapter steps in order
+		*/
+		Startup startup;
+		string comm;
+
+		bool creatingOutput = !output;
+		if (creatingOutput) {
+			startup.add("output",   [this] { createOutput(); });
+		}
+		startup.add("libcec",   [this] { adapterCalls.run("loading libcec", [this] { cec->init(); }, openTimeout); });
+		if (takingOver) {
+			startup.add("adapters", [this, &comm, &device] { comm = takeOver(device); }, {"libcec"});
+		} else {
+			startup.add("adapters", [this, &comm, &device] { comm = findAdapter(device); }, {"libcec"});
+		}
+		/* keys arrive as soon as the adapter is open, and must find the output there */
+		if (creatingOutput) {
+			startup.add("open",     [this, &comm, &device] { openAdapter(comm, device); }, {"adapters", "output"});
+		} else {
+			startup.add("open",     [this, &comm, &device] { openAdapter(comm, device); }, {"adapters"});
+		}
+
+		notify.status(takingOver ? "Taking over from the previous daemon" : restart ? "Reopening adapter" : "Opening adapter");
+		try {
+			startup.run();
+		} catch (std::exception & e) {
+			if (takingOver)
+				endTakeover(false);
+
+			std::unique_lock<std::mutex> lock(libcec_sync);
+			bool stopped = stopping;
+			lock.unlock();
+
+			/* stop() gave up on opening the adapter, which is no failure */
+			if (stopped) {
+				LOG4CPLUS_INFO(logger, "Stopped while opening the adapter");
+				break;
+			}
+
+			notify.status(string("Failed: ") + e.what());
+			throw;
+		}
+
+		if (takingOver) {
+			try {
+				handoff.send("done");
+			} catch (std::exception & e) {
+				endTakeover(false);
+				throw;
+			}
+			handoff.close();
+			endTakeover(true);
+		}
+
+		/* a stop() since startup finished found nothing running to queue its exit on */
+		std::unique_lock<std::mutex> running_lock(libcec_sync);
+		bool stopped = stopping;
+		running = !stopped;
+		restart = false;
+		running_lock.unlock();
+
+		if (stopped) {
+			LOG4CPLUS_INFO(logger, "Stopped while opening the adapter");
+			releaseHeldKeys("exit");
+
+			/* stop() gave up on the adapter's calls, but closing it is still worth a try */
+			adapterCalls.reset();
+			try {
+				adapterCalls.run("closing the adapter", [this] { cec->close(); }, adapterTimeout);
+			} catch (std::exception & e) {
+				LOG4CPLUS_ERROR(logger, e.what());
+			}
+			break;
+		}
+
+		/* install signals, unless they belong to the program embedding us */
+		if (!embedded) {
+			watchSignals();
+		}
+
+		/* the TV's input is already on us after an upgrade, so leave it be */
+		if (makeActive && !takingOver) {
+			try {
+				adapterCalls.run("making this the active source", [this] { cec->makeActive(); }, adapterTimeout);
+			} catch (std::exception & e) {
+				LOG4CPLUS_ERROR(logger, e.what());
+			}
+		}
+
+		LOG4CPLUS_INFO(logger, "Ready");
+		events.publish(Event(EVENT_READY));
+		takingOver = false;
+
+		/* opening the adapter is as good a liveness check as a ping */
+		{
+			std::lock_guard<std::mutex> lock(state_sync);
+			adapterReady = true;
+		}
+		notifyReady();
+		notify.watchdog();
+		bool adapterClosed = false;
+
+		std::thread lifecycle(&Main::lifecycleLoop, this);
+
+		Clock::time_point nextPing = Clock::now() + pingInterval();
+		int64_t suspended = suspendedMicros();
+		std::unique_lock<std::mutex> libcec_lock(libcec_sync);
+
+		while( running )
+		{
+			Clock::time_point now = Clock::now();
+
+			/* a jump means the host slept, so look at the adapter before anything else */
+			int64_t slept = resumeCheck.count() ? suspendedMicros() - suspended : 0;
+
+			if( laneStatsRequested )
+			{
+				laneStatsRequested = false;
+				logLaneStats();
+			}
+			else if( slept >= RESUME_THRESHOLD_US )
+			{
+				suspended += slept;
+
+				libcec_lock.unlock();
+				bool recovered = resume(std::chrono::microseconds(slept));
+				libcec_lock.lock();
+
+				if( recovered )
+				{
+					dropStaleRestarts();
+				}
+				else
+				{
+					events.publish(Event(EVENT_RESTART));
+					restart = true;
+					running = false;
+				}
+				nextPing = Clock::now() + pingInterval();
+			}
+			else if( !lanes[LANE_CONTROL].queue.empty() )
+			{
+				Command cmd = pop(LANE_CONTROL);
+
+				if( cmd.command == COMMAND_UPGRADE )
+				{
+					libcec_lock.unlock();
+					notify.status("Upgrading");
+					int result = handOff();
+					if( result == HANDOFF_FAILED )
+						notify.status("Upgrade failed, carrying on");
+					libcec_lock.lock();
+
+					if( result != HANDOFF_FAILED )
+					{
+						adapterClosed = true;
+						restart = (result == HANDOFF_ABORTED);
+						running = false;
+					}
+					continue;
+				}
+
+				if( cmd.command == COMMAND_RESTART )
+					events.publish(Event(EVENT_RESTART));
+				restart = (cmd.command == COMMAND_RESTART);
+				running = false;
+			}
+			else if( now >= macrosDeadline() )
+			{
+				libcec_lock.unlock();
+				runMacros();
+				libcec_lock.lock();
+			}
+			else if( !lanes[LANE_INPUT].queue.empty() )
+			{
+				Command cmd = pop(LANE_INPUT);
+
+				/* run commands without the lock held, so callbacks are never held up by them */
+				libcec_lock.unlock();
+				execute(cmd);
+				libcec_lock.lock();
+			}
+			else if( now >= heldKeysDeadline() )
+			{
+				libcec_lock.unlock();
+				releaseStaleKeys();
+				libcec_lock.lock();
+			}
+			else if( now >= nextPing )
+			{
+				libcec_lock.unlock();
+				bool alive = pingAdapter();
+
+				/* keepalives stop as soon as the adapter does, so a wedged daemon gets restarted */
+				if( alive )
+					notify.watchdog();
+				else
+					notify.status("Adapter not responding");
+				libcec_lock.lock();
+
+				running = running && alive;
+				nextPing = Clock::now() + pingInterval();
+			}
+			else
+			{
+				Clock::time_point wake = std::min(nextPing, std::min(heldKeysDeadline(), macrosDeadline()));
+
+				/* the clock the wait uses stops while suspended, so wake up regularly to notice a resume */
+				if( resumeCheck.count() )
+					wake = std::min(wake, now + resumeCheck);
+
+				libcec_cond.wait_until(libcec_lock, wake);
+			}
+		}
+
+		libcec_lock.unlock();
+
+		/* readiness is only reported again once the adapter is back */
+		{
+			std::lock_guard<std::mutex> lock(state_sync);
+			adapterReady = serviceReady = false;
+			busState.logicalAddress = CECDEVICE_UNKNOWN;
+		}
+
+		/* after an upgrade, the new daemon is the one being supervised */
+		if( !restart && !adapterClosed )
+			notify.send("STOPPING=1\nSTATUS=Stopping");
+
+		/* let any running hook finish */
+		lifecycle_cond.notify_all();
+		lifecycle.join();
+
+		/* nothing must be left held down while the adapter is gone */
+		releaseHeldKeys(restart ? "restart" : "exit");
+
+		/* reset signals */
+		if (!embedded) {
+			unwatchSignals();
+		}
+
+		if (!adapterClosed) {
+			/* stop() gave up on the adapter's calls, but closing it is still worth a try */
+			if (!restart)
+				adapterCalls.reset();
+
+			try {
+				adapterCalls.run("closing the adapter", [this, restart] { cec->close(!restart); }, adapterTimeout);
+			} catch (std::exception & e) {
+				LOG4CPLUS_ERROR(logger, e.what());
+
+				/* the call given up on still has the adapter, so it can't be opened again */
+				if (restart && adapterCalls.wedged())
+					throw std::runtime_error("Adapter stopped responding, giving up on it");
+			}
+		}
+
+		if( restart && savedStateStale )
+		{
+			forgetSavedState();
+		}
+	}
+	while( restart );
+
+	if (Trace::enabled())
+		Trace::save(traceFile);
+	Trace::wait();
+}
+
+/**
+ * Tells the service manager the daemon is ready, once the adapter is open and
+ * has been given a logical address, whichever happens last
+ */
+void Main::notifyReady() {
+	std::lock_guard<std::mutex> lock(state_sync);
+	if (!adapterReady || serviceReady)
+		return;
+
+	if (busState.logicalAddress == CECDEVICE_UNKNOWN) {
+		notify.status("Waiting for a logical address");
+		return;
+	}
+
+	std::ostringstream state;
+	state << "READY=1\nSTATUS=Ready, logical address " << (int) busState.logicalAddress << " on " << busState.comm;
+	notify.send(state.str());
+	serviceReady = true;
+}
+
+/**
+ * Brings the adapter back after the host resumed from suspend, doing as little
+ * as will work: nothing if it still answers a ping, otherwise reopening it
+ * without detecting it again. Returns false if only a full restart will do.
+ */
+bool Main::resume(std::chrono::microseconds slept) {
+	LOG4CPLUS_TRACE_STR(logger, "Main::resume()");
+
+	int sleptMs = std::chrono::duration_cast<std::chrono::milliseconds>(slept).count();
+	LOG4CPLUS_INFO(logger, "Host resumed after " << sleptMs << "ms suspended, checking the adapter");
+	notify.status("Resuming");
+
+	/* any release happened long ago, while nobody was listening */
+	releaseHeldKeys("resume");
+
+	Clock::time_point start = Clock::now();
+	int recovery = EVENT_RESUME_ALIVE;
+
+	if( !pingAdapter() )
+	{
+		string comm;
+		{
+			std::lock_guard<std::mutex> lock(state_sync);
+			comm = adapterComm;
+		}
+
+		LOG4CPLUS_INFO(logger, "Adapter not responding after resume, reopening " << comm);
+		recovery = EVENT_RESUME_REOPENED;
+
+		try {
+			adapterCalls.run("closing the adapter", [this] { cec->close(false); }, adapterTimeout);
+			adapterCalls.run("reopening the adapter", [this, comm] { cec->openAdapter(comm); }, openTimeout);
+		} catch (std::exception & e) {
+			LOG4CPLUS_WARN(logger, "Failed to reopen the adapter: " << e.what() << ", restarting");
+			events.publish(Event(EVENT_RESUME, EVENT_RESUME_RESTART, sleptMs));
+			return false;
+		}
+	}
+
+	bool wasActive;
+	{
+		std::lock_guard<std::mutex> lock(libcec_sync);
+		wasActive = (appliedPowerCommand == COMMAND_ACTIVE);
+	}
+
+	/* the TV may have switched input while we were away */
+	if( resumeActivate && wasActive )
+	{
+		LOG4CPLUS_INFO(logger, "Making this the active source again");
+		try {
+			adapterCalls.run("making this the active source", [this] { cec->makeActive(); }, adapterTimeout);
+		} catch (std::exception & e) {
+			LOG4CPLUS_ERROR(logger, e.what());
+		}
+	}
+
+	notify.watchdog();
+	notify.status(recovery == EVENT_RESUME_ALIVE ? "Resumed, adapter still responding" : "Resumed, adapter reopened");
+	events.publish(Event(EVENT_RESUME, recovery, sleptMs));
+
+	LOG4CPLUS_INFO(logger, "Recovered from suspend in "
+		<< std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start).count() << "ms"
+		<< (recovery == EVENT_RESUME_ALIVE ? "" : ", after reopening the adapter"));
+	return true;
+}
+
+/**
+ * Forgets restarts asked for (by a lost connection alert) before resume()
+ * recovered the adapter, as they were about the connection it replaced.
+ * libcec_sync must be held.
+ */
+void Main::dropStaleRestarts() {
+	CommandLane & l = lanes[LANE_CONTROL];
+
+	for (size_t n = l.queue.size(); n > 0; n--) {
+		QueuedCommand queued = l.queue.front();
+		l.queue.pop();
+
+		if( queued.command.command == COMMAND_RESTART )
+			LOG4CPLUS_DEBUG(logger, "Dropping restart asked for before the adapter recovered");
+		else
+			l.queue.push(queued);
+	}
+}
+
+/**
+ * Whether the adapter answers a ping, counting one it never answers as failed
+ */
+bool Main::pingAdapter() {
+	try {
+		return adapterCalls.call<bool>("pinging the adapter", [this] { return cec->ping(); }, adapterTimeout);
+	} catch (std::exception & e) {
+		LOG4CPLUS_WARN(logger, e.what());
+		return false;
+	}
+}
+
+/**
+ * How long to wait between pings, short enough to keep the watchdog fed
+ */
+std::chrono::steady_clock::duration Main::pingInterval() const {
+	std::chrono::steady_clock::duration interval = std::chrono::seconds(43);
+	std::chrono::steady_clock::duration watchdog = notify.getWatchdogInterval() / 2;
+
+	if (watchdog.count() > 0 && watchdog < interval)
+		interval = watchdog;
+	return interval;
+}
+
+/**
+ * Reuses the bus configuration saved by a previous run, unless it is for
+ * another adapter than the one asked for
+ */
+void Main::loadState(const string & device) {
+	LOG4CPLUS_TRACE_STR(logger, "Main::loadState()");
+
+	BusState state;
+	if (!state.load(stateFile))
+		return;
 
-#include <log4cplus/logger.h>
-#include <log4cplus/loggingmacros.h>
-#include <log4cplus/configurator.h>
+	if (!device.empty() && device != state.comm) {
+		LOG4CPLUS_INFO(logger, "Saved state is for " << state.comm << ", not " << device << ", ignoring it");
+		return;
+	}
+
+	LOG4CPLUS_INFO(logger, "Using saved bus configuration " << state);
+
+	std::lock_guard<std::mutex> lock(state_sync);
+	savedState = state;
+	usingSavedState = true;
+
+	if (!explicitAddress) {
+		cec->setTargetAddress(state.address);
+	}
+}
+
+/**
+ * Stops using the saved bus configuration, so the next open does full
+ * detection. libcec must be closed.
+ */
+void Main::forgetSavedState() {
+	LOG4CPLUS_TRACE_STR(logger, "Main::forgetSavedState()");
+
+	std::unique_lock<std::mutex> lock(state_sync);
+	bool wasUsed = usingSavedState;
+	usingSavedState = false;
+	savedStateStale = false;
+	lock.unlock();
+
+	if (wasUsed && !explicitAddress) {
+		LOG4CPLUS_WARN(logger, "Saved bus configuration is no longer valid, detecting it again");
+		cec->clearTargetAddress();
+	}
+}
+
+string Main::findAdapter(const string & device) {
+	return adapterCalls.call<string>("finding the adapter", [this, device] () -> string {
+		{
+			std::lock_guard<std::mutex> lock(state_sync);
+			if (usingSavedState && savedState.adapterPresent())
+				return savedState.comm;
+		}
+
+		if (usingSavedState) {
+			forgetSavedState();
+			cec->init();
+		}
+		return cec->findAdapter(device);
+	}, openTimeout);
+}
+
+void Main::openAdapter(const string & comm, const string & device) {
+	{
+		std::lock_guard<std::mutex> lock(state_sync);
+		adapterComm = comm;
+	}
+
+	adapterCalls.run("opening the adapter", [this, comm, device] {
+		if (!usingSavedState) {
+			cec->openAdapter(comm);
+			return;
+		}
+
+		try {
+			cec->openAdapter(comm);
+		} catch (std::exception & e) {
+			// Maybe the adapter moved, fall back to finding it the slow way
+			LOG4CPLUS_WARN(logger, "Failed to open saved adapter " << comm << ": " << e.what());
+			forgetSavedState();
+			cec->init();
+
+			string found = cec->findAdapter(device);
+			{
+				std::lock_guard<std::mutex> lock(state_sync);
+				adapterComm = found;
+			}
+			cec->openAdapter(found);
+		}
+	}, openTimeout);
+}
+
+/**
+ * Runs a queued command, on the loop thread
+ */
+void Main::execute(const Command & cmd) {
+	Trace::Span span("Main::execute");
+
+	switch( cmd.command )
+	{
+		case COMMAND_STANDBY:
+			events.publish(Event(EVENT_POWER, EVENT_POWER_STANDBY));
+			if( ! onStandbyCommand.empty() )
+			{
+				LOG4CPLUS_DEBUG(logger, "Standby: Running \"" << onStandbyCommand << "\"");
+				Trace::Span hook("onstandby");
+				int ret = system(onStandbyCommand.c_str());
+				if( ret )
+					LOG4CPLUS_ERROR(logger, "Standby command failed: " << ret);
+			}
+			else
+			{
+				onCecKeyPress( CEC_USER_CONTROL_CODE_POWER );
+			}
+			break;
+		case COMMAND_KEYPRESS:
+			onCecKeyPress( cmd.keycode );
+			break;
+		case COMMAND_SET_ACTIVE_SOURCE:
+			try {
+				adapterCalls.run("making this the active source", [this] { cec->makeActive(); }, adapterTimeout);
+			} catch (std::exception & e) {
+				LOG4CPLUS_ERROR(logger, e.what());
+			}
+			break;
+	}
+}
+
+/**
+ * Which lane a command is queued in
+ */
+Main::Lane Main::laneFor(const Command & cmd) {
+	switch( cmd.command )
+	{
+		case COMMAND_RESTART:
+		case COMMAND_EXIT:
+		case COMMAND_UPGRADE:
+			return LANE_CONTROL;
+		case COMMAND_KEYPRESS:
+		case COMMAND_KEYRELEASE:
+			return LANE_INPUT;
+		default:
+			return LANE_LIFECYCLE;
+	}
+}
+
+void Main::push(Command cmd) {
+	Trace::Span span("Main::push");
+	std::lock_guard<std::mutex> lock(libcec_sync);
+	if( running )
+	{
+		if( cmd.command == COMMAND_ACTIVE || cmd.command == COMMAND_INACTIVE )
+		{
+			/*
+			** TVs send these in bursts, so rather than queueing each one,
+			** only remember the latest and restart the debounce window
+			*/
+			if( pendingPowerCommand != COMMAND_NONE )
+				LOG4CPLUS_DEBUG(logger, "Coalescing power command " << pendingPowerCommand << " into " << cmd.command);
+			pendingPowerCommand = cmd.command;
+			pendingPowerDeadline = Clock::now() + powerDebounce;
+			lifecycle_cond.notify_one();
+			return;
+		}
+
+		Lane lane = laneFor(cmd);
+		CommandLane & l = lanes[lane];
+
+		if( !l.queue.push(QueuedCommand(cmd, Clock::now())) )
+		{
+			l.dropped++;
+			LOG4CPLUS_WARN(logger, "Command lane " << lane << " full, dropping command " << cmd.command);
+			return;
+		}
+		l.maxDepth = std::max(l.maxDepth, l.queue.size());
+
+		if( lane == LANE_LIFECYCLE )
+			lifecycle_cond.notify_one();
+		else
+			libcec_cond.notify_one();
+	}
+}
+
+/**
+ * Takes the next command from a lane, which must not be empty. libcec_sync must be held.
+ */
+Command Main::pop(Lane lane) {
+	static const char *waitName[LANE_MAX] = {"control lane wait", "input lane wait", "lifecycle lane wait"};
+
+	CommandLane & l = lanes[lane];
+	Clock::time_point now = Clock::now();
+
+	Command cmd = l.queue.front().command;
+	l.recordWait(now - l.queue.front().queued);
+	if (Trace::enabled())
+		Trace::record(waitName[lane], Trace::micros(l.queue.front().queued), Trace::micros(now));
+	l.queue.pop();
+
+	return cmd;
+}
+
+void Main::CommandLane::recordWait(Clock::duration wait) {
+	count++;
+	totalWait += wait;
+	maxWait = std::max(maxWait, wait);
+}
+
+/**
+ * Runs lifecycle commands, which may run hooks that take a while, so they
+ * never hold up keys or control commands
+ */
+void Main::lifecycleLoop() {
+	/* started from the delivery thread, but only runs hooks and checks the adapter */
+	Realtime::enterNormal("lifecycle");
+
+	std::unique_lock<std::mutex> lock(libcec_sync);
+
+	while( running )
+	{
+		Clock::time_point now = Clock::now();
+
+		if( !lanes[LANE_LIFECYCLE].queue.empty() )
+		{
+			Command cmd = pop(LANE_LIFECYCLE);
+
+			lock.unlock();
+			execute(cmd);
+			lock.lock();
+		}
+		else if( pendingPowerCommand != COMMAND_NONE && now >= pendingPowerDeadline )
+		{
+			/* only act on the latest power state once it has settled */
+			int command = pendingPowerCommand;
+			pendingPowerCommand = COMMAND_NONE;
+			makeActive = (command == COMMAND_ACTIVE);
+			lanes[LANE_LIFECYCLE].recordWait(now - pendingPowerDeadline);
+
+			lock.unlock();
+			applyPowerCommand(command);
+			lock.lock();
+		}
+		else if( pendingPowerCommand != COMMAND_NONE )
+		{
+			lifecycle_cond.wait_until(lock, pendingPowerDeadline);
+		}
+		else
+		{
+			lifecycle_cond.wait(lock);
+		}
+	}
+}
+
+/**
+ * Logs queue depth and waiting time for each lane. libcec_sync must be held.
+ */
+void Main::logLaneStats() {
+	static const char *laneName[LANE_MAX] = {"control", "input", "lifecycle"};
+
+	for (int i = 0; i < LANE_MAX; i++) {
+		const CommandLane & l = lanes[i];
+		long long avg = l.count ? std::chrono::duration_cast<std::chrono::microseconds>(l.totalWait).count() / (long long) l.count : 0;
+		long long max = std::chrono::duration_cast<std::chrono::microseconds>(l.maxWait).count();
+
+		LOG4CPLUS_INFO(logger, "Lane " << laneName[i] << ": depth " << l.queue.size() << " (max " << l.maxDepth << "), "
+			<< l.count << " run, " << l.dropped << " dropped, wait avg " << avg << "us max " << max << "us");
+	}
+
+	LOG4CPLUS_INFO(logger, "Stats: " << stats());
+
+	std::lock_guard<std::mutex> lock(keys_sync);
+	if (macros.droppedCount())
+		LOG4CPLUS_INFO(logger, "Macros: " << macros.droppedCount() << " dropped, as " << MacroRunner::MAX_RUNNING << " were already playing");
+}
+
+/**
+ * Runs the hook for an activate or deactivate command, but only when the
+ * state actually changes
+ */
+void Main::applyPowerCommand(int command) {
+	bool active = (command == COMMAND_ACTIVE);
+
+	if( command == appliedPowerCommand )
+	{
+		LOG4CPLUS_DEBUG(logger, (active ? "Already activated" : "Already deactivated") << ", nothing to do");
+		return;
+	}
+	appliedPowerCommand = command;
+
+	events.publish(Event(EVENT_POWER, active ? EVENT_POWER_ACTIVE : EVENT_POWER_INACTIVE));
+
+	const string & hook = active ? onActivateCommand : onDeactivateCommand;
+	if( ! hook.empty() )
+	{
+		LOG4CPLUS_DEBUG(logger, (active ? "Activated" : "Deactivated") << ": Running \"" << hook << "\"");
+		Trace::Span span(active ? "onactivate" : "ondeactivate");
+		int ret = system(hook.c_str());
+		if( ret )
+			LOG4CPLUS_ERROR(logger, (active ? "Activate" : "Deactivate") << " command failed: " << ret);
+	}
+}
+
+void Main::stop() {
+	LOG4CPLUS_TRACE_STR(logger, "Main::stop()");
+	push(Command(COMMAND_EXIT));
+
+	/*
+	** however stuck the adapter is, stopping takes no longer than closing it.
+	** Only the first stop() gives up on its calls, so closing is not given up on too.
+	*/
+	std::lock_guard<std::mutex> lock(libcec_sync);
+	if( !stopping )
+	{
+		stopping = true;
+		adapterCalls.cancel();
+	}
+}
+
+void Main::restart() {
+	LOG4CPLUS_TRACE_STR(logger, "Main::restart()");
+	push(Command(COMMAND_RESTART));
+}
+
+void Main::setActiveSource() {
+	LOG4CPLUS_TRACE_STR(logger, "Main::setActiveSource()");
+	push(Command(COMMAND_SET_ACTIVE_SOURCE));
+}
+
+void Main::pressKey(cec_user_control_code key) {
+	LOG4CPLUS_TRACE_STR(logger, "Main::pressKey()");
+	push(Command(COMMAND_KEYPRESS, key));
+}
+
+void Main::setEmbedded(bool embedded) {
+	this->embedded = embedded;
+	if (embedded)
+		notify.close();
+}
+
+void Main::upgrade() {
+	LOG4CPLUS_TRACE_STR(logger, "Main::upgrade()");
+	push(Command(COMMAND_UPGRADE));
+}
+
+void Main::setBackend(const string & backend) {
+	releaseWedgedDevice();
+
+	if (backend == "libcec") {
+		cec.reset(new Cec(getCecName(), this));
+	} else if (backend == "kernel") {
+#ifdef HAVE_LINUX_CEC_H
+		cec.reset(new KernelCec(getCecName(), this));
+#else
+		throw std::runtime_error("This build has no kernel CEC support");
+#endif
+	} else {
+		throw std::runtime_error("Unknown backend " + backend + ", expected libcec or kernel");
+	}
+
+	updateLogMask();
+}
+
+void Main::setDevice(std::unique_ptr<CecDevice> device) {
+	releaseWedgedDevice();
+	cec = std::move(device);
+	updateLogMask();
+}
+
+/**
+ * Leaks the adapter if a call given up on is still using it, as destroying it
+ * would pull it out from under that call
+ */
+void Main::releaseWedgedDevice() {
+	if (!adapterCalls.wedged())
+		return;
+
+	LOG4CPLUS_WARN(logger, "Leaving the adapter to the call still using it");
+	cec.release();
+	adapterCalls.abandon();
+}
+
+/**
+ * Drops libcec messages that would never be shown as early as possible, but
+ * keeps those the bus statistics are kept from
+ */
+void Main::updateLogMask() {
+	logMask = cecLog.levelMask();
+	cec->setLogMask(logMask | (busStatsEnabled ? BusStats::LOG_MASK : 0));
+}
+
+void Main::setSlowCall(int ms) {
+	CallStats *calls = cec->callStats();
+	if (calls)
+		calls->setSlowThreshold(std::chrono::milliseconds(ms));
+}
+
+/**
+ * The bus statistics, and how long calls into libcec have taken, as one line
+ * of JSON
+ */
+string Main::stats() {
+	string line = busStats.snapshot(Event::now());
+
+	CallStats *calls = cec->callStats();
+	if (calls)
+		line.insert(line.size() - 1, ",\"calls\":" + calls->snapshot());
+
+	return line;
+}
+
+string Main::trace(bool on) {
+	LOG4CPLUS_TRACE_STR(logger, "Main::trace()");
+
+	if (on) {
+		Trace::start();
+		return "{\"type\":\"trace\",\"tracing\":true}";
+	}
+
+	if (!Trace::enabled())
+		return "{\"type\":\"trace\",\"tracing\":false}";
+
+	Trace::save(traceFile);
+	return "{\"type\":\"trace\",\"tracing\":false,\"file\":\"" + traceFile + "\"}";
+}
+
+void Main::setArguments(int argc, char *argv[]) {
+	// Resolved now, so an upgrade runs whatever binary has been installed at this path since
+	char path[PATH_MAX];
+	ssize_t len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+
+	executable = len > 0 ? string(path, len) : string(argv[0]);
+	arguments.assign(argv, argv + argc);
+}
+
+/**
+ * Gets rid of a new daemon that failed to take over, whatever state it got
+ * to, so it neither holds on to the adapter or the uinput device while this
+ * one carries on, nor is left a zombie
+ */
+static void killChild(pid_t child) {
+	if (child <= 0)
+		return;
+
+	kill(child, SIGKILL);
+	while (waitpid(child, NULL, 0) < 0 && errno == EINTR) {
+	}
+}
+
+/**
+ * Hands the adapter, the uinput device and the held keys over to a newly
+ * started copy of the daemon, so it can carry on without the device going
+ * away. The new daemon loads libcec before the adapter is handed over, so
+ * input only stops while the adapter is closed and reopened.
+ */
+int Main::handOff() {
+	LOG4CPLUS_TRACE_STR(logger, "Main::handOff()");
+
+	Handoff channel;
+	pid_t child = -1;
+	UInput *device = dynamic_cast<UInput *>(output.get());
+	string reply;
+
+	try {
+		std::ostringstream state;
+		{
+			std::lock_guard<std::mutex> lock(state_sync);
+			busState.write(state);
+		}
+
+		child = channel.spawn(executable, arguments, notify.getWatchdogInterval().count() > 0);
+		channel.send(state.str(), device ? device->getFd() : -1);
+
+		if (!channel.receive(reply, HANDOFF_TIMEOUT_MS) || reply != "ready") {
+			LOG4CPLUS_ERROR(logger, "New daemon did not start, carrying on");
+			killChild(child);
+			return HANDOFF_FAILED;
+		}
+	} catch (std::exception & e) {
+		LOG4CPLUS_ERROR(logger, "Upgrade failed: " << e.what());
+		killChild(child);
+		return HANDOFF_FAILED;
+	}
+
+	/* from here on, the adapter belongs to the new daemon */
+	try {
+		adapterCalls.run("closing the adapter", [this] { cec->close(false); }, adapterTimeout);
+	} catch (std::exception & e) {
+		LOG4CPLUS_ERROR(logger, e.what());
+	}
+
+	try {
+		std::ostringstream go;
+		go << "go\n";
+		{
+			std::lock_guard<std::mutex> lock(libcec_sync);
+			go << "active " << makeActive << "\n"
+			   << "power " << appliedPowerCommand << "\n";
+		}
+		{
+			std::lock_guard<std::mutex> lock(keys_sync);
+
+			/* macros can't be handed over, so cut them short rather than leave keys down */
+			if (output)
+				macros.abort(*output);
+
+			go << "keys";
+			for (KeyList::const_iterator k = heldKeyList.begin(); k != heldKeyList.end(); ++k)
+				go << ' ' << *k;
+			go << "\n";
+
+			channel.send(go.str());
+
+			/* it finds and opens the adapter first, each of which may take up to the open timeout */
+			int doneTimeout = HANDOFF_TIMEOUT_MS + 2 * openTimeout.count();
+			if (channel.receive(reply, doneTimeout) && reply == "done") {
+				/* the keys are the new daemon's problem now */
+				if (device)
+					device->detach();
+				heldKeys.reset();
+				heldKeyList.clear();
+
+				/* so the service manager follows the new daemon rather than restarting */
+				std::ostringstream mainPid;
+				mainPid << "MAINPID=" << child << "\nSTATUS=Handed over to " << child;
+				notify.send(mainPid.str());
+
+				LOG4CPLUS_INFO(logger, "Handed over to the new daemon, exiting");
+				return HANDOFF_DONE;
+			}
+		}
+	} catch (std::exception & e) {
+		LOG4CPLUS_ERROR(logger, "Upgrade failed: " << e.what());
+	}
+
+	LOG4CPLUS_ERROR(logger, "New daemon failed to take over, reopening the adapter");
+	killChild(child);
+	return HANDOFF_ABORTED;
+}
+
+/**
+ * Picks up the state handed over by the daemon being upgraded
+ */
+void Main::receiveHandoff() {
+	LOG4CPLUS_TRACE_STR(logger, "Main::receiveHandoff()");
+
+	string message;
+	int fd;
+
+	if (!handoff.receive(message, HANDOFF_TIMEOUT_MS, &fd)) {
+		throw std::runtime_error("No state handed over");
+	}
+
+	std::istringstream in(message);
+	BusState state;
+	if (state.read(in)) {
+		LOG4CPLUS_INFO(logger, "Taking over bus configuration " << state);
+
+		std::lock_guard<std::mutex> lock(state_sync);
+		savedState = state;
+		usingSavedState = true;
+		if (!explicitAddress) {
+			cec->setTargetAddress(state.address);
+		}
+	}
+
+	if (fd >= 0) {
+		if (outputs == "uinput") {
+			LOG4CPLUS_INFO(logger, "Taking over the uinput device");
+			setOutput(std::unique_ptr<InputSink>(new UInput(fd)));
+		} else {
+			close(fd);
+		}
+	}
+}
 
-using namespace CEC;
-using namespace log4cplus;
+/**
+ * Tells the old daemon everything else is ready, and waits for it to give
+ * up the adapter. Returns the adapter's comm port.
+ */
+string Main::takeOver(const string & device) {
+	LOG4CPLUS_TRACE_STR(logger, "Main::takeOver()");
 
-using std::cout;
-using std::cerr;
-using std::endl;
-using std::min;
-using std::string;
-using std::vector;
-using std::queue;
-using std::list;
+	string message;
+	handoff.send("ready");
+	if (!handoff.receive(message, HANDOFF_TIMEOUT_MS) || message.compare(0, 3, "go\n") != 0) {
+		throw std::runtime_error("Old daemon did not hand over the adapter");
+	}
 
-static Logger logger = Logger::getInstance("main");
-static boost::mutex libcec_sync;
-static boost::condition_variable libcec_cond;
+	std::istringstream in(message.substr(3));
+	string line;
+	while (std::getline(in, line)) {
+		std::istringstream ss(line);
+		string key;
+		ss >> key;
+
+		if (key == "active") {
+			ss >> makeActive;
+		} else if (key == "power") {
+			ss >> appliedPowerCommand;
+		} else if (key == "keys") {
+			std::lock_guard<std::mutex> lock(keys_sync);
+			unsigned ukey;
+			while (ss >> ukey) {
+				if (ukey >= KEY_CNT || heldKeys[ukey])
+					continue;
+
+				/* the list is all that gets released, so a key it can't hold must not count as held */
+				if (heldKeyList.size() == KeyList::MAX_KEYS) {
+					LOG4CPLUS_WARN(logger, "Old daemon held more than " << KeyList::MAX_KEYS << " keys, ignoring key " << ukey);
+					continue;
+				}
+				heldKeys.set(ukey);
+				heldKeyList.push_back(ukey);
+			}
+			/* released by the key timeout unless the TV keeps repeating them */
+			heldKeysTimeout = Clock::now() + keyTimeout;
+		}
+	}
 
-const vector<list<__u16>> Main::uinputCecMap = Main::setupUinputMap();
+	return findAdapter(device);
+}
 
-enum
-{
-	COMMAND_STANDBY,
-	COMMAND_ACTIVE,
-	COMMAND_INACTIVE,
-	COMMAND_RESTART,
-	COMMAND_KEYPRESS,
-	COMMAND_KEYRELEASE,
-	COMMAND_EXIT,
-};
+/**
+ * Settles who the uinput device handed over belongs to. Until "done" has been
+ * sent, the old daemon may carry on with it, so when the takeover fails it is
+ * let go of untouched, along with the keys the old daemon said were held.
+ */
+void Main::endTakeover(bool taken) {
+	std::lock_guard<std::mutex> lock(keys_sync);
+	UInput *device = dynamic_cast<UInput *>(output.get());
+
+	if (taken) {
+		if (device)
+			device->adopt();
+		return;
+	}
 
-Main & Main::instance() {
-	// Singleton pattern so we can use main from a sighandle
-	static Main main;
-	return main;
+	LOG4CPLUS_WARN(logger, "Leaving the uinput device and held keys to the old daemon");
+	if (device)
+		device->detach();
+	heldKeys.reset();
+	heldKeyList.clear();
 }
 
-Main::Main() : cec(getCecName(), this), uinput(UINPUT_NAME, uinputCecMap),
-	makeActive(true), running(false), lastUInputKeys({ }), logicalAddress(CECDEVICE_UNKNOWN)
-{
-	LOG4CPLUS_TRACE_STR(logger, "Main::Main()");
+void Main::listDevices() {
+	LOG4CPLUS_TRACE_STR(logger, "Main::listDevices()");
+	cecLog.start();
+	cec->listDevices(cout);
 }
 
-Main::~Main() {
-	LOG4CPLUS_TRACE_STR(logger, "Main::~Main()");
-	stop();
+/**
+ * Only passes the signal on to signalLoop(), as nothing else it could do is
+ * safe in a signal handler: the commands it stands for take locks, which the
+ * thread it interrupted may hold.
+ */
+void Main::signalHandler(int sigNum) {
+	int saved = errno;
+	unsigned char sig = sigNum;
+	if (write(signalPipe[1], &sig, 1) < 0) {
+		/* the pipe is full of signals not yet acted on, so this one can go */
+	}
+	errno = saved;
 }
 
-void Main::loop(const string & device) {
-	LOG4CPLUS_TRACE_STR(logger, "Main::loop()");
+/**
+ * Installs the signal handlers, and starts the thread that acts on them
+ */
+void Main::watchSignals() {
+	if (signalPipe[0] < 0 && pipe2(signalPipe, O_CLOEXEC) < 0)
+		throw std::runtime_error(string("Failed to create signal pipe: ") + strerror(errno));
+
+	/* the handler must never block */
+	fcntl(signalPipe[1], F_SETFL, O_NONBLOCK);
+
+	signalThread = std::thread(&Main::signalLoop, this);
 
 	struct sigaction action;
 
@@ -88,131 +1266,176 @@ void Main::loop(const string & device) {
 	action.sa_flags = SA_RESETHAND;
 	sigemptyset(&action.sa_mask);
 
-	int restart = false;
+	struct sigaction statsAction = action;
+	statsAction.sa_flags = SA_RESTART;
 
-	do
-	{
-		cec.open(device);
+	sigaction (SIGHUP,  &action, NULL);
+	sigaction (SIGINT,  &action, NULL);
+	sigaction (SIGTERM, &action, NULL);
+	sigaction (SIGUSR1, &statsAction, NULL);
+	sigaction (SIGUSR2, &statsAction, NULL);
+}
+
+/**
+ * Resets the signal handlers, and stops the thread that acts on them once
+ * it has acted on any signal already caught
+ */
+void Main::unwatchSignals() {
+	signal (SIGHUP,  SIG_DFL);
+	signal (SIGINT,  SIG_DFL);
+	signal (SIGTERM, SIG_DFL);
+	signal (SIGUSR1, SIG_DFL);
+	signal (SIGUSR2, SIG_DFL);
+
+	/* no signal is 0, so it tells signalLoop() to return */
+	unsigned char stop = 0;
+	while (write(signalPipe[1], &stop, 1) < 0 && (errno == EINTR || errno == EAGAIN))
+		std::this_thread::yield();
+	signalThread.join();
+}
 
-		running = true;
+void Main::signalLoop() {
+	unsigned char sig;
+	ssize_t n;
 
-		/* install signals */
-		sigaction (SIGHUP,  &action, NULL);
-		sigaction (SIGINT,  &action, NULL);
-		sigaction (SIGTERM, &action, NULL);
+	Realtime::enterNormal("signal");
 
-		if (makeActive) {
-			cec.makeActive();
+	while ((n = read(signalPipe[0], &sig, 1)) != 0) {
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			LOG4CPLUS_ERROR(logger, "Failed to read signal pipe: " << strerror(errno));
+			return;
 		}
 
-		do
+		LOG4CPLUS_DEBUG(logger, "Main::signalLoop(" << (int) sig << ")");
+		switch( sig )
 		{
-			boost::unique_lock<boost::mutex> libcec_lock(libcec_sync);
-
-			while( running && !commands.empty() )
-			{
-				Command cmd = commands.front();
-				switch( cmd.command )
-				{
-					case COMMAND_STANDBY:
-						if( ! onStandbyCommand.empty() )
-						{
-							LOG4CPLUS_DEBUG(logger, "Standby: Running \"" << onStandbyCommand << "\"");
-							int ret = system(onStandbyCommand.c_str());
-                            if( ret )
-                                LOG4CPLUS_ERROR(logger, "Standby command failed: " << ret);
-							
-						}
-						else
-						{
-							onCecKeyPress( CEC_USER_CONTROL_CODE_POWER );
-						}
-						break;
-					case COMMAND_ACTIVE:
-						makeActive = true;
-						if( ! onActivateCommand.empty() )
-						{
-							LOG4CPLUS_DEBUG(logger, "Activated: Running \"" << onActivateCommand << "\"");
-							int ret = system(onActivateCommand.c_str());
-                            if( ret )
-                                LOG4CPLUS_ERROR(logger, "Activate command failed: " << ret);
-						}
-						break;
-					case COMMAND_INACTIVE:
-						makeActive = false;
-						if( ! onDeactivateCommand.empty() )
-						{
-							LOG4CPLUS_DEBUG(logger, "Deactivated: Running \"" << onDeactivateCommand << "\"");
-							int ret = system(onDeactivateCommand.c_str());
-                            if( ret )
-                                LOG4CPLUS_ERROR(logger, "Deactivate command failed: " << ret);
-						}
-						break;
-					case COMMAND_KEYPRESS:
-						onCecKeyPress( cmd.keycode );
-						break;
-					case COMMAND_RESTART:
-						running = false;
-						restart = true;
-						break;
-					case COMMAND_EXIT:
-						running = false;
-						break;
-				}
-				commands.pop();
-			}
-			while( running && !libcec_cond.timed_wait(libcec_lock, boost::posix_time::seconds(43)) )
+			case 0:
+				return;
+			case SIGHUP:
+				restart();
+				break;
+			case SIGUSR2:
+				upgrade();
+				break;
+			case SIGUSR1:
 			{
-				running = cec.ping();
+				/* logged by the loop, rather than here */
+				std::lock_guard<std::mutex> lock(libcec_sync);
+				laneStatsRequested = true;
+				libcec_cond.notify_one();
+				break;
 			}
+			default:
+				stop();
+				break;
 		}
-		while( running );
-
-		/* reset signals */
-		signal (SIGHUP,  SIG_DFL);
-		signal (SIGINT,  SIG_DFL);
-		signal (SIGTERM, SIG_DFL);
-
-		cec.close(!restart);
 	}
-	while( restart );
 }
 
-void Main::push(Command cmd) {
-	boost::lock_guard<boost::mutex> lock(libcec_sync);
-	if( running )
-	{
-		commands.push(cmd);
-		libcec_cond.notify_one();
-	}
+/**
+ * Creates a sink from an --output spec
+ */
+static std::unique_ptr<InputSink> createSink(const string & spec, const std::vector<KeyList> & keys) {
+	if (spec == "uinput")
+		return std::unique_ptr<InputSink>(new UInput(UINPUT_NAME, keys.data(), keys.size()));
+	if (spec == "none")
+		return std::unique_ptr<InputSink>(new RecordingSink(0));
+	if (spec.compare(0, 5, "unix:") == 0)
+		return std::unique_ptr<InputSink>(StreamSink::connect(spec.substr(5)));
+	if (spec.compare(0, 5, "file:") == 0)
+		return std::unique_ptr<InputSink>(StreamSink::open(spec.substr(5)));
+	if (spec.compare(0, 3, "fd:") == 0)
+		return std::unique_ptr<InputSink>(new StreamSink(atoi(spec.c_str() + 3), spec));
+
+	throw std::runtime_error("Unknown output " + spec);
 }
 
-void Main::stop() {
-	LOG4CPLUS_TRACE_STR(logger, "Main::stop()");
-	push(Command(COMMAND_EXIT));
+void Main::createOutput() {
+	std::unique_ptr<InputSink> sink;
+
+	/* uinput has to be told up front about every key it will send */
+	std::vector<KeyList> keys(uinputCecMap.begin(), uinputCecMap.end());
+	for (KeyMacros::const_iterator m = keyMacros.begin(); m != keyMacros.end(); ++m)
+		m->addKeys(keys);
+
+	if (outputs.find(',') == string::npos) {
+		sink = createSink(outputs, keys);
+	} else {
+		std::unique_ptr<FanOutSink> fanout(new FanOutSink());
+		std::istringstream ss(outputs);
+		string spec;
+
+		while (std::getline(ss, spec, ','))
+			fanout->add(createSink(spec, keys));
+		sink = std::move(fanout);
+	}
+
+	setOutput(std::move(sink));
 }
 
-void Main::restart() {
-	LOG4CPLUS_TRACE_STR(logger, "Main::restart()");
-	push(Command(COMMAND_RESTART));
+void Main::loadMacros(const string & path) {
+	std::ifstream in(path.c_str());
+	if (!in)
+		throw std::runtime_error("Failed to open macros " + path);
+
+	string line;
+	int lineNumber = 0;
+	int count = 0;
+
+	while (std::getline(in, line)) {
+		lineNumber++;
+
+		size_t start = line.find_first_not_of(" \t");
+		if (start == string::npos || line[start] == '#')
+			continue;
+
+		size_t end = std::min(line.find_first_of(" \t", start), line.size());
+		string name = line.substr(start, end - start);
+
+		std::ostringstream where;
+		where << path << ":" << lineNumber << ": ";
+
+		int keycode = -1;
+		for (int i = 0; i <= CEC_USER_CONTROL_CODE_MAX; i++) {
+			const char *known = Cec::cecUserControlCodeName[i];
+			if (known && strcasecmp(known, name.c_str()) == 0) {
+				keycode = i;
+				break;
+			}
+		}
+		if (keycode < 0)
+			throw std::runtime_error(where.str() + "unknown CEC key " + name);
+
+		try {
+			keyMacros[keycode] = Macro::compile(line.substr(end));
+		} catch (std::runtime_error & e) {
+			throw std::runtime_error(where.str() + e.what());
+		}
+		count++;
+	}
+
+	LOG4CPLUS_INFO(logger, "Loaded " << count << " macros from " << path);
 }
 
-void Main::listDevices() {
-	LOG4CPLUS_TRACE_STR(logger, "Main::listDevices()");
-	cec.listDevices(cout);
+void Main::setOutput(std::unique_ptr<InputSink> sink) {
+	std::lock_guard<std::mutex> lock(output_sync);
+	output = std::move(sink);
 }
 
-void Main::signalHandler(int sigNum) {
-	LOG4CPLUS_DEBUG_STR(logger, "Main::signalHandler()");
-	switch( sigNum )
-	{
-		case SIGHUP:
-			Main::instance().restart();
-			break;
-		default:
-			Main::instance().stop();
-			break;
+/**
+ * Startup creates the output before opening the adapter, so keys only find
+ * none if they come before loop() has started. Such keys are dropped, as
+ * waiting would hold up libcec's callback thread.
+ */
+InputSink * Main::currentOutput() {
+	std::lock_guard<std::mutex> lock(output_sync);
+	if (!output) {
+		LOG4CPLUS_WARN(logger, "Output not ready, dropping key");
+		return NULL;
 	}
+	return output.get();
 }
 
 char *Main::getCecName() {
@@ -225,11 +1448,10 @@ char *Main::getCecName() {
 	return cec_name;
 }
 
-const std::vector<list<__u16>> & Main::setupUinputMap() {
-	static std::vector<list<__u16>> uinputCecMap;
+const Main::UInputKeyMap & Main::setupUinputMap() {
+	static UInputKeyMap uinputCecMap;
 
-	if (uinputCecMap.empty()) {
-		uinputCecMap.resize(CEC_USER_CONTROL_CODE_MAX + 1, {});
+	if (uinputCecMap[CEC_USER_CONTROL_CODE_SELECT].empty()) {
 		uinputCecMap[CEC_USER_CONTROL_CODE_SELECT                      ] = { KEY_OK };
 		uinputCecMap[CEC_USER_CONTROL_CODE_UP                          ] = { KEY_UP };
 		uinputCecMap[CEC_USER_CONTROL_CODE_DOWN                        ] = { KEY_DOWN };
@@ -316,118 +1538,288 @@ const std::vector<list<__u16>> & Main::setupUinputMap() {
 }
 
 int Main::onCecLogMessage(const cec_log_message &message) {
-	LOG4CPLUS_DEBUG(logger, "Main::onCecLogMessage(" << message << ")");
+	realtime.enterCec();
+	if (busStatsEnabled)
+		busStats.message(message, Event::now());
+	if (message.level & logMask)
+		cecLog.push(message);
 	return 1;
 }
 
 int Main::onCecKeyPress(const cec_keypress &key) {
+	realtime.enterCec();
+	HotPath hot("Main::onCecKeyPress()");
+
 	LOG4CPLUS_DEBUG(logger, "Main::onCecKeyPress(" << key << ")");
 
-	// Check bounds and find uinput code for this cec keypress
-	if (key.keycode >= 0 && key.keycode <= CEC_USER_CONTROL_CODE_MAX) {
-		const list<__u16> & uinputKeys = uinputCecMap[key.keycode];
+	// Stamped on arrival, so both subscribers and output readers see how late delivery was
+	Event event(EVENT_KEY, key.keycode, key.duration);
+	events.publish(event);
 
-		if ( !uinputKeys.empty() ) {
-			if( key.duration == 0 ) {
-				if( uinputKeys == lastUInputKeys )
-				{
-					/*
-					** KEY REPEAT
-					*/
-					for (std::list<__u16>::const_iterator ukeys = uinputKeys.begin(); ukeys != uinputKeys.end(); ++ukeys) {
-						__u16 ukey = *ukeys;
+	int result = deliverKey(key, event.time, Clock::duration::zero());
 
-						LOG4CPLUS_DEBUG(logger, "repeat " << ukey);
+#ifdef HOTPATH_CHECK
+	// Nothing but debug logging may allocate while handling a key
+	assert(hot.allocationCount() == 0 || logger.isEnabledFor(DEBUG_LOG_LEVEL));
+#endif
 
-						uinput.send_event(EV_KEY, ukey, EV_KEY_REPEAT);
-					}
-				}
-				else
-				{
-					/*
-					** KEY PRESSED
-					*/
-					if( ! lastUInputKeys.empty() )
-					{
-						/* what happened with the last key release ? */
-						for (std::list<__u16>::const_iterator ukeys = lastUInputKeys.begin(); ukeys != lastUInputKeys.end(); ++ukeys) {
-							__u16 ukey = *ukeys;
+	return result;
+}
 
-							LOG4CPLUS_DEBUG(logger, "release " << ukey);
+/**
+ * Sends a key to the output. Keys with a macro, and keys the daemon presses
+ * itself, which are held for hold rather than until the TV releases them,
+ * are played as macros.
+ */
+int Main::deliverKey(const cec_keypress & key, uint64_t time, Clock::duration hold) {
+	InputSink *output = currentOutput();
+	if (!output) {
+		return 0;
+	}
 
-							uinput.send_event(EV_KEY, ukey, EV_KEY_RELEASED);
-						}
-					}
-					for (std::list<__u16>::const_iterator ukeys = uinputKeys.begin(); ukeys != uinputKeys.end(); ++ukeys) {
-						__u16 ukey = *ukeys;
+	// Check bounds and find uinput code for this cec keypress
+	if (key.keycode < 0 || key.keycode > CEC_USER_CONTROL_CODE_MAX) {
+		return 1;
+	}
 
-						LOG4CPLUS_DEBUG(logger, "send " << ukey);
+	const KeyList & uinputKeys = uinputCecMap[key.keycode];
+	const Macro & macro = keyMacros[key.keycode].empty() && hold.count() ? tapMacros[key.keycode] : keyMacros[key.keycode];
 
-						uinput.send_event(EV_KEY, ukey, EV_KEY_PRESSED);
-					}
-					lastUInputKeys = uinputKeys;
-				}
+	if ( uinputKeys.empty() && macro.empty() ) {
+		return 1;
+	}
+
+	std::unique_lock<std::mutex> lock(keys_sync);
+	bool wasHeld = !heldKeyList.empty();
+	Clock::time_point now = Clock::now();
+	Clock::time_point macrosWere = macros.deadline();
+
+	try {
+		output->timestamp(time);
+
+		if( !macro.empty() ) {
+			playMacro(*output, macro, key, hold.count() ? now + hold : releaseDeadline(now), now);
+		}
+		else if( key.duration == 0 ) {
+			/* a new key means any other was released */
+			macros.release(MacroRunner::ANY_KEY, *output, now);
+			pressKeys(*output, uinputKeys);
+			heldKeysTimeout = now + keyTimeout;
+		}
+		else {
+			bool missed = !isHeld(uinputKeys);
+			releaseKeys(*output, KeyBits());
+
+			if( missed ) {
+				/* what happened with the key press ? play it now, briefly */
+				macros.start(tapMacros[key.keycode], key.keycode, now + SIMULATED_PRESS, *output, now);
 			}
-			else {
-				if( lastUInputKeys != uinputKeys ) {
-					if( ! lastUInputKeys.empty() ) {
-						/* what happened with the last key release ? */
-						for (std::list<__u16>::const_iterator ukeys = lastUInputKeys.begin(); ukeys != lastUInputKeys.end(); ++ukeys) {
-							__u16 ukey = *ukeys;
+		}
+		output->sync();
+	} catch (std::exception & e) {
+		LOG4CPLUS_ERROR(logger, "Failed to send key: " << e.what());
+		macros.abort(*output);
+		releaseAllKeys(*output);
+		return 0;
+	}
 
-							LOG4CPLUS_DEBUG(logger, "release " << ukey);
+	bool isNowHeld = !heldKeyList.empty();
+	bool macrosSooner = macros.deadline() < macrosWere;
+	lock.unlock();
 
-							uinput.send_event(EV_KEY, ukey, EV_KEY_RELEASED);
-						}
-					}
-					for (std::list<__u16>::const_iterator ukeys = uinputKeys.begin(); ukeys != uinputKeys.end(); ++ukeys) {
-						__u16 ukey = *ukeys;
+	if( (!wasHeld && isNowHeld && keyTimeout.count()) || macrosSooner ) {
+		/* make sure the loop wakes up in time to check the key is still held, or play the macro on */
+		std::lock_guard<std::mutex> libcec_lock(libcec_sync);
+		libcec_cond.notify_one();
+	}
 
-						LOG4CPLUS_DEBUG(logger, "send " << ukey);
+	return 1;
+}
 
-						uinput.send_event(EV_KEY, ukey, EV_KEY_PRESSED);
-					}
-					boost::this_thread::sleep(boost::posix_time::milliseconds(100));
-				}
-				/*
-				** KEY RELEASED
-				*/
-				for (std::list<__u16>::const_iterator ukeys = uinputKeys.begin(); ukeys != uinputKeys.end(); ++ukeys) {
-					__u16 ukey = *ukeys;
+/**
+ * Starts the macro for a key press, or lets it carry on for a repeat or a
+ * release. keys_sync must be held.
+ */
+void Main::playMacro(InputSink & output, const Macro & macro, const cec_keypress & key, Clock::time_point releaseBy, Clock::time_point now) {
+	if( key.duration == 0 ) {
+		/* the TV repeats a key for as long as it is held, which must not start it again */
+		if( macros.repeat(key.keycode, releaseBy) )
+			return;
+
+		/* a new key means any other was released */
+		releaseKeys(output, KeyBits());
+		macros.release(MacroRunner::ANY_KEY, output, now);
+		macros.start(macro, key.keycode, releaseBy, output, now);
+	}
+	else if( !macros.release(key.keycode, output, now) ) {
+		/* the press never arrived, so play it now, briefly */
+		macros.start(macro, key.keycode, now + SIMULATED_PRESS, output, now);
+	}
+}
 
-					LOG4CPLUS_DEBUG(logger, "release " << ukey);
+/**
+ * Plays the macro steps that are due, on the loop thread
+ */
+void Main::runMacros() {
+	std::lock_guard<std::mutex> lock(keys_sync);
+	if( !output )
+		return;
 
-					uinput.send_event(EV_KEY, ukey, EV_KEY_RELEASED);
+	try {
+		macros.run(*output, Clock::now());
+	} catch (std::exception & e) {
+		LOG4CPLUS_ERROR(logger, "Failed to play macro: " << e.what());
+		macros.abort(*output);
+	}
+}
 
-				}
-				lastUInputKeys.clear();
-			}
-			uinput.sync();
+Clock::time_point Main::macrosDeadline() const {
+	std::lock_guard<std::mutex> lock(keys_sync);
+	return macros.deadline();
+}
+
+/**
+ * When a key pressed now counts as released, unless the TV repeats it
+ */
+Clock::time_point Main::releaseDeadline(Clock::time_point now) const {
+	return keyTimeout.count() ? now + keyTimeout : Clock::time_point::max();
+}
+
+/**
+ * Releases every held key, carrying on even if sending fails, so the key
+ * state is always left empty. keys_sync must be held.
+ */
+void Main::releaseAllKeys(InputSink & output) {
+	for (KeyList::const_iterator k = heldKeyList.begin(); k != heldKeyList.end(); ++k) {
+		try {
+			output.send_event(EV_KEY, *k, EV_KEY_RELEASED);
+		} catch (std::exception & e) {
+			LOG4CPLUS_ERROR(logger, "Failed to release key " << *k << ": " << e.what());
 		}
 	}
+	heldKeys.reset();
+	heldKeyList.clear();
 
-	return 1;
+	try {
+		output.sync();
+	} catch (std::exception & e) {
+		LOG4CPLUS_ERROR(logger, "Failed to sync output: " << e.what());
+	}
+}
+
+void Main::releaseHeldKeys(const char *reason) {
+	std::lock_guard<std::mutex> lock(keys_sync);
+	if( !output || (heldKeyList.empty() && !macros.busy()) )
+		return;
+
+	LOG4CPLUS_INFO(logger, "Releasing held keys (" << reason << ")");
+	macros.abort(*output);
+	releaseAllKeys(*output);
+}
+
+/**
+ * Releases held keys if the TV has stopped repeating them for longer than
+ * the key timeout, which happens when the release is lost
+ */
+void Main::releaseStaleKeys() {
+	std::lock_guard<std::mutex> lock(keys_sync);
+	if( !output || heldKeyList.empty() || !keyTimeout.count() || Clock::now() < heldKeysTimeout )
+		return;
+
+	LOG4CPLUS_INFO(logger, "Releasing held keys (no keepalive for " << keyTimeout.count() << "ms)");
+	releaseAllKeys(*output);
+}
+
+Clock::time_point Main::heldKeysDeadline() const {
+	std::lock_guard<std::mutex> lock(keys_sync);
+	if( heldKeyList.empty() || !keyTimeout.count() )
+		return Clock::time_point::max();
+	return heldKeysTimeout;
+}
+
+/**
+ * True if exactly these keys are held
+ */
+bool Main::isHeld(const KeyList & keys) const {
+	KeyBits bits;
+	for (KeyList::const_iterator k = keys.begin(); k != keys.end(); ++k)
+		bits.set(*k);
+	return bits == heldKeys;
+}
+
+/**
+ * Presses the given keys, or repeats them if they are already held. Any other
+ * held keys are released first.
+ */
+void Main::pressKeys(InputSink & output, const KeyList & keys) {
+	KeyBits pressed;
+	for (KeyList::const_iterator k = keys.begin(); k != keys.end(); ++k)
+		pressed.set(*k);
+
+	releaseKeys(output, pressed);
+
+	for (KeyList::const_iterator k = keys.begin(); k != keys.end(); ++k) {
+		__u16 ukey = *k;
+
+		if( heldKeys[ukey] ) {
+			LOG4CPLUS_DEBUG(logger, "repeat " << ukey);
+			output.send_event(EV_KEY, ukey, EV_KEY_REPEAT);
+		} else {
+			LOG4CPLUS_DEBUG(logger, "send " << ukey);
+			output.send_event(EV_KEY, ukey, EV_KEY_PRESSED);
+			heldKeys.set(ukey);
+			heldKeyList.push_back(ukey);
+		}
+	}
+}
+
+/**
+ * Releases all held keys, except for those in keep
+ */
+void Main::releaseKeys(InputSink & output, const KeyBits & keep) {
+	KeyList kept;
+
+	for (KeyList::const_iterator k = heldKeyList.begin(); k != heldKeyList.end(); ++k) {
+		__u16 ukey = *k;
+
+		if( keep[ukey] ) {
+			kept.push_back(ukey);
+		} else {
+			LOG4CPLUS_DEBUG(logger, "release " << ukey);
+			output.send_event(EV_KEY, ukey, EV_KEY_RELEASED);
+			heldKeys.reset(ukey);
+		}
+	}
+
+	heldKeyList = kept;
 }
 
 int Main::onCecKeyPress(const cec_user_control_code & keycode) {
 	cec_keypress key = { .keycode=keycode };
-
-	/* PUSH KEY */
 	key.duration = 0;
-	onCecKeyPress( key );
 
-	/* simulate delay */
-	key.duration = 100;
-	boost::this_thread::sleep(boost::posix_time::milliseconds(key.duration));
+	Event event(EVENT_KEY, key.keycode, key.duration);
+	events.publish(event);
 
-	/* RELEASE KEY */
-	onCecKeyPress( key );
-
-	return 1;
+	/* released again by the loop, rather than sleeping here */
+	return deliverKey(key, event.time, SIMULATED_PRESS);
 }
 
 int Main::onCecCommand(const cec_command & command) {
+	realtime.enterCec();
 	LOG4CPLUS_DEBUG(logger, "Main::onCecCommand(" << command << ")");
+
+	Event event(EVENT_COMMAND, command.opcode);
+	event.initiator   = command.initiator;
+	event.destination = command.destination;
+	event.ack         = command.ack;
+	event.eom         = command.eom;
+	for (event.size = 0; event.size < command.parameters.size && event.size < Event::MAX_PARAMETERS; event.size++)
+		event.parameters[event.size] = command.parameters[event.size];
+	events.publish(event);
+	if (busStatsEnabled)
+		busStats.command(command, event.time);
+
 	switch( command.opcode )
 	{
 		case CEC_OPCODE_STANDBY:
@@ -488,7 +1880,9 @@ int Main::onCecCommand(const cec_command & command) {
 }
 
 int Main::onCecAlert(const CEC::libcec_alert alert, const CEC::libcec_parameter & param) {
+	realtime.enterCec();
 	LOG4CPLUS_ERROR(logger, "Main::onCecAlert(alert=" << alert << ")");
+	events.publish(Event(EVENT_ALERT, alert));
 	switch( alert )
 	{
 		case CEC_ALERT_SERVICE_DEVICE:
@@ -497,7 +1891,13 @@ int Main::onCecAlert(const CEC::libcec_alert alert, const CEC::libcec_parameter
 		case CEC_ALERT_PERMISSION_ERROR:
 		case CEC_ALERT_PORT_BUSY:
 		case CEC_ALERT_PHYSICAL_ADDRESS_ERROR:
+			{
+				std::lock_guard<std::mutex> lock(state_sync);
+				savedStateStale = usingSavedState;
+			}
+			/* fall through */
 		case CEC_ALERT_TV_POLL_FAILED:
+			releaseHeldKeys("adapter alert");
 			Main::instance().restart();
 			break;
 		default:
@@ -507,169 +1907,50 @@ int Main::onCecAlert(const CEC::libcec_alert alert, const CEC::libcec_parameter
 }
 
 int Main::onCecConfigurationChanged(const libcec_configuration & configuration) {
+	realtime.enterCec();
 	//LOG4CPLUS_DEBUG(logger, "Main::onCecConfigurationChanged(" << configuration << ")");
 	LOG4CPLUS_DEBUG(logger, "Main::onCecConfigurationChanged(logicalAddress=" << configuration.logicalAddresses.primary << ")");
 	logicalAddress = configuration.logicalAddresses.primary;
+
+	{
+		std::lock_guard<std::mutex> lock(state_sync);
+
+		BusState & state = busState;
+		state.comm             = adapterComm;
+		state.address.physical = configuration.iPhysicalAddress;
+		state.address.logical  = configuration.baseDevice;
+		state.address.port     = configuration.iHDMIPort;
+		state.logicalAddress   = configuration.logicalAddresses.primary;
+
+		if (!stateFile.empty() && state.valid() && state != savedState) {
+			try {
+				state.save(stateFile);
+				savedState = state;
+				LOG4CPLUS_INFO(logger, "Saved bus configuration " << state);
+			} catch (std::exception & e) {
+				LOG4CPLUS_WARN(logger, e.what());
+			}
+		}
+	}
+
+	notifyReady();
 	return 1;
 }
 
 
 int Main::onCecMenuStateChanged(const cec_menu_state & menu_state) {
+	realtime.enterCec();
 	LOG4CPLUS_DEBUG(logger, "Main::onCecMenuStateChanged(" << menu_state << ")");
 
 	return onCecKeyPress(CEC_USER_CONTROL_CODE_CONTENTS_MENU);
 }
 
 void Main::onCecSourceActivated(const cec_logical_address & address, bool bActivated) {
+	realtime.enterCec();
 	LOG4CPLUS_DEBUG(logger, "Main::onCecSourceActivated(logicalAddress " << address << " = " << bActivated << ")");
+	events.publish(Event(EVENT_SOURCE, address, bActivated));
 	if( logicalAddress == address )
 	{
 		push(Command(bActivated ? COMMAND_ACTIVE : COMMAND_INACTIVE));
 	}
 }
-
-#if defined(HAVE_BOOST_PO_TYPED_VALUE_NAME)
-
-/*
-** boost versions 1.50 and newer support value_name() program option value
-*/
-
-using boost::program_options::value;
-
-#else
-
-/*
-** provide a value_name() replacement for older versions
-*/
-
-template<class T> class typed_value_name : public boost::program_options::typed_value<T>
-{
-    public:
-        typed_value_name(T *my_value = new T()) : boost::program_options::typed_value<T>(my_value), val_name("arg") {};
-        boost::program_options::typed_value<T> *value_name(const char *name) { val_name = name;; return this; };
-        std::string name() const { return std::string(val_name); };
-
-    protected:
-        const char *val_name;
-};
-
-template<class T> typed_value_name<T> *value(T *my_value = new T()) { return new typed_value_name<T>(my_value); };
-
-#endif
-
-int main (int argc, char *argv[]) {
-
-    BasicConfigurator config;
-    config.configure();
-
-    int loglevel = 0;
-
-	namespace po = boost::program_options;
-
-	po::options_description desc("Allowed options");
-	desc.add_options()
-	    ("help,h",    "show help message")
-	    ("version,V", "show version (and exit)")
-	    ("daemon,d",  "daemon mode, run in background")
-	    ("list,l",    "list available CEC adapters and devices")
-	    ("verbose,v", accumulator<int>(&loglevel)->implicit_value(1), "verbose output (use -vv for more)")
-	    ("quiet,q",   "quiet output (print almost nothing)")
-	    ("donotactivate,a", "do not activate device on startup")
-
-	    ("onstandby", value<string>()->value_name("<path>"),  "command to run on standby")
-	    ("onactivate", value<string>()->value_name("<path>"),  "command to run on activation")
-	    ("ondeactivate", value<string>()->value_name("<path>"),  "command to run on deactivation")
-	    ("port,p", value<HDMI::address>()->value_name("[a[.b.c.d]>"),  "HDMI port A or address A.B.C.D (overrides autodetected value)")
-	    ("usb", value<string>()->value_name("<path>"), "USB adapter path (as shown by --list)")
-	;
-
-	po::positional_options_description p;
-	p.add("usb", 1);
-
-    po::variables_map vm;
-    try
-    {
-        po::store(po::command_line_parser(argc, argv).options(desc).positional(p).run(), vm);
-    }
-    catch( po::error &e )
-    {
-        cerr << argv[0] << ": " << e.what() << endl;
-        cerr << "Type \"" << argv[0] << " --help\" for more information." << endl;
-        return 1;
-    }
-    po::notify(vm);
-
-	if (vm.count("help")) {
-		cout << "Usage: " << argv[0] << " [options] [usb]" << endl << endl;
-	    cout << desc << endl;
-	    return 0;
-	}
-
-	if (vm.count("version")) {
-		cout << PACKAGE_STRING << endl;
-		return 0;
-	}
-
-	if(vm.count("quiet")) {
-		loglevel = -1;
-	} else {
-		loglevel = min(loglevel, 2);
-	}
-
-	Logger root = Logger::getRoot();
-	switch (loglevel) {
-		case 2:  root.setLogLevel(TRACE_LOG_LEVEL); break;
-		case 1:  root.setLogLevel(DEBUG_LOG_LEVEL); break;
-		default: root.setLogLevel(INFO_LOG_LEVEL); break;
-		case -1: root.setLogLevel(FATAL_LOG_LEVEL); break;
-	}
-
-	try {
-		// Create the main
-		Main & main = Main::instance();
-        string device = "";
-
-		if (vm.count("list")) {
-			main.listDevices();
-			return 0;
-		}
-
-		if (vm.count("donotactivate")) {
-			main.setMakeActive(false);
-		}
-
-		if (vm.count("usb")) {
-			device = vm["usb"].as< string >();
-		}
-
-		if (vm.count("onstandby")) {
-			main.setOnStandbyCommand(vm["onstandby"].as< string >());
-		}
-
-		if (vm.count("onactivate")) {
-			main.setOnActivateCommand(vm["onactivate"].as< string >());
-		}
-
-		if (vm.count("ondeactivate")) {
-			main.setOnDeactivateCommand(vm["ondeactivate"].as< string >());
-		}
-
-		if (vm.count("port")) {
-            main.setTargetAddress(vm["port"].as< HDMI::address >());
-        }
-
-        if (vm.count("daemon")) {
-            if( daemon(0, 0) )
-                return -1;
-        }
-
-		main.loop(device);
-
-	} catch (std::exception & e) {
-		cerr << e.what() << endl;
-		return -1;
-	}
-
-	return 0;
-}
-
@@ -1,9 +1,25 @@
 #include "uinput.h"
 #include "libcec.h"
+#include "busstats.h"
+#include "ceclog.h"
+#include "events.h"
+#include "realtime.h"
+#include "ringbuffer.hpp"
+#include "state.h"
+#include "handoff.h"
+#include "notify.h"
+#include "macro.h"
+#include "deadline.h"
 #include <limits.h>
+#include <array>
+#include <bitset>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
 #include <string>
-#include <queue>
-#include <list>
+#include <thread>
+#include <vector>
 
 class Command
 {
@@ -24,8 +40,14 @@ class Main : public CecCallback {
 	private:
 
 		// Main controls
-		Cec cec;
-		UInput uinput;
+		CecLog cecLog; // before cec, so it outlives libcec's callbacks
+		BusStats busStats; // likewise
+		bool busStatsEnabled;
+		int logMask;   // the libcec log levels cecLog logs
+		std::unique_ptr<CecDevice> cec;
+		std::unique_ptr<InputSink> output; // created during startup, before the adapter is opened
+		EventServer events;
+		Realtime realtime;
 		char cec_name[HOST_NAME_MAX];
 
 		// Some config params
@@ -33,7 +55,26 @@ class Main : public CecCallback {
 		bool running; // TODO Change this to be threadsafe!. Voiatile or better
 
 		//
-		std::list<__u16> lastUInputKeys; // for key(s) repetition
+		// Currently held uinput keys (for key repetition), both as a set and in
+		// the order they were pressed. Guarded by keys_sync.
+		typedef std::bitset<KEY_CNT> KeyBits;
+		KeyBits heldKeys;
+		KeyList heldKeyList;
+		std::chrono::steady_clock::time_point heldKeysTimeout; // when held keys are given up on
+		std::chrono::milliseconds keyTimeout;
+
+		// Key macros (--macros), and the mapped keys as macros for simulated
+		// key presses, indexed by CEC key. Both are only changed before loop().
+		typedef std::array<Macro, CEC::CEC_USER_CONTROL_CODE_MAX + 1> KeyMacros;
+		KeyMacros keyMacros;   // empty for keys without a macro
+		KeyMacros tapMacros;
+		MacroRunner macros;    // guarded by keys_sync
+
+		// Activate/deactivate commands are coalesced, see push()
+		int pendingPowerCommand; // latest requested, not yet applied
+		int appliedPowerCommand; // last one whose hook was run
+		std::chrono::steady_clock::time_point pendingPowerDeadline;
+		std::chrono::milliseconds powerDebounce;
 
 		//
 		Main();
@@ -44,23 +85,134 @@ class Main : public CecCallback {
 		void operator=(Main const&);
 
 		static void signalHandler(int sigNum);
+		void watchSignals();
+		void unwatchSignals();
+		void signalLoop();
+		std::thread signalThread; // acts on the signals signalHandler() passes on
+
+		typedef std::array<KeyList, CEC::CEC_USER_CONTROL_CODE_MAX + 1> UInputKeyMap;
+
+		static const UInputKeyMap & setupUinputMap();
+
+		/*
+		** Commands are queued in lanes, served in strict priority order:
+		** control (exit and restart), then interactive input, then lifecycle
+		** commands, which may run slow hooks and so have a thread of their own.
+		** Guarded by libcec_sync.
+		*/
+		enum Lane { LANE_CONTROL, LANE_INPUT, LANE_LIFECYCLE, LANE_MAX };
+
+		struct QueuedCommand {
+			Command command;
+			std::chrono::steady_clock::time_point queued;
+
+			QueuedCommand(const Command & command, std::chrono::steady_clock::time_point queued) : command(command), queued(queued) {}
+		};
+
+		struct CommandLane {
+			RingBuffer<QueuedCommand, 64> queue;
+			size_t maxDepth;
+			uint64_t count;    // commands run
+			uint64_t dropped;  // commands dropped as the lane was full
+			std::chrono::steady_clock::duration totalWait;
+			std::chrono::steady_clock::duration maxWait;
 
-		static const std::vector<std::list<__u16>> & setupUinputMap();
-		std::queue<Command> commands;
+			CommandLane() : maxDepth(0), count(0), dropped(0), totalWait(0), maxWait(0) {}
+
+			void recordWait(std::chrono::steady_clock::duration wait);
+		};
+
+		CommandLane lanes[LANE_MAX];
+
+		static Lane laneFor(const Command & command);
 
 		std::string onStandbyCommand;
 		std::string onActivateCommand;
 		std::string onDeactivateCommand;
+		std::string eventSocket;
+		std::string traceFile; // where trace(false) saves spans
+		std::string outputs; // comma separated --output specs
 
 		CEC::cec_logical_address logicalAddress;
 
+		// Last known good bus configuration (--state-file), guarded by state_sync
+		std::string stateFile;
+		BusState savedState;     // as last loaded or saved
+		std::string adapterComm; // comm port of the adapter being opened
+		bool explicitAddress;    // given with --port, so never replaced by the saved one
+		bool usingSavedState;    // startup is trying the saved configuration
+		bool savedStateStale;    // the saved configuration turned out wrong
+		BusState busState;       // as currently negotiated
+
+		// Upgrades (SIGUSR2), see handOff()
+		std::string executable;
+		std::vector<std::string> arguments;
+		Handoff handoff;         // from the daemon being replaced, if any
+
+		// Service manager notifications (NOTIFY_SOCKET), see notifyReady()
+		ServiceNotify notify;
+		bool adapterReady;       // adapter open and startup done, guarded by state_sync
+		bool serviceReady;       // READY=1 sent for the current connection, guarded by state_sync
+
+		// Recovery after the host resumes from suspend, see resume()
+		std::chrono::milliseconds resumeCheck; // how often to look for a resume, 0 to never
+		bool resumeActivate;                    // become the active source again, if we were
+
+		bool embedded; // running inside another program, see setEmbedded()
+
+		// Calls into the adapter that may never return are given up on after these
+		DeadlineRunner adapterCalls;
+		std::chrono::milliseconds openTimeout;    // loading libcec, finding and opening the adapter
+		std::chrono::milliseconds adapterTimeout; // anything else, such as closing it or a ping
+		bool stopping;                            // stop() has given up on adapter calls, guarded by libcec_sync
+
 		char *getCecName();
+		void updateLogMask();
+		void releaseWedgedDevice();
+		std::string stats();
+
+		bool isHeld(const KeyList & keys) const;
+		void pressKeys(InputSink & output, const KeyList & keys);
+		void releaseKeys(InputSink & output, const KeyBits & keep);
+		void releaseAllKeys(InputSink & output);
+		void releaseHeldKeys(const char *reason);
+		void releaseStaleKeys();
+		std::chrono::steady_clock::time_point heldKeysDeadline() const;
+		std::chrono::steady_clock::time_point releaseDeadline(std::chrono::steady_clock::time_point now) const;
+		int deliverKey(const CEC::cec_keypress & key, uint64_t time, std::chrono::steady_clock::duration hold);
+		void playMacro(InputSink & output, const Macro & macro, const CEC::cec_keypress & key, std::chrono::steady_clock::time_point releaseBy, std::chrono::steady_clock::time_point now);
+		void runMacros();
+		std::chrono::steady_clock::time_point macrosDeadline() const;
+
+		int handOff();
+		void receiveHandoff();
+		std::string takeOver(const std::string & device);
+		void endTakeover(bool taken);
+
+		void loadState(const std::string & device);
+		void forgetSavedState();
+		std::string findAdapter(const std::string & device);
+		void openAdapter(const std::string & comm, const std::string & device);
+
+		void notifyReady();
+		bool resume(std::chrono::microseconds slept);
+		bool pingAdapter();
+		void dropStaleRestarts();
+		std::chrono::steady_clock::duration pingInterval() const;
+
+		void createOutput();
+		InputSink * currentOutput();
 
 		void push(Command command);
+		Command pop(Lane lane);
+		void execute(const Command & command);
+		void lifecycleLoop();
+		void logLaneStats();
+		void applyPowerCommand(int command);
 
 	public:
 
-		static const std::vector<std::list<__u16>> uinputCecMap;
+		static const UInputKeyMap uinputCecMap;
 
 		int onCecLogMessage(const CEC::cec_log_message &message);
 		int onCecKeyPress(const CEC::cec_keypress &key);
@@ -77,6 +229,22 @@ class Main : public CecCallback {
 		void stop();
 		void restart();
 
+		/**
+		 * Makes this device the active source, as on startup
+		 */
+		void setActiveSource();
+
+		/**
+		 * Presses and releases a key, as if the TV had sent it
+		 */
+		void pressKey(CEC::cec_user_control_code key);
+
+		/**
+		 * Hands over to a fresh copy of the daemon binary, keeping the uinput
+		 * device and key state
+		 */
+		void upgrade();
+
 		void listDevices();
 
 		void setMakeActive(bool active) {this->makeActive = active;};
@@ -84,6 +252,62 @@ class Main : public CecCallback {
 		void setOnStandbyCommand(const std::string &cmd) {this->onStandbyCommand = cmd;};
 		void setOnActivateCommand(const std::string &cmd) {this->onActivateCommand = cmd;};
 		void setOnDeactivateCommand(const std::string &cmd) {this->onDeactivateCommand = cmd;};
-		void setTargetAddress(const HDMI::address & address) {cec.setTargetAddress(address);};
+		void setLogRateLimit(unsigned perSecond) {cecLog.setRateLimit(perSecond);};
+		void setBusStats(bool enabled) {busStatsEnabled = enabled; updateLogMask();};
+		void setSlowCall(int ms);
+		void setKeyTimeout(int ms) {this->keyTimeout = std::chrono::milliseconds(ms);};
+		void setOutputs(const std::string &outputs) {this->outputs = outputs;};
+
+		/**
+		 * Reads key macros from path, one per line: the CEC key name (as
+		 * shown in the log) followed by the macro, see Macro. Throws if any
+		 * of them is wrong.
+		 */
+		void loadMacros(const std::string &path);
+
+		/**
+		 * Delivers keys to sink, instead of creating the outputs set with
+		 * setOutputs(), if called before loop()
+		 */
+		void setOutput(std::unique_ptr<InputSink> sink);
+
+		void setEventSocket(const std::string &path) {this->eventSocket = path;};
+		void setEventRing(unsigned slots) {events.setRingSlots(slots);};
+		void setTraceFile(const std::string &path) {this->traceFile = path;};
+
+		/**
+		 * Starts span tracing, or stops it and saves the trace to the trace
+		 * file. Returns the event socket's reply to a trace request.
+		 */
+		std::string trace(bool on);
+		void setEventListener(std::function<void(const Event &)> listener) {events.setListener(listener);};
+
+		/**
+		 * Runs inside another program (see cecdaemon.h), so leaves signal
+		 * handling to it and sends the service manager nothing
+		 */
+		void setEmbedded(bool embedded);
+		void setPowerDebounce(int ms) {this->powerDebounce = std::chrono::milliseconds(ms);};
+		void setResumeCheck(int ms) {this->resumeCheck = std::chrono::milliseconds(ms);};
+		void setResumeActivate(bool activate) {this->resumeActivate = activate;};
+		void setOpenTimeout(int ms) {this->openTimeout = std::chrono::milliseconds(ms);};
+		void setAdapterTimeout(int ms) {this->adapterTimeout = std::chrono::milliseconds(ms);};
+		Realtime & getRealtime() {return realtime;};
+		void setArguments(int argc, char *argv[]);
+		void setHandoff(int fd) {handoff.attach(fd);};
+		void setStateFile(const std::string &path) {this->stateFile = path;};
+		void setTargetAddress(const HDMI::address & address) {cec->setTargetAddress(address); explicitAddress = true;};
+
+		/**
+		 * Drives the adapter through libcec (the default) or the kernel CEC
+		 * framework. Must come before anything else that touches the adapter.
+		 */
+		void setBackend(const std::string & backend);
+
+		/**
+		 * Drives device instead, such as a simulated adapter. Likewise must
+		 * come first.
+		 */
+		void setDevice(std::unique_ptr<CecDevice> device);
 };
 
@@ -0,0 +1,80 @@
+/**
+ * notify.cpp
+ *
+ * Readiness, status and watchdog notifications for the service manager
+ */
+#include "notify.h"
+#include "log.h"
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace log4cplus;
+
+using std::string;
+
+static Logger logger = Logger::getInstance("notify");
+
+ServiceNotify::ServiceNotify() : fd(-1), watchdogInterval(0) {
+	const char *path = getenv("NOTIFY_SOCKET");
+	if (!path || (path[0] != '/' && path[0] != '@'))
+		return;
+
+	socket = path;
+
+	// Also left set for any daemon we hand over to during an upgrade, see Handoff::spawn()
+	const char *usec = getenv("WATCHDOG_USEC");
+	const char *pid  = getenv("WATCHDOG_PID");
+	if (usec && (!pid || atoi(pid) == getpid()))
+		watchdogInterval = std::chrono::microseconds(strtoull(usec, NULL, 10));
+
+	fd = ::socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		LOG4CPLUS_WARN(logger, "Failed to create notify socket: " << strerror(errno));
+	}
+}
+
+ServiceNotify::~ServiceNotify() {
+	close();
+}
+
+void ServiceNotify::close() {
+	if (fd >= 0)
+		::close(fd);
+	fd = -1;
+	watchdogInterval = std::chrono::microseconds(0);
+}
+
+void ServiceNotify::send(const string & state) const {
+	if (fd < 0)
+		return;
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+
+	if (socket.size() >= sizeof(addr.sun_path)) {
+		LOG4CPLUS_WARN(logger, "NOTIFY_SOCKET is too long");
+		return;
+	}
+	memcpy(addr.sun_path, socket.data(), socket.size());
+
+	// Abstract sockets start with a NUL, and are not NUL terminated
+	socklen_t len = offsetof(struct sockaddr_un, sun_path) + socket.size();
+	if (addr.sun_path[0] == '@')
+		addr.sun_path[0] = '\0';
+	else
+		len++;
+
+	if (sendto(fd, state.data(), state.size(), MSG_NOSIGNAL, (struct sockaddr *) &addr, len) < 0) {
+		LOG4CPLUS_DEBUG(logger, "Failed to notify: " << strerror(errno));
+	} else {
+		LOG4CPLUS_TRACE(logger, "Notified " << state);
+	}
+}
@@ -0,0 +1,53 @@
+#ifndef LIBCEC_DAEMON_NOTIFY_H
+#define LIBCEC_DAEMON_NOTIFY_H
+
+#include <chrono>
+#include <string>
+
+/**
+ * Service manager notifications, as sd_notify() sends them, without
+ * needing libsystemd.
+ *
+ * Does nothing unless NOTIFY_SOCKET is set, which can name a filesystem or
+ * an abstract ('@' prefixed) unix datagram socket, so any stand-in listening
+ * on such a socket can be used for testing.
+ */
+class ServiceNotify {
+private:
+	int fd;
+	std::string socket;
+	std::chrono::microseconds watchdogInterval;
+
+	// Not implemented
+	ServiceNotify(ServiceNotify const&);
+	void operator=(ServiceNotify const&);
+
+public:
+	ServiceNotify();
+	~ServiceNotify();
+
+	bool isEnabled() const { return fd >= 0; }
+
+	/**
+	 * Stops sending notifications, for when the process being supervised
+	 * is not this daemon's
+	 */
+	void close();
+
+	/**
+	 * How often keepalives are expected (WATCHDOG_USEC), zero when the
+	 * watchdog is off
+	 */
+	std::chrono::microseconds getWatchdogInterval() const { return watchdogInterval; }
+
+	/**
+	 * Sends newline separated assignments, such as "READY=1\nSTATUS=Ready".
+	 * Safe to call from any thread.
+	 */
+	void send(const std::string & state) const;
+
+	void status(const std::string & status) const { send("STATUS=" + status); }
+	void watchdog() const { send("WATCHDOG=1"); }
+};
+
+#endif
@@ -0,0 +1,172 @@
+/**
+ * options.cpp
+ *
+ * Built-in command line parser used by minimal builds, see options.h
+ */
+#include "options.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace miniopts {
+
+option_description::option_description(const char *names, value_semantic *semantic, const char *description)
+	: short_name(0), description(description), semantic(semantic)
+{
+	const char *comma = strchr(names, ',');
+	if (comma) {
+		long_name.assign(names, comma - names);
+		short_name = comma[1];
+	} else {
+		long_name = names;
+	}
+}
+
+std::string option_description::format_name() const {
+	std::string name;
+
+	if (short_name) {
+		name = std::string("-") + short_name + " [ --" + long_name + " ]";
+	} else {
+		name = "--" + long_name;
+	}
+
+	if (takes_token())
+		name += " " + semantic->name();
+
+	return name;
+}
+
+const option_description * options_description::find_long(const std::string & name) const {
+	for (std::vector<option_description>::const_iterator i = options.begin(); i != options.end(); ++i) {
+		if (i->long_name == name)
+			return &*i;
+	}
+	return 0;
+}
+
+const option_description * options_description::find_short(char name) const {
+	for (std::vector<option_description>::const_iterator i = options.begin(); i != options.end(); ++i) {
+		if (i->short_name == name)
+			return &*i;
+	}
+	return 0;
+}
+
+std::ostream & operator<<(std::ostream & out, const options_description & desc) {
+	size_t width = 0;
+
+	for (std::vector<option_description>::const_iterator i = desc.options.begin(); i != desc.options.end(); ++i) {
+		width = std::max(width, i->format_name().size());
+	}
+	width = std::min(width, (size_t) 24) + 4;
+
+	out << desc.caption << ":" << std::endl;
+	for (std::vector<option_description>::const_iterator i = desc.options.begin(); i != desc.options.end(); ++i) {
+		std::string name = "  " + i->format_name();
+
+		out << name;
+		if (name.size() + 1 > width) {
+			out << std::endl << std::string(width, ' ');
+		} else {
+			out << std::string(width - name.size(), ' ');
+		}
+		out << i->description << std::endl;
+	}
+	return out;
+}
+
+parsed_options command_line_parser::run() const {
+	parsed_options parsed(desc);
+	size_t positional = 0;
+	bool options_ended = false;
+
+	for (size_t i = 0; i < args.size(); ++i) {
+		const std::string & arg = args[i];
+
+		if (options_ended || arg.size() < 2 || arg[0] != '-') {
+			if (!pos || positional >= pos->names.size())
+				throw error("too many positional options have been specified on the command line");
+			parsed.values.push_back(std::make_pair(pos->names[positional++], arg));
+
+		} else if (arg == "--") {
+			options_ended = true;
+
+		} else if (arg[1] == '-') {
+			// --name or --name=value
+			size_t eq = arg.find('=');
+			std::string name = arg.substr(2, eq == std::string::npos ? std::string::npos : eq - 2);
+
+			const option_description *opt = desc->find_long(name);
+			if (!opt)
+				throw error("unrecognised option '--" + name + "'");
+
+			std::string token;
+			if (opt->takes_token()) {
+				if (eq != std::string::npos) {
+					token = arg.substr(eq + 1);
+				} else if (i + 1 < args.size()) {
+					token = args[++i];
+				} else {
+					throw error("the required argument for option '--" + name + "' is missing");
+				}
+			} else if (eq != std::string::npos) {
+				throw error("option '--" + name + "' does not take any arguments");
+			}
+			parsed.values.push_back(std::make_pair(opt->long_name, token));
+
+		} else {
+			// -n, -nvalue, -n value or grouped flags such as -vv
+			for (size_t j = 1; j < arg.size(); ++j) {
+				const option_description *opt = desc->find_short(arg[j]);
+				if (!opt)
+					throw error(std::string("unrecognised option '-") + arg[j] + "'");
+
+				std::string token;
+				if (opt->takes_token()) {
+					if (j + 1 < arg.size()) {
+						token = arg.substr(j + 1);
+					} else if (i + 1 < args.size()) {
+						token = args[++i];
+					} else {
+						throw error(std::string("the required argument for option '-") + arg[j] + "' is missing");
+					}
+					j = arg.size();
+				}
+				parsed.values.push_back(std::make_pair(opt->long_name, token));
+			}
+		}
+	}
+
+	return parsed;
+}
+
+void store(const parsed_options & options, variables_map & vm) {
+	vm.desc = options.desc;
+
+	for (std::vector< std::pair<std::string, std::string> >::const_iterator i = options.values.begin(); i != options.values.end(); ++i) {
+		const option_description *opt = options.desc->find_long(i->first);
+
+		if (opt->semantic && !opt->semantic->validate(i->second))
+			throw error("the argument ('" + i->second + "') for option '--" + i->first + "' is invalid");
+
+		variable_value & v = vm[i->first];
+		v.token = i->second;
+		v.occurrences++;
+	}
+}
+
+void notify(variables_map & vm) {
+	if (!vm.desc)
+		return;
+
+	for (std::vector<option_description>::const_iterator i = vm.desc->options.begin(); i != vm.desc->options.end(); ++i) {
+		if (!i->semantic)
+			continue;
+
+		variables_map::const_iterator v = vm.find(i->long_name);
+		i->semantic->notify(v == vm.end() ? 0 : &v->second);
+	}
+}
+
+}
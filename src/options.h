@@ -0,0 +1,214 @@
+/**
+ * options.h
+ *
+ * A small stand-in for the parts of boost::program_options used by main(),
+ * used by minimal builds (--enable-minimal) so boost is not required.
+ *
+ * Supports long (--name, --name=value) and short (-n, -nvalue, -vv)
+ * options, flags, typed values, accumulating flags and positional options.
+ */
+#ifndef LIBCEC_DAEMON_OPTIONS_H
+#define LIBCEC_DAEMON_OPTIONS_H
+
+#include <map>
+#include <memory>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace miniopts {
+
+	class error : public std::runtime_error {
+	public:
+		explicit error(const std::string & what) : std::runtime_error(what) {}
+	};
+
+	template<typename T> bool parse_token(const std::string & token, T & val) {
+		std::istringstream ss(token);
+		ss >> val;
+		return !ss.fail();
+	}
+
+	inline bool parse_token(const std::string & token, std::string & val) {
+		val = token;
+		return true;
+	}
+
+	class value_semantic;
+
+	class variable_value {
+	public:
+		variable_value() : occurrences(0) {}
+
+		std::string token;
+		unsigned occurrences;
+
+		template<typename T> T as() const {
+			T val = T();
+			parse_token(token, val);
+			return val;
+		}
+	};
+
+	class value_semantic {
+	public:
+		virtual ~value_semantic() {}
+
+		virtual std::string name() const = 0;
+		virtual bool takes_token() const = 0;
+		virtual bool validate(const std::string & token) const = 0;
+		virtual void notify(const variable_value * value) const = 0;
+	};
+
+	template<typename T> class typed_value : public value_semantic {
+	private:
+		T *store;
+		std::string val_name;
+
+	public:
+		explicit typed_value(T *store) : store(store), val_name("arg") {}
+
+		typed_value * value_name(const char *name) { val_name = name; return this; }
+
+		std::string name() const { return val_name; }
+		bool takes_token() const { return true; }
+
+		bool validate(const std::string & token) const {
+			T val;
+			return parse_token(token, val);
+		}
+
+		void notify(const variable_value * value) const {
+			if (store && value)
+				*store = value->as<T>();
+		}
+	};
+
+	/**
+	 * Every appearance of the option increments the stored value
+	 */
+	template<typename T> class accumulator_type : public value_semantic {
+	private:
+		T *store;
+		T interval;
+		T def;
+
+	public:
+		explicit accumulator_type(T *store) : store(store), interval(1), def(0) {}
+
+		accumulator_type * implicit_value(const T & t) { interval = t; return this; }
+		accumulator_type * default_value(const T & t) { def = t; return this; }
+
+		std::string name() const { return std::string(); }
+		bool takes_token() const { return false; }
+		bool validate(const std::string &) const { return true; }
+
+		void notify(const variable_value * value) const {
+			if (store)
+				*store = def + (value ? value->occurrences : 0) * interval;
+		}
+	};
+
+	template<typename T> typed_value<T> * value(T *store = 0) {
+		return new typed_value<T>(store);
+	}
+
+	template<typename T> accumulator_type<T> * accumulator(T *store = 0) {
+		return new accumulator_type<T>(store);
+	}
+
+	class option_description {
+	public:
+		option_description(const char *names, value_semantic *semantic, const char *description);
+
+		std::string long_name;
+		char short_name;
+		std::string description;
+		std::shared_ptr<value_semantic> semantic;
+
+		bool takes_token() const { return semantic && semantic->takes_token(); }
+		std::string format_name() const;
+	};
+
+	class options_description {
+	private:
+		std::string caption;
+
+	public:
+		class easy_init {
+		private:
+			options_description *owner;
+
+		public:
+			explicit easy_init(options_description *owner) : owner(owner) {}
+
+			easy_init & operator()(const char *names, const char *description) {
+				owner->options.push_back(option_description(names, 0, description));
+				return *this;
+			}
+
+			easy_init & operator()(const char *names, value_semantic *semantic, const char *description) {
+				owner->options.push_back(option_description(names, semantic, description));
+				return *this;
+			}
+		};
+
+		explicit options_description(const std::string & caption) : caption(caption) {}
+
+		easy_init add_options() { return easy_init(this); }
+
+		const option_description * find_long(const std::string & name) const;
+		const option_description * find_short(char name) const;
+
+		std::vector<option_description> options;
+
+		friend std::ostream & operator<<(std::ostream & out, const options_description & desc);
+	};
+
+	class positional_options_description {
+	public:
+		positional_options_description & add(const char *name, unsigned max_count) {
+			names.insert(names.end(), max_count, name);
+			return *this;
+		}
+
+		std::vector<std::string> names;
+	};
+
+	class parsed_options {
+	public:
+		explicit parsed_options(const options_description *desc) : desc(desc) {}
+
+		const options_description *desc;
+		std::vector< std::pair<std::string, std::string> > values;
+	};
+
+	class command_line_parser {
+	private:
+		std::vector<std::string> args;
+		const options_description *desc;
+		const positional_options_description *pos;
+
+	public:
+		command_line_parser(int argc, char *argv[]) : args(argv + 1, argv + argc), desc(0), pos(0) {}
+
+		command_line_parser & options(const options_description & d) { desc = &d; return *this; }
+		command_line_parser & positional(const positional_options_description & p) { pos = &p; return *this; }
+
+		parsed_options run() const;
+	};
+
+	class variables_map : public std::map<std::string, variable_value> {
+	public:
+		const options_description *desc;
+
+		variables_map() : desc(0) {}
+	};
+
+	void store(const parsed_options & options, variables_map & vm);
+	void notify(variables_map & vm);
+}
+
+#endif // LIBCEC_DAEMON_OPTIONS_H
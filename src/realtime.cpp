@@ -0,0 +1,246 @@
+/**
+ * realtime.cpp
+ *
+ * Memory locking, real-time scheduling and CPU pinning for the input path
+ */
+#include "realtime.h"
+#include "config.h"
+#include "log.h"
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <new>
+#include <sstream>
+#include <stdexcept>
+
+#include <pthread.h>
+#include <sys/mman.h>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+using namespace log4cplus;
+
+using std::string;
+
+static Logger logger = Logger::getInstance("realtime");
+
+// How much stack to touch up front on each real-time thread
+static const size_t PREFAULT_STACK = 256 * 1024;
+
+// Set once a thread has been configured, so each thread is only set up once
+static thread_local bool threadConfigured = false;
+
+static bool realtimeEnabled = false;
+
+// The CPUs the daemon was allowed to run on before any thread was pinned
+static cpu_set_t startCpus;
+
+static uint64_t nowMicros() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * Parses a list of CPUs such as "0", "1,3" or "0-2"
+ */
+static void parseCpuList(const string & list, cpu_set_t & cpus) {
+	std::istringstream ss(list);
+	string item;
+
+	CPU_ZERO(&cpus);
+	while (std::getline(ss, item, ',')) {
+		char *end;
+		unsigned long first = strtoul(item.c_str(), &end, 10);
+		unsigned long last  = first;
+
+		if (end == item.c_str())
+			throw std::runtime_error("Invalid CPU list " + list);
+		if (*end == '-')
+			last = strtoul(end + 1, &end, 10);
+		if (*end != '\0' || last < first || last >= CPU_SETSIZE)
+			throw std::runtime_error("Invalid CPU list " + list);
+
+		for (unsigned long cpu = first; cpu <= last; cpu++)
+			CPU_SET(cpu, &cpus);
+	}
+}
+
+static void prefaultStack() {
+	volatile char stack[PREFAULT_STACK];
+	for (size_t i = 0; i < sizeof(stack); i += 4096)
+		stack[i] = 0;
+}
+
+Realtime::Realtime() : enabled(false), policy(SCHED_FIFO), priority(50) {
+	CPU_ZERO(&cecCpus);
+	CPU_ZERO(&deliveryCpus);
+}
+
+void Realtime::setPolicy(const string & policy) {
+	if (policy == "fifo") {
+		this->policy = SCHED_FIFO;
+	} else if (policy == "rr") {
+		this->policy = SCHED_RR;
+	} else {
+		throw std::runtime_error("Unknown scheduling policy " + policy + ", expected fifo or rr");
+	}
+}
+
+void Realtime::setCecCpus(const string & cpus) {
+	parseCpuList(cpus, cecCpus);
+}
+
+void Realtime::setDeliveryCpus(const string & cpus) {
+	parseCpuList(cpus, deliveryCpus);
+}
+
+void Realtime::start() {
+	if (!enabled)
+		return;
+
+	realtimeEnabled = true;
+
+	if (CPU_COUNT(&startCpus) == 0 && sched_getaffinity(0, sizeof(startCpus), &startCpus) < 0)
+		CPU_ZERO(&startCpus);
+
+	if (priority < sched_get_priority_min(policy) || priority > sched_get_priority_max(policy)) {
+		throw std::runtime_error("Real-time priority out of range");
+	}
+
+#ifdef __GLIBC__
+	// Never hand memory back to the kernel, so it never has to be faulted in again
+	mallopt(M_TRIM_THRESHOLD, -1);
+	mallopt(M_MMAP_MAX, 0);
+#endif
+
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+		LOG4CPLUS_WARN(logger, "Failed to lock memory: " << strerror(errno));
+	} else {
+		LOG4CPLUS_INFO(logger, "Locked memory");
+	}
+}
+
+void Realtime::configureThread(const char *name, const cpu_set_t & cpus) {
+	threadConfigured = true;
+
+	prefaultStack();
+
+	struct sched_param param;
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = priority;
+
+	int ret = pthread_setschedparam(pthread_self(), policy, &param);
+	if (ret) {
+		LOG4CPLUS_WARN(logger, "Failed to set real-time scheduling for " << name << " thread: " << strerror(ret));
+	}
+
+	if (CPU_COUNT(&cpus) > 0) {
+		ret = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+		if (ret) {
+			LOG4CPLUS_WARN(logger, "Failed to pin " << name << " thread: " << strerror(ret));
+		}
+	}
+
+	LOG4CPLUS_INFO(logger, "Configured " << name << " thread for "
+		<< (policy == SCHED_FIFO ? "SCHED_FIFO" : "SCHED_RR") << " priority " << priority);
+}
+
+void Realtime::enterDelivery() {
+	if (enabled && !threadConfigured)
+		configureThread("delivery", deliveryCpus);
+}
+
+void Realtime::enterCec() {
+	if (enabled && !threadConfigured)
+		configureThread("libcec", cecCpus);
+}
+
+void Realtime::enterNormal(const char *name) {
+	/* never made real-time by enterCec() either, should it call back */
+	threadConfigured = true;
+
+	if (!realtimeEnabled)
+		return;
+
+	struct sched_param param;
+	memset(&param, 0, sizeof(param));
+
+	int ret = pthread_setschedparam(pthread_self(), SCHED_OTHER, &param);
+	if (ret) {
+		LOG4CPLUS_WARN(logger, "Failed to set normal scheduling for " << name << " thread: " << strerror(ret));
+	}
+
+	if (CPU_COUNT(&startCpus) > 0) {
+		ret = pthread_setaffinity_np(pthread_self(), sizeof(startCpus), &startCpus);
+		if (ret) {
+			LOG4CPLUS_WARN(logger, "Failed to unpin " << name << " thread: " << strerror(ret));
+		}
+	}
+
+	LOG4CPLUS_INFO(logger, "Configured " << name << " thread for SCHED_OTHER");
+}
+
+#ifdef HOTPATH_CHECK
+
+/*
+** Count heap allocations made by each thread while inside a HotPath
+*/
+
+static thread_local unsigned hotPathDepth = 0;
+static thread_local unsigned hotPathAllocations = 0;
+
+void *operator new(size_t size) {
+	if (hotPathDepth)
+		hotPathAllocations++;
+
+	void *p = malloc(size ? size : 1);
+	if (!p)
+		throw std::bad_alloc();
+	return p;
+}
+
+void operator delete(void *p) noexcept {
+	free(p);
+}
+
+#endif // HOTPATH_CHECK
+
+HotPath::HotPath(const char *name) : name(name), start(0), allocations(0) {
+#ifdef HOTPATH_CHECK
+	hotPathDepth++;
+	allocations = hotPathAllocations;
+#endif
+	if (realtimeEnabled)
+		start = nowMicros();
+}
+
+HotPath::~HotPath() {
+#ifdef HOTPATH_CHECK
+	hotPathDepth--;
+
+	unsigned count = allocationCount();
+	if (count) {
+		LOG4CPLUS_WARN(logger, name << " made " << count << " heap allocations");
+	}
+#endif
+
+	if (start) {
+		uint64_t took = nowMicros() - start;
+		if (took > MAX_MICROS) {
+			LOG4CPLUS_WARN(logger, name << " took " << took << "us, it may have blocked");
+		}
+	}
+}
+
+unsigned HotPath::allocationCount() const {
+#ifdef HOTPATH_CHECK
+	return hotPathAllocations - allocations;
+#else
+	return 0;
+#endif
+}
@@ -0,0 +1,89 @@
+#ifndef LIBCEC_DAEMON_REALTIME_H
+#define LIBCEC_DAEMON_REALTIME_H
+
+#include <sched.h>
+
+#include <cstdint>
+#include <string>
+
+/**
+ * Optional real-time setup for the input path (--realtime).
+ *
+ * When enabled, all memory is locked and stacks are pre-faulted so nothing
+ * on the input path can page fault, and the delivery thread (the one running
+ * Main::loop) and the libcec callback threads run under SCHED_FIFO or SCHED_RR,
+ * optionally pinned to chosen CPUs.
+ */
+class Realtime {
+private:
+	bool enabled;
+	int policy;
+	int priority;
+	cpu_set_t cecCpus;      // empty means leave the affinity alone
+	cpu_set_t deliveryCpus;
+
+	void configureThread(const char *name, const cpu_set_t & cpus);
+
+public:
+	Realtime();
+
+	void setEnabled(bool enabled) { this->enabled = enabled; }
+	void setPriority(int priority) { this->priority = priority; }
+	void setPolicy(const std::string & policy);
+	void setCecCpus(const std::string & cpus);
+	void setDeliveryCpus(const std::string & cpus);
+
+	bool isEnabled() const { return enabled; }
+
+	/**
+	 * Locks memory, should be called once early on, before other threads exist
+	 */
+	void start();
+
+	/**
+	 * Configures the calling thread as the delivery thread
+	 */
+	void enterDelivery();
+
+	/**
+	 * Configures the calling libcec callback thread, the first time it is
+	 * seen. Cheap enough to call on every callback.
+	 */
+	void enterCec();
+
+	/**
+	 * Puts the calling thread back under normal scheduling, on the CPUs the
+	 * daemon started with, and keeps it there, for threads that may be
+	 * started from a real-time one but have no business being real-time
+	 */
+	static void enterNormal(const char *name);
+};
+
+/**
+ * Marks a section of the input path that must neither allocate nor block.
+ *
+ * In realtime mode, a section that takes longer than MAX_MICROS is reported,
+ * as that usually means it blocked. Builds configured with
+ * --enable-hotpath-check also count heap allocations made inside the section
+ * and report any.
+ */
+class HotPath {
+private:
+	const char *name;
+	uint64_t start;
+	unsigned allocations;
+
+public:
+	static const uint64_t MAX_MICROS = 2000;
+
+	explicit HotPath(const char *name);
+	~HotPath();
+
+	/**
+	 * Number of heap allocations made so far inside this section, always 0
+	 * unless built with --enable-hotpath-check
+	 */
+	unsigned allocationCount() const;
+};
+
+#endif
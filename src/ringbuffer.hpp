@@ -0,0 +1,67 @@
+// ringbuffer.hpp header file
+//
+// Fixed capacity FIFO queue. Storage is allocated inline, so pushing and
+// popping never touches the heap. Elements are copy constructed in place,
+// which allows types with const members (such as Command).
+
+#ifndef LIBCEC_DAEMON_RINGBUFFER_HPP
+#define LIBCEC_DAEMON_RINGBUFFER_HPP
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+
+template<typename T, size_t N>
+class RingBuffer
+{
+public:
+
+    RingBuffer() : head(0), count(0) {}
+
+    ~RingBuffer() {
+        clear();
+    }
+
+    bool empty() const { return count == 0; }
+    bool full()  const { return count == N; }
+    size_t size() const { return count; }
+    static size_t capacity() { return N; }
+
+    /// Appends a copy of t, returns false if the buffer is full
+    bool push(const T & t) {
+        if (full())
+            return false;
+        new (slot((head + count) % N)) T(t);
+        count++;
+        return true;
+    }
+
+    T & front() { return *slot(head); }
+    const T & front() const { return *slot(head); }
+
+    void pop() {
+        slot(head)->~T();
+        head = (head + 1) % N;
+        count--;
+    }
+
+    void clear() {
+        while (!empty())
+            pop();
+    }
+
+private:
+
+    // Not copyable
+    RingBuffer(RingBuffer const&);
+    void operator=(RingBuffer const&);
+
+    T * slot(size_t i) { return reinterpret_cast<T *>(&storage[i]); }
+    const T * slot(size_t i) const { return reinterpret_cast<const T *>(&storage[i]); }
+
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type storage[N];
+    size_t head;
+    size_t count;
+};
+
+#endif
@@ -0,0 +1,148 @@
+/**
+ * simcec.cpp
+ *
+ * A simulated adapter with injectable faults, for soak testing
+ */
+#include "simcec.h"
+#include "log.h"
+
+#include <cstring>
+#include <stdexcept>
+#include <thread>
+
+using namespace CEC;
+using namespace log4cplus;
+
+using std::string;
+
+static Logger logger = Logger::getInstance("sim");
+
+static const char COMM[] = "sim";
+
+// Where the simulated adapter sits on the bus
+static const uint16_t PHYSICAL_ADDRESS = 0x1000;
+
+SimCec::SimCec(CecCallback *callback, unsigned seed) : callback(callback), connected(false), random(seed),
+	dropRate(0.0), maxAckDelay(0), opens(0) {}
+
+std::ostream & SimCec::listDevices(std::ostream & out) {
+	return out << "Found devices: 1" << std::endl << std::endl << "[0] " << COMM << std::endl;
+}
+
+string SimCec::findAdapter(const string & adapter) {
+	LOG4CPLUS_TRACE_STR(logger, "SimCec::findAdapter()");
+	if (!adapter.empty() && adapter != COMM)
+		throw std::runtime_error("Simulated adapter " + adapter + " not found");
+	return COMM;
+}
+
+void SimCec::openAdapter(const string & comm) {
+	LOG4CPLUS_TRACE_STR(logger, "SimCec::openAdapter()");
+
+	std::lock_guard<std::mutex> lock(callbackSync);
+	connected = true;
+	opens++;
+
+	libcec_configuration configuration;
+	configuration.Clear();
+	configuration.iPhysicalAddress = PHYSICAL_ADDRESS;
+	configuration.baseDevice       = CECDEVICE_TV;
+	configuration.iHDMIPort        = 1;
+	configuration.logicalAddresses.Clear();
+	configuration.logicalAddresses.Set(CECDEVICE_RECORDINGDEVICE1);
+	configuration.logicalAddresses.primary = CECDEVICE_RECORDINGDEVICE1;
+
+	callback->onCecConfigurationChanged(configuration);
+}
+
+void SimCec::close(bool makeInactive) {
+	LOG4CPLUS_TRACE_STR(logger, "SimCec::close()");
+
+	if (makeInactive && isConnected())
+		ack();
+
+	std::lock_guard<std::mutex> lock(callbackSync);
+	connected = false;
+}
+
+void SimCec::makeActive() {
+	if (!isConnected())
+		throw std::runtime_error("Simulated adapter is closed");
+	ack();
+}
+
+bool SimCec::ping() {
+	ack();
+	return isConnected();
+}
+
+bool SimCec::isConnected() {
+	std::lock_guard<std::mutex> lock(callbackSync);
+	return connected;
+}
+
+/**
+ * Whether the next frame is lost on the bus
+ */
+bool SimCec::dropped() {
+	std::lock_guard<std::mutex> lock(sync);
+	return dropRate > 0.0 && std::uniform_real_distribution<double>(0.0, 1.0)(random) < dropRate;
+}
+
+/**
+ * Waits for a frame the daemon sent to be acked
+ */
+void SimCec::ack() {
+	std::chrono::milliseconds delay(0);
+	{
+		std::lock_guard<std::mutex> lock(sync);
+		if (maxAckDelay.count() > 0)
+			delay = std::chrono::milliseconds(std::uniform_int_distribution<int>(0, maxAckDelay.count())(random));
+	}
+	std::this_thread::sleep_for(delay);
+}
+
+void SimCec::setDropRate(double rate) {
+	std::lock_guard<std::mutex> lock(sync);
+	dropRate = rate;
+}
+
+void SimCec::setMaxAckDelay(std::chrono::milliseconds delay) {
+	std::lock_guard<std::mutex> lock(sync);
+	maxAckDelay = delay;
+}
+
+bool SimCec::key(cec_user_control_code code, unsigned duration) {
+	if (dropped())
+		return false;
+
+	std::lock_guard<std::mutex> lock(callbackSync);
+	if (!connected)
+		return false;
+
+	cec_keypress key;
+	key.keycode = code;
+	key.duration = duration;
+
+	// As libcec's callback trampolines do, so a failure is the daemon's problem alone
+	try {
+		callback->onCecKeyPress(key);
+	} catch (...) {}
+	return true;
+}
+
+bool SimCec::alert(libcec_alert alert) {
+	std::lock_guard<std::mutex> lock(callbackSync);
+	if (!connected)
+		return false;
+
+	if (alert != CEC_ALERT_SERVICE_DEVICE && alert != CEC_ALERT_TV_POLL_FAILED)
+		connected = false;
+
+	libcec_parameter param;
+	memset(&param, 0, sizeof(param));
+	try {
+		callback->onCecAlert(alert, param);
+	} catch (...) {}
+	return true;
+}
@@ -0,0 +1,91 @@
+#ifndef LIBCEC_DAEMON_SIMCEC_H
+#define LIBCEC_DAEMON_SIMCEC_H
+
+#include "cecdevice.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <random>
+#include <string>
+
+/**
+ * A simulated adapter, for exercising the daemon with no hardware and no
+ * libcec: cec-soak drives it to press keys, and to inject the faults real
+ * adapters have, while the daemon treats it like any other backend.
+ *
+ * Whatever calls key() and alert() plays the part of libcec's callback
+ * threads. Callbacks are never made while the adapter is closed, and close()
+ * waits for any in progress, as libcec does.
+ */
+class SimCec : public CecDevice {
+	private:
+		CecCallback *callback;
+
+		// Serialises callbacks with opening and closing
+		std::mutex callbackSync;
+		bool connected;                       // guarded by callbackSync
+
+		std::mutex sync;                      // guards the faults and random
+		std::mt19937 random;
+		double dropRate;
+		std::chrono::milliseconds maxAckDelay;
+
+		std::atomic<uint64_t> opens;
+
+		bool dropped();
+		void ack();
+
+		// Not implemented
+		SimCec(SimCec const&);
+		void operator=(SimCec const&);
+
+	public:
+		explicit SimCec(CecCallback *callback, unsigned seed = 1);
+
+		std::ostream & listDevices(std::ostream & out);
+		void init() {}
+		std::string findAdapter(const std::string &adapter = "");
+		void openAdapter(const std::string &comm);
+		void close(bool makeInactive = true);
+		void setLogMask(int mask) {}
+		void makeActive();
+		void setTargetAddress(const HDMI::address & address) {}
+		void clearTargetAddress() {}
+		bool ping();
+
+		/**
+		 * Frames are lost on the bus this often, from 0 to 1
+		 */
+		void setDropRate(double rate);
+
+		/**
+		 * Frames the daemon sends are acked after a random delay of up to
+		 * this long, holding up the call that sent them
+		 */
+		void setMaxAckDelay(std::chrono::milliseconds delay);
+
+		/**
+		 * The TV sending a key press (duration 0) or release. Returns false
+		 * if the frame never reached the daemon, as it was dropped or the
+		 * adapter was closed.
+		 */
+		bool key(CEC::cec_user_control_code code, unsigned duration);
+
+		/**
+		 * Raises an alert, as libcec does when the adapter fails. Alerts that
+		 * mean the connection is gone also disconnect it, until reopened.
+		 * Returns false if the adapter was closed.
+		 */
+		bool alert(CEC::libcec_alert alert);
+
+		bool isConnected();
+
+		/**
+		 * Times the adapter has been opened
+		 */
+		uint64_t openCount() const { return opens; }
+};
+
+#endif
@@ -0,0 +1,228 @@
+/**
+ * sink.cpp
+ *
+ * Input sinks other than uinput
+ */
+#include "sink.h"
+#include "trace.h"
+#include "log.h"
+
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <ctime>
+#include <exception>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace log4cplus;
+
+using std::string;
+
+static Logger logger = Logger::getInstance("sink");
+
+void InputSink::sync() {
+	Trace::Span span("InputSink::sync");
+	send_event(EV_SYN, SYN_REPORT, 0);
+}
+
+void InputSink::timestamp(uint64_t micros) {
+	send_event(EV_MSC, MSC_TIMESTAMP, (__s32) (uint32_t) micros);
+}
+
+RecordingSink::RecordingSink(size_t limit) : limit(limit), count(0) {
+	recorded.reserve(limit);
+}
+
+void RecordingSink::send_event(__u16 type, __u16 code, __s32 value) {
+	count++;
+	if (recorded.size() >= limit)
+		return;
+
+	struct input_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.type  = type;
+	ev.code  = code;
+	ev.value = value;
+	recorded.push_back(ev);
+}
+
+void RecordingSink::clear() {
+	recorded.clear();
+	count = 0;
+}
+
+StreamSink::StreamSink(int fd, const string & name) : fd(fd), name(name), isSocket(false), dead(false), frameSize(0), dropped(0) {
+	struct stat st;
+	isSocket = fstat(fd, &st) == 0 && S_ISSOCK(st.st_mode);
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	LOG4CPLUS_INFO(logger, "Sending input events to " << name);
+}
+
+StreamSink::~StreamSink() {
+	if (dropped) {
+		LOG4CPLUS_WARN(logger, "Dropped " << dropped << " input frames for " << name);
+	}
+	close(fd);
+}
+
+StreamSink *StreamSink::connect(const string & path) {
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+
+	if (path.size() >= sizeof(addr.sun_path)) {
+		throw std::runtime_error("Output socket path is too long");
+	}
+	strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		throw std::runtime_error("Failed to create output socket");
+	}
+
+	if (::connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+		LOG4CPLUS_ERROR(logger, "Failed to connect to " << path << ": " << strerror(errno));
+		close(fd);
+		throw std::runtime_error("Failed to connect output socket");
+	}
+
+	return new StreamSink(fd, path);
+}
+
+StreamSink *StreamSink::open(const string & path) {
+	// Non blocking, so opening a FIFO nobody reads from fails rather than hangs
+	int fd = ::open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_NONBLOCK | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		LOG4CPLUS_ERROR(logger, "Failed to open " << path << ": " << strerror(errno));
+		throw std::runtime_error("Failed to open output file");
+	}
+
+	return new StreamSink(fd, path);
+}
+
+void StreamSink::send_event(__u16 type, __u16 code, __s32 value) {
+	if (dead)
+		return;
+
+	if (frameSize == MAX_FRAME)
+		flush();
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	// Nothing stamps these on the way, unlike with uinput
+	struct input_event & ev = frame[frameSize++];
+	memset(&ev, 0, sizeof(ev));
+#ifdef input_event_sec
+	ev.input_event_sec  = ts.tv_sec;
+	ev.input_event_usec = ts.tv_nsec / 1000;
+#else
+	ev.time.tv_sec  = ts.tv_sec;
+	ev.time.tv_usec = ts.tv_nsec / 1000;
+#endif
+	ev.type  = type;
+	ev.code  = code;
+	ev.value = value;
+}
+
+void StreamSink::sync() {
+	InputSink::sync();
+	flush();
+}
+
+/**
+ * Writes to a pipe whose reader may have gone away, without the SIGPIPE that
+ * would kill the daemon, or its host if embedded: the signal is blocked for
+ * this thread only while writing, and any it raised taken before unblocking
+ * it, so the process's signal handling is never touched
+ */
+static ssize_t writePipe(int fd, const void *buf, size_t len) {
+	sigset_t pipeSet, pending, old;
+	sigemptyset(&pipeSet);
+	sigaddset(&pipeSet, SIGPIPE);
+
+	sigpending(&pending);
+	bool wasPending = sigismember(&pending, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &pipeSet, &old);
+
+	ssize_t ret = write(fd, buf, len);
+	int error = errno;
+
+	if (ret < 0 && error == EPIPE && !wasPending) {
+		struct timespec none = { 0, 0 };
+		while (sigtimedwait(&pipeSet, NULL, &none) < 0 && errno == EINTR) {
+		}
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	errno = error;
+	return ret;
+}
+
+void StreamSink::flush() {
+	size_t len = frameSize * sizeof(frame[0]);
+	frameSize = 0;
+
+	if (dead || len == 0)
+		return;
+
+	// A consumer that went away is an EPIPE like any other failure
+	ssize_t ret = isSocket ? send(fd, frame, len, MSG_NOSIGNAL) : writePipe(fd, frame, len);
+	if (ret == (ssize_t) len)
+		return;
+
+	if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		dropped++;
+		return;
+	}
+
+	// A partial write would leave the consumer out of step, so give up on it too
+	if (ret < 0) {
+		LOG4CPLUS_ERROR(logger, "Failed to write to " << name << ": " << strerror(errno) << ", no longer sending to it");
+	} else {
+		LOG4CPLUS_ERROR(logger, "Short write to " << name << ", no longer sending to it");
+	}
+	dead = true;
+}
+
+void FanOutSink::send_event(__u16 type, __u16 code, __s32 value) {
+	std::exception_ptr failure;
+
+	for (std::vector< std::unique_ptr<InputSink> >::iterator s = sinks.begin(); s != sinks.end(); ++s) {
+		try {
+			(*s)->send_event(type, code, value);
+		} catch (...) {
+			if (!failure)
+				failure = std::current_exception();
+		}
+	}
+
+	if (failure)
+		std::rethrow_exception(failure);
+}
+
+void FanOutSink::sync() {
+	std::exception_ptr failure;
+
+	for (std::vector< std::unique_ptr<InputSink> >::iterator s = sinks.begin(); s != sinks.end(); ++s) {
+		try {
+			(*s)->sync();
+		} catch (...) {
+			if (!failure)
+				failure = std::current_exception();
+		}
+	}
+
+	if (failure)
+		std::rethrow_exception(failure);
+}
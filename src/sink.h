@@ -0,0 +1,125 @@
+#ifndef LIBCEC_DAEMON_SINK_H
+#define LIBCEC_DAEMON_SINK_H
+
+#include <linux/input.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+/**
+ * Somewhere to deliver input events to. Main writes keys to one of these,
+ * so the key path does not care whether they end up in uinput, in memory,
+ * with a remote consumer, or in several of these at once.
+ *
+ * Events are grouped into frames, each ended by sync(). Sinks are only used
+ * by one thread at a time.
+ */
+class InputSink {
+public:
+	virtual ~InputSink() {}
+
+	virtual void send_event(__u16 type, __u16 code, __s32 value) = 0;
+
+	/**
+	 * Ends the current frame
+	 */
+	virtual void sync();
+
+	/**
+	 * Stamps the current frame with the time its input really arrived, as
+	 * CLOCK_MONOTONIC microseconds. uinput overwrites input_event.time, so
+	 * this is sent as MSC_TIMESTAMP (truncated to 32 bits, so it wraps about
+	 * every 71 minutes), which readers can compare with the evdev timestamp
+	 * of the frame to see how late it was delivered.
+	 */
+	virtual void timestamp(uint64_t micros);
+};
+
+/**
+ * Keeps the events sent to it in memory, for cec-sinkbench (src/sinkbench.cpp)
+ * and tests. Only the first limit
+ * events are kept, though all of them are counted, so with a limit of 0 this
+ * just discards events.
+ */
+class RecordingSink : public InputSink {
+private:
+	std::vector<struct input_event> recorded;
+	size_t limit;
+	uint64_t count;
+
+public:
+	explicit RecordingSink(size_t limit = 1024);
+
+	void send_event(__u16 type, __u16 code, __s32 value);
+
+	const std::vector<struct input_event> & events() const { return recorded; }
+	uint64_t eventCount() const { return count; }
+	void clear();
+};
+
+/**
+ * Writes events to a pipe, socket or file, as raw struct input_event just
+ * as evdev would, so remote consumers can reuse evdev parsing code. Each frame
+ * is written in one go when it ends. A consumer that can't keep up has
+ * frames dropped rather than holding up the key path, and one that goes away
+ * is no longer written to.
+ */
+class StreamSink : public InputSink {
+private:
+	static const size_t MAX_FRAME = 64;
+
+	int fd;
+	std::string name;
+	bool isSocket; // sent to with MSG_NOSIGNAL, rather than written to
+	bool dead;
+	struct input_event frame[MAX_FRAME];
+	size_t frameSize;
+	uint64_t dropped;
+
+	void flush();
+
+	// Not implemented
+	StreamSink(StreamSink const&);
+	void operator=(StreamSink const&);
+
+public:
+	/**
+	 * Takes ownership of fd
+	 */
+	StreamSink(int fd, const std::string & name);
+	virtual ~StreamSink();
+
+	/**
+	 * Connects to the stream socket at path
+	 */
+	static StreamSink *connect(const std::string & path);
+
+	/**
+	 * Opens path for appending, creating it if needed
+	 */
+	static StreamSink *open(const std::string & path);
+
+	void send_event(__u16 type, __u16 code, __s32 value);
+	void sync();
+};
+
+/**
+ * Passes every event on to several sinks. A sink that fails does not stop the
+ * others getting the event, though the first failure is rethrown afterwards.
+ */
+class FanOutSink : public InputSink {
+private:
+	std::vector< std::unique_ptr<InputSink> > sinks;
+
+public:
+	void add(std::unique_ptr<InputSink> sink) { sinks.push_back(std::move(sink)); }
+	size_t size() const { return sinks.size(); }
+
+	void send_event(__u16 type, __u16 code, __s32 value);
+	void sync();
+};
+
+#endif
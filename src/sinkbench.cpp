@@ -0,0 +1,150 @@
+/**
+ * sinkbench.cpp
+ *
+ * cec-sinkbench: pushes key presses and releases through Main::onCecKeyPress()
+ * into a RecordingSink as fast as they will go, reporting how many events a
+ * second the key path delivers, and checking the frames it recorded are
+ * exactly the ones each key should make
+ */
+#include "main.h"
+#include "sink.h"
+#include "checks.h"
+#include "log.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+#include <getopt.h>
+
+using namespace CEC;
+using namespace log4cplus;
+
+using std::cerr;
+using std::endl;
+
+typedef std::chrono::steady_clock Clock;
+
+// Keys that map to a single uinput key and no macro, with what they map to
+static const struct {
+	cec_user_control_code code;
+	__u16 key;
+} keys[] = {
+	{ CEC_USER_CONTROL_CODE_UP,    KEY_UP },
+	{ CEC_USER_CONTROL_CODE_DOWN,  KEY_DOWN },
+	{ CEC_USER_CONTROL_CODE_LEFT,  KEY_LEFT },
+	{ CEC_USER_CONTROL_CODE_RIGHT, KEY_RIGHT },
+};
+static const size_t KEYS = sizeof(keys) / sizeof(keys[0]);
+
+// A press and a release each make a frame of a timestamp, a key and a sync
+static const size_t EVENTS_PER_KEY = 6;
+
+static Checks checks;
+
+static bool isEvent(const struct input_event & ev, __u16 type, __u16 code, __s32 value) {
+	return ev.type == type && ev.code == code && ev.value == value;
+}
+
+/**
+ * Whether the events recorded are the frames for pressing and releasing
+ * each key in turn, starting from the first
+ */
+static bool framesMatch(const std::vector<struct input_event> & events) {
+	if (events.size() % EVENTS_PER_KEY)
+		return false;
+
+	for (size_t i = 0; i < events.size(); i += EVENTS_PER_KEY) {
+		__u16 key = keys[(i / EVENTS_PER_KEY) % KEYS].key;
+		for (int value = 1; value >= 0; value--) {
+			const struct input_event *frame = &events[i + (1 - value) * EVENTS_PER_KEY / 2];
+			if (frame[0].type != EV_MSC || frame[0].code != MSC_TIMESTAMP
+					|| !isEvent(frame[1], EV_KEY, key, value)
+					|| !isEvent(frame[2], EV_SYN, SYN_REPORT, 0))
+				return false;
+		}
+	}
+	return true;
+}
+
+static void usage(const char *name) {
+	cerr << "Usage: " << name << " [options]" << endl
+	     << "  -n <n>  keys to press and release in each run (default 200000)" << endl
+	     << "  -r <n>  number of runs (default 5)" << endl
+	     << "  -c <n>  record and check the events of the first n keys of each run (default 1000)" << endl
+	     << "  -v      log the daemon's messages (-vv for debug, which slows it down)" << endl
+	     << "  -h      show this help" << endl;
+}
+
+int main(int argc, char *argv[]) {
+	unsigned long count = 200000;
+	unsigned runs = 5;
+	unsigned long checked = 1000;
+	int verbose = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:r:c:vh")) != -1) {
+		switch (opt) {
+			case 'n': count = strtoul(optarg, NULL, 10); break;
+			case 'r': runs = strtoul(optarg, NULL, 10); break;
+			case 'c': checked = strtoul(optarg, NULL, 10); break;
+			case 'v': verbose++; break;
+			case 'h': usage(argv[0]); return 0;
+			default:  usage(argv[0]); return 1;
+		}
+	}
+
+	if (optind < argc || count < 1 || runs < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	BasicConfigurator config;
+	config.configure();
+	Logger::getRoot().setLogLevel(verbose > 1 ? DEBUG_LOG_LEVEL : verbose ? INFO_LOG_LEVEL : WARN_LOG_LEVEL);
+
+	checked = std::min(checked, count);
+
+	// Keys are delivered on the calling thread, so the loop need not run
+	Main & main = Main::instance();
+	RecordingSink *sink = new RecordingSink(checked * EVENTS_PER_KEY);
+	main.setEmbedded(true);
+	main.setOutput(std::unique_ptr<InputSink>(sink));
+
+	std::vector<double> rates;
+	bool counted = true, matched = true;
+
+	for (unsigned run = 0; run < runs; run++) {
+		sink->clear();
+
+		Clock::time_point start = Clock::now();
+		for (unsigned long k = 0; k < count; k++) {
+			cec_keypress key;
+			key.keycode = keys[k % KEYS].code;
+			key.duration = 0;
+			main.onCecKeyPress(key);
+			key.duration = 100;
+			main.onCecKeyPress(key);
+		}
+		double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+		double rate = sink->eventCount() / seconds;
+		rates.push_back(rate);
+		printf("run %u: keys=%lu events=%llu seconds=%.3f events_per_s=%.0f ns_per_key=%.0f\n",
+			run + 1, count, (unsigned long long) sink->eventCount(), seconds, rate, seconds * 1e9 / count);
+
+		counted = counted && sink->eventCount() == count * EVENTS_PER_KEY;
+		matched = matched && sink->events().size() == checked * EVENTS_PER_KEY && framesMatch(sink->events());
+	}
+
+	std::sort(rates.begin(), rates.end());
+	printf("median: events_per_s=%.0f\n", rates[rates.size() / 2]);
+
+	checks.check("every key made a press and a release frame", counted);
+	checks.check("the frames recorded are the right keys, in order, each stamped and synced", matched);
+
+	return checks.finish();
+}
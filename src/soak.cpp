@@ -0,0 +1,491 @@
+/**
+ * soak.cpp
+ *
+ * cec-soak: runs the daemon against a simulated adapter for as long as asked,
+ * injecting adapter alerts, dropped frames, slow acks and uinput write
+ * failures, and reports how quickly it recovers, whether any keys were lost
+ * or doubled, and whether memory or descriptors leak across restarts
+ */
+#include "main.h"
+#include "simcec.h"
+#include "sink.h"
+#include "log.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <getopt.h>
+#include <unistd.h>
+
+using namespace CEC;
+using namespace log4cplus;
+
+using std::cerr;
+using std::endl;
+using std::string;
+
+typedef std::chrono::steady_clock Clock;
+
+static Logger logger = Logger::getInstance("soak");
+
+// The alerts Main::onCecAlert() restarts the adapter for
+static const struct {
+	libcec_alert alert;
+	const char *name;
+} alerts[] = {
+	{ CEC_ALERT_CONNECTION_LOST,  "connection_lost" },
+	{ CEC_ALERT_PORT_BUSY,        "port_busy" },
+	{ CEC_ALERT_PERMISSION_ERROR, "permission_error" },
+	{ CEC_ALERT_TV_POLL_FAILED,   "tv_poll_failed" },
+};
+static const size_t ALERTS = sizeof(alerts) / sizeof(alerts[0]);
+
+// Keys that map to a single uinput key and no macro, so each is one press
+static const cec_user_control_code keys[] = {
+	CEC_USER_CONTROL_CODE_UP,
+	CEC_USER_CONTROL_CODE_DOWN,
+	CEC_USER_CONTROL_CODE_LEFT,
+	CEC_USER_CONTROL_CODE_RIGHT,
+};
+
+// How long the TV holds each key before releasing it
+static const std::chrono::milliseconds HOLD(40);
+
+// Longer than the daemon takes to release a key whose release was dropped
+static const std::chrono::milliseconds KEY_SETTLE(1500);
+
+// An alert the daemon has not recovered from by then counts as a failure
+static const std::chrono::seconds RECOVERY_TIMEOUT(30);
+
+struct Options {
+	unsigned duration;       // seconds
+	double alertInterval;    // mean seconds between alerts
+	unsigned keyRate;        // per second
+	double dropRate;
+	unsigned maxAckDelay;    // ms
+	double writeFailRate;
+	unsigned reportInterval; // seconds
+	unsigned seed;
+};
+
+/**
+ * Stands in for uinput, counting key presses and releases, and failing
+ * writes as often as asked
+ */
+class SoakSink : public InputSink {
+private:
+	std::mutex sync;
+	std::condition_variable cond;
+	std::mt19937 random;
+	double failRate;
+
+	uint64_t presses;
+	uint64_t releases;
+	uint64_t failures;
+
+public:
+	SoakSink(double failRate, unsigned seed) : random(seed), failRate(failRate), presses(0), releases(0), failures(0) {}
+
+	void send_event(__u16 type, __u16 code, __s32 value) {
+		std::lock_guard<std::mutex> lock(sync);
+		if (failRate > 0.0 && std::uniform_real_distribution<double>(0.0, 1.0)(random) < failRate) {
+			failures++;
+			throw std::runtime_error("Injected uinput write failure");
+		}
+
+		if (type != EV_KEY)
+			return;
+		if (value == 1)
+			presses++;
+		else if (value == 0)
+			releases++;
+		cond.notify_all();
+	}
+
+	void counts(uint64_t & presses, uint64_t & releases, uint64_t & failures) {
+		std::lock_guard<std::mutex> lock(sync);
+		presses = this->presses;
+		releases = this->releases;
+		failures = this->failures;
+	}
+
+	/**
+	 * Waits until a key has been pressed since presses and released since
+	 * releases were counted, or until the deadline
+	 */
+	void settle(uint64_t presses, uint64_t releases, Clock::time_point deadline) {
+		std::unique_lock<std::mutex> lock(sync);
+		cond.wait_until(lock, deadline, [&] { return this->presses > presses && this->releases > releases; });
+	}
+};
+
+/**
+ * Follows the daemon's events, for knowing when it has recovered
+ */
+class Watcher {
+private:
+	std::mutex sync;
+	std::condition_variable cond;
+	uint64_t ready;
+	uint64_t restarts;
+
+public:
+	Watcher() : ready(0), restarts(0) {}
+
+	void event(const Event & event) {
+		std::lock_guard<std::mutex> lock(sync);
+		if (event.type == EVENT_READY)
+			ready++;
+		else if (event.type == EVENT_RESTART)
+			restarts++;
+		cond.notify_all();
+	}
+
+	uint64_t readyCount() {
+		std::lock_guard<std::mutex> lock(sync);
+		return ready;
+	}
+
+	uint64_t restartCount() {
+		std::lock_guard<std::mutex> lock(sync);
+		return restarts;
+	}
+
+	/**
+	 * Waits for the daemon to be ready more than count times, returning false
+	 * if it wasn't by the deadline
+	 */
+	bool waitReady(uint64_t count, Clock::time_point deadline) {
+		std::unique_lock<std::mutex> lock(sync);
+		return cond.wait_until(lock, deadline, [&] { return ready > count; });
+	}
+};
+
+struct KeyStats {
+	uint64_t sent;
+	uint64_t ok;
+	uint64_t duplicated;   // pressed more than once
+	uint64_t undelivered;  // neither frame reached the daemon, so nothing to see
+	uint64_t faulted;      // lost or repeated while a write failed or the adapter restarted
+	uint64_t lost;         // lost with no fault to explain it
+};
+
+struct Sample {
+	unsigned seconds;
+	long rssKb;
+	long fds;
+	long threads;
+	uint64_t opens;
+};
+
+static long statusField(const char *field) {
+	FILE *f = fopen("/proc/self/status", "re");
+	if (!f)
+		return -1;
+
+	char line[256];
+	size_t len = strlen(field);
+	long value = -1;
+	while (fgets(line, sizeof(line), f)) {
+		if (strncmp(line, field, len) == 0 && line[len] == ':') {
+			value = strtol(line + len + 1, NULL, 10);
+			break;
+		}
+	}
+	fclose(f);
+	return value;
+}
+
+static long countFds() {
+	DIR *dir = opendir("/proc/self/fd");
+	if (!dir)
+		return -1;
+
+	long count = 0;
+	while (struct dirent *entry = readdir(dir)) {
+		if (entry->d_name[0] != '.')
+			count++;
+	}
+	closedir(dir);
+
+	// Less the one reading it
+	return count - 1;
+}
+
+/**
+ * The p-th percentile, p from 1 to 100
+ */
+static double percentile(std::vector<double> values, unsigned p) {
+	if (values.empty())
+		return 0.0;
+	std::sort(values.begin(), values.end());
+	return values[std::min(values.size() - 1, (values.size() * p + 99) / 100 - 1)];
+}
+
+static void usage(const char *name) {
+	cerr << "Usage: " << name << " [options]" << endl
+	     << "  -d <s>     run for this long (default 60)" << endl
+	     << "  -a <s>     inject an adapter alert about this often (default 5)" << endl
+	     << "  -k <n>     send up to n keys a second (default 10)" << endl
+	     << "  -f <p>     drop this share of frames on the bus (default 0.01)" << endl
+	     << "  -s <ms>    ack frames the daemon sends after up to this long (default 50)" << endl
+	     << "  -w <p>     fail this share of uinput writes (default 0.001)" << endl
+	     << "  -i <s>     sample memory and descriptors this often (default 10)" << endl
+	     << "  -r <seed>  seed for the faults (default 1)" << endl
+	     << "  -o <path>  write the JSON report here instead of stdout" << endl
+	     << "  -v         log the daemon's messages (-vv for debug)" << endl
+	     << "  -h         show this help" << endl;
+}
+
+/**
+ * Raises an alert now and then, timing how long the daemon takes to be ready
+ * again after each
+ */
+static void injectAlerts(SimCec & sim, Watcher & watcher, const Options & options, std::mutex & sync,
+		std::condition_variable & cond, bool & done, std::vector<double> (&recovery)[ALERTS], uint64_t & failed) {
+	std::mt19937 random(options.seed + 1);
+	std::exponential_distribution<double> interval(1.0 / options.alertInterval);
+	size_t next = 0;
+
+	std::unique_lock<std::mutex> lock(sync);
+	while (!done) {
+		Clock::time_point when = Clock::now() + std::chrono::microseconds((int64_t) (interval(random) * 1e6));
+		if (cond.wait_until(lock, when, [&] { return done; }))
+			break;
+		lock.unlock();
+
+		size_t i = next++ % ALERTS;
+		uint64_t ready = watcher.readyCount();
+		Clock::time_point start = Clock::now();
+
+		if (sim.alert(alerts[i].alert)) {
+			if (watcher.waitReady(ready, start + RECOVERY_TIMEOUT)) {
+				recovery[i].push_back(std::chrono::duration<double, std::milli>(Clock::now() - start).count());
+			} else {
+				LOG4CPLUS_ERROR(logger, "No recovery from " << alerts[i].name << " after " << RECOVERY_TIMEOUT.count() << "s");
+				failed++;
+			}
+		}
+
+		lock.lock();
+	}
+}
+
+/**
+ * Presses and releases one key, as a TV would, and works out what became of it
+ */
+static void sendKey(SimCec & sim, SoakSink & sink, Watcher & watcher, cec_user_control_code code, KeyStats & stats) {
+	uint64_t presses, releases, failures, after, released, failuresAfter;
+	sink.counts(presses, releases, failures);
+	uint64_t restarts = watcher.restartCount();
+	uint64_t opens = sim.openCount();
+
+	stats.sent++;
+	bool pressed = sim.key(code, 0);
+	std::this_thread::sleep_for(HOLD);
+	sink.counts(after, released, failuresAfter);
+	bool releasedKey = sim.key(code, HOLD.count());
+
+	// Nothing will come of a key the daemon never heard
+	if (pressed || releasedKey)
+		sink.settle(presses, released, Clock::now() + KEY_SETTLE);
+	sink.counts(after, released, failuresAfter);
+
+	bool faults = failuresAfter != failures || watcher.restartCount() != restarts || sim.openCount() != opens;
+	uint64_t count = after - presses;
+
+	// A restart releases held keys, and the release that follows then plays
+	// the key again as a missed press, so only a fault explains a second press
+	if (count == 1)
+		stats.ok++;
+	else if (count == 0 && !pressed && !releasedKey)
+		stats.undelivered++;
+	else if (faults)
+		stats.faulted++;
+	else if (count > 1)
+		stats.duplicated++;
+	else
+		stats.lost++;
+
+	if (!faults && (count > 1 || (count == 0 && (pressed || releasedKey))))
+		LOG4CPLUS_WARN(logger, "Key " << (int) code << " was pressed " << count << " times");
+}
+
+static void report(FILE *out, const Options & options, double seconds, const KeyStats & keys,
+		const std::vector<double> (&recovery)[ALERTS], uint64_t failed, const std::vector<Sample> & samples) {
+	fprintf(out, "{\"seconds\":%.1f,\"seed\":%u,\"faults\":{\"alert_interval_s\":%.1f,\"drop_rate\":%.4f,"
+		"\"max_ack_delay_ms\":%u,\"write_fail_rate\":%.4f},\n",
+		seconds, options.seed, options.alertInterval, options.dropRate, options.maxAckDelay, options.writeFailRate);
+
+	fprintf(out, " \"keys\":{\"sent\":%llu,\"ok\":%llu,\"duplicated\":%llu,\"undelivered\":%llu,\"faulted\":%llu,\"lost\":%llu},\n",
+		(unsigned long long) keys.sent, (unsigned long long) keys.ok, (unsigned long long) keys.duplicated,
+		(unsigned long long) keys.undelivered, (unsigned long long) keys.faulted, (unsigned long long) keys.lost);
+
+	std::vector<double> all;
+	fprintf(out, " \"recovery_ms\":{");
+	for (size_t i = 0; i < ALERTS; i++) {
+		const std::vector<double> & r = recovery[i];
+		all.insert(all.end(), r.begin(), r.end());
+		fprintf(out, "\"%s\":{\"count\":%zu,\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"max\":%.1f},",
+			alerts[i].name, r.size(), percentile(r, 50), percentile(r, 90), percentile(r, 99), percentile(r, 100));
+	}
+	fprintf(out, "\"all\":{\"count\":%zu,\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"max\":%.1f},\"failed\":%llu},\n",
+		all.size(), percentile(all, 50), percentile(all, 90), percentile(all, 99), percentile(all, 100),
+		(unsigned long long) failed);
+
+	fprintf(out, " \"samples\":[");
+	for (size_t i = 0; i < samples.size(); i++) {
+		const Sample & s = samples[i];
+		fprintf(out, "%s\n  {\"seconds\":%u,\"rss_kb\":%ld,\"fds\":%ld,\"threads\":%ld,\"opens\":%llu}",
+			i ? "," : "", s.seconds, s.rssKb, s.fds, s.threads, (unsigned long long) s.opens);
+	}
+
+	// Growth since the second sample, by when the daemon has been through a restart or two
+	long rssGrowth = samples.size() > 1 ? samples.back().rssKb - samples[1].rssKb : 0;
+	long fdGrowth = samples.size() > 1 ? samples.back().fds - samples[1].fds : 0;
+	fprintf(out, "\n ],\n \"rss_growth_kb\":%ld,\"fd_growth\":%ld}\n", rssGrowth, fdGrowth);
+}
+
+int main(int argc, char *argv[]) {
+	Options options = { 60, 5.0, 10, 0.01, 50, 0.001, 10, 1 };
+	const char *output = NULL;
+	int verbose = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:a:k:f:s:w:i:r:o:vh")) != -1) {
+		switch (opt) {
+			case 'd': options.duration = strtoul(optarg, NULL, 10); break;
+			case 'a': options.alertInterval = strtod(optarg, NULL); break;
+			case 'k': options.keyRate = strtoul(optarg, NULL, 10); break;
+			case 'f': options.dropRate = strtod(optarg, NULL); break;
+			case 's': options.maxAckDelay = strtoul(optarg, NULL, 10); break;
+			case 'w': options.writeFailRate = strtod(optarg, NULL); break;
+			case 'i': options.reportInterval = strtoul(optarg, NULL, 10); break;
+			case 'r': options.seed = strtoul(optarg, NULL, 10); break;
+			case 'o': output = optarg; break;
+			case 'v': verbose++; break;
+			case 'h':
+				usage(argv[0]);
+				return 0;
+			default:
+				usage(argv[0]);
+				return 1;
+		}
+	}
+
+	if (optind < argc || options.alertInterval <= 0.0 || options.keyRate < 1 || options.reportInterval < 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	BasicConfigurator config;
+	config.configure();
+	Logger root = Logger::getRoot();
+	switch (verbose) {
+		case 0:  root.setLogLevel(WARN_LOG_LEVEL); break;
+		case 1:  root.setLogLevel(INFO_LOG_LEVEL); break;
+		default: root.setLogLevel(DEBUG_LOG_LEVEL); break;
+	}
+
+	FILE *out = stdout;
+	if (output && !(out = fopen(output, "w"))) {
+		cerr << "Failed to create " << output << ": " << strerror(errno) << endl;
+		return 1;
+	}
+
+	Main & main = Main::instance();
+	SimCec *sim = new SimCec(&main, options.seed);
+	SoakSink *sink = new SoakSink(options.writeFailRate, options.seed + 2);
+	Watcher watcher;
+
+	sim->setDropRate(options.dropRate);
+	sim->setMaxAckDelay(std::chrono::milliseconds(options.maxAckDelay));
+
+	main.setEmbedded(true);
+	main.setDevice(std::unique_ptr<CecDevice>(sim));
+	main.setOutput(std::unique_ptr<InputSink>(sink));
+	main.setEventListener([&watcher] (const Event & event) { watcher.event(event); });
+
+	std::thread loop([&main] {
+		try {
+			main.loop("");
+		} catch (std::exception & e) {
+			LOG4CPLUS_FATAL(logger, "Daemon stopped: " << e.what());
+			exit(1);
+		}
+	});
+
+	if (!watcher.waitReady(0, Clock::now() + RECOVERY_TIMEOUT)) {
+		LOG4CPLUS_FATAL(logger, "Daemon never became ready");
+		return 1;
+	}
+
+	std::mutex sync;
+	std::condition_variable cond;
+	bool done = false;
+	std::vector<double> recovery[ALERTS];
+	uint64_t failed = 0;
+	std::thread faults(injectAlerts, std::ref(*sim), std::ref(watcher), std::cref(options), std::ref(sync),
+		std::ref(cond), std::ref(done), std::ref(recovery), std::ref(failed));
+
+	Clock::time_point start = Clock::now();
+	Clock::time_point end = start + std::chrono::seconds(options.duration);
+	Clock::time_point nextSample = start;
+	std::chrono::microseconds keyInterval(1000000 / options.keyRate);
+	KeyStats keyStats = KeyStats();
+	std::vector<Sample> samples;
+
+	for (size_t k = 0; ; k++) {
+		Clock::time_point now = Clock::now();
+
+		if (now >= nextSample || now >= end) {
+			Sample s;
+			s.seconds = std::chrono::duration_cast<std::chrono::seconds>(now - start).count();
+			s.rssKb = statusField("VmRSS");
+			s.fds = countFds();
+			s.threads = statusField("Threads");
+			s.opens = sim->openCount();
+			samples.push_back(s);
+			cerr << "cec-soak: " << s.seconds << "s rss " << s.rssKb << "kB, " << s.fds << " fds, "
+			     << s.threads << " threads, " << s.opens << " opens, " << keyStats.sent << " keys sent, "
+			     << keyStats.lost << " lost, " << keyStats.duplicated << " duplicated" << endl;
+			nextSample += std::chrono::seconds(options.reportInterval);
+		}
+		if (now >= end)
+			break;
+
+		sendKey(*sim, *sink, watcher, keys[k % (sizeof(keys) / sizeof(keys[0]))], keyStats);
+		std::this_thread::sleep_until(now + keyInterval);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(sync);
+		done = true;
+		cond.notify_all();
+	}
+	faults.join();
+
+	main.stop();
+	loop.join();
+	main.setEventListener(nullptr);
+
+	report(out, options, std::chrono::duration<double>(Clock::now() - start).count(), keyStats, recovery, failed, samples);
+	if (out != stdout)
+		fclose(out);
+
+	// Anything a restart can explain is expected, anything else is a bug
+	return keyStats.lost || keyStats.duplicated || failed ? 2 : 0;
+}
@@ -0,0 +1,111 @@
+/**
+ * startup.cpp
+ *
+ * Dependency ordered, concurrent startup stages
+ */
+#include "startup.h"
+#include "realtime.h"
+#include "log.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+using namespace log4cplus;
+
+using std::string;
+
+static Logger logger = Logger::getInstance("startup");
+
+static std::mutex startup_sync;
+static std::condition_variable startup_cond;
+
+typedef std::chrono::steady_clock Clock;
+
+static long long millisSince(Clock::time_point start) {
+	return std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start).count();
+}
+
+void Startup::add(const string & name, Stage stage, std::initializer_list<string> deps) {
+	Node node;
+	node.name  = name;
+	node.stage = stage;
+	node.state = PENDING;
+
+	for (std::initializer_list<string>::const_iterator dep = deps.begin(); dep != deps.end(); ++dep) {
+		size_t i;
+		for (i = 0; i < nodes.size(); i++) {
+			if (nodes[i].name == *dep)
+				break;
+		}
+		if (i == nodes.size()) {
+			throw std::logic_error("Unknown startup stage " + *dep);
+		}
+		node.deps.push_back(i);
+	}
+
+	nodes.push_back(node);
+}
+
+void Startup::runNode(size_t i) {
+	Node & node = nodes[i];
+	bool skip = false;
+
+	/* a restart runs these from the delivery thread, and startup has no deadlines to meet */
+	Realtime::enterNormal("startup");
+
+	{
+		// Wait for everything we depend on
+		std::unique_lock<std::mutex> lock(startup_sync);
+		for (std::vector<size_t>::const_iterator dep = node.deps.begin(); dep != node.deps.end(); ++dep) {
+			startup_cond.wait(lock, [this, dep] { return nodes[*dep].state != PENDING; });
+			if (nodes[*dep].state == FAILED)
+				skip = true;
+		}
+	}
+
+	State state = FAILED;
+
+	if (skip) {
+		LOG4CPLUS_DEBUG(logger, "Skipping startup stage " << node.name);
+	} else {
+		Clock::time_point start = Clock::now();
+		try {
+			node.stage();
+			state = DONE;
+			LOG4CPLUS_INFO(logger, "Startup stage " << node.name << " took " << millisSince(start) << "ms");
+		} catch (...) {
+			LOG4CPLUS_ERROR(logger, "Startup stage " << node.name << " failed after " << millisSince(start) << "ms");
+			std::lock_guard<std::mutex> lock(startup_sync);
+			if (!failure)
+				failure = std::current_exception();
+		}
+	}
+
+	std::lock_guard<std::mutex> lock(startup_sync);
+	node.state = state;
+	startup_cond.notify_all();
+}
+
+void Startup::run() {
+	LOG4CPLUS_TRACE_STR(logger, "Startup::run()");
+
+	Clock::time_point start = Clock::now();
+	std::vector<std::thread> threads;
+
+	for (size_t i = 0; i < nodes.size(); i++) {
+		threads.push_back(std::thread(&Startup::runNode, this, i));
+	}
+
+	for (std::vector<std::thread>::iterator t = threads.begin(); t != threads.end(); ++t) {
+		t->join();
+	}
+
+	LOG4CPLUS_INFO(logger, "Startup took " << millisSince(start) << "ms");
+
+	if (failure) {
+		std::rethrow_exception(failure);
+	}
+}
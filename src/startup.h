@@ -0,0 +1,56 @@
+#ifndef LIBCEC_DAEMON_STARTUP_H
+#define LIBCEC_DAEMON_STARTUP_H
+
+#include <exception>
+#include <functional>
+#include <initializer_list>
+#include <string>
+#include <vector>
+
+/**
+ * Runs the daemon's startup as a dependency graph of named stages.
+ *
+ * Every stage runs on its own thread as soon as all the stages it depends on
+ * have completed, so independent stages (such as creating the uinput device
+ * and loading libcec) overlap, and startup takes about as long as the slowest
+ * chain of stages rather than the sum of all of them. The time taken by each
+ * stage is logged.
+ */
+class Startup {
+public:
+	typedef std::function<void()> Stage;
+
+	/**
+	 * Adds a stage which will only be run after all stages named in deps,
+	 * which must have been added before it
+	 */
+	void add(const std::string & name, Stage stage, std::initializer_list<std::string> deps = {});
+
+	/**
+	 * Runs all stages, and waits for them to finish. If any stage fails,
+	 * the stages depending on it are skipped and the first failure is
+	 * rethrown once all running stages have finished.
+	 */
+	void run();
+
+private:
+	enum State {
+		PENDING,
+		DONE,
+		FAILED,
+	};
+
+	struct Node {
+		std::string name;
+		Stage stage;
+		std::vector<size_t> deps;
+		State state;
+	};
+
+	std::vector<Node> nodes;
+	std::exception_ptr failure;
+
+	void runNode(size_t i);
+};
+
+#endif
@@ -0,0 +1,119 @@
+/**
+ * state.cpp
+ *
+ * Saves and restores the last known good bus configuration
+ */
+#include "state.h"
+#include "log.h"
+
+#include <cstdio>
+#include <fstream>
+#include <stdexcept>
+
+#include <unistd.h>
+
+using namespace log4cplus;
+
+using std::string;
+
+static Logger logger = Logger::getInstance("state");
+
+bool BusState::valid() const {
+	return !comm.empty()
+		&& address.physical != 0 && address.physical != 0xFFFF
+		&& logicalAddress > CEC::CECDEVICE_TV && logicalAddress < CEC::CECDEVICE_BROADCAST;
+}
+
+bool BusState::adapterPresent() const {
+	// Serial adapters are device nodes, others (such as "RPI") can only be checked by opening them
+	if (comm[0] != '/')
+		return true;
+	return access(comm.c_str(), R_OK | W_OK) == 0;
+}
+
+bool BusState::read(std::istream & in) {
+	string key;
+	int value;
+
+	while (in >> key) {
+		if (key == "comm") {
+			in >> comm;
+		} else if (key == "physical") {
+			in >> address.physical;
+		} else if (key == "base" && in >> value) {
+			address.logical = (CEC::cec_logical_address) value;
+		} else if (key == "port" && in >> value) {
+			address.port = value;
+		} else if (key == "logical" && in >> value) {
+			logicalAddress = (CEC::cec_logical_address) value;
+		} else {
+			in.setstate(std::ios::failbit);
+		}
+
+		if (in.fail())
+			break;
+	}
+
+	return in.eof() && valid();
+}
+
+void BusState::write(std::ostream & out) const {
+	out << "comm "     << comm << '\n'
+	    << "physical " << address.physical << '\n'
+	    << "base "     << (int) address.logical << '\n'
+	    << "port "     << (int) address.port << '\n'
+	    << "logical "  << (int) logicalAddress << '\n';
+}
+
+bool BusState::load(const string & path) {
+	LOG4CPLUS_TRACE_STR(logger, "BusState::load()");
+
+	std::ifstream in(path.c_str());
+	if (!in) {
+		LOG4CPLUS_DEBUG(logger, "No saved state in " << path);
+		return false;
+	}
+
+	if (!read(in)) {
+		LOG4CPLUS_WARN(logger, "Ignoring invalid state in " << path);
+		return false;
+	}
+
+	return true;
+}
+
+void BusState::save(const string & path) const {
+	LOG4CPLUS_TRACE_STR(logger, "BusState::save()");
+
+	// Written to the side and renamed into place, so a crash never leaves half a file
+	string tmp = path + ".tmp";
+	{
+		std::ofstream out(tmp.c_str(), std::ios::trunc);
+		write(out);
+		out.close();
+
+		if (out.fail()) {
+			unlink(tmp.c_str());
+			throw std::runtime_error("Failed to write " + tmp);
+		}
+	}
+
+	if (rename(tmp.c_str(), path.c_str()) < 0) {
+		unlink(tmp.c_str());
+		throw std::runtime_error("Failed to replace " + path);
+	}
+}
+
+bool BusState::operator==(const BusState & other) const {
+	return comm == other.comm
+		&& address.physical == other.address.physical
+		&& address.logical == other.address.logical
+		&& address.port == other.address.port
+		&& logicalAddress == other.logicalAddress;
+}
+
+std::ostream& operator<<(std::ostream &out, const BusState & state) {
+	return out << state.comm << " physical " << state.address.physical
+	           << " base " << (int) state.address.logical << " port " << (int) state.address.port
+	           << " logical " << (int) state.logicalAddress;
+}
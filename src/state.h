@@ -0,0 +1,55 @@
+#ifndef LIBCEC_DAEMON_STATE_H
+#define LIBCEC_DAEMON_STATE_H
+
+#include "hdmi.h"
+
+#include <iostream>
+#include <string>
+
+/**
+ * The bus configuration negotiated the last time the daemon ran (--state-file).
+ *
+ * Reusing it on the next start lets the daemon skip adapter detection and
+ * physical address autodetection, which can otherwise take seconds.
+ */
+class BusState {
+public:
+	std::string comm;                       // adapter comm port
+	HDMI::address address;                  // physical address, base device and HDMI port
+	CEC::cec_logical_address logicalAddress;
+
+	BusState() : logicalAddress(CEC::CECDEVICE_UNKNOWN) {}
+
+	/**
+	 * True if this is complete enough to be reused
+	 */
+	bool valid() const;
+
+	/**
+	 * Cheap check that the adapter is still there, without touching the bus
+	 */
+	bool adapterPresent() const;
+
+	/**
+	 * Reads the state, as written by write(), returns false if it is invalid
+	 */
+	bool read(std::istream & in);
+	void write(std::ostream & out) const;
+
+	/**
+	 * Reads the state from path, returns false if missing or unreadable
+	 */
+	bool load(const std::string & path);
+
+	/**
+	 * Atomically replaces the state at path
+	 */
+	void save(const std::string & path) const;
+
+	bool operator==(const BusState & other) const;
+	bool operator!=(const BusState & other) const { return !(*this == other); }
+};
+
+std::ostream& operator<<(std::ostream &out, const BusState & state);
+
+#endif
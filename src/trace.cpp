@@ -0,0 +1,256 @@
+/**
+ * trace.cpp
+ *
+ * Per-thread span buffers, written out as Chrome trace event JSON
+ */
+#include "trace.h"
+#include "realtime.h"
+#include "log.h"
+
+#include <cerrno>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using namespace log4cplus;
+
+using std::string;
+
+static Logger logger = Logger::getInstance("trace");
+
+std::atomic<bool> Trace::on(false);
+
+namespace {
+
+struct Record {
+	const char *name;
+	uint64_t start;      // microseconds on the steady clock
+	uint32_t duration;
+};
+
+/**
+ * One thread's spans. Only the owning thread adds to records, and only while
+ * count is below CAPACITY, so a writer can read everything below the count it
+ * saw while the thread carries on. Nothing else touches a live buffer's count
+ * either: the owner empties it itself once it sees a new trace has started,
+ * and until then the writer skips it, as what it holds is from an old one.
+ */
+struct Buffer {
+	pid_t tid;
+	char name[16];
+	bool live;                        // owned by a running thread, guarded by registry
+	std::atomic<unsigned> trace;      // the trace count and dropped belong to
+	std::atomic<size_t> count;
+	std::atomic<uint64_t> dropped;
+	Record records[Trace::CAPACITY];
+};
+
+/**
+ * Gives the thread's buffer back when it exits. What it recorded is kept
+ * until the next trace starts, and only then is the buffer reused.
+ */
+struct Owner {
+	Buffer *buffer;
+
+	Owner() : buffer(NULL) {}
+	~Owner();
+};
+
+}
+
+static std::mutex registry;
+static std::vector<Buffer *> buffers; // never freed, as threads may still be writing to them
+static std::atomic<unsigned> traces(0); // bumped by each start()
+
+static std::mutex save_sync;
+static std::condition_variable save_cond;
+static bool saving = false;           // guarded by save_sync
+
+static thread_local Owner owner;
+
+Owner::~Owner() {
+	if (!buffer)
+		return;
+	std::lock_guard<std::mutex> lock(registry);
+	buffer->live = false;
+}
+
+static Buffer *claim() {
+	std::lock_guard<std::mutex> lock(registry);
+
+	Buffer *buffer = NULL;
+	for (std::vector<Buffer *>::const_iterator i = buffers.begin(); i != buffers.end(); ++i) {
+		if (!(*i)->live && (*i)->count.load() == 0) {
+			buffer = *i;
+			break;
+		}
+	}
+
+	if (!buffer) {
+		buffer = new (std::nothrow) Buffer();
+		if (!buffer)
+			return NULL;
+		buffers.push_back(buffer);
+	}
+
+	buffer->live = true;
+	buffer->tid = syscall(SYS_gettid);
+	memset(buffer->name, 0, sizeof(buffer->name));
+	prctl(PR_GET_NAME, buffer->name);
+	buffer->dropped = 0;
+	buffer->trace = traces.load();
+	return buffer;
+}
+
+void Trace::record(const char *name, uint64_t start, uint64_t end) {
+	Buffer *buffer = owner.buffer;
+	if (!buffer) {
+		// The thread's first span, the only one that takes a lock (and may allocate)
+		buffer = owner.buffer = claim();
+		if (!buffer)
+			return;
+	}
+
+	unsigned trace = traces.load(std::memory_order_acquire);
+	if (buffer->trace.load(std::memory_order_relaxed) != trace) {
+		buffer->count.store(0, std::memory_order_relaxed);
+		buffer->dropped.store(0, std::memory_order_relaxed);
+		buffer->trace.store(trace, std::memory_order_release);
+	}
+
+	size_t n = buffer->count.load(std::memory_order_relaxed);
+	if (n >= CAPACITY) {
+		buffer->dropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	Record & r = buffer->records[n];
+	r.name = name;
+	r.start = start;
+	r.duration = end > start ? end - start : 0;
+	buffer->count.store(n + 1, std::memory_order_release);
+}
+
+void Trace::start() {
+	wait();
+
+	std::lock_guard<std::mutex> lock(registry);
+	unsigned trace = ++traces;
+
+	/* live buffers are left to their threads, but no thread will empty the others */
+	for (std::vector<Buffer *>::const_iterator i = buffers.begin(); i != buffers.end(); ++i) {
+		if ((*i)->live)
+			continue;
+		(*i)->count = 0;
+		(*i)->dropped = 0;
+		(*i)->trace = trace;
+	}
+	on = true;
+
+	LOG4CPLUS_INFO(logger, "Tracing");
+}
+
+void Trace::save(const string & path) {
+	on = false;
+	wait();
+
+	{
+		std::lock_guard<std::mutex> lock(save_sync);
+		saving = true;
+	}
+
+	// Detached, so a save in progress never holds up exiting
+	std::thread(&Trace::write, path).detach();
+}
+
+void Trace::wait() {
+	std::unique_lock<std::mutex> lock(save_sync);
+	save_cond.wait(lock, [] { return !saving; });
+}
+
+/**
+ * Thread names come from the kernel and may hold anything
+ */
+static void writeName(FILE *out, const char *name) {
+	for (const char *p = name; *p; p++)
+		fputc(*p == '"' || *p == '\\' || (unsigned char) *p < ' ' ? '_' : *p, out);
+}
+
+void Trace::write(const string & path) {
+	size_t spans = 0;
+	uint64_t dropped = 0;
+	int error = 0;
+
+	Realtime::enterNormal("trace");
+
+	/* the default is in /tmp and we may be root, so never follow a link planted there */
+	FILE *out = NULL;
+	int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0644);
+	if (fd >= 0 && !(out = fdopen(fd, "w"))) {
+		error = errno;
+		::close(fd);
+	}
+	if (out) {
+		pid_t pid = getpid();
+		bool first = true;
+
+		fprintf(out, "{\"traceEvents\":[\n");
+
+		std::lock_guard<std::mutex> lock(registry);
+		for (std::vector<Buffer *>::const_iterator i = buffers.begin(); i != buffers.end(); ++i) {
+			const Buffer & buffer = **i;
+			if (buffer.trace.load(std::memory_order_acquire) != traces.load())
+				continue;
+
+			size_t count = buffer.count.load(std::memory_order_acquire);
+			if (!count)
+				continue;
+
+			fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"",
+				first ? "" : ",\n", (int) pid, (int) buffer.tid);
+			writeName(out, buffer.name);
+			fprintf(out, "\"}}");
+			first = false;
+
+			for (size_t r = 0; r < count; r++) {
+				const Record & record = buffer.records[r];
+				fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%u,\"pid\":%d,\"tid\":%d}",
+					record.name, (unsigned long long) record.start, record.duration, (int) pid, (int) buffer.tid);
+			}
+
+			spans += count;
+			dropped += buffer.dropped.load();
+		}
+
+		fprintf(out, "\n],\"displayTimeUnit\":\"ms\",\"otherData\":{\"spans\":%zu,\"dropped\":%llu}}\n",
+			spans, (unsigned long long) dropped);
+
+		if (ferror(out))
+			error = EIO;
+		if (fclose(out) && !error)
+			error = errno;
+	} else if (!error) {
+		error = errno;
+	}
+
+	if (error) {
+		LOG4CPLUS_ERROR(logger, "Failed to write trace to " << path << ": " << strerror(error));
+	} else {
+		LOG4CPLUS_INFO(logger, "Wrote " << spans << " spans to " << path);
+		if (dropped)
+			LOG4CPLUS_WARN(logger, "Dropped " << dropped << " spans, as threads filled their buffers");
+	}
+
+	std::lock_guard<std::mutex> lock(save_sync);
+	saving = false;
+	save_cond.notify_all();
+}
@@ -0,0 +1,82 @@
+#ifndef LIBCEC_DAEMON_TRACE_H
+#define LIBCEC_DAEMON_TRACE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/**
+ * Span tracing of the daemon's stages, for finding out why one keypress was
+ * slow when the histograms only say that it was. Traces are written in the
+ * Chrome trace event format, which chrome://tracing and Perfetto both load.
+ *
+ * Each thread records its spans into a fixed buffer of its own, without
+ * locks, and spans past the end of a full buffer are counted and dropped.
+ * Tracing is switched on and off while running; while it is off, a span
+ * costs one relaxed atomic load.
+ */
+class Trace {
+public:
+	typedef std::chrono::steady_clock Clock;
+
+	/**
+	 * Spans per thread kept until tracing stops
+	 */
+	static const size_t CAPACITY = 8192;
+
+	/**
+	 * Records its own lifetime as a span. name must be a string literal,
+	 * or otherwise outlive the trace.
+	 */
+	class Span {
+	private:
+		const char *name;
+		uint64_t start;
+
+		// Not implemented
+		Span(Span const&);
+		void operator=(Span const&);
+
+	public:
+		explicit Span(const char *name) : name(name), start(enabled() ? now() : 0) {}
+		~Span() { if (start) record(name, start, now()); }
+	};
+
+	static bool enabled() { return on.load(std::memory_order_relaxed); }
+
+	/**
+	 * Throws away whatever was recorded, and starts recording
+	 */
+	static void start();
+
+	/**
+	 * Stops recording, and writes the trace to path on a thread of its own,
+	 * so the caller is not held up
+	 */
+	static void save(const std::string & path);
+
+	/**
+	 * Waits for a save() in progress to finish
+	 */
+	static void wait();
+
+	/**
+	 * Records a span that was timed some other way, in microseconds on
+	 * the steady clock
+	 */
+	static void record(const char *name, uint64_t start, uint64_t end);
+
+	static uint64_t now() { return micros(Clock::now()); }
+	static uint64_t micros(Clock::time_point t) {
+		return std::chrono::duration_cast<std::chrono::microseconds>(t.time_since_epoch()).count();
+	}
+
+private:
+	static std::atomic<bool> on;
+
+	static void write(const std::string & path);
+};
+
+#endif
@@ -0,0 +1,476 @@
+/**
+ * tracestats.cpp
+ *
+ * Fast line and field scanning of daemon logs and event traces, for cec-analyze
+ */
+#include "tracestats.h"
+
+#include <cstring>
+
+using std::string;
+
+// Bus traffic as logged by libcec
+static const char NOT_ACKED[]   = "not acked";
+static const char FAILED_ACK[]  = "FAILED_ACK";
+static const char KEY_PRESS[]   = "Main::onCecKeyPress(Key press: ";
+static const char KEY_FOR[]     = " for ";
+
+#define LITERAL(s) s, sizeof(s) - 1
+
+static const char *find(const char *p, const char *end, const char *needle, size_t len) {
+	return (const char *) memmem(p, end - p, needle, len);
+}
+
+static bool startsWith(const char *p, const char *end, const char *prefix, size_t len) {
+	return (size_t) (end - p) >= len && memcmp(p, prefix, len) == 0;
+}
+
+static bool isDigit(char c) {
+	return c >= '0' && c <= '9';
+}
+
+/**
+ * Parses a decimal number, leaving p just past it
+ */
+static bool number(const char *& p, const char *end, uint64_t & value) {
+	const char *start = p;
+	value = 0;
+	while (p < end && isDigit(*p))
+		value = value * 10 + (*p++ - '0');
+	return p != start;
+}
+
+static int hexDigit(char c) {
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+static int hexByte(const char *p, const char *end) {
+	if (end - p < 2)
+		return -1;
+	int hi = hexDigit(p[0]);
+	int lo = hexDigit(p[1]);
+	return hi < 0 || lo < 0 ? -1 : hi << 4 | lo;
+}
+
+/**
+ * Finds the value of a JSON field such as "\"time\":", which must be present
+ */
+static const char *field(const char *p, const char *end, const char *name, size_t len) {
+	const char *f = find(p, end, name, len);
+	return f ? f + len : NULL;
+}
+
+static double rate(uint64_t count, uint64_t total) {
+	return total ? (double) count / total : 0.0;
+}
+
+TraceStats::Histogram::Histogram() {
+	memset(counts, 0, sizeof(counts));
+}
+
+void TraceStats::Histogram::add(uint64_t gap) {
+	size_t bucket = gap < 2 ? 0 : 63 - __builtin_clzll(gap);
+	counts[bucket < BUCKETS ? bucket : BUCKETS - 1]++;
+}
+
+void TraceStats::Histogram::merge(const Histogram & other) {
+	for (size_t i = 0; i < BUCKETS; i++)
+		counts[i] += other.counts[i];
+}
+
+void TraceStats::Histogram::write(FILE *out) const {
+	size_t used = BUCKETS;
+	while (used > 0 && counts[used - 1] == 0)
+		used--;
+
+	fputc('[', out);
+	for (size_t i = 0; i < used; i++)
+		fprintf(out, i ? ",%llu" : "%llu", (unsigned long long) counts[i]);
+	fputc(']', out);
+}
+
+TraceStats::Series::Series() : seen(false), first(0), last(0) {}
+
+void TraceStats::Series::add(uint64_t time) {
+	if (!seen) {
+		seen  = true;
+		first = time;
+	} else if (time >= last) {
+		// Times going backwards means libcec restarted, so there is no gap to count
+		gaps.add(time - last);
+	}
+	last = time;
+}
+
+void TraceStats::Series::merge(const Series & later) {
+	if (!later.seen)
+		return;
+	if (!seen) {
+		*this = later;
+		return;
+	}
+	if (later.first >= last)
+		gaps.add(later.first - last);
+	gaps.merge(later.gaps);
+	last = later.last;
+}
+
+TraceStats::TraceStats()
+	: lines(0), unparsed(0), rx(0), tx(0), polls(0), nacked(0),
+	  haveLastTx(false), lastTxOpcode(-1), lastTxDestination(0),
+	  anyTx(false), leadingNack(false)
+{}
+
+void TraceStats::frame(int initiator, int destination, int opcode, bool sent, bool hasTime, uint64_t time) {
+	AddressStats & from = addresses[initiator];
+	AddressStats & to   = addresses[destination];
+
+	if (sent) {
+		tx++;
+		to.tx++;
+		haveLastTx        = true;
+		anyTx             = true;
+		lastTxOpcode      = opcode;
+		lastTxDestination = destination;
+	} else {
+		rx++;
+	}
+
+	if (opcode < 0) {
+		polls++;
+		from.polls++;
+	} else {
+		from.sent++;
+		to.received++;
+
+		OpcodeStats & op = opcodes[opcode];
+		if (sent)
+			op.tx++;
+		else
+			op.rx++;
+		if (hasTime)
+			op.arrivals.add(time);
+	}
+
+	if (hasTime) {
+		frames.add(time);
+		from.arrivals.add(time);
+	}
+}
+
+void TraceStats::nack() {
+	if (!haveLastTx) {
+		if (!anyTx)
+			leadingNack = true;
+		return;
+	}
+
+	// Only the first report counts, libcec may log the failure more than once
+	haveLastTx = false;
+	nacked++;
+	addresses[lastTxDestination].nacked++;
+	if (lastTxOpcode >= 0)
+		opcodes[lastTxOpcode].nacked++;
+}
+
+void TraceStats::key(const char *name, size_t len, uint64_t duration, bool hasTime, uint64_t time) {
+	KeyStats & k = keys[string(name, len)];
+
+	// libcec reports a press with no duration, and the release with how long it was held
+	if (duration == 0) {
+		k.presses++;
+		if (hasTime)
+			k.arrivals.add(time);
+	} else {
+		k.releases++;
+		k.held += duration;
+		if (duration > k.maxHeld)
+			k.maxHeld = duration;
+	}
+}
+
+/**
+ * Handles a libcec log message, such as ">> 10:8f", logged at time (in ms)
+ */
+void TraceStats::cecMessage(const char *p, const char *end, uint64_t time) {
+	if (end - p >= 3 && p[2] == ' ' && ((p[0] == '>' && p[1] == '>') || (p[0] == '<' && p[1] == '<'))) {
+		bool sent = p[0] == '<';
+		int header = hexByte(p + 3, end);
+		if (header < 0) {
+			unparsed++;
+			return;
+		}
+
+		int opcode = -1;
+		if (end - (p + 5) >= 3 && p[5] == ':')
+			opcode = hexByte(p + 6, end);
+
+		frame(header >> 4, header & 0xF, opcode, sent, true, time * 1000);
+	} else if (find(p, end, LITERAL(NOT_ACKED)) || find(p, end, LITERAL(FAILED_ACK))) {
+		nack();
+	}
+}
+
+/**
+ * Handles a line logged by the daemon, "<layout> - <message>"
+ */
+void TraceStats::logLine(const char *line, const char *end) {
+	const char *p = find(line, end, LITERAL(" - "));
+	if (!p) {
+		unparsed++;
+		return;
+	}
+	p += 3;
+
+	uint64_t time;
+	if (isDigit(*p)) {
+		// A libcec message, prefixed with libcec's time in ms
+		number(p, end, time);
+		if (p < end && *p == ' ')
+			cecMessage(p + 1, end, time);
+		return;
+	}
+
+	if (startsWith(p, end, LITERAL(KEY_PRESS))) {
+		const char *name = p + sizeof(KEY_PRESS) - 1;
+		const char *sep  = find(name, end, LITERAL(KEY_FOR));
+		if (!sep) {
+			unparsed++;
+			return;
+		}
+
+		uint64_t duration;
+		const char *d = sep + sizeof(KEY_FOR) - 1;
+		if (!number(d, end, duration)) {
+			unparsed++;
+			return;
+		}
+
+		// The default layout starts with the ms since the daemon started
+		const char *t = line;
+		bool hasTime = number(t, end, time);
+		key(name, sep - name, duration, hasTime, time * 1000);
+	}
+}
+
+/**
+ * Handles a cec-client log line, "TRAFFIC: [    1234]	<message>". Returns
+ * false if the line is not one.
+ */
+bool TraceStats::cecClientLine(const char *line, const char *end) {
+	const char *colon = (const char *) memchr(line, ':', end - line < 8 ? end - line : 8);
+	if (!colon)
+		return false;
+
+	const char *p = colon + 1;
+	while (p < end && *p == ' ')
+		p++;
+	if (p == end || *p != '[')
+		return false;
+
+	p++;
+	while (p < end && *p == ' ')
+		p++;
+
+	uint64_t time;
+	if (!number(p, end, time) || p == end || *p != ']')
+		return false;
+
+	p++;
+	while (p < end && (*p == ' ' || *p == '\t'))
+		p++;
+
+	cecMessage(p, end, time);
+	return true;
+}
+
+/**
+ * Handles an event from the event socket, one JSON object
+ */
+void TraceStats::eventLine(const char *line, const char *end) {
+	const char *type = field(line, end, LITERAL("\"type\":\""));
+	const char *t    = field(line, end, LITERAL("\"time\":"));
+	uint64_t time;
+
+	if (!type || !t || !number(t, end, time)) {
+		unparsed++;
+		return;
+	}
+
+	if (startsWith(type, end, LITERAL("command\""))) {
+		const char *op   = field(type, end, LITERAL("\"opcode\":"));
+		const char *from = field(type, end, LITERAL("\"initiator\":"));
+		const char *to   = field(type, end, LITERAL("\"destination\":"));
+		uint64_t opcode, initiator, destination;
+
+		if (!op || !from || !to || !number(op, end, opcode) || !number(from, end, initiator) || !number(to, end, destination)
+				|| opcode > 0xFF || initiator > 0xF || destination > 0xF) {
+			unparsed++;
+			return;
+		}
+		frame(initiator, destination, opcode, false, true, time);
+	} else if (startsWith(type, end, LITERAL("key\""))) {
+		const char *name = field(type, end, LITERAL("\"name\":\""));
+		const char *d    = field(type, end, LITERAL("\"duration\":"));
+		const char *quote;
+		uint64_t duration;
+
+		if (!name || !d || !(quote = (const char *) memchr(name, '"', end - name)) || !number(d, end, duration)) {
+			unparsed++;
+			return;
+		}
+		key(name, quote - name, duration, true, time);
+	}
+}
+
+void TraceStats::scan(const char *begin, const char *end) {
+	const char *p = begin;
+
+	while (p < end) {
+		const char *nl  = (const char *) memchr(p, '\n', end - p);
+		const char *eol = nl ? nl : end;
+
+		if (eol > p && eol[-1] == '\r')
+			eol--;
+
+		if (eol > p) {
+			lines++;
+			if (*p == '{') {
+				eventLine(p, eol);
+			} else if (*p < 'A' || *p > 'Z' || !cecClientLine(p, eol)) {
+				logLine(p, eol);
+			}
+		}
+
+		p = nl ? nl + 1 : end;
+	}
+}
+
+void TraceStats::merge(const TraceStats & later) {
+	// A "not acked" at the start of the later chunk is about our last frame
+	if (later.leadingNack)
+		nack();
+
+	lines    += later.lines;
+	unparsed += later.unparsed;
+	rx       += later.rx;
+	tx       += later.tx;
+	polls    += later.polls;
+	nacked   += later.nacked;
+
+	for (size_t i = 0; i < 256; i++) {
+		OpcodeStats & op = opcodes[i];
+		const OpcodeStats & other = later.opcodes[i];
+
+		op.rx     += other.rx;
+		op.tx     += other.tx;
+		op.nacked += other.nacked;
+		op.arrivals.merge(other.arrivals);
+	}
+
+	for (size_t i = 0; i < 16; i++) {
+		AddressStats & a = addresses[i];
+		const AddressStats & other = later.addresses[i];
+
+		a.sent     += other.sent;
+		a.received += other.received;
+		a.polls    += other.polls;
+		a.tx       += other.tx;
+		a.nacked   += other.nacked;
+		a.arrivals.merge(other.arrivals);
+	}
+
+	for (std::map<string, KeyStats>::const_iterator i = later.keys.begin(); i != later.keys.end(); ++i) {
+		KeyStats & k = keys[i->first];
+		const KeyStats & other = i->second;
+
+		k.presses  += other.presses;
+		k.releases += other.releases;
+		k.held     += other.held;
+		if (other.maxHeld > k.maxHeld)
+			k.maxHeld = other.maxHeld;
+		k.arrivals.merge(other.arrivals);
+	}
+
+	frames.merge(later.frames);
+
+	if (later.anyTx) {
+		haveLastTx        = later.haveLastTx;
+		lastTxOpcode      = later.lastTxOpcode;
+		lastTxDestination = later.lastTxDestination;
+	}
+	if (!anyTx)
+		leadingNack = leadingNack || later.leadingNack;
+	anyTx = anyTx || later.anyTx;
+}
+
+void TraceStats::write(FILE *out) const {
+	fprintf(out, "{\"lines\":%llu,\"unparsed\":%llu,\"frames\":{\"rx\":%llu,\"tx\":%llu,\"polls\":%llu,\"nacked\":%llu,\"nack_rate\":%.4f,\"gaps\":",
+		(unsigned long long) lines, (unsigned long long) unparsed, (unsigned long long) rx, (unsigned long long) tx,
+		(unsigned long long) polls, (unsigned long long) nacked, rate(nacked, tx));
+	frames.gaps.write(out);
+
+	fputs("},\"gap_buckets_us\":[0", out);
+	for (size_t i = 1; i < Histogram::BUCKETS; i++)
+		fprintf(out, ",%llu", 1ULL << i);
+
+	fputs("],\"opcodes\":[", out);
+	bool first = true;
+	for (size_t i = 0; i < 256; i++) {
+		const OpcodeStats & op = opcodes[i];
+		if (op.rx + op.tx == 0)
+			continue;
+
+		fprintf(out, "%s{\"opcode\":%zu,\"rx\":%llu,\"tx\":%llu,\"nacked\":%llu,\"nack_rate\":%.4f,\"gaps\":",
+			first ? "" : ",", i, (unsigned long long) op.rx, (unsigned long long) op.tx,
+			(unsigned long long) op.nacked, rate(op.nacked, op.tx));
+		op.arrivals.gaps.write(out);
+		fputc('}', out);
+		first = false;
+	}
+
+	fputs("],\"addresses\":[", out);
+	first = true;
+	for (size_t i = 0; i < 16; i++) {
+		const AddressStats & a = addresses[i];
+		if (a.sent + a.received + a.polls + a.tx == 0)
+			continue;
+
+		fprintf(out, "%s{\"address\":%zu,\"sent\":%llu,\"received\":%llu,\"polls\":%llu,\"tx\":%llu,\"nacked\":%llu,\"nack_rate\":%.4f,\"gaps\":",
+			first ? "" : ",", i, (unsigned long long) a.sent, (unsigned long long) a.received,
+			(unsigned long long) a.polls, (unsigned long long) a.tx, (unsigned long long) a.nacked, rate(a.nacked, a.tx));
+		a.arrivals.gaps.write(out);
+		fputc('}', out);
+		first = false;
+	}
+
+	fputs("],\"keys\":[", out);
+	first = true;
+	for (std::map<string, KeyStats>::const_iterator i = keys.begin(); i != keys.end(); ++i) {
+		const KeyStats & k = i->second;
+
+		// Names come from the logs, so keep anything odd in them from breaking the JSON
+		fputs(first ? "{\"name\":\"" : ",{\"name\":\"", out);
+		for (string::const_iterator c = i->first.begin(); c != i->first.end(); ++c) {
+			if (*c == '"' || *c == '\\' || (unsigned char) *c < 0x20)
+				fprintf(out, "\\u%04x", (unsigned char) *c);
+			else
+				fputc(*c, out);
+		}
+
+		fprintf(out, "\",\"presses\":%llu,\"releases\":%llu,\"mean_held_ms\":%.1f,\"max_held_ms\":%llu,\"gaps\":",
+			(unsigned long long) k.presses, (unsigned long long) k.releases,
+			k.releases ? (double) k.held / k.releases : 0.0, (unsigned long long) k.maxHeld);
+		k.arrivals.gaps.write(out);
+		fputc('}', out);
+		first = false;
+	}
+
+	fputs("]}", out);
+}
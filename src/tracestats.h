@@ -0,0 +1,133 @@
+#ifndef LIBCEC_DAEMON_TRACESTATS_H
+#define LIBCEC_DAEMON_TRACESTATS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <map>
+#include <string>
+
+/**
+ * Statistics rebuilt from daemon logs and event traces by cec-analyze.
+ *
+ * Understands these kinds of line, and skips everything else:
+ *   ... - 1234 >> 10:8f               libcec traffic logged by the daemon (-vv)
+ *   ... - 1234 ... not acked ...      libcec reporting the last frame sent was not acked
+ *                                     (or TRANSMIT_FAILED_ACK)
+ *   ... - Main::onCecKeyPress(Key press: UP for 0ms)
+ *   TRAFFIC: [    1234]	<< 10:8f     cec-client logs
+ *   {"seq":1,"time":...,"type":...}   event socket (--socket) traces
+ *
+ * A file can be split into chunks that are scanned in parallel, as long as
+ * the results are merged back in file order.
+ */
+class TraceStats {
+public:
+	/**
+	 * Log2 histogram of gaps in microseconds. Bucket 0 holds gaps under 2us,
+	 * and bucket i after that gaps from 2^i up to 2^(i+1)us.
+	 */
+	struct Histogram {
+		static const size_t BUCKETS = 32;
+		uint64_t counts[BUCKETS];
+
+		Histogram();
+		void add(uint64_t gap);
+		void merge(const Histogram & other);
+		void write(FILE *out) const;
+	};
+
+	/**
+	 * Arrival times of one kind of event, and the gaps between them
+	 */
+	struct Series {
+		bool seen;
+		uint64_t first;  // microseconds
+		uint64_t last;
+		Histogram gaps;
+
+		Series();
+		void add(uint64_t time);
+		void merge(const Series & later);
+	};
+
+	struct OpcodeStats {
+		uint64_t rx;
+		uint64_t tx;
+		uint64_t nacked;
+		Series arrivals;
+
+		OpcodeStats() : rx(0), tx(0), nacked(0) {}
+	};
+
+	struct AddressStats {
+		uint64_t sent;      // frames with this initiator
+		uint64_t received;  // frames with this destination
+		uint64_t polls;     // polls with this initiator
+		uint64_t tx;        // frames we sent to this destination
+		uint64_t nacked;    // of those, how many it did not ack
+		Series arrivals;    // as initiator
+
+		AddressStats() : sent(0), received(0), polls(0), tx(0), nacked(0) {}
+	};
+
+	struct KeyStats {
+		uint64_t presses;
+		uint64_t releases;
+		uint64_t held;      // total of the release durations, in ms
+		uint64_t maxHeld;
+		Series arrivals;    // of presses
+
+		KeyStats() : presses(0), releases(0), held(0), maxHeld(0) {}
+	};
+
+private:
+	uint64_t lines;
+	uint64_t unparsed;
+	uint64_t rx;
+	uint64_t tx;
+	uint64_t polls;
+	uint64_t nacked;
+
+	OpcodeStats opcodes[256];
+	AddressStats addresses[16];
+	std::map<std::string, KeyStats> keys;
+	Series frames;
+
+	// The last frame we sent and has not been reported as not acked yet
+	bool haveLastTx;
+	int lastTxOpcode;   // -1 for a poll
+	int lastTxDestination;
+
+	// Whether any frame was sent in this chunk, and if a "not acked" report
+	// came before the first one, in which case it belongs to the previous chunk
+	bool anyTx;
+	bool leadingNack;
+
+	void frame(int initiator, int destination, int opcode, bool sent, bool hasTime, uint64_t time);
+	void nack();
+	void key(const char *name, size_t len, uint64_t duration, bool hasTime, uint64_t time);
+	void cecMessage(const char *p, const char *end, uint64_t time);
+	void logLine(const char *line, const char *end);
+	bool cecClientLine(const char *line, const char *end);
+	void eventLine(const char *line, const char *end);
+
+public:
+	TraceStats();
+
+	/**
+	 * Scans whole lines. The last line need not end in a newline.
+	 */
+	void scan(const char *begin, const char *end);
+
+	/**
+	 * Adds the results of a chunk that followed this one
+	 */
+	void merge(const TraceStats & later);
+
+	uint64_t lineCount() const { return lines; }
+
+	void write(FILE *out) const;
+};
+
+#endif
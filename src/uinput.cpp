@@ -1,4 +1,5 @@
 #include "uinput.h"
+#include "trace.h"
 
 #include <cstring>
 #include <stdexcept>
@@ -8,8 +9,7 @@
 #include <linux/uinput.h>
 #include <unistd.h>
 
-#include <log4cplus/logger.h>
-#include <log4cplus/loggingmacros.h>
+#include "log.h"
 
 using namespace log4cplus;
 
@@ -18,9 +18,9 @@ static const char *uinput_filename[] = {"/dev/uinput", "/dev/input/uinput", "/de
 
 static Logger logger = Logger::getInstance("uinput");
 
-UInput::UInput(const char *dev_name, const std::vector< std::list<__u16> > & keys) : fd(-1) {
+UInput::UInput(const char *dev_name, const KeyList *keys, size_t count) : fd(-1), owned(true) {
 	openAll();
-	setup(dev_name, keys);
+	setup(dev_name, keys, count);
 	create();
 }
 
@@ -69,7 +69,7 @@ void UInput::openAll() {
 	}
 }
 
-void UInput::setup(const char *dev_name, const std::vector< std::list<__u16> > & keys) {
+void UInput::setup(const char *dev_name, const KeyList *keys, size_t count) {
 
 	int ret;
 	struct uinput_user_dev uidev;
@@ -87,13 +87,15 @@ void UInput::setup(const char *dev_name, const std::vector< std::list<__u16> > &
 		//cerr << "Failed to setup uinput: " << errno << " " << strerror(errno) << endl;
 	}
 
-	// We only want to send keypresses
+	// We only want to send keypresses, and when they arrived
 	ret  = ioctl(this->fd, UI_SET_EVBIT, EV_KEY);
+	ret |= ioctl(this->fd, UI_SET_EVBIT, EV_MSC);
+	ret |= ioctl(this->fd, UI_SET_MSCBIT, MSC_TIMESTAMP);
 
 	// Add all the keys we might use
-	for (std::vector< std::list<__u16> >::const_iterator i = keys.begin(); i != keys.end(); ++i) {
-		const std::list<__u16> & kk = *i;
-		for (std::list<__u16>::const_iterator k = kk.begin(); k != kk.end(); ++k) {
+	for (size_t i = 0; i < count; ++i) {
+		const KeyList & kk = keys[i];
+		for (KeyList::const_iterator k = kk.begin(); k != kk.end(); ++k) {
 			__u16 ukey = *k;
 			if (ukey != KEY_RESERVED)
 				ret |= ioctl(this->fd, UI_SET_KEYBIT, ukey);
@@ -119,7 +121,9 @@ void UInput::create() {
 	sleep(1);
 }
 
-void UInput::send_event(__u16 type, __u16 code, __s32 value) const {
+void UInput::send_event(__u16 type, __u16 code, __s32 value) {
+	Trace::Span span("UInput::send_event");
+
 	struct input_event ev;
 	memset(&ev, 0, sizeof(ev));
 
@@ -133,13 +137,21 @@ void UInput::send_event(__u16 type, __u16 code, __s32 value) const {
 	}
 }
 
-void UInput::sync() const {
-	send_event(EV_SYN, SYN_REPORT, 0);
+void UInput::detach() {
+	close(this->fd);
+	this->fd = -1;
 }
 
+void UInput::adopt() {
+	this->owned = true;
+}
 
 void UInput::destroy() {
-	ioctl(this->fd, UI_DEV_DESTROY);
+	if (this->fd < 0)
+		return;
+
+	if (this->owned)
+		ioctl(this->fd, UI_DEV_DESTROY);
 	close(this->fd);
 
 	this->fd = -1;
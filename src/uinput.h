@@ -1,19 +1,71 @@
+#ifndef LIBCEC_DAEMON_UINPUT_H
+#define LIBCEC_DAEMON_UINPUT_H
+
+#include "sink.h"
+
 #include <linux/input.h>
 
-#include <vector>
-#include <list>
+#include <cstddef>
+#include <initializer_list>
 
 #define EV_KEY_RELEASED 0
 #define EV_KEY_PRESSED  1
 #define EV_KEY_REPEAT   2
 
-class UInput {
+/**
+ * Fixed capacity list of uinput key codes, stored inline so key maps
+ * and key state can be copied without touching the heap
+ */
+class KeyList {
+public:
+	static const size_t MAX_KEYS = 4;
+
+private:
+	__u16 keys[MAX_KEYS];
+	size_t count;
+
+public:
+	KeyList() : count(0) {}
+	KeyList(std::initializer_list<__u16> init) : count(0) {
+		for (std::initializer_list<__u16>::const_iterator i = init.begin(); i != init.end() && count < MAX_KEYS; ++i)
+			keys[count++] = *i;
+	}
+
+	typedef const __u16 * const_iterator;
+
+	const_iterator begin() const { return keys; }
+	const_iterator end() const { return keys + count; }
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+	void clear() { count = 0; }
+
+	/**
+	 * Appends a key, silently ignoring it if the list is full
+	 */
+	void push_back(__u16 key) {
+		if (count < MAX_KEYS)
+			keys[count++] = key;
+	}
+
+	bool operator==(const KeyList & other) const {
+		if (count != other.count)
+			return false;
+		for (size_t i = 0; i < count; i++)
+			if (keys[i] != other.keys[i])
+				return false;
+		return true;
+	}
+	bool operator!=(const KeyList & other) const { return !(*this == other); }
+};
+
+class UInput : public InputSink {
 private:
 	int fd; // Handle for uinput file ops
+	bool owned; // destroy the device when done with it, see adopt()
 
 	int open(const char *uinput_path);
 	void openAll();
-	void setup(const char *dev_name, const std::vector< std::list<__u16> > & keys);
+	void setup(const char *dev_name, const KeyList *keys, size_t count);
 	void create();
 
 	void destroy();
@@ -22,9 +74,30 @@ private:
 	// onUInputEvent(
 
 public:
-	UInput(const char *dev_name, const std::vector< std::list<__u16> > & keys);
+	UInput(const char *dev_name, const KeyList *keys, size_t count);
+
+	/**
+	 * Uses a device created by another process, see Handoff. It is left
+	 * to that process, and never destroyed, until adopt() is called.
+	 */
+	explicit UInput(int fd) : fd(fd), owned(false) {}
 	virtual ~UInput();
 
-	void send_event(__u16 type, __u16 code, __s32 value) const;
-	void sync() const;
+	int getFd() const { return fd; }
+
+	/**
+	 * Stops using the device without destroying it, as another process
+	 * has taken it over
+	 */
+	void detach();
+
+	/**
+	 * Takes over a device passed in, so it is destroyed along with this,
+	 * once the process that created it has let it go
+	 */
+	void adopt();
+
+	void send_event(__u16 type, __u16 code, __s32 value);
 };
+
+#endif
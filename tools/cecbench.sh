@@ -0,0 +1,137 @@
+#!/bin/sh
+#
+# cecbench.sh - compares key latency and CPU use of the libcec and kernel backends
+#
+# Usage: cecbench.sh <path to libcec-daemon> [daemon args...]
+#
+# Starts the daemon once with each backend on the same kernel CEC adapter,
+# then sends KEYS (default 200) remote control key presses to it with cec-ctl
+# from a second adapter acting as the TV, and reports for each backend:
+#   threads    number of daemon threads once ready
+#   cpu_ticks  CPU time (user + system, in clock ticks) used to handle the keys
+#   idle_ticks CPU time used while idle for IDLE (default 5) seconds
+#   p50_us     median time from sending a key until it comes out of the event
+#   p99_us     socket, and the 99th percentile, in microseconds
+#
+# The adapters can be real, or software ones from the vivid driver:
+#   modprobe vivid num_inputs=1 num_outputs=1 input_types=3 output_types=1
+# which connects the TV side /dev/cec0 to /dev/cec1. Set TV and DEVICE to use
+# other adapters, and TO to the logical address the daemon claims (default 1).
+# The libcec run needs libcec built with support for Linux CEC adapters.
+#
+# Latency includes starting cec-ctl for each key, which is the same for both
+# backends, so only the difference between them is meaningful.
+#
+
+DAEMON="$1"
+shift
+
+KEYS="${KEYS:-200}"
+IDLE="${IDLE:-5}"
+TIMEOUT="${TIMEOUT:-30}"
+TV="${TV:-/dev/cec0}"
+DEVICE="${DEVICE:-/dev/cec1}"
+TO="${TO:-1}"
+
+if [ ! -x "$DAEMON" ]; then
+    echo "usage: $0 <path to libcec-daemon> [daemon args...]" >&2
+    exit 1
+fi
+
+for tool in cec-ctl nc; do
+    if ! command -v $tool >/dev/null 2>&1; then
+        echo "$0: $tool is needed" >&2
+        exit 1
+    fi
+done
+
+now_us() {
+    echo $(( $(date +%s%N) / 1000 ))
+}
+
+cpu_ticks() {
+    awk '{ print $14 + $15 }' /proc/$1/stat
+}
+
+percentile() {
+    sort -n | awk -v p=$1 '{ v[NR] = $1 } END { if (NR) print v[int((NR - 1) * p / 100) + 1]; else print "n/a" }'
+}
+
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+cec-ctl -d "$TV" --tv >/dev/null || exit 1
+
+bench() {
+    backend=$1
+    shift
+    log="$DIR/$backend.log"
+    sock="$DIR/$backend.sock"
+    events="$DIR/$backend.events"
+    sent="$DIR/$backend.sent"
+
+    "$DAEMON" --backend $backend --output none --socket "$sock" "$@" "$DEVICE" > "$log" 2>&1 &
+    pid=$!
+
+    start=$(now_us)
+    while ! grep -q "Ready" "$log"; do
+        if ! kill -0 $pid 2>/dev/null || [ $(( $(now_us) - start )) -gt $(( TIMEOUT * 1000000 )) ]; then
+            echo "$backend: daemon did not become ready, log follows" >&2
+            cat "$log" >&2
+            kill $pid 2>/dev/null
+            wait $pid 2>/dev/null
+            return 1
+        fi
+        sleep 0.01
+    done
+
+    # Stamp each key event with the wall clock as it arrives, since the times
+    # in the events themselves are CLOCK_MONOTONIC. The request goes through
+    # a FIFO held open until the end, so nc keeps the connection up.
+    mkfifo "$DIR/$backend.in"
+    nc -U "$sock" < "$DIR/$backend.in" | while read line; do
+        echo "$(now_us) $line"
+    done > "$events" &
+    reader=$!
+    exec 3> "$DIR/$backend.in"
+    echo "types key" >&3
+    sleep 0.5
+
+    threads=$(awk '/^Threads:/ { print $2 }' /proc/$pid/status)
+
+    before=$(cpu_ticks $pid)
+    sleep $IDLE
+    idle=$(( $(cpu_ticks $pid) - before ))
+
+    : > "$sent"
+    before=$(cpu_ticks $pid)
+    i=0
+    while [ $i -lt "$KEYS" ]; do
+        now_us >> "$sent"
+        cec-ctl -d "$TV" --to $TO --user-control-pressed ui-cmd=select >/dev/null
+        cec-ctl -d "$TV" --to $TO --user-control-released >/dev/null
+        i=$(( i + 1 ))
+    done
+    sleep 0.5
+    busy=$(( $(cpu_ticks $pid) - before ))
+
+    kill -TERM $pid
+    wait $pid 2>/dev/null
+    exec 3>&-
+    wait $reader 2>/dev/null
+
+    # Pair each key sent with the first key event that arrived after it, which
+    # is its press, as the previous release arrived before it was sent
+    cut -d' ' -f1 "$events" > "$events.presses"
+    awk 'NR == FNR { p[NR] = $1; n = NR; next }
+         { while (j < n && p[j + 1] < $1) j++; if (j < n) { j++; print p[j] - $1 } }' \
+        "$events.presses" "$sent" > "$DIR/$backend.latency"
+
+    received=$(wc -l < "$DIR/$backend.latency")
+    echo "$backend: threads=$threads cpu_ticks=$busy idle_ticks=$idle keys=$received/$KEYS" \
+         "p50_us=$(percentile 50 < "$DIR/$backend.latency")" \
+         "p99_us=$(percentile 99 < "$DIR/$backend.latency")"
+}
+
+bench libcec "$@"
+bench kernel "$@"
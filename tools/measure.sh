@@ -0,0 +1,90 @@
+#!/bin/sh
+#
+# measure.sh - reports the memory and startup budget of libcec-daemon
+#
+# Usage: measure.sh <path to libcec-daemon> [daemon args...]
+#
+# Prints the binary size and linked libraries, then starts the daemon RUNS
+# times (default 5) and reports, for each run and as a median:
+#   ready_ms  time from exec until the daemon logs "Ready"
+#   hwm_kb    peak resident set size (VmHWM) once ready
+#   rss_kb    resident set size (VmRSS) once ready
+#
+# This needs a working CEC adapter and uinput, just like a normal start.
+# TIMEOUT (default 30) bounds how long each run may take to become ready.
+#
+
+DAEMON="$1"
+shift
+
+RUNS="${RUNS:-5}"
+TIMEOUT="${TIMEOUT:-30}"
+
+if [ ! -x "$DAEMON" ]; then
+    echo "usage: $0 <path to libcec-daemon> [daemon args...]" >&2
+    exit 1
+fi
+
+now_ms() {
+    echo $(( $(date +%s%N) / 1000000 ))
+}
+
+median() {
+    sort -n | awk '{ v[NR] = $1 } END { if (NR) print v[int((NR + 1) / 2)]; else print "n/a" }'
+}
+
+echo "binary:     $DAEMON"
+echo "size_bytes: $(stat -c %s "$DAEMON")"
+if command -v size >/dev/null 2>&1; then
+    size "$DAEMON" | awk 'NR == 2 { print "text: " $1 " data: " $2 " bss: " $3 }'
+fi
+if command -v ldd >/dev/null 2>&1; then
+    echo "libraries:  $(ldd "$DAEMON" | wc -l)"
+    ldd "$DAEMON" | awk '{ print "  " $1 }'
+fi
+
+LOG=$(mktemp)
+RESULTS=$(mktemp)
+trap 'rm -f "$LOG" "$RESULTS"' EXIT
+
+run=1
+while [ $run -le "$RUNS" ]; do
+    : > "$LOG"
+    start=$(now_ms)
+    "$DAEMON" "$@" > "$LOG" 2>&1 &
+    pid=$!
+
+    ready=""
+    while [ $(( $(now_ms) - start )) -lt $(( TIMEOUT * 1000 )) ]; do
+        if grep -q "Ready" "$LOG"; then
+            ready=$(( $(now_ms) - start ))
+            break
+        fi
+        if ! kill -0 $pid 2>/dev/null; then
+            break
+        fi
+        sleep 0.01
+    done
+
+    if [ -z "$ready" ]; then
+        echo "run $run: daemon did not become ready, log follows" >&2
+        cat "$LOG" >&2
+        kill $pid 2>/dev/null
+        wait $pid 2>/dev/null
+        exit 1
+    fi
+
+    hwm=$(awk '/^VmHWM:/ { print $2 }' /proc/$pid/status)
+    rss=$(awk '/^VmRSS:/ { print $2 }' /proc/$pid/status)
+
+    kill -TERM $pid
+    wait $pid 2>/dev/null
+
+    echo "run $run: ready_ms=$ready hwm_kb=$hwm rss_kb=$rss"
+    echo "$ready $hwm $rss" >> "$RESULTS"
+    run=$(( run + 1 ))
+done
+
+echo "median: ready_ms=$(cut -d' ' -f1 "$RESULTS" | median)" \
+     "hwm_kb=$(cut -d' ' -f2 "$RESULTS" | median)" \
+     "rss_kb=$(cut -d' ' -f3 "$RESULTS" | median)"
@@ -0,0 +1,165 @@
+#!/bin/sh
+#
+# rtbench.sh - compares key latency with and without --realtime under CPU load
+#
+# Usage: rtbench.sh <path to libcec-daemon> [daemon args...]
+#
+# Starts the daemon on a kernel CEC adapter twice, once as it is and once with
+# --realtime, each time with LOAD (default twice the number of CPUs) busy
+# processes competing for the CPUs, and sends KEYS (default 500) remote control
+# key presses to it with cec-ctl from a second adapter acting as the TV. Reports
+# for each run, in microseconds from sending a key until it comes out of the
+# event socket:
+#   p50_us   median
+#   p99_us   99th percentile
+#   p999_us  99.9th percentile
+#   max_us   worst case
+#
+# The load comes from stress-ng --cpu if it is installed, and from busy shell
+# loops otherwise. The sending and timestamping side runs under SCHED_FIFO at
+# priority PRIO (default 90) with chrt, so the load holds up only the daemon.
+# That and --realtime need root, or CAP_SYS_NICE and CAP_IPC_LOCK.
+#
+# The adapters are set up as for cecbench.sh: real ones, or software ones from
+#   modprobe vivid num_inputs=1 num_outputs=1 input_types=3 output_types=1
+# with TV (default /dev/cec0) sending to DEVICE (default /dev/cec1), whose
+# logical address is TO (default 1). BACKEND (default kernel) picks the
+# daemon's backend, and TIMEOUT (default 30) bounds how long it may take to
+# become ready.
+#
+# Latency includes starting cec-ctl for each key, which is the same for both
+# runs, so only the difference between them is meaningful, above all in the
+# tail.
+#
+
+DAEMON="$1"
+shift
+
+KEYS="${KEYS:-500}"
+LOAD="${LOAD:-$(( $(nproc) * 2 ))}"
+PRIO="${PRIO:-90}"
+BACKEND="${BACKEND:-kernel}"
+TIMEOUT="${TIMEOUT:-30}"
+TV="${TV:-/dev/cec0}"
+DEVICE="${DEVICE:-/dev/cec1}"
+TO="${TO:-1}"
+
+if [ ! -x "$DAEMON" ]; then
+    echo "usage: $0 <path to libcec-daemon> [daemon args...]" >&2
+    exit 1
+fi
+
+for tool in cec-ctl nc chrt; do
+    if ! command -v $tool >/dev/null 2>&1; then
+        echo "$0: $tool is needed" >&2
+        exit 1
+    fi
+done
+
+now_us() {
+    echo $(( $(date +%s%N) / 1000 ))
+}
+
+percentile() {
+    sort -n | awk -v p=$1 '{ v[NR] = $1 } END { if (NR) print v[int((NR - 1) * p / 100) + 1]; else print "n/a" }'
+}
+
+DIR=$(mktemp -d)
+LOADERS=""
+trap 'stop_load; rm -rf "$DIR"' EXIT
+
+start_load() {
+    if command -v stress-ng >/dev/null 2>&1; then
+        stress-ng --cpu "$LOAD" --quiet &
+        LOADERS=$!
+    else
+        i=0
+        while [ $i -lt "$LOAD" ]; do
+            sh -c 'while :; do :; done' &
+            LOADERS="$LOADERS $!"
+            i=$(( i + 1 ))
+        done
+    fi
+}
+
+stop_load() {
+    if [ -n "$LOADERS" ]; then
+        kill $LOADERS 2>/dev/null
+        wait $LOADERS 2>/dev/null
+        LOADERS=""
+    fi
+}
+
+cec-ctl -d "$TV" --tv >/dev/null || exit 1
+
+bench() {
+    name=$1
+    shift
+    log="$DIR/$name.log"
+    sock="$DIR/$name.sock"
+    events="$DIR/$name.events"
+    sent="$DIR/$name.sent"
+
+    "$DAEMON" --backend $BACKEND --output none --socket "$sock" "$@" "$DEVICE" > "$log" 2>&1 &
+    pid=$!
+
+    start=$(now_us)
+    while ! grep -q "Ready" "$log"; do
+        if ! kill -0 $pid 2>/dev/null || [ $(( $(now_us) - start )) -gt $(( TIMEOUT * 1000000 )) ]; then
+            echo "$name: daemon did not become ready, log follows" >&2
+            cat "$log" >&2
+            kill $pid 2>/dev/null
+            wait $pid 2>/dev/null
+            return 1
+        fi
+        sleep 0.01
+    done
+
+    # Stamped as in cecbench.sh, but at real-time priority, so the load
+    # delays neither the stamps nor the keys being sent
+    mkfifo "$DIR/$name.in"
+    chrt -f $PRIO nc -U "$sock" < "$DIR/$name.in" | chrt -f $PRIO sh -c '
+        while read line; do
+            echo "$(( $(date +%s%N) / 1000 )) $line"
+        done' > "$events" &
+    reader=$!
+    exec 3> "$DIR/$name.in"
+    echo "types key" >&3
+    sleep 0.5
+
+    start_load
+    sleep 1
+
+    chrt -f $PRIO sh -c '
+        i=0
+        while [ $i -lt "$1" ]; do
+            echo $(( $(date +%s%N) / 1000 ))
+            cec-ctl -d "$2" --to $3 --user-control-pressed ui-cmd=select >/dev/null
+            cec-ctl -d "$2" --to $3 --user-control-released >/dev/null
+            i=$(( i + 1 ))
+        done' rtbench "$KEYS" "$TV" "$TO" > "$sent"
+    sleep 0.5
+
+    stop_load
+
+    kill -TERM $pid
+    wait $pid 2>/dev/null
+    exec 3>&-
+    wait $reader 2>/dev/null
+
+    # Paired up as in cecbench.sh
+    cut -d' ' -f1 "$events" > "$events.presses"
+    awk 'NR == FNR { p[NR] = $1; n = NR; next }
+         { while (j < n && p[j + 1] < $1) j++; if (j < n) { j++; print p[j] - $1 } }' \
+        "$events.presses" "$sent" > "$DIR/$name.latency"
+
+    received=$(wc -l < "$DIR/$name.latency")
+    echo "$name: load=$LOAD keys=$received/$KEYS" \
+         "p50_us=$(percentile 50 < "$DIR/$name.latency")" \
+         "p99_us=$(percentile 99 < "$DIR/$name.latency")" \
+         "p999_us=$(percentile 99.9 < "$DIR/$name.latency")" \
+         "max_us=$(percentile 100 < "$DIR/$name.latency")"
+}
+
+bench normal "$@"
+bench realtime --realtime "$@"